@@ -0,0 +1,351 @@
+// Loads a model through LLModel::Implementation::construct and measures prompt evaluation and
+// generation for every combination of thread count, n_batch and prompt length, written as JSON
+//
+//   llmodel-bench <model> [--variant auto|all|avx512,default,...] [--search-path dir] [--threads 4,8]
+//                 [--batch 9,128] [--prompt 32,256] [--predict 64] [--seed 42] [--json out.json]
+//
+// The JSON goes to the --json file, or to stdout; the backends log to stdout while they load and run,
+// so that is sent to stderr until the bench is done.
+//
+// With several build variants, 'all' for every one this CPU runs, each is loaded in turn and its runs
+// report their speedup over the same run of the default variant, or of the first one if default is
+// not among them. Peak RSS covers the whole process, so compare models by running the bench once for
+// each of them. Generation is greedy and the prompts come from the seed, so runs are repeatable.
+
+#include "llmodel.h"
+#include "sysinfo.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchRun {
+    int32_t threads = 0;
+    int32_t n_batch = 0;
+    int32_t prompt_length = 0;      // requested, in words
+    int32_t prompt_tokens = 0;
+    int32_t generated_tokens = 0;
+    double prompt_seconds = 0.0;
+    double decode_seconds = 0.0;    // after the first generated token
+    std::vector<double> latencies;  // milliseconds between generated tokens
+
+    double promptRate() const { return prompt_seconds > 0.0 ? prompt_tokens / prompt_seconds : 0.0; }
+    double decodeRate() const { return decode_seconds > 0.0 ? (generated_tokens - 1) / decode_seconds : 0.0; }
+};
+
+struct VariantBench {
+    std::string variant;
+    double load_seconds = 0.0;
+    std::vector<BenchRun> runs;
+};
+
+std::vector<int32_t> parse_list(const char *arg)
+{
+    std::vector<int32_t> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        const int value = std::atoi(item.c_str());
+        if (value > 0)
+            values.push_back(value);
+    }
+    return values;
+}
+
+std::vector<std::string> parse_names(const char *arg)
+{
+    std::vector<std::string> names;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            names.push_back(item);
+    return names;
+}
+
+std::string json_string(const std::string &s)
+{
+    std::string out = "\"";
+    for (const char c : s) {
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char) c < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+// Common words, which are single tokens in the vocabularies of all the supported models, so a prompt
+// of n words comes out close to n tokens
+std::string make_prompt(int32_t words, std::mt19937 &rng)
+{
+    static const char *vocabulary[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on",
+        "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they",
+        "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if", "more",
+        "when", "will", "would", "who", "so", "no", "time", "people", "water", "world", "house", "light",
+    };
+    std::uniform_int_distribution<size_t> pick(0, std::size(vocabulary) - 1);
+    std::string prompt;
+    for (int32_t i = 0; i < words; ++i) {
+        if (i)
+            prompt += ' ';
+        prompt += vocabulary[pick(rng)];
+    }
+    return prompt;
+}
+
+double percentile(std::vector<double> values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    const size_t k = std::min(values.size() - 1, size_t(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+}
+
+BenchRun run_once(LLModel *model, int32_t threads, int32_t n_batch, int32_t prompt_length, int32_t n_predict,
+                  std::mt19937 &rng)
+{
+    BenchRun run;
+    run.threads = threads;
+    run.n_batch = n_batch;
+    run.prompt_length = prompt_length;
+
+    LLModel::PromptContext ctx;
+    ctx.n_batch = n_batch;
+    ctx.n_predict = n_predict;
+    ctx.temp = 0.0f; // greedy
+    ctx.repeat_penalty = 1.0f;
+
+    model->setThreadCount(threads);
+    const std::string prompt = make_prompt(prompt_length, rng);
+
+    const auto start = Clock::now();
+    auto last = start;
+    auto first = start;
+    model->prompt(prompt,
+        [&](int32_t) { ++run.prompt_tokens; return true; },
+        [&](int32_t token, std::string_view) {
+            if (token < 0)
+                return false;
+            const auto now = Clock::now();
+            if (run.generated_tokens == 0) {
+                first = now;
+                run.prompt_seconds = std::chrono::duration<double>(now - start).count();
+            } else {
+                run.latencies.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+            }
+            last = now;
+            ++run.generated_tokens;
+            return true;
+        },
+        [](bool) { return true; },
+        ctx);
+    run.decode_seconds = std::chrono::duration<double>(last - first).count();
+    return run;
+}
+
+double speedup(double rate, double baseline)
+{
+    return baseline > 0.0 ? rate / baseline : 0.0;
+}
+
+// baseline is the same run of the variant the speedups are relative to
+void print_run(FILE *out, const BenchRun &run, const BenchRun &baseline, bool last)
+{
+    std::fprintf(out, "        {\"threads\": %d, \"n_batch\": %d, \"prompt_length\": %d, \"prompt_tokens\": %d, "
+                      "\"generated_tokens\": %d,\n", run.threads, run.n_batch, run.prompt_length, run.prompt_tokens,
+                      run.generated_tokens);
+    std::fprintf(out, "         \"prompt_seconds\": %.4f, \"prompt_tokens_per_second\": %.2f, "
+                      "\"decode_seconds\": %.4f, \"decode_tokens_per_second\": %.2f,\n",
+                      run.prompt_seconds, run.promptRate(), run.decode_seconds, run.decodeRate());
+    std::fprintf(out, "         \"prompt_speedup\": %.3f, \"decode_speedup\": %.3f,\n",
+                      speedup(run.promptRate(), baseline.promptRate()), speedup(run.decodeRate(), baseline.decodeRate()));
+    std::fprintf(out, "         \"token_latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}%s\n",
+                      percentile(run.latencies, 0.50), percentile(run.latencies, 0.90),
+                      percentile(run.latencies, 0.99), percentile(run.latencies, 1.0), last ? "" : ",");
+}
+
+// Sends what is written to stdout to stderr, returns the descriptor to restore stdout from or -1
+int redirect_stdout()
+{
+    std::fflush(stdout);
+#if defined(_WIN32)
+    const int saved = _dup(_fileno(stdout));
+    if (saved >= 0)
+        _dup2(_fileno(stderr), _fileno(stdout));
+#else
+    const int saved = dup(fileno(stdout));
+    if (saved >= 0)
+        dup2(fileno(stderr), fileno(stdout));
+#endif
+    return saved;
+}
+
+void restore_stdout(int saved)
+{
+    if (saved < 0)
+        return;
+    std::fflush(stdout);
+#if defined(_WIN32)
+    _dup2(saved, _fileno(stdout));
+    _close(saved);
+#else
+    dup2(saved, fileno(stdout));
+    close(saved);
+#endif
+}
+
+void usage(const char *argv0)
+{
+    std::fprintf(stderr, "usage: %s <model> [--variant auto|all|avx512,default,...] [--search-path dir] "
+                         "[--threads 4,8] [--batch 9,128] [--prompt 32,256] [--predict 64] [--seed 42] [--json out.json]\n", argv0);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const std::string modelPath = argv[1];
+    std::vector<std::string> variants = { "auto" };
+    std::vector<int32_t> threadCounts = { std::min(getPhysicalCoreCount(), 8) };
+    std::vector<int32_t> batchSizes = { 9, 128 };
+    std::vector<int32_t> promptLengths = { 32, 256 };
+    int32_t n_predict = 64;
+    unsigned seed = 42;
+    const char *jsonPath = nullptr;
+
+    for (int i = 2; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (!std::strcmp(arg, "--variant"))
+            variants = !std::strcmp(value, "all") ? LLModel::Implementation::cpuBuildVariants() : parse_names(value);
+        else if (!std::strcmp(arg, "--search-path"))
+            LLModel::Implementation::setImplementationsSearchPath(value);
+        else if (!std::strcmp(arg, "--threads"))
+            threadCounts = parse_list(value);
+        else if (!std::strcmp(arg, "--batch"))
+            batchSizes = parse_list(value);
+        else if (!std::strcmp(arg, "--prompt"))
+            promptLengths = parse_list(value);
+        else if (!std::strcmp(arg, "--predict"))
+            n_predict = std::max(2, std::atoi(value));
+        else if (!std::strcmp(arg, "--seed"))
+            seed = unsigned(std::strtoul(value, nullptr, 10));
+        else if (!std::strcmp(arg, "--json"))
+            jsonPath = value;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *out = stdout;
+    int savedStdout = -1;
+    if (jsonPath) {
+        out = std::fopen(jsonPath, "w");
+        if (!out) {
+            std::fprintf(stderr, "cannot write %s\n", jsonPath);
+            return 1;
+        }
+    } else {
+        savedStdout = redirect_stdout();
+    }
+
+    std::vector<VariantBench> benches;
+    std::string modelType;
+    for (const std::string &variant : variants) {
+        const auto loadStart = Clock::now();
+        std::unique_ptr<LLModel> model(LLModel::Implementation::construct(modelPath, variant));
+        if (!model) {
+            std::fprintf(stderr, "no implementation found for %s with build variant %s\n", modelPath.c_str(),
+                         variant.c_str());
+            continue;
+        }
+        if (!model->loadModel(modelPath) || !model->isModelLoaded()) {
+            std::fprintf(stderr, "failed to load %s with build variant %s\n", modelPath.c_str(), variant.c_str());
+            continue;
+        }
+
+        VariantBench bench;
+        bench.variant = model->implementation().buildVariant();
+        bench.load_seconds = std::chrono::duration<double>(Clock::now() - loadStart).count();
+        modelType = model->implementation().modelType();
+
+        // every variant gets the same prompts
+        std::mt19937 rng(seed);
+        for (const int32_t threads : threadCounts)
+            for (const int32_t n_batch : batchSizes)
+                for (const int32_t promptLength : promptLengths)
+                    bench.runs.push_back(run_once(model.get(), threads, n_batch, promptLength, n_predict, rng));
+        benches.push_back(std::move(bench));
+    }
+
+    restore_stdout(savedStdout);
+    if (benches.empty())
+        return 1;
+
+    const auto baseline = std::find_if(benches.begin(), benches.end(),
+                                       [](const VariantBench &b) { return b.variant == "default"; });
+    const VariantBench &base = baseline != benches.end() ? *baseline : benches.front();
+
+    std::fprintf(out, "{\n");
+    std::fprintf(out, "  \"model\": %s,\n", json_string(modelPath).c_str());
+    std::fprintf(out, "  \"model_type\": %s,\n", json_string(modelType).c_str());
+    std::fprintf(out, "  \"seed\": %u,\n", seed);
+    std::fprintf(out, "  \"n_predict\": %d,\n", n_predict);
+    std::fprintf(out, "  \"peak_rss_bytes\": %lld,\n", getProcessPeakResidentMemoryInBytes());
+    std::fprintf(out, "  \"speedup_baseline\": %s,\n", json_string(base.variant).c_str());
+    std::fprintf(out, "  \"variants\": [\n");
+    for (size_t v = 0; v < benches.size(); ++v) {
+        const VariantBench &bench = benches[v];
+        std::fprintf(out, "    {\"build_variant\": %s, \"load_seconds\": %.4f, \"runs\": [\n",
+                     json_string(bench.variant).c_str(), bench.load_seconds);
+        for (size_t i = 0; i < bench.runs.size(); ++i)
+            print_run(out, bench.runs[i], base.runs[i], i + 1 == bench.runs.size());
+        std::fprintf(out, "    ]}%s\n", v + 1 == benches.size() ? "" : ",");
+    }
+    std::fprintf(out, "  ]\n}\n");
+    if (out != stdout && std::fclose(out) != 0) {
+        std::fprintf(stderr, "cannot write %s\n", jsonPath);
+        return 1;
+    }
+    return 0;
+}
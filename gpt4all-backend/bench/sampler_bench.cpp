@@ -0,0 +1,114 @@
+// Measures the cost of sampling one token with llm_sampler against the full sort it replaced
+//
+//   llmodel-sampler-bench [iterations]
+
+#include "sampler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// the previous gpt_sample_top_k_top_p, kept as the baseline
+int32_t reference_sample(const std::vector<float> &logits, const int32_t *last_n, int n_last,
+                         int top_k, double top_p, double temp, float repeat_penalty, std::mt19937 &rng)
+{
+    const std::vector<int32_t> last_n_tokens(last_n, last_n + n_last);
+    std::vector<std::pair<double, int32_t>> logits_id;
+    logits_id.reserve(logits.size());
+    const double scale = 1.0/temp;
+    for (int i = 0; i < int(logits.size()); ++i) {
+        double l = logits[i]*scale;
+        if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end())
+            l = logits[i] < 0.0f ? l*repeat_penalty : l/repeat_penalty;
+        logits_id.push_back({ l, i });
+    }
+    std::partial_sort(logits_id.begin(), logits_id.begin() + top_k, logits_id.end(),
+        [](const auto &a, const auto &b) { return a.first > b.first; });
+    logits_id.resize(top_k);
+
+    std::vector<double> probs;
+    double sum = 0.0;
+    for (const auto &kv : logits_id) {
+        probs.push_back(std::exp(kv.first - logits_id[0].first));
+        sum += probs.back();
+    }
+    double cumsum = 0.0;
+    for (int i = 0; i < top_k; ++i) {
+        cumsum += probs[i]/sum;
+        if (cumsum >= top_p) {
+            probs.resize(i + 1);
+            break;
+        }
+    }
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    return logits_id[dist(rng)].second;
+}
+
+template <typename F>
+double microseconds_per_token(int iterations, F &&sample)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        sample(i);
+    const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count()/iterations;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const int iterations = argc > 1 ? std::max(1, std::atoi(argv[1])) : 2000;
+    const int n_rows = 16; // distinct logit rows so the caches see more than one
+    const int n_last = 64;
+
+    llm_sampler_params params;
+    params.top_k = 40;
+    params.top_p = 0.9f;
+    params.temp = 0.7f;
+    params.repeat_penalty = 1.1f;
+
+    std::printf("%8s %12s %12s %12s %9s\n", "vocab", "sampler us", "+min/typ us", "reference us", "speedup");
+    for (const size_t n_vocab : { size_t(50000), size_t(150000) }) {
+        std::mt19937 gen(42);
+        std::normal_distribution<float> normal(0.0f, 3.0f);
+        std::vector<std::vector<float>> rows(n_rows, std::vector<float>(n_vocab));
+        for (auto &row : rows)
+            for (auto &l : row)
+                l = normal(gen);
+        std::vector<int32_t> last_n(n_last);
+        for (auto &t : last_n)
+            t = gen() % n_vocab;
+
+        llm_sampler sampler;
+        std::mt19937 rng(1234);
+        volatile int32_t sink = 0;
+
+        const double fast = microseconds_per_token(iterations, [&](int i) {
+            sink = sampler.sample(rows[i % n_rows].data(), n_vocab, last_n.data(), n_last, params, rng);
+        });
+
+        llm_sampler_params extended = params;
+        extended.min_p = 0.05f;
+        extended.typical_p = 0.95f;
+        const double fastExtended = microseconds_per_token(iterations, [&](int i) {
+            sink = sampler.sample(rows[i % n_rows].data(), n_vocab, last_n.data(), n_last, extended, rng);
+        });
+
+        const double reference = microseconds_per_token(std::max(1, iterations/10), [&](int i) {
+            sink = reference_sample(rows[i % n_rows], last_n.data(), n_last, params.top_k, params.top_p,
+                params.temp, params.repeat_penalty, rng);
+        });
+
+        std::printf("%8zu %12.2f %12.2f %12.2f %8.1fx\n", n_vocab, fast, fastExtended, reference, reference/fast);
+        (void) sink;
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+// ggml starts the compute threads of every graph it evaluates and joins them as soon as the graph is
+// done, which for a small model is a measurable part of the time of a token. On Linux the model
+// implementations are linked with pthread_create and pthread_join wrapped (see prepare_target in
+// CMakeLists.txt), so those threads come from this pool instead: its workers stay alive between
+// evaluations, spin for a little while after they finish as the next graph usually follows within
+// the same token, and then park until they are handed another one.
+//
+// A worker takes on the affinity of the thread that hands it work, as a thread started by it would
+// have, so the cores of a CpuScheduler lease hold for the pool as well. Every model implementation
+// library has its own pool, shared by all the models it loads.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPUTE_POOL_PAUSE() _mm_pause()
+#elif defined(__aarch64__)
+#define COMPUTE_POOL_PAUSE() __asm__ __volatile__("yield")
+#else
+#define COMPUTE_POOL_PAUSE() ((void) 0)
+#endif
+
+extern "C" {
+int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*routine)(void *), void *arg);
+int __real_pthread_join(pthread_t thread, void **result);
+}
+
+namespace {
+
+// rounds of pause instructions before a waiting thread parks, some tens of microseconds. Every round
+// ends with a yield, so a thread that waits for one sharing its core does not hold it up.
+constexpr int COMPUTE_POOL_SPIN = 256;
+constexpr int COMPUTE_POOL_PAUSES = 64;
+
+enum : uint32_t { WorkerIdle, WorkerQueued, WorkerDone };
+
+struct Worker {
+    std::atomic<uint32_t> state { WorkerIdle };
+    void *(*routine)(void *) = nullptr;
+    void *arg = nullptr;
+    void *result = nullptr;
+    bool busy = false;          // handed out and not joined yet, guarded by the mutex of the pool
+    pthread_t thread;
+    cpu_set_t affinity;         // the last one set, to skip setting it again
+};
+
+void spinThenPark(std::atomic<uint32_t> &state, uint32_t until)
+{
+    for (int i = 0; i < COMPUTE_POOL_SPIN; ++i) {
+        for (int j = 0; j < COMPUTE_POOL_PAUSES; ++j) {
+            if (state.load(std::memory_order_acquire) == until)
+                return;
+            COMPUTE_POOL_PAUSE();
+        }
+        sched_yield();
+    }
+    for (uint32_t s; (s = state.load(std::memory_order_acquire)) != until;)
+        state.wait(s, std::memory_order_acquire);
+}
+
+void *workerMain(void *arg)
+{
+    Worker &w = *static_cast<Worker *>(arg);
+    for (;;) {
+        spinThenPark(w.state, WorkerQueued);
+        w.result = w.routine(w.arg);
+        w.state.store(WorkerDone, std::memory_order_release);
+        w.state.notify_one();
+    }
+    return nullptr;
+}
+
+class ComputePool {
+public:
+    // Never destroyed, its workers do not exit
+    static ComputePool &instance()
+    {
+        static ComputePool *pool = new ComputePool;
+        return *pool;
+    }
+
+    // Hands routine to an idle worker, or to a new one if there is none, nullptr if that fails
+    Worker *start(void *(*routine)(void *), void *arg)
+    {
+        Worker *w = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto &candidate : m_workers) {
+                if (!candidate->busy) {
+                    w = candidate.get();
+                    break;
+                }
+            }
+            if (!w) {
+                auto worker = std::make_unique<Worker>();
+                CPU_ZERO(&worker->affinity);
+                if (__real_pthread_create(&worker->thread, nullptr, workerMain, worker.get()) != 0)
+                    return nullptr;
+                pthread_detach(worker->thread);
+                if (m_workers.empty())
+                    keepLoaded();
+                w = worker.get();
+                m_workers.push_back(std::move(worker));
+            }
+            w->busy = true;
+        }
+
+        cpu_set_t set;
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0 && !CPU_EQUAL(&set, &w->affinity)
+                && pthread_setaffinity_np(w->thread, sizeof(set), &set) == 0)
+            w->affinity = set;
+
+        w->routine = routine;
+        w->arg = arg;
+        w->state.store(WorkerQueued, std::memory_order_release);
+        w->state.notify_one();
+        return w;
+    }
+
+    // Waits for the routine a worker was handed to return, false if thread is not a worker
+    bool join(pthread_t thread, void **result)
+    {
+        Worker *w = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = std::find_if(m_workers.begin(), m_workers.end(),
+                [thread](const auto &candidate) { return handle(candidate.get()) == thread; });
+            if (it == m_workers.end() || !(*it)->busy)
+                return false;
+            w = it->get();
+        }
+
+        spinThenPark(w->state, WorkerDone);
+        if (result)
+            *result = w->result;
+        w->state.store(WorkerIdle, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        w->busy = false;
+        return true;
+    }
+
+    static pthread_t handle(Worker *w) { return reinterpret_cast<pthread_t>(w); }
+
+private:
+    // The parked workers run code of this library, which must not be unloaded under them
+    static void keepLoaded()
+    {
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void *>(&workerMain), &info) && info.dli_fname)
+            dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+};
+
+} // namespace
+
+extern "C" {
+
+__attribute__((visibility("hidden")))
+int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*routine)(void *), void *arg)
+{
+    // ggml starts its compute threads without attributes
+    if (!attr) {
+        if (Worker *w = ComputePool::instance().start(routine, arg)) {
+            *thread = ComputePool::handle(w);
+            return 0;
+        }
+    }
+    return __real_pthread_create(thread, attr, routine, arg);
+}
+
+__attribute__((visibility("hidden")))
+int __wrap_pthread_join(pthread_t thread, void **result)
+{
+    if (ComputePool::instance().join(thread, result))
+        return 0;
+    return __real_pthread_join(thread, result);
+}
+
+} // extern "C"
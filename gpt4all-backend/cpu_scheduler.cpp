@@ -0,0 +1,113 @@
+#include "cpu_scheduler.h"
+#include "sysinfo.h"
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+
+CpuScheduler &CpuScheduler::globalInstance()
+{
+    static CpuScheduler scheduler;
+    return scheduler;
+}
+
+CpuScheduler::CpuScheduler()
+{
+    for (const CpuCore &c : getPhysicalCpuCores())
+        m_cores.push_back({ c.cpu, c.node });
+}
+
+CpuScheduler::Lease::Lease(int32_t n_threads)
+    : m_scheduler(CpuScheduler::globalInstance())
+    , m_requested(n_threads)
+{
+#if defined(__linux__)
+    m_thread = pthread_self();
+    m_restoreAffinity = pthread_getaffinity_np(m_thread, sizeof(m_savedAffinity), &m_savedAffinity) == 0;
+#endif
+    {
+        std::lock_guard<std::mutex> lock(m_scheduler.m_mutex);
+        ++m_scheduler.m_leases;
+        m_generation = ++m_scheduler.m_generation;
+        assign();
+    }
+    pin();
+}
+
+CpuScheduler::Lease::~Lease()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_scheduler.m_mutex);
+        for (int32_t i : m_cores)
+            --m_scheduler.m_cores[i].users;
+        --m_scheduler.m_leases;
+        ++m_scheduler.m_generation;
+    }
+#if defined(__linux__)
+    if (m_restoreAffinity)
+        pthread_setaffinity_np(m_thread, sizeof(m_savedAffinity), &m_savedAffinity);
+#endif
+}
+
+bool CpuScheduler::Lease::refresh()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_scheduler.m_mutex);
+        if (m_generation == m_scheduler.m_generation)
+            return false;
+        m_generation = m_scheduler.m_generation;
+        const std::vector<int32_t> previous = m_cores;
+        assign();
+        if (m_cores == previous)
+            return false;
+    }
+    pin();
+    return true;
+}
+
+// Called with the mutex of the scheduler held
+void CpuScheduler::Lease::assign()
+{
+    std::vector<Core> &cores = m_scheduler.m_cores;
+    for (int32_t i : m_cores)
+        --cores[i].users;
+    m_cores.clear();
+
+    const int32_t n_cores = cores.size();
+    const int32_t share = std::max(1, n_cores / std::max(1, m_scheduler.m_leases));
+    const int32_t n = std::min(m_requested > 0 ? m_requested : n_cores, share);
+
+    // Idle cores come first, from the NUMA node with the most of them, and cores other leases are
+    // using only once there are no idle ones left.
+    std::map<int32_t, int32_t> idle;
+    for (const Core &c : cores)
+        idle[c.node] += c.users == 0;
+
+    std::vector<int32_t> order(n_cores);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) {
+        const Core &ca = cores[a], &cb = cores[b];
+        if (ca.users != cb.users)
+            return ca.users < cb.users;
+        if (idle[ca.node] != idle[cb.node])
+            return idle[ca.node] > idle[cb.node];
+        return ca.node < cb.node;
+    });
+
+    m_cores.assign(order.begin(), order.begin() + n);
+    std::sort(m_cores.begin(), m_cores.end());
+    for (int32_t i : m_cores)
+        ++cores[i].users;
+}
+
+void CpuScheduler::Lease::pin()
+{
+#if defined(__linux__)
+    // the compute threads take on the affinity of the thread that hands them a graph
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int32_t i : m_cores)
+        CPU_SET(m_scheduler.m_cores[i].cpu, &set);
+    pthread_setaffinity_np(m_thread, sizeof(set), &set);
+#endif
+}
@@ -0,0 +1,75 @@
+#ifndef CPU_SCHEDULER_H
+#define CPU_SCHEDULER_H
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Shares the physical cores of the machine between the threads that evaluate models, so that several
+// loaded models, or a chat and the embedding worker, do not run more compute threads than there are
+// cores. A thread holds a Lease while it evaluates: every lease gets an equal share of the cores, and
+// on Linux the thread and the compute threads ggml starts from it are pinned to the cores of its lease.
+// Those come from the pool of compute_pool.cpp, which keeps them alive between evaluations. Cores are
+// handed out by NUMA node so the threads of a lease share their memory controller.
+//
+// Leases do not wait for each other. One that was taken before others came or went is resized the next
+// time refresh() is called on it, which callers do between two tokens.
+class CpuScheduler {
+public:
+    static CpuScheduler &globalInstance();
+
+    // The number of physical cores, and so the most threads a model should use
+    int32_t coreCount() const { return int32_t(m_cores.size()); }
+
+    class Lease {
+    public:
+        // Asks for n_threads cores, or for all of them if n_threads <= 0
+        explicit Lease(int32_t n_threads);
+        ~Lease();
+
+        Lease(const Lease&) = delete;
+        Lease &operator=(const Lease&) = delete;
+
+        // The number of compute threads the cores of this lease can run
+        int32_t threadCount() const { return int32_t(m_cores.size()); }
+
+        // Takes the share of this lease again if leases were taken or returned since it was last
+        // computed. Returns whether the cores of the lease changed.
+        bool refresh();
+
+    private:
+        void assign();
+        void pin();
+
+        CpuScheduler &m_scheduler;
+        const int32_t m_requested;
+        std::vector<int32_t> m_cores;   // indices into the cores of the scheduler
+        uint64_t m_generation = 0;
+#if defined(__linux__)
+        pthread_t m_thread;
+        cpu_set_t m_savedAffinity;
+        bool m_restoreAffinity = false;
+#endif
+    };
+
+private:
+    CpuScheduler();
+
+    struct Core {
+        int32_t cpu;
+        int32_t node;
+        int32_t users = 0;
+    };
+
+    std::mutex m_mutex;
+    std::vector<Core> m_cores;
+    int32_t m_leases = 0;
+    uint64_t m_generation = 0;  // changes whenever a lease is taken or returned
+};
+
+#endif // CPU_SCHEDULER_H
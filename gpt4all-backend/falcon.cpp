@@ -4,7 +4,10 @@
 #include "llama.h"
 #include "llama-util.h"
 #include "utils.h"
+#include "sampler.h"
 #include "llmodel_shared.h"
+#include "mmap_file.h"
+#include "sysinfo.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -63,17 +66,21 @@ struct falcon_model {
 
     struct ggml_context* ctx;
     std::map<std::string, struct ggml_tensor*> tensors;
+    llm_mmap mapping; // the weights, unless they had to be copied
 
     llm_buffer eval_buf;
     llm_buffer work_buf;
     llm_buffer scr0_buf;
     llm_buffer scr1_buf;
+
+    LLModel::EvalStats stats;
 };
 
 static bool kv_cache_init(
         const struct falcon_hparams & hparams,
               struct llm_kv_cache & cache,
-                         ggml_type   wtype,
+                         ggml_type   ktype,
+                         ggml_type   vtype,
                                int   n_ctx) {
     const int n_embd  = hparams.n_embd;
     const int dim_head  = n_embd / hparams.n_head;
@@ -82,7 +89,7 @@ static bool kv_cache_init(
 
     const int64_t n_mem      = (int64_t)n_layer*n_ctx;
     const int64_t n_elements = dim_kv * n_mem;
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    cache.buf.resize(llm_row_size(ktype, n_elements) + llm_row_size(vtype, n_elements) + 2_MiB);
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
     params.mem_buffer = cache.buf.addr;
@@ -94,8 +101,8 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
     return true;
 }
 
@@ -173,8 +180,7 @@ bool falcon_model_load(const std::string & fname, falcon_model & model, gpt_voca
             uint32_t dummy;
             fin.read((char *) &dummy, sizeof(dummy));
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            vocab.add_token(word);
         }
     }
 
@@ -230,17 +236,20 @@ bool falcon_model_load(const std::string & fname, falcon_model & model, gpt_voca
 
         const int64_t n_mem      = (int64_t)n_layer*model.hparams.n_ctx;
         const int64_t n_elements = dim_kv * n_mem;
-        size_t kv_cache_size = 2u*n_elements*ggml_type_size(wtype) + 2_MiB;
+        const ggml_type k_type = llm_kv_cache_type(model.kv_self.kv_type, dim_head, GGML_TYPE_F32);
+        size_t kv_cache_size = llm_row_size(k_type, n_elements) + llm_row_size(GGML_TYPE_F32, n_elements) + 2_MiB;
         *mem_req = ctx_size + kv_cache_size;
         return false;
     }
 
-    // create the ggml context
+    // create the ggml context, which only holds the tensor headers when the weights are mapped
     {
+        const bool mapped = model.mapping.open(fname);
+        const size_t n_objs = size_t(4 + 8*model.hparams.n_layer);
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
+            .mem_size   = mapped ? n_objs*ggml_tensor_overhead() : ctx_size,
             .mem_buffer = NULL,
-            .no_alloc   = false,
+            .no_alloc   = mapped,
         };
 
         model.ctx = ggml_init(params);
@@ -345,7 +354,9 @@ bool falcon_model_load(const std::string & fname, falcon_model & model, gpt_voca
         const int64_t n_mem      = n_layer*n_ctx;
         const int64_t n_elements = head_dim*n_mem;
 
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F32, model.hparams.n_ctx)) {
+        // the graph repeats K and V for every head, which ggml only does for F32
+        const ggml_type k_type = llm_kv_cache_type(model.kv_self.kv_type, head_dim, GGML_TYPE_F32);
+        if (!kv_cache_init(hparams, model.kv_self, k_type, GGML_TYPE_F32, model.hparams.n_ctx)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             ggml_free(ctx);
             return false;
@@ -416,7 +427,10 @@ bool falcon_model_load(const std::string & fname, falcon_model & model, gpt_voca
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (!model.mapping.load_tensor(tensor, fin)) {
+                fprintf(stderr, "%s: failed to read tensor '%s' from the model file\n", __func__, name.data());
+                return false;
+            }
 
             total_size += ggml_nbytes(tensor);
             if (++n_tensors % 8 == 0) {
@@ -428,6 +442,14 @@ bool falcon_model_load(const std::string & fname, falcon_model & model, gpt_voca
         printf(" done\n");
 
         printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+
+        // with mapped weights a tensor the file does not have would have no data at all
+        for (const auto & [name, tensor] : model.tensors) {
+            if (!tensor->data) {
+                fprintf(stderr, "%s: tensor '%s' is missing from the model file\n", __func__, name.c_str());
+                return false;
+            }
+        }
     }
 
     fin.close();
@@ -446,6 +468,8 @@ bool falcon_model_load(const std::string & fname, falcon_model & model, gpt_voca
 //   - n_past:    the context size so far
 //   - embd_inp:  the embeddings of the tokens in the context
 //   - embd_w:    the predicted logits for the next token
+//   - logits_all: return the logits of every input token instead of only the last one
+//   - logits_rows: otherwise, when not empty, the positions among the input tokens to return the logits of
 //
 bool falcon_eval(
         falcon_model & model,
@@ -453,7 +477,9 @@ bool falcon_eval(
         const int n_past,
         const std::vector<gpt_vocab::id> & embd_inp,
               std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+              size_t                     & mem_per_token,
+              bool                         logits_all = false,
+        const std::vector<int32_t>       & logits_rows = {}) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
@@ -479,6 +505,9 @@ bool falcon_eval(
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
 
+    int n_out;
+    struct ggml_tensor * out_rows = llm_logits_rows(ctx0, N, logits_all, logits_rows, n_out);
+
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.tok_embeddings, embd);
     struct ggml_tensor* repeat_dummy = ggml_new_tensor_3d(ctx0, inpL->type, head_dim, N + n_past, n_head);
@@ -486,6 +515,14 @@ bool falcon_eval(
     ggml_type wtype = GGML_TYPE_F32;
     const int sizeof_wtype = ggml_type_sizef(wtype);
 
+    const int    dim_kv    = head_dim*n_head_kv;
+    const size_t k_row     = llm_row_size(model.kv_self.k->type, dim_kv);
+    const size_t v_row     = llm_row_size(model.kv_self.v->type, dim_kv);
+    const bool   k_quant   = ggml_is_quantized(model.kv_self.k->type);
+
+    // the positions to dequantize a quantized K cache with
+    struct ggml_tensor * kv_pos = k_quant ? llm_kv_cache_positions(ctx0, n_past + N) : nullptr;
+
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * cur;
         struct ggml_tensor * layernorm_output;
@@ -554,12 +591,10 @@ bool falcon_eval(
             {
                 struct ggml_tensor* k = ggml_view_1d(
                     ctx0, model.kv_self.k, N * n_head_kv * head_dim,
-                    (ggml_element_size(model.kv_self.k) * n_head_kv * head_dim) *
-                        (il * n_ctx + n_past));
+                    k_row * (il * n_ctx + n_past));
                 struct ggml_tensor* v = ggml_view_1d(
                     ctx0, model.kv_self.v, N * n_head_kv * head_dim,
-                    (ggml_element_size(model.kv_self.v) * n_head_kv * head_dim) *
-                        (il * n_ctx + n_past));
+                    v_row * (il * n_ctx + n_past));
 
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
@@ -567,13 +602,17 @@ bool falcon_eval(
 
             struct ggml_tensor * K = ggml_permute(
                 ctx0,
-                ggml_view_3d(
-                    ctx0,
-                    model.kv_self.k,
-                    head_dim, n_head_kv, n_past + N,
-                    head_dim * sizeof_wtype,
-                    head_dim * n_head_kv * sizeof_wtype,
-                    il * n_ctx * ggml_element_size(model.kv_self.k) * n_head_kv * head_dim),
+                k_quant
+                    ? ggml_reshape_3d(ctx0,
+                        llm_kv_cache_dequantize(ctx0, model.kv_self.k, dim_kv, n_past + N, il * n_ctx * k_row, kv_pos),
+                        head_dim, n_head_kv, n_past + N)
+                    : ggml_view_3d(
+                        ctx0,
+                        model.kv_self.k,
+                        head_dim, n_head_kv, n_past + N,
+                        head_dim * sizeof_wtype,
+                        head_dim * n_head_kv * sizeof_wtype,
+                        il * n_ctx * k_row),
                 0, 2, 1, 3);
 
             // K * Q
@@ -606,7 +645,7 @@ bool falcon_eval(
                     head_dim, n_head_kv, n_past + N,
                     head_dim * sizeof_wtype,
                     head_dim * n_head_kv * sizeof_wtype,
-                    il * n_ctx * ggml_element_size(model.kv_self.v) * n_head_kv * head_dim),
+                    il * n_ctx * v_row),
                 0, 2, 1, 3);
 
             // changed from repeat2 back to repeat, will not support 40B!
@@ -651,6 +690,11 @@ bool falcon_eval(
 
     ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
 
+    // the norm and the lm_head only for the rows that are returned
+    if (out_rows) {
+        inpL = ggml_get_rows(ctx0, inpL, out_rows);
+    }
+
     // norm
     {
         inpL = ggml_norm(ctx0, inpL);
@@ -679,7 +723,7 @@ bool falcon_eval(
 
     // run the computation
     ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute_g4a(model.work_buf, &gf, n_threads);
+    ggml_graph_compute_g4a(model.work_buf, &gf, n_threads, &model.stats.allocations);
   
 
     //if (n_past%100 == 0) {
@@ -687,12 +731,11 @@ bool falcon_eval(
     //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
     //}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    if (embd_w.capacity() < size_t(n_vocab)*n_out) {
+        model.stats.allocations++;
+    }
+    embd_w.resize(n_vocab*n_out);
+    memcpy(embd_w.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*n_out);
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
@@ -701,111 +744,29 @@ bool falcon_eval(
 
     ggml_free(ctx0);
 
+    model.kv_self.n[0] = n_past + N;
+    model.stats.evals++;
+    model.stats.tokens += N;
     return true;
 }
 
 
-#define MAX_RNG_STATE 64*1024
-size_t falcon_get_state_size(const falcon_model &model) {
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    return s_total;
-}
-
-size_t falcon_copy_state_data(const falcon_model &model, const std::mt19937 &rng, uint8_t *dest)
+// the state is a record of the KV rows that are in use, see llm_state_write()
+static bool falcon_write_state(const falcon_model &model, const std::mt19937 &rng, int since,
+                              const LLModel::StateWriter &write)
 {
-    uint8_t * out = dest;
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
-
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[MAX_RNG_STATE];
-
-        memset(&rng_buf[0], 0, MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
-
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], MAX_RNG_STATE); out += MAX_RNG_STATE;
-    }
-
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
-        }
-    }
-
-    const size_t written  = out - dest;
-    assert(written == falcon_get_state_size(model));
-    fflush(stdout);
-    return written;
+    const auto & hparams = model.hparams;
+    return llm_state_write(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd/hparams.n_head*hparams.n_head_kv,
+        false, 0, rng, since, write);
 }
 
-size_t falcon_set_state_data(falcon_model *model, std::mt19937 *rng, const uint8_t *src)
+static bool falcon_read_state(falcon_model &model, std::mt19937 &rng, const LLModel::StateReader &read)
 {
-    const uint8_t * in = src;
-
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[MAX_RNG_STATE];
-
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, MAX_RNG_STATE); in += MAX_RNG_STATE;
-
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
-
-        assert(rng_ss.fail() == false);
-    }
-
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
-
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
-
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
-
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
-
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
-
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
-
-        }
-
-        model->kv_self.n = kv_ntok;
-    }
-
-    const size_t nread    = in - src;
-    assert(nread == falcon_get_state_size(*model));
-    fflush(stdout);
-    return nread;
+    const auto & hparams = model.hparams;
+    if (!llm_state_read(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd/hparams.n_head*hparams.n_head_kv,
+            false, 0, rng, read))
+        return false;
+    return true;
 }
 
 struct FalconPrivate {
@@ -816,6 +777,7 @@ struct FalconPrivate {
     int64_t n_threads = 0;
     size_t mem_per_token = 0;
     std::mt19937 rng;
+    llm_sampler sampler;
 };
 
 Falcon::Falcon() : d_ptr(new FalconPrivate) {
@@ -837,13 +799,17 @@ bool Falcon::loadModel(const std::string &modelPath)
     std::mt19937 rng(time(NULL));
     d_ptr->rng = rng;
 
+    d_ptr->model->kv_self.kv_type = m_loadOptions.kv_type;
+    d_ptr->model->mapping.enabled = m_loadOptions.use_mmap;
+    d_ptr->model->mapping.prefault = m_loadOptions.prefault;
+
     // load the model
     if (!falcon_model_load(modelPath, *d_ptr->model, d_ptr->vocab, nullptr)) {
         std::cerr << "FALCON ERROR: failed to load model from " <<  modelPath;
         return false;
     }
 
-    d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads = getPhysicalCoreCount();
     d_ptr->modelLoaded = true;
     fflush(stdout);
     return true;
@@ -859,6 +825,7 @@ size_t Falcon::requiredMem(const std::string &modelPath)
     falcon_model dummy_model;
     gpt_vocab dummy_vocab;
     size_t mem_req;
+    dummy_model.kv_self.kv_type = m_loadOptions.kv_type;
     auto fin = std::ifstream(modelPath, std::ios::binary);
     falcon_model_load(modelPath, dummy_model, dummy_vocab, &mem_req);
     return mem_req;
@@ -866,17 +833,27 @@ size_t Falcon::requiredMem(const std::string &modelPath)
 
 size_t Falcon::stateSize() const
 {
-    return falcon_get_state_size(*d_ptr->model);
+    return streamedStateSize();
 }
 
 size_t Falcon::saveState(uint8_t *dest) const
 {
-    return falcon_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
+    return saveStreamedState(dest);
 }
 
 size_t Falcon::restoreState(const uint8_t *src)
 {
-    return falcon_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return restoreStreamedState(src);
+}
+
+bool Falcon::writeState(const StateWriter &write, int32_t since) const
+{
+    return falcon_write_state(*d_ptr->model, d_ptr->rng, since, write);
+}
+
+bool Falcon::readState(const StateReader &read)
+{
+    return falcon_read_state(*d_ptr->model, d_ptr->rng, read);
 }
 
 void Falcon::setThreadCount(int32_t n_threads)
@@ -896,19 +873,12 @@ std::vector<LLModel::Token> Falcon::tokenize(PromptContext &, const std::string
 
 LLModel::Token Falcon::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks,
-        promptCtx.logits,
-        promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty,
-        d_ptr->rng);
+    return d_ptr->sampler.sample(promptCtx, promptCtx.logits.data(), d_ptr->model->hparams.n_vocab, d_ptr->rng);
 }
 
-std::string Falcon::tokenToString(Token id) const
+std::string_view Falcon::tokenToString(Token id) const
 {
-    return d_ptr->vocab.id_to_token[id];
+    return d_ptr->vocab.piece(id);
 }
 
 bool Falcon::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
@@ -921,7 +891,41 @@ bool Falcon::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens)
         initialized = true;
     }
 
-    return falcon_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+    return falcon_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token,
+        ctx.logits_all, ctx.logits_rows);
+}
+
+LLModel::EvalStats Falcon::evalStats() const
+{
+    return d_ptr->model->stats;
+}
+
+size_t Falcon::kvCacheUsed() const
+{
+    const auto & hparams = d_ptr->model->hparams;
+    return llm_kv_cache_used(d_ptr->model->kv_self, hparams.n_layer, hparams.n_head_kv*(hparams.n_embd/hparams.n_head));
+}
+
+void Falcon::resetEvalStats()
+{
+    d_ptr->model->stats = EvalStats();
+}
+
+bool Falcon::shiftContext(int32_t n_keep, int32_t n_discard, int32_t n_past)
+{
+    auto & model = *d_ptr->model;
+    const auto & hparams = model.hparams;
+    const int head_dim = hparams.n_embd/hparams.n_head;
+    const int n_move = n_past - n_keep - n_discard;
+
+    // the keys were rotated for their old position, rotate the ones we keep to their new one first
+    if (!llm_kv_cache_rope_shift(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_head_kv,
+            head_dim, head_dim, 0, n_keep + n_discard, n_move, -n_discard, true))
+        return false;
+
+    llm_kv_cache_shift(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_head_kv*head_dim, 0,
+        n_keep, n_discard, n_past, false);
+    return true;
 }
 
 int32_t Falcon::contextLength() const
@@ -2,7 +2,10 @@
 #include "gptj_impl.h"
 
 #include "utils.h"
+#include "sampler.h"
 #include "llmodel_shared.h"
+#include "mmap_file.h"
+#include "sysinfo.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -64,6 +67,40 @@ struct gptj_layer {
     struct ggml_tensor * c_mlp_proj_b;
 };
 
+// The input and output tensors of a graph built by gptj_build_graph()
+struct gptj_graph {
+    struct ggml_tensor * embd     = nullptr;
+    struct ggml_tensor * KQ_pos   = nullptr;
+    struct ggml_tensor * KQ_mask  = nullptr;    // only in decode graphs
+    struct ggml_tensor * out_rows = nullptr;
+    struct ggml_tensor * logits   = nullptr;
+};
+
+// decode graphs attend to a multiple of this many KV positions, so one is reused for as many tokens
+#define GPTJ_DECODE_KV_PAD 64
+
+// The graph of a single token decode step, kept between evaluations so generating a token does not
+// build it again; see gptj_eval_decode()
+struct gptj_decode_graph {
+    llm_buffer buf;
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph  * gf  = nullptr;
+
+    int seq  = -1;  // the KV slot and the number of positions it was built for
+    int n_kv = 0;
+
+    gptj_graph g;
+
+    // the copies of the new key and value into the KV cache, two per layer
+    std::vector<struct ggml_tensor *> kv_stores;
+
+    ~gptj_decode_graph() {
+        if (ctx) {
+            ggml_free(ctx);
+        }
+    }
+};
+
 struct gptj_model {
     gptj_hparams hparams;
 
@@ -84,10 +121,16 @@ struct gptj_model {
     //
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+    llm_mmap mapping; // the weights, unless they had to be copied
 
     llm_buffer eval_buf;
     llm_buffer scr0_buf;
     llm_buffer scr1_buf;
+    llm_buffer work_buf;
+
+    gptj_decode_graph decode;
+
+    LLModel::EvalStats stats;
 
     ~gptj_model() {
         if (ctx) {
@@ -99,15 +142,17 @@ struct gptj_model {
 static bool kv_cache_init(
         const struct gptj_hparams & hparams,
               struct llm_kv_cache & cache,
-                         ggml_type   wtype,
+                         ggml_type   ktype,
+                         ggml_type   vtype,
                                int   n_ctx) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
 
-    const int64_t n_mem      = (int64_t)n_layer*n_ctx;
+    // one n_ctx long slot per sequence
+    const int64_t n_mem      = (int64_t)n_layer*n_ctx*cache.n_seq;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    cache.buf.resize(llm_row_size(ktype, n_elements) + llm_row_size(vtype, n_elements) + 2_MiB);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -121,8 +166,10 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
+    cache.n.assign(cache.n_seq, 0);
+    cache.n_set.assign(cache.n_seq, 0);
 
     return true;
 }
@@ -134,9 +181,9 @@ bool gptj_model_load(const std::string &fname, gptj_model & model, gpt_vocab & v
         *mem_req = 0;
     }
 
-    // create the ggml context
+    // create the ggml context, the tensor data is mapped or read in once the tensors are known
     struct gguf_init_params params = {
-        /*.no_alloc = */ false,
+        /*.no_alloc = */ true,
         /*.ctx      = */ &model.ctx,
     };
 
@@ -217,23 +264,45 @@ bool gptj_model_load(const std::string &fname, gptj_model & model, gpt_vocab & v
         printf("%s: gpt2 tokenizer vocab = %d\n", __func__, int(hparams.n_vocab));
 
         for (int i = 0; i < hparams.n_vocab; i++) {
-            std::string word = gguf_get_arr_str(ggufctx, tokens_keyidx, i);
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            vocab.add_token(gguf_get_arr_str(ggufctx, tokens_keyidx, i));
         }
     }
 
     auto & ctx = model.ctx;
 
     size_t ctx_size = ggml_get_mem_size(ctx);
+    for (int i = 0; i < gguf_get_n_tensors(ggufctx); ++i) {
+        ctx_size += ggml_nbytes(ggml_get_tensor(ctx, gguf_get_tensor_name(ggufctx, i)));
+    }
     printf("%s: ggml ctx size = %6.2f MB\n", __func__, ctx_size / (1024.0 * 1024.0));
 
     if (mem_req != nullptr) {
-        *mem_req = ctx_size;
+        const auto & hparams = model.hparams;
+        const ggml_type k_type = llm_kv_cache_type(model.kv_self.kv_type, hparams.n_embd/hparams.n_head);
+        const int64_t n_elements = int64_t(hparams.n_embd)*hparams.n_layer*hparams.n_ctx*model.kv_self.n_seq;
+        *mem_req = ctx_size + llm_row_size(k_type, n_elements) + llm_row_size(GGML_TYPE_F16, n_elements);
         gguf_free(ggufctx);
         return false;
     }
 
+    // load the weights, gguf aligns them so all of them can be mapped
+    {
+        model.mapping.open(fname);
+
+        auto fin = std::ifstream(fname, std::ios::binary);
+        const size_t data_offset = gguf_get_data_offset(ggufctx);
+        for (int i = 0; i < gguf_get_n_tensors(ggufctx); ++i) {
+            const char * name = gguf_get_tensor_name(ggufctx, i);
+            fin.seekg(data_offset + gguf_get_tensor_offset(ggufctx, i));
+            if (!model.mapping.load_tensor(ggml_get_tensor(ctx, name), fin)) {
+                fprintf(stderr, "%s: failed to read tensor '%s' from the model file\n", __func__, name);
+                gguf_free(ggufctx);
+                return false;
+            }
+        }
+        gguf_free(ggufctx);
+    }
+
     // prepare memory for the weights
     {
         const auto & hparams = model.hparams;
@@ -276,14 +345,15 @@ bool gptj_model_load(const std::string &fname, gptj_model & model, gpt_vocab & v
     // key + value memory
     {
         const auto & hparams = model.hparams;
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F16, model.hparams.n_ctx)) {
+        const ggml_type k_type = llm_kv_cache_type(model.kv_self.kv_type, hparams.n_embd/hparams.n_head);
+        if (!kv_cache_init(hparams, model.kv_self, k_type, GGML_TYPE_F16, model.hparams.n_ctx)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             ggml_free(ctx);
             return false;
         }
 
         const size_t memory_size = ggml_nbytes(model.kv_self.k) + ggml_nbytes(model.kv_self.v);
-        printf("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+        printf("%s: kv self size  = %7.2f MB (K %s)\n", __func__, memory_size / 1024.0 / 1024.0, ggml_type_name(k_type));
     }
 
     model.scr0_buf.resize(256u * 1024 * 1024);
@@ -292,24 +362,23 @@ bool gptj_model_load(const std::string &fname, gptj_model & model, gpt_vocab & v
     return true;
 }
 
-// evaluate the transformer
-//
-//   - model:     the model
-//   - n_threads: number of threads to use
-//   - n_past:    the context size so far
-//   - embd_inp:  the embeddings of the tokens in the context
-//   - embd_w:    the predicted logits for the next token
-//
-// The GPT-J model requires about 16MB of memory per input token.
-//
-bool gptj_eval(
+// Builds the graph evaluating the batch into gf, with logits for the n_out rows in out_rows, or for every
+// token when n_out is 0. Every sequence attends to the n_past + n_tokens
+// positions of its KV slot, except when n_kv is given: then the batch is a single token attending to
+// n_kv positions, those after it are hidden by KQ_mask, and the copies of its key and value into the
+// KV cache of every layer are appended to kv_stores so the graph can be reused at other positions.
+static gptj_graph gptj_build_graph(
         gptj_model & model,
-        const int n_threads,
-        const int n_past,
-        const std::vector<gpt_vocab::id> & embd_inp,
-              std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
-    const int N = embd_inp.size();
+        struct ggml_context * ctx0,
+        struct ggml_cgraph * gf,
+        const std::vector<llm_batch_seq> & batch,
+        int n_out,
+        int n_kv = 0,
+        std::vector<struct ggml_tensor *> * kv_stores = nullptr) {
+    int N = 0;
+    for (const auto & s : batch) {
+        N += s.n_tokens;
+    }
 
     const auto & hparams = model.hparams;
 
@@ -317,46 +386,31 @@ bool gptj_eval(
     const int n_layer = hparams.n_layer;
     const int n_ctx   = hparams.n_ctx;
     const int n_head  = hparams.n_head;
-    const int n_vocab = hparams.n_vocab;
     const int n_rot   = hparams.n_rot;
 
-    const size_t init_buf_size = 1024_MiB;
-    if (!model.eval_buf.addr || model.eval_buf.size < init_buf_size)
-        model.eval_buf.resize(init_buf_size);
+    const size_t k_row = llm_row_size(model.kv_self.k->type, n_embd);
+    const size_t v_esz = ggml_element_size(model.kv_self.v);
 
-    if (mem_per_token > 0 && mem_per_token*N > model.eval_buf.size) {
-        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
-        printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.eval_buf.size, buf_size_new);
+    // first row of layer il in the KV cache slot of sequence seq
+    auto kv_row = [&](int seq, int il) { return (int64_t(seq)*n_layer + il)*n_ctx; };
 
-        // reallocate
-        model.eval_buf.resize(buf_size_new);
-        if (model.eval_buf.addr == nullptr) {
-            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.eval_buf.size);
-            return false;
-        }
-    }
-
-    struct ggml_init_params params = {
-        .mem_size   = model.eval_buf.size,
-        .mem_buffer = model.eval_buf.addr,
-        .no_alloc = false
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+    gptj_graph g;
 
     // KQ_pos - contains the positions
-    struct ggml_tensor * KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    int * data = (int *) KQ_pos->data;
-    for (int i = 0; i < N; ++i) {
-        data[i] = n_past + i;
+    g.KQ_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    g.embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+
+    // the rows whose logits are returned, filled in by the caller
+    if (n_out > 0) {
+        g.out_rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_out);
     }
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
+    if (n_kv > 0) {
+        g.KQ_mask = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_kv);
+    }
 
     // wte
-    struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
+    struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, g.embd);
 
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * cur;
@@ -377,74 +431,103 @@ bool gptj_eval(
 
         // self-attention
         {
+            // the projections are shared by the whole batch, only the attention is per sequence
             struct ggml_tensor * Qcur = ggml_rope(
                 ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_q_proj_w, cur), n_embd/n_head, n_head, N),
-                KQ_pos, n_rot, 0, 0
+                g.KQ_pos, n_rot, 0, 0
             );
             struct ggml_tensor * Kcur = ggml_rope(
                 ctx0, ggml_reshape_3d(ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_k_proj_w, cur), n_embd/n_head, n_head, N),
-                KQ_pos, n_rot, 0, 0
+                g.KQ_pos, n_rot, 0, 0
             );
-
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_mul_mat(ctx0, model.layers[il].c_attn_v_proj_w, cur));
-
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, N, n_embd,
-                        (   n_ctx)*ggml_element_size(model.kv_self.v),
-                        (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + n_past*ggml_element_size(model.kv_self.v));
-
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].c_attn_v_proj_w, cur);
+
+            // KQV_merged of every sequence is copied into its columns of this tensor
+            struct ggml_tensor * KQV_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
+
+            int offs = 0;
+            for (const auto & s : batch) {
+                const int     n_past = s.n_past;
+                const int     n      = s.n_tokens;
+                const int     n_attn = n_kv > 0 ? n_kv : n_past + n;
+                const int64_t row    = kv_row(s.seq, il);
+
+                // store key and value to memory
+                {
+                    struct ggml_tensor * Kcur_s = ggml_view_1d(ctx0, Kcur, n*n_embd, offs*Kcur->nb[2]);
+                    struct ggml_tensor * Vcur_s = ggml_view_2d(ctx0, Vcur, n_embd, n, Vcur->nb[1], offs*Vcur->nb[1]);
+
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, n*n_embd, k_row*(row + n_past));
+                    struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, n, n_embd,
+                            (   n_ctx)*v_esz,
+                            row*v_esz*n_embd + n_past*v_esz);
+                    Vcur_s = ggml_transpose(ctx0, Vcur_s);
+
+                    struct ggml_tensor * k_store = ggml_cpy(ctx0, Kcur_s, k);
+                    struct ggml_tensor * v_store = ggml_cpy(ctx0, Vcur_s, v);
+                    ggml_build_forward_expand(gf, k_store);
+                    ggml_build_forward_expand(gf, v_store);
+
+                    if (kv_stores) {
+                        kv_stores->push_back(k_store);
+                        kv_stores->push_back(v_store);
+                    }
+                }
+
+                // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, Qcur, n_embd/n_head, n_head, n, Qcur->nb[1], Qcur->nb[2], offs*Qcur->nb[2]),
+                            0, 2, 1, 3);
+
+                // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0,
+                                ggml_view_1d(ctx0, model.kv_self.k, n_attn*n_embd, row*k_row),
+                                n_embd/n_head, n_head, n_attn),
+                            0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                // KQ_scaled = KQ / sqrt(n_embd/n_head)
+                struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, 1.0f/sqrt(float(n_embd)/n_head));
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = n_kv > 0
+                    ? ggml_add(ctx0, KQ_scaled, ggml_repeat(ctx0, g.KQ_mask, KQ_scaled))
+                    : ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
+
+                // KQ = soft_max(KQ_masked)
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+                // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, model.kv_self.v,
+                            n_attn, n_embd/n_head, n_head,
+                            n_ctx*v_esz,
+                            n_ctx*v_esz*n_embd/n_head,
+                            row*v_esz*n_embd);
+
+                // KQV = transpose(V) * KQ_soft_max
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                // KQV_all[:, offs:offs + n] = KQV_merged.contiguous().view(n_embd, n)
+                ggml_build_forward_expand(gf, ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_view_2d(ctx0, KQV_all, n_embd, n, KQV_all->nb[1], offs*KQV_all->nb[1])));
+
+                offs += n;
             }
 
-            // Q = Qcur.contiguous().view(n_embd/n_head, n_head, N).permute(0, 2, 1, 3)
-            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
-
-            // K = Kmem.view(n_embd/n_head, n_head, n_past + N).permute(0, 2, 1, 3)
-            struct ggml_tensor * K =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
-                            n_embd/n_head, n_head, n_past + N),
-                        0, 2, 1, 3);
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-
-            // KQ_scaled = KQ / sqrt(n_embd/n_head)
-            struct ggml_tensor * KQ_scaled = ggml_scale(ctx0, KQ, 1.0f/sqrt(float(n_embd)/n_head));
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
-
-            // V_trans = Vmem.view(n_embd/n_head, n_head, n_past + N).permute(1, 2, 0, 3).contiguous()
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, model.kv_self.v,
-                        n_past + N, n_embd/n_head, n_head,
-                        n_ctx*ggml_element_size(model.kv_self.v),
-                        n_ctx*ggml_element_size(model.kv_self.v)*n_embd/n_head,
-                        il*n_ctx*ggml_element_size(model.kv_self.v)*n_embd);
-
-            // KQV = transpose(V) * KQ_soft_max
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-
             // projection (no bias)
             cur = ggml_mul_mat(ctx0,
                     model.layers[il].c_attn_proj_w,
-                    cur);
+                    KQV_all);
         }
 
         struct ggml_tensor * inpFF = cur;
@@ -485,6 +568,11 @@ bool gptj_eval(
 
     ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
 
+    // only the rows we return logits for go through the final norm and the lm head
+    if (g.out_rows) {
+        inpL = ggml_get_rows(ctx0, inpL, g.out_rows);
+    }
+
     // norm
     {
         inpL = ggml_norm(ctx0, inpL, model.hparams.norm_eps);
@@ -513,146 +601,274 @@ bool gptj_eval(
 
     ggml_build_forward_expand(gf, inpL);
 
-    // run the computation
-    {
-        std::unique_ptr<uint8_t []> data;
-        auto plan = ggml_graph_plan(gf, n_threads);
-        if (plan.work_size > 0) {
-            data.reset(new uint8_t[plan.work_size]);
-            plan.work_data = data.get();
-        }
-        ggml_graph_compute(gf, &plan);
+    g.logits = inpL;
+    return g;
+}
+
+static void gptj_graph_compute(gptj_model & model, struct ggml_cgraph * gf, int n_threads) {
+    auto plan = ggml_graph_plan(gf, n_threads);
+    if (plan.work_size > 0) {
+        model.stats.allocations += llm_buffer_reserve(model.work_buf, plan.work_size);
+        plan.work_data = model.work_buf.addr;
     }
+    ggml_graph_compute(gf, &plan);
+}
 
-    //if (n_past%100 == 0) {
-    //    ggml_graph_print   (gf);
-    //    ggml_graph_dump_dot(gf, NULL, "gpt-2.dot");
-    //}
+static void gptj_copy_logits(gptj_model & model, const struct ggml_tensor * logits, int n_out,
+                             std::vector<float> & embd_w) {
+    const size_t n = size_t(model.hparams.n_vocab)*n_out;
+    if (embd_w.capacity() < n) {
+        model.stats.allocations++;
+    }
+    embd_w.resize(n);
+    memcpy(embd_w.data(), (const float *) ggml_get_data(logits), sizeof(float)*n);
+}
+
+// Builds the decode graph of KV slot seq for n_kv positions, into its own buffer so it outlives the
+// evaluation. The positions up to n_kv that were never written are zeroed first: the cache is not
+// initialized and the mask only hides them from the softmax, a NaN in them would still reach the
+// result through V. Written positions past n_past are left alone, they may hold a cached suffix the
+// next prompt reuses.
+static bool gptj_build_decode_graph(gptj_model & model, int seq, int n_past, int n_kv) {
+    auto & dg = model.decode;
+
+    const auto & hparams = model.hparams;
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = hparams.n_ctx;
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
+    if (!dg.buf.addr) {
+        const size_t graph_size = GGML_DEFAULT_GRAPH_SIZE + 16*n_layer;
+        dg.buf.resize(ggml_tensor_overhead()*graph_size*2 + ggml_graph_overhead_custom(graph_size, false)
+            + sizeof(float)*(n_embd + 3*size_t(hparams.n_vocab) + n_ctx) + 1_MiB);
+        model.stats.allocations++;
+    }
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    if (dg.ctx) {
+        ggml_free(dg.ctx);
+        dg.ctx = nullptr;
+    }
 
-    if (mem_per_token == 0) {
-        mem_per_token = ggml_used_mem(ctx0)/N;
+    struct ggml_init_params params = {
+        .mem_size   = dg.buf.size,
+        .mem_buffer = dg.buf.addr,
+        .no_alloc = false
+    };
+    dg.ctx = ggml_init(params);
+    if (!dg.ctx) {
+        return false;
     }
-    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    ggml_free(ctx0);
+    const int32_t token = 0;
+    dg.gf = ggml_new_graph_custom(dg.ctx, GGML_DEFAULT_GRAPH_SIZE + 16*n_layer, false);
+    dg.kv_stores.clear();
+    dg.kv_stores.reserve(2*n_layer);
+    dg.g = gptj_build_graph(model, dg.ctx, dg.gf, { { seq, n_past, &token, 1 } }, 0, n_kv, &dg.kv_stores);
+    dg.seq  = seq;
+    dg.n_kv = n_kv;
+
+    int & n_set = model.kv_self.n_set[seq];
+    const int first = std::max(n_past, n_set);
+    if (first >= n_kv) {
+        return true;
+    }
 
+    const size_t k_row = llm_row_size(model.kv_self.k->type, n_embd);
+    const size_t v_esz = ggml_element_size(model.kv_self.v);
+    for (int il = 0; il < n_layer; ++il) {
+        const int64_t row = (int64_t(seq)*n_layer + il)*n_ctx;
+        memset((uint8_t *) model.kv_self.k->data + (row + first)*k_row, 0, (n_kv - first)*k_row);
+        for (int i = 0; i < n_embd; ++i) {
+            memset((uint8_t *) model.kv_self.v->data + ((row*n_embd) + int64_t(i)*n_ctx + first)*v_esz, 0,
+                (n_kv - first)*v_esz);
+        }
+    }
+    n_set = n_kv;
     return true;
 }
 
-#define GPTJ_MAX_RNG_STATE 64*1024
+// Evaluates the next token of a single sequence with the cached decode graph, which is only rebuilt
+// when the sequence moves to another slot or past the positions it was built for. Its inputs and the
+// KV cache rows the new key and value are written to are patched in place.
+static bool gptj_eval_decode(gptj_model & model, const int n_threads, const llm_batch_seq & s,
+                             std::vector<float> & embd_w) {
+    auto & dg = model.decode;
 
-size_t gptj_get_state_size(const gptj_model &model)
-{
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = GPTJ_MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    fflush(stdout);
-    return s_total;
-}
+    const auto & hparams = model.hparams;
+    const int n_embd  = hparams.n_embd;
+    const int n_layer = hparams.n_layer;
+    const int n_ctx   = hparams.n_ctx;
 
-size_t gptj_copy_state_data(const gptj_model &model, const std::mt19937 &rng, uint8_t *dest)
-{
-    uint8_t * out = dest;
-    fflush(stdout);
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
+    const int n_kv = std::min(n_ctx, (s.n_past + GPTJ_DECODE_KV_PAD)/GPTJ_DECODE_KV_PAD*GPTJ_DECODE_KV_PAD);
+    if (!dg.ctx || dg.seq != s.seq || dg.n_kv != n_kv) {
+        if (!gptj_build_decode_graph(model, s.seq, s.n_past, n_kv)) {
+            fprintf(stderr, "%s: failed to build the decode graph\n", __func__);
+            return false;
+        }
+    }
 
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[GPTJ_MAX_RNG_STATE];
+    ((int32_t *) dg.g.embd->data)[0]   = s.tokens[0];
+    ((int32_t *) dg.g.KQ_pos->data)[0] = s.n_past;
 
-        memset(&rng_buf[0], 0, GPTJ_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
+    float * mask = (float *) dg.g.KQ_mask->data;
+    for (int i = 0; i < n_kv; ++i) {
+        mask[i] = i <= s.n_past ? 0.0f : -INFINITY;
+    }
 
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], GPTJ_MAX_RNG_STATE); out += GPTJ_MAX_RNG_STATE;
+    // the result of a copy is a view of its destination made when the graph was built, it is where
+    // the copy writes to
+    const size_t k_row = llm_row_size(model.kv_self.k->type, n_embd);
+    const size_t v_esz = ggml_element_size(model.kv_self.v);
+    for (int il = 0; il < n_layer; ++il) {
+        const int64_t row = (int64_t(s.seq)*n_layer + il)*n_ctx;
+        struct ggml_tensor * k_store = dg.kv_stores[2*il + 0];
+        struct ggml_tensor * v_store = dg.kv_stores[2*il + 1];
+        k_store->data = (char *) model.kv_self.k->data + k_row*(row + s.n_past);
+        v_store->data = (char *) model.kv_self.v->data + row*v_esz*n_embd + s.n_past*v_esz;
     }
 
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
+    gptj_graph_compute(model, dg.gf, n_threads);
+    gptj_copy_logits(model, dg.g.logits, 1, embd_w);
 
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
+    model.kv_self.n[s.seq] = s.n_past + 1;
+    model.kv_self.n_set[s.seq] = std::max(model.kv_self.n_set[s.seq], s.n_past + 1);
+    model.stats.evals++;
+    model.stats.tokens++;
+    return true;
+}
 
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
-        }
+// evaluate the transformer
+//
+//   - model:     the model
+//   - n_threads: number of threads to use
+//   - batch:     the sequences to evaluate, each one continues its own KV cache slot at n_past
+//   - embd_w:    the predicted logits for the next token of every sequence in the batch
+//   - logits_all: return the logits of every token in the batch instead
+//   - logits_rows: otherwise, for a single sequence and when not empty, the positions among its tokens to
+//                  return the logits of
+//
+// The GPT-J model requires about 16MB of memory per input token.
+//
+bool gptj_eval(
+        gptj_model & model,
+        const int n_threads,
+        const std::vector<llm_batch_seq> & batch,
+              std::vector<float>         & embd_w,
+              size_t                     & mem_per_token,
+              bool                         logits_all = false,
+        const std::vector<int32_t>       & logits_rows = {}) {
+    const int n_seqs = batch.size();
+
+    int N = 0;
+    for (const auto & s : batch) {
+        N += s.n_tokens;
     }
 
-    const size_t written  = out - dest;
-    assert(written == gptj_get_state_size(model));
-    fflush(stdout);
-    return written;
-}
+    // the norm and the lm head only run for the rows that get logits
+    const bool custom_rows = n_seqs == 1 && !logits_all && !logits_rows.empty();
+    const int  n_out       = logits_all ? N : custom_rows ? int(logits_rows.size()) : n_seqs;
 
-size_t gptj_set_state_data(gptj_model *model, std::mt19937 *rng, const uint8_t *src)
-{
-    const uint8_t * in = src;
+    // every row gets logits when each sequence is a single token, then nothing is gathered
+    const bool all_rows = logits_all || (!custom_rows && N == n_seqs);
 
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[GPTJ_MAX_RNG_STATE];
+    // generating a single sequence reuses the graph of the previous token
+    if (n_seqs == 1 && N == 1 && n_out == 1) {
+        return gptj_eval_decode(model, n_threads, batch[0], embd_w);
+    }
 
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, GPTJ_MAX_RNG_STATE); in += GPTJ_MAX_RNG_STATE;
+    const int n_layer = model.hparams.n_layer;
 
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
+    const size_t init_buf_size = 1024_MiB;
+    model.stats.allocations += llm_buffer_reserve(model.eval_buf, init_buf_size);
 
-        assert(rng_ss.fail() == false);
+    if (mem_per_token > 0 && mem_per_token*N > model.eval_buf.size) {
+        const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
+        printf("\n%s: reallocating buffer from %zu to %zu bytes\n", __func__, model.eval_buf.size, buf_size_new);
+
+        // reallocate
+        model.eval_buf.resize(buf_size_new);
+        model.stats.allocations++;
+        if (model.eval_buf.addr == nullptr) {
+            fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.eval_buf.size);
+            return false;
+        }
     }
 
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
+    struct ggml_init_params params = {
+        .mem_size   = model.eval_buf.size,
+        .mem_buffer = model.eval_buf.addr,
+        .no_alloc = false
+    };
 
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
+    // every sequence adds its own attention nodes to the graph
+    struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, GGML_DEFAULT_GRAPH_SIZE + 16*n_layer*n_seqs, false);
 
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
+    const gptj_graph g = gptj_build_graph(model, ctx0, gf, batch, all_rows ? 0 : n_out);
+    {
+        int * pos  = (int *) g.KQ_pos->data;
+        int * toks = (int *) g.embd->data;
+        int * rows = g.out_rows ? (int *) g.out_rows->data : nullptr;
+
+        int offs = 0;
+        for (int i = 0; i < n_seqs; ++i) {
+            const auto & s = batch[i];
+            for (int j = 0; j < s.n_tokens; ++j) {
+                pos[offs + j]  = s.n_past + j;
+                toks[offs + j] = s.tokens[j];
+            }
+            offs += s.n_tokens;
+            if (rows && !custom_rows) {
+                rows[i] = offs - 1;
+            }
+        }
+        for (int i = 0; custom_rows && i < n_out; ++i) {
+            rows[i] = std::clamp(logits_rows[i], 0, N - 1);
+        }
+    }
 
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
+    // run the computation
+    gptj_graph_compute(model, gf, n_threads);
 
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
+    //if (n_past%100 == 0) {
+    //    ggml_graph_print   (gf);
+    //    ggml_graph_dump_dot(gf, NULL, "gpt-2.dot");
+    //}
 
-        }
+    // return result for the last token of every sequence, or for the rows asked for
+    gptj_copy_logits(model, g.logits, n_out, embd_w);
 
-        model->kv_self.n = kv_ntok;
+    if (mem_per_token == 0) {
+        mem_per_token = ggml_used_mem(ctx0)/N;
     }
+    //printf("used_mem = %zu\n", ggml_used_mem(ctx0));
 
-    const size_t nread    = in - src;
-    assert(nread == gptj_get_state_size(*model));
-    fflush(stdout);
-    return nread;
+    ggml_free(ctx0);
+
+    for (const auto & s : batch) {
+        model.kv_self.n[s.seq] = s.n_past + s.n_tokens;
+        model.kv_self.n_set[s.seq] = std::max(model.kv_self.n_set[s.seq], s.n_past + s.n_tokens);
+    }
+    model.stats.evals++;
+    model.stats.tokens += N;
+    return true;
+}
+
+// the state is a record of the KV rows that are in use, see llm_state_write()
+static bool gptj_write_state(const gptj_model &model, int seq, const std::mt19937 &rng, int since,
+                              const LLModel::StateWriter &write)
+{
+    const auto & hparams = model.hparams;
+    return llm_state_write(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+        true, seq, rng, since, write);
+}
+
+static bool gptj_read_state(gptj_model &model, int seq, std::mt19937 &rng, const LLModel::StateReader &read)
+{
+    const auto & hparams = model.hparams;
+    return llm_state_read(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+        true, seq, rng, read);
 }
 
 struct GPTJPrivate {
@@ -662,7 +878,10 @@ struct GPTJPrivate {
     gptj_model *model = nullptr;
     int64_t n_threads = 0;
     size_t mem_per_token = 0;
-    std::mt19937 rng;
+    std::vector<std::mt19937> rngs; // one per KV cache slot, see LLModel::createContext()
+    llm_sampler sampler;
+    std::vector<llm_batch_seq> seqs;
+    std::vector<float> batch_logits;
 };
 
 GPTJ::GPTJ()
@@ -678,6 +897,8 @@ size_t GPTJ::requiredMem(const std::string &modelPath, int n_ctx, int ngl) {
     gptj_model dummy_model;
     gpt_vocab dummy_vocab;
     size_t mem_req;
+    dummy_model.kv_self.n_seq = std::max(1, m_loadOptions.n_seq);
+    dummy_model.kv_self.kv_type = m_loadOptions.kv_type;
     gptj_model_load(modelPath, dummy_model, dummy_vocab, &mem_req);
     return mem_req;
 }
@@ -687,8 +908,11 @@ bool GPTJ::loadModel(const std::string &modelPath, int n_ctx, int ngl) {
     (void)ngl;
     d_ptr->modelLoaded = false;
 
-    std::mt19937 rng(time(NULL));
-    d_ptr->rng = rng;
+    d_ptr->model->kv_self.n_seq = std::max(1, m_loadOptions.n_seq);
+    d_ptr->rngs.assign(d_ptr->model->kv_self.n_seq, std::mt19937(time(NULL)));
+    d_ptr->model->kv_self.kv_type = m_loadOptions.kv_type;
+    d_ptr->model->mapping.enabled = m_loadOptions.use_mmap;
+    d_ptr->model->mapping.prefault = m_loadOptions.prefault;
 
     // load the model
     bool ok = gptj_model_load(modelPath, *d_ptr->model, d_ptr->vocab);
@@ -698,7 +922,7 @@ bool GPTJ::loadModel(const std::string &modelPath, int n_ctx, int ngl) {
         return false;
     }
 
-    d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads = getPhysicalCoreCount();
     d_ptr->modelLoaded = true;
     return true;
 }
@@ -724,17 +948,38 @@ bool GPTJ::isModelLoaded() const
 
 size_t GPTJ::stateSize() const
 {
-    return gptj_get_state_size(*d_ptr->model);
+    return streamedStateSize();
 }
 
 size_t GPTJ::saveState(uint8_t *dest) const
 {
-    return gptj_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
+    return saveStreamedState(dest);
 }
 
 size_t GPTJ::restoreState(const uint8_t *src)
 {
-    return gptj_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return restoreStreamedState(src);
+}
+
+bool GPTJ::writeState(const StateWriter &write, int32_t since) const
+{
+    return gptj_write_state(*d_ptr->model, currentSlot(), d_ptr->rngs[currentSlot()], since, write);
+}
+
+bool GPTJ::readState(const StateReader &read)
+{
+    return gptj_read_state(*d_ptr->model, currentSlot(), d_ptr->rngs[currentSlot()], read);
+}
+
+bool GPTJ::writeSlotState(int32_t slot, const StateWriter &write) const
+{
+    return gptj_write_state(*d_ptr->model, slot, d_ptr->rngs[slot], 0, write);
+}
+
+void GPTJ::resetSlot(int32_t slot)
+{
+    d_ptr->model->kv_self.n[slot] = 0;
+    d_ptr->rngs[slot].seed(time(NULL) + slot);
 }
 
 std::vector<LLModel::Token> GPTJ::tokenize(PromptContext &ctx, const std::string &str, bool special) const
@@ -746,32 +991,101 @@ std::vector<LLModel::Token> GPTJ::tokenize(PromptContext &ctx, const std::string
 
 LLModel::Token GPTJ::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks,
-        promptCtx.logits,
-        promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty,
-        d_ptr->rng);
+    return d_ptr->sampler.sample(promptCtx, promptCtx.logits.data(), d_ptr->model->hparams.n_vocab,
+        d_ptr->rngs[currentSlot()]);
 }
 
-std::string GPTJ::tokenToString(Token id) const
+std::string_view GPTJ::tokenToString(Token id) const
 {
-    return d_ptr->vocab.id_to_token[id];
+    return d_ptr->vocab.piece(id);
 }
 
 bool GPTJ::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
 {
     // determine the required inference memory per token:
+    // the warmup goes where the tokens will be written, so it does not overwrite any cached ones
     static bool initialized = false;
     if (!initialized) {
-        gptj_eval(*d_ptr->model, d_ptr->n_threads, 0, { 0, 1, 2, 3 }, ctx.logits,
+        const int32_t warmup[] = { 0, 1, 2, 3 };
+        const int n_past = std::min(ctx.n_past, d_ptr->model->hparams.n_ctx - 4);
+        gptj_eval(*d_ptr->model, d_ptr->n_threads, { { currentSlot(), n_past, warmup, 4 } }, ctx.logits,
             d_ptr->mem_per_token);
         initialized = true;
     }
 
-    return gptj_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+    // reuse the vector so a decode step does not allocate for it
+    auto & seqs = d_ptr->seqs;
+    seqs.clear();
+    seqs.push_back({ currentSlot(), ctx.n_past, tokens.data(), int(tokens.size()) });
+    return gptj_eval(*d_ptr->model, d_ptr->n_threads, seqs, ctx.logits, d_ptr->mem_per_token, ctx.logits_all,
+        ctx.logits_rows);
+}
+
+bool GPTJ::evalBatch(std::vector<BatchItem> &items)
+{
+    auto & batch = d_ptr->seqs;
+    batch.clear();
+    for (const BatchItem &item : items)
+        batch.push_back({ item.seq, item.ctx->n_past, item.tokens, item.n_tokens });
+
+    if (!gptj_eval(*d_ptr->model, d_ptr->n_threads, batch, d_ptr->batch_logits, d_ptr->mem_per_token))
+        return false;
+
+    // hand every sequence the logits of its last token
+    const size_t n_vocab = d_ptr->model->hparams.n_vocab;
+    for (size_t i = 0; i < items.size(); ++i) {
+        auto first = d_ptr->batch_logits.begin() + i*n_vocab;
+        items[i].ctx->logits.assign(first, first + n_vocab);
+    }
+    return true;
+}
+
+int32_t GPTJ::maxSequences() const
+{
+    return d_ptr->model->kv_self.n_seq;
+}
+
+bool GPTJ::copySequence(int32_t src, int32_t dst, int32_t n_tokens)
+{
+    auto & model = *d_ptr->model;
+    const auto & hparams = model.hparams;
+    if (src < 0 || dst < 0 || src >= model.kv_self.n_seq || dst >= model.kv_self.n_seq || n_tokens > hparams.n_ctx)
+        return false;
+    if (src != dst)
+        llm_kv_cache_copy(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd, src, dst, n_tokens, true);
+    return true;
+}
+
+LLModel::EvalStats GPTJ::evalStats() const
+{
+    return d_ptr->model->stats;
+}
+
+size_t GPTJ::kvCacheUsed() const
+{
+    const auto & hparams = d_ptr->model->hparams;
+    return llm_kv_cache_used(d_ptr->model->kv_self, hparams.n_layer, hparams.n_embd);
+}
+
+void GPTJ::resetEvalStats()
+{
+    d_ptr->model->stats = EvalStats();
+}
+
+bool GPTJ::shiftContext(int32_t n_keep, int32_t n_discard, int32_t n_past)
+{
+    auto & model = *d_ptr->model;
+    const auto & hparams = model.hparams;
+    const int n_move = n_past - n_keep - n_discard;
+
+    // the keys were rotated for their old position, rotate the ones we keep to their new one first
+    if (!llm_kv_cache_rope_shift(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_head,
+            hparams.n_embd/hparams.n_head, hparams.n_rot, currentSlot(), n_keep + n_discard, n_move, -n_discard, false))
+        return false;
+
+    llm_kv_cache_shift(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd, currentSlot(),
+        n_keep, n_discard, n_past, true);
+    return true;
 }
 
 int32_t GPTJ::contextLength() const
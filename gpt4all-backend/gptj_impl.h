@@ -23,8 +23,15 @@ public:
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
     size_t restoreState(const uint8_t *src) override;
+    bool writeState(const StateWriter &write, int32_t since = 0) const override;
+    bool readState(const StateReader &read) override;
     void setThreadCount(int32_t n_threads) override;
     int32_t threadCount() const override;
+    int32_t maxSequences() const override;
+    bool copySequence(int32_t src, int32_t dst, int32_t n_tokens) override;
+    EvalStats evalStats() const override;
+    size_t kvCacheUsed() const override;
+    void resetEvalStats() override;
 
 private:
     GPTJPrivate *d_ptr;
@@ -32,10 +39,14 @@ private:
 protected:
     std::vector<Token> tokenize(PromptContext &ctx, const std::string &str, bool special) const override;
     Token sampleToken(PromptContext &ctx) const override;
-    std::string tokenToString(Token id) const override;
+    std::string_view tokenToString(Token id) const override;
     bool evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const override;
+    bool evalBatch(std::vector<BatchItem> &items) override;
+    void resetSlot(int32_t slot) override;
+    bool writeSlotState(int32_t slot, const StateWriter &write) const override;
     int32_t contextLength() const override;
     const std::vector<Token> &endTokens() const override;
+    bool shiftContext(int32_t n_keep, int32_t n_discard, int32_t n_past) override;
     bool shouldAddBOS() const override { return false; }
 };
 
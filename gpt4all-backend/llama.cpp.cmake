@@ -65,6 +65,7 @@ option(LLAMA_SANITIZE_UNDEFINED     "llama: enable undefined sanitizer"
 #option(LLAMA_AVX512                 "llama: enable AVX512"                                  OFF)
 #option(LLAMA_AVX512_VBMI            "llama: enable AVX512-VBMI"                             OFF)
 #option(LLAMA_AVX512_VNNI            "llama: enable AVX512-VNNI"                             OFF)
+#option(LLAMA_AVX_VNNI               "llama: enable AVX-VNNI"                                OFF)
 #option(LLAMA_FMA                    "llama: enable FMA"                                     ON)
 # in MSVC F16C is implied with AVX2/AVX512
 #if (NOT MSVC)
@@ -536,6 +537,11 @@ function(include_ggml DIRECTORY SUFFIX WITH_LLAMA)
                 target_compile_options(ggml${SUFFIX} PRIVATE
                     $<$<COMPILE_LANGUAGE:C>:/arch:AVX2>
                     $<$<COMPILE_LANGUAGE:CXX>:/arch:AVX2>)
+                if (LLAMA_AVX_VNNI)
+                    target_compile_definitions(ggml${SUFFIX} PRIVATE
+                        $<$<COMPILE_LANGUAGE:C>:__AVXVNNI__>
+                        $<$<COMPILE_LANGUAGE:CXX>:__AVXVNNI__>)
+                endif()
             elseif (LLAMA_AVX)
                 target_compile_options(ggml${SUFFIX} PRIVATE
                     $<$<COMPILE_LANGUAGE:C>:/arch:AVX>
@@ -564,6 +570,9 @@ function(include_ggml DIRECTORY SUFFIX WITH_LLAMA)
             if (LLAMA_AVX512_VNNI)
                 target_compile_options(ggml${SUFFIX} PRIVATE -mavx512vnni)
             endif()
+            if (LLAMA_AVX_VNNI)
+                target_compile_options(ggml${SUFFIX} PRIVATE -mavxvnni)
+            endif()
         endif()
     else()
         # TODO: support PowerPC
@@ -1,10 +1,14 @@
 #define LLAMAMODEL_H_I_KNOW_WHAT_I_AM_DOING_WHEN_INCLUDING_THIS_FILE
 #include "llamamodel_impl.h"
+#include "sampler.h"
+#include "sysinfo.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <fstream>
 #include <map>
 #include <string>
@@ -57,42 +61,15 @@ struct gpt_params {
     bool use_mlock         = false; // use mlock to keep model in memory
 };
 
-#if LLAMA_DATE >= 230519
-static int llama_sample_top_p_top_k(
-        llama_context *ctx,
-        const llama_token *last_n_tokens_data,
-        int last_n_tokens_size,
-        int top_k,
-        float top_p,
-        float temp,
-        float repeat_penalty) {
-    auto logits = llama_get_logits(ctx);
-    auto n_vocab = llama_n_vocab(ctx);
-    // Populate initial list of all candidates
-    std::vector<llama_token_data> candidates;
-    candidates.reserve(n_vocab);
-    for (int token_id = 0; token_id < n_vocab; token_id++) {
-        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-    llama_token_data_array candidates_p = {candidates.data(), candidates.size(), false};
-    // Sample repeat penalty
-    llama_sample_repetition_penalty(nullptr, &candidates_p, last_n_tokens_data, last_n_tokens_size, repeat_penalty);
-    // Temperature sampling
-    llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-    llama_sample_tail_free(ctx, &candidates_p, 1.0f, 1);
-    llama_sample_typical(ctx, &candidates_p, 1.0f, 1);
-    llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-    llama_sample_temperature(ctx, &candidates_p, temp);
-    return llama_sample_token(ctx, &candidates_p);
-}
-#endif
-
 struct LLamaPrivate {
     const std::string modelPath;
     bool modelLoaded;
     llama_context *ctx = nullptr;
     llama_context_params params;
     int64_t n_threads = 0;
+    std::mt19937 rng;
+    llm_sampler sampler;
+    size_t kv_bytes_per_token = 0; // K and V of every layer, 0 if the file header is not known
 };
 
 LLamaModel::LLamaModel()
@@ -111,23 +88,29 @@ struct llama_file_hparams {
     enum llama_ftype ftype = LLAMA_FTYPE_MOSTLY_F16;
 };
 
-size_t LLamaModel::requiredMem(const std::string &modelPath) {
-    auto fin = std::ifstream(modelPath, std::ios::binary);
-    fin.seekg(0, std::ios_base::end);
-    size_t filesize = fin.tellg();
-    fin.seekg(0, std::ios_base::beg);
+// Reads the hparams from the header of a ggjt file, returns false if it is not one
+static bool read_file_hparams(std::istream &fin, llama_file_hparams &hparams) {
     uint32_t magic = 0;
     fin.read(reinterpret_cast<char*>(&magic), sizeof(magic));
-    if (magic != 0x67676a74) return 0;
+    if (magic != 0x67676a74) return false;
     uint32_t version = 0;
     fin.read(reinterpret_cast<char*>(&version), sizeof(version));
-    llama_file_hparams hparams;
     fin.read(reinterpret_cast<char*>(&hparams.n_vocab), sizeof(hparams.n_vocab));
     fin.read(reinterpret_cast<char*>(&hparams.n_embd), sizeof(hparams.n_embd));
     fin.read(reinterpret_cast<char*>(&hparams.n_head), sizeof(hparams.n_head));
     fin.read(reinterpret_cast<char*>(&hparams.n_layer), sizeof(hparams.n_layer));
     fin.read(reinterpret_cast<char*>(&hparams.n_rot), sizeof(hparams.n_rot));
     fin.read(reinterpret_cast<char*>(&hparams.ftype), sizeof(hparams.ftype));
+    return bool(fin);
+}
+
+size_t LLamaModel::requiredMem(const std::string &modelPath) {
+    auto fin = std::ifstream(modelPath, std::ios::binary);
+    fin.seekg(0, std::ios_base::end);
+    size_t filesize = fin.tellg();
+    fin.seekg(0, std::ios_base::beg);
+    llama_file_hparams hparams;
+    if (!read_file_hparams(fin, hparams)) return 0;
     const size_t n_ctx = 2048;
     const size_t kvcache_element_size = 2; // fp16
     const size_t est_kvcache_size = hparams.n_embd * hparams.n_layer * 2u * n_ctx * kvcache_element_size;
@@ -143,7 +126,8 @@ bool LLamaModel::loadModel(const std::string &modelPath)
     d_ptr->params.n_ctx      = 2048;
     d_ptr->params.seed       = params.seed;
     d_ptr->params.f16_kv     = params.memory_f16;
-    d_ptr->params.use_mmap   = params.use_mmap;
+    d_ptr->params.use_mmap   = params.use_mmap && m_loadOptions.use_mmap;
+    d_ptr->params.logits_all = m_loadOptions.logits_all;
 #if defined (__APPLE__)
     d_ptr->params.use_mlock  = true;
 #else
@@ -178,7 +162,18 @@ bool LLamaModel::loadModel(const std::string &modelPath)
     }
 #endif
 
-    d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    // llama.cpp counts the tokens in its KV cache but does not tell how large a token is
+    {
+        auto fin = std::ifstream(modelPath, std::ios::binary);
+        llama_file_hparams hparams;
+        if (read_file_hparams(fin, hparams)) {
+            const size_t element_size = d_ptr->params.f16_kv ? 2 : 4;
+            d_ptr->kv_bytes_per_token = size_t(hparams.n_embd) * hparams.n_layer * 2u * element_size;
+        }
+    }
+
+    d_ptr->n_threads = getPhysicalCoreCount();
+    d_ptr->rng = std::mt19937(params.seed < 0 ? time(NULL) : params.seed);
     d_ptr->modelLoaded = true;
     fflush(stderr);
     return true;
@@ -192,6 +187,12 @@ int32_t LLamaModel::threadCount() const {
     return d_ptr->n_threads;
 }
 
+size_t LLamaModel::kvCacheUsed() const {
+    if (!d_ptr->ctx)
+        return 0;
+    return size_t(llama_get_kv_cache_token_count(d_ptr->ctx)) * d_ptr->kv_bytes_per_token;
+}
+
 LLamaModel::~LLamaModel()
 {
     if(d_ptr->ctx) {
@@ -229,32 +230,61 @@ std::vector<LLModel::Token> LLamaModel::tokenize(PromptContext &ctx, const std::
     return fres;
 }
 
-std::string LLamaModel::tokenToString(Token id) const
+std::string_view LLamaModel::tokenToString(Token id) const
 {
     return llama_token_to_str(d_ptr->ctx, id);
 }
 
 LLModel::Token LLamaModel::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return llama_sample_top_p_top_k(d_ptr->ctx,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks, promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty);
+    // the logits may have been picked from an evaluation of several tokens, see evalTokens()
+    const size_t n_vocab = llama_n_vocab(d_ptr->ctx);
+    const float *logits = promptCtx.logits.size() == n_vocab ? promptCtx.logits.data() : llama_get_logits(d_ptr->ctx);
+    return d_ptr->sampler.sample(promptCtx, logits, n_vocab, d_ptr->rng);
 }
 
 bool LLamaModel::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
 {
     // When we recalculate context we could have erased the original BOS token... we need to replace it
-    const bool useBOS = ctx.n_past == 0 && (ctx.tokens.empty() || ctx.tokens.front() != llama_token_bos());
+    // tokenize() already added it if this is the start of a new prompt
+    const bool useBOS = ctx.n_past == 0 && (ctx.tokens.empty() || ctx.tokens.front() != llama_token_bos())
+        && (tokens.empty() || tokens.front() != llama_token_bos());
+    bool ok;
     if (useBOS) {
         std::vector<int32_t> myTokens;
         myTokens.push_back(llama_token_bos());
         myTokens.insert(myTokens.end(), tokens.begin(), tokens.end());
+        ok = llama_eval(d_ptr->ctx, myTokens.data(), myTokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
         ctx.n_past += 1;
-        return llama_eval(d_ptr->ctx, myTokens.data(), myTokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
     } else
-        return llama_eval(d_ptr->ctx, tokens.data(), tokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
+        ok = llama_eval(d_ptr->ctx, tokens.data(), tokens.size(), ctx.n_past, d_ptr->n_threads) == 0;
+    if (!ok || tokens.empty())
+        return ok;
+
+    // llama.cpp only has the logits of every token if the context was created with logits_all
+    const size_t n_vocab = llama_n_vocab(d_ptr->ctx);
+    const float *logits = llama_get_logits(d_ptr->ctx);
+    if (ctx.logits_all) {
+        if (!d_ptr->params.logits_all) {
+            std::cerr << "LLAMA ERROR: the model has to be loaded with logits_all to return the logits of every token\n";
+            return false;
+        }
+        ctx.logits.assign(logits + (useBOS ? n_vocab : 0), logits + (useBOS + tokens.size())*n_vocab);
+    } else if (!ctx.logits_rows.empty()) {
+        if (!d_ptr->params.logits_all) {
+            std::cerr << "LLAMA ERROR: the model has to be loaded with logits_all to return the logits of given tokens\n";
+            return false;
+        }
+        ctx.logits.resize(ctx.logits_rows.size()*n_vocab);
+        for (size_t i = 0; i < ctx.logits_rows.size(); ++i) {
+            const size_t row = useBOS + std::clamp(ctx.logits_rows[i], 0, int32_t(tokens.size()) - 1);
+            std::copy(logits + row*n_vocab, logits + (row + 1)*n_vocab, ctx.logits.begin() + i*n_vocab);
+        }
+    } else {
+        const size_t last = d_ptr->params.logits_all ? useBOS + tokens.size() - 1 : 0;
+        ctx.logits.assign(logits + last*n_vocab, logits + (last + 1)*n_vocab);
+    }
+    return true;
 }
 
 int32_t LLamaModel::contextLength() const
@@ -2,6 +2,7 @@
 #include "dlhandle.h"
 #include "sysinfo.h"
 
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -12,6 +13,9 @@
 #include <sstream>
 #ifdef _MSC_VER
 #include <intrin.h>
+#include <immintrin.h>
+#elif defined(__x86_64__)
+#include <cpuid.h>
 #endif
 
 std::string s_implementations_search_path = ".";
@@ -30,17 +34,62 @@ static bool has_at_least_minimal_hardware() {
 #endif
 }
 
-static bool requires_avxonly() {
+// The features of the CPU build variants other than avxonly, see BUILD_VARIANTS in CMakeLists.txt
+struct CpuFeatures {
+    bool avx2 = false;      // default: AVX2, FMA and F16C
+    bool avxvnni = false;   // avxvnni: the VEX encoded int8 dot products of AVX-VNNI on top of AVX2
+    bool avx512 = false;    // avx512: AVX-512 F and BW with the int8 dot products of AVX512-VNNI
+};
+
+static CpuFeatures cpu_features() {
+    CpuFeatures features;
 #if defined(__x86_64__) || defined(_M_X64)
     #ifndef _MSC_VER
-        return !__builtin_cpu_supports("avx2");
+        features.avx2 = __builtin_cpu_supports("avx2");
+        features.avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+            && __builtin_cpu_supports("avx512vnni");
+        // older compilers do not know AVX-VNNI, it is bit 4 of EAX in leaf 7 subleaf 1
+        unsigned int eax, ebx, ecx, edx;
+        features.avxvnni = features.avx2 && __get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx) && (eax & (1 << 4));
     #else
         int cpuInfo[4];
         __cpuidex(cpuInfo, 7, 0);
-        return !(cpuInfo[1] & (1 << 5));
+        features.avx2 = cpuInfo[1] & (1 << 5);
+        // the OS has to save the AVX-512 registers, which XCR0 bits 5-7 tell
+        features.avx512 = (cpuInfo[1] & (1 << 16)) && (cpuInfo[1] & (1 << 30)) && (cpuInfo[2] & (1 << 11))
+            && (_xgetbv(0) & 0xe6) == 0xe6;
+        __cpuidex(cpuInfo, 7, 1);
+        features.avxvnni = features.avx2 && (cpuInfo[0] & (1 << 4));
     #endif
+#endif
+    return features;
+}
+
+std::vector<std::string> LLModel::Implementation::cpuBuildVariants() {
+#if defined(__x86_64__) || defined(_M_X64)
+    static const CpuFeatures features = cpu_features();
+    std::vector<std::string> variants;
+    if (features.avx512) variants.push_back("avx512");
+    if (features.avxvnni) variants.push_back("avxvnni");
+    if (features.avx2) variants.push_back("default");
+    variants.push_back("avxonly");
+    return variants;
+#else
+    return { "default" }; // Don't know how to handle non-x86_64
+#endif
+}
+
+// Variants built for other CPU features than the x86 ones above, like metal, are always allowed
+static bool cpu_runs_build_variant(const std::string &buildVariant) {
+#if defined(__x86_64__) || defined(_M_X64)
+    static const char *cpuVariants[] = { "avx512", "avxvnni", "default", "avxonly" };
+    if (std::find(std::begin(cpuVariants), std::end(cpuVariants), buildVariant) == std::end(cpuVariants))
+        return true;
+    const auto supported = LLModel::Implementation::cpuBuildVariants();
+    return std::find(supported.begin(), supported.end(), buildVariant) != supported.end();
 #else
-    return false; // Don't know how to handle non-x86_64
+    (void)buildVariant;
+    return true;
 #endif
 }
 
@@ -126,6 +175,16 @@ LLModel *LLModel::Implementation::construct(const std::string &modelPath, std::s
     if (!has_at_least_minimal_hardware())
         return nullptr;
 
+    if (buildVariant == "auto") {
+        const char *forced = std::getenv("LLMODEL_BUILD_VARIANT");
+        if (forced && *forced)
+            buildVariant = forced;
+    }
+    if (!cpu_runs_build_variant(buildVariant)) {
+        std::cerr << "LLModel ERROR: this CPU cannot run the " << buildVariant << " build variant\n";
+        return nullptr;
+    }
+
     // Read magic
     std::ifstream f(modelPath, std::ios::binary);
     if (!f) return nullptr;
@@ -155,13 +214,14 @@ LLModel *LLModel::Implementation::construct(const std::string &modelPath, std::s
     if (!impl) {
         //TODO: Auto-detect CUDA/OpenCL
         if (buildVariant == "auto") {
-            if (requires_avxonly()) {
-                buildVariant = "avxonly";
-            } else {
-                buildVariant = "default";
+            // the fastest variant that was built and installed for this model
+            for (const auto &variant : cpuBuildVariants()) {
+                impl = implementation(f, variant);
+                if (impl) break;
             }
+        } else {
+            impl = implementation(f, buildVariant);
         }
-        impl = implementation(f, buildVariant);
         if (!impl) return nullptr;
     }
     f.close();
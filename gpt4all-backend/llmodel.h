@@ -8,6 +8,7 @@
 #include <fstream>
 #include <cstdint>
 #include <limits>
+#include <map>
 
 #define LLMODEL_MAX_PROMPT_BATCH 128
 
@@ -28,7 +29,12 @@ public:
         static bool isImplementation(const Dlhandle&);
         static const std::vector<Implementation>& implementationList();
         static const Implementation *implementation(std::ifstream& f, const std::string& buildVariant);
+        // buildVariant "auto" takes the LLMODEL_BUILD_VARIANT environment variable if it is set, and
+        // otherwise the first of cpuBuildVariants() that was built for the model. A variant that is
+        // asked for by name has to run on this CPU.
         static LLModel *construct(const std::string &modelPath, std::string buildVariant = "auto");
+        // The CPU build variants this machine runs, fastest first
+        static std::vector<std::string> cpuBuildVariants();
         static void setImplementationsSearchPath(const std::string& path);
         static const std::string& implementationsSearchPath();
 
@@ -42,6 +48,31 @@ public:
         Dlhandle *m_dlhandle;
     };
 
+    // Finds the stop sequences of a PromptContext in generated text with an Aho-Corasick automaton,
+    // which takes one table lookup per byte however many sequences there are. The text that could
+    // still be the start of a stop sequence is held back until it is known not to be one.
+    class StopMatcher {
+    public:
+        // Builds the automaton unless it is already the one for these sequences and forgets the text
+        // held back
+        void reset(const std::vector<std::string> &sequences);
+        // Takes the piece of a generated token and returns the text that can be shown now, which is
+        // valid until the next call. Once a stop sequence is complete 'stopped' is set and the text
+        // ends right before it. Nothing is held back after the last token.
+        std::string_view feed(std::string_view piece, bool &stopped, bool last = false);
+        // The text held back when generation ends without a stop sequence
+        std::string_view flush();
+
+    private:
+        std::vector<std::string> m_sequences;
+        std::vector<int32_t> m_next;    // 256 transitions per state, empty without sequences
+        std::vector<int32_t> m_depth;   // bytes of the prefix a state stands for
+        std::vector<int32_t> m_match;   // length of the longest sequence ending in a state, 0 if none
+        int32_t m_state = 0;
+        std::string m_text;             // the text held back, then the piece being fed
+        size_t m_shown = 0;             // bytes of m_text returned by the last call
+    };
+
     struct PromptContext {
         std::vector<float> logits;      // logits of current context
         std::vector<int32_t> tokens;    // current tokens in the context window
@@ -50,12 +81,69 @@ public:
         int32_t n_predict = 200;
         int32_t top_k = 40;
         float   top_p = 0.9f;
+        float   min_p = 0.0f;
+        float   typical_p = 1.0f;       // 1 disables locally typical sampling
         float   temp = 0.9f;
         int32_t n_batch = 9;
         float   repeat_penalty = 1.10f;
         int32_t repeat_last_n = 64;     // last n tokens to penalize
         float   contextErase = 0.75f;   // percent of context to erase if we exceed the context
             // window
+        int32_t n_keep = 0;             // tokens at the start of the context, like the system prompt,
+            // that are kept when the context window is shifted
+        bool    logits_all = false;     // evalTokens() returns the logits of every token it evaluates
+            // one after the other, instead of only those of the last one
+        std::vector<int32_t> logits_rows; // otherwise, when not empty, evalTokens() returns the logits of
+            // just these positions among the tokens it evaluates, in this order; the models built on
+            // ggml skip the LM head for the other positions
+        std::vector<std::string> stop = { "### Instruction", "### Prompt", "### Response", "### Human",
+            "### Assistant", "### Context" }; // generation ends before the first of these in the output
+    };
+
+    // Element type of the K half of the KV cache; V stays F16, as attention reads it transposed. Q8_0
+    // cuts the cache by about a quarter and Q4_0 by about three eighths, and with it what attention
+    // reads per token at long context, at some cost in accuracy.
+    enum class KVCacheType { F16, Q8_0, Q4_0 };
+
+    // Options that have to be known before the model is loaded; see setLoadOptions()
+    struct LoadOptions {
+        int32_t n_seq = 1;              // KV cache slots reserved for batched decoding of independent
+            // sequences; models without batched decoding always use a single slot
+        bool    logits_all = false;     // keep the logits of every token of an evaluation around, which
+            // llama.cpp has to know up front; set by setDraftModel()
+        bool    use_mmap = true;        // map the weights from the model file instead of reading them in,
+            // so they load lazily and are shared with other processes using the same file
+        bool    prefault = false;       // read all of the mapped file in with several threads while loading
+        KVCacheType kv_type = KVCacheType::F16; // models that cannot quantize their KV cache, or whose
+            // graph needs an F32 one, keep their own type
+    };
+
+    // Counts how many of the tokens proposed by the draft model were accepted, see setDraftModel()
+    struct SpeculativeStats {
+        uint64_t drafted = 0;
+        uint64_t accepted = 0;
+        float acceptRate() const { return drafted ? float(accepted) / drafted : 0.0f; }
+    };
+
+    // Counts the evaluations of the model and the heap allocations they made. Buffers and graphs are
+    // kept between evaluations, so once generation reaches a steady state allocations stop growing.
+    struct EvalStats {
+        uint64_t evals = 0;
+        uint64_t tokens = 0;
+        uint64_t allocations = 0;
+        float allocationsPerToken() const { return tokens ? float(allocations) / tokens : 0.0f; }
+    };
+
+    // A sequence taking part in continuous batching. Sequences may join or leave between two calls to
+    // decodeBatch() and each one owns the KV cache slot 'seq' for as long as it is not finished.
+    struct BatchSequence {
+        int32_t seq = 0;                // KV cache slot, 0 <= seq < maxSequences()
+        PromptContext *ctx = nullptr;   // sampling parameters, logits and tokens of this sequence
+        std::vector<Token> pending;     // prompt tokens that have not been evaluated yet
+        std::function<bool(int32_t, std::string_view)> responseCallback;
+        StopMatcher stop;               // set up for ctx->stop by beginSequence()
+        int32_t n_generated = 0;
+        bool finished = false;
     };
 
     struct GPUDevice {
@@ -78,16 +166,97 @@ public:
     virtual size_t saveState(uint8_t */*dest*/) const { return 0; }
     virtual size_t restoreState(const uint8_t */*src*/) { return 0; }
 
+    // The state as a stream of pieces, for saving it without a buffer of the whole state. Passing
+    // since > 0 only writes what the first 'since' tokens of the context do not already hold, a delta
+    // that readState() applies on top of the state it was taken from. A context shift moves the
+    // cached tokens, so a full state has to be written after one. Models that do not stream their
+    // state write it as one piece of saveState().
+    using StateWriter = std::function<bool(const void *data, size_t size)>;
+    using StateReader = std::function<bool(void *data, size_t size)>;
+    virtual bool writeState(const StateWriter &write, int32_t since = 0) const;
+    virtual bool readState(const StateReader &read);
+
+    // Appends the state, or the delta since the first 'since' tokens, to the file descriptor
+    bool saveStateToFile(int fd, int32_t since = 0) const;
+    // Restores a state and every delta written after it from the file descriptor
+    bool restoreStateFromFile(int fd);
+
     // This method requires the model to return true from supportsCompletion otherwise it will throw
-    // an error
+    // an error. responseCallback is called once for every token generated into the context, with
+    // the text that can be shown after it, which is empty while it may be the start of a stop
+    // sequence and for the end of text token.
     virtual void prompt(const std::string &prompt,
                         std::function<bool(int32_t)> promptCallback,
-                        std::function<bool(int32_t, const std::string&)> responseCallback,
+                        std::function<bool(int32_t, std::string_view)> responseCallback,
                         std::function<bool(bool)> recalculateCallback,
                         PromptContext &ctx);
 
     virtual std::vector<float> embedding(const std::string &text);
 
+    // Log-likelihood scoring: sets logprobs[i] to the log-probability of tokens[i] following the prefix
+    // and tokens[0..i), for ranking candidate completions or computing perplexity. The prefix and the
+    // tokens start at the beginning of the context and are evaluated in chunks of ctx.n_batch, with
+    // logits only for the positions that predict a scored token. The KV cache is kept the way
+    // ctx.tokens describes it, so scoring several candidates after the same prefix only evaluates the
+    // prefix once. Without a prefix the first token is not predicted by anything and its entry is 0.
+    // Returns false if the model cannot score or everything does not fit the context window; LLaMA
+    // models have to be loaded with the logits_all load option.
+    bool score(const std::vector<Token> &prefix, const std::vector<Token> &tokens, std::vector<float> &logprobs,
+               PromptContext &ctx);
+    // The tokens of text as prompt() would evaluate them, starting with the BOS token of models that
+    // have one if the text is at the start of the context
+    std::vector<Token> tokenizeText(const std::string &text, bool atStart = false) const;
+
+    // Continuous batching: beginSequence() tokenizes the prompt of a new sequence and starts its
+    // context over. A context that still has the tokens of the previous sequence of its slot keeps
+    // the KV cache of the ones the prompt starts with, so callers that keep one context per slot only
+    // evaluate what a prompt does not share with the last one. decodeBatch() then advances every
+    // unfinished sequence by one step in a single evaluation of the model. A step evaluates the next
+    // chunk of a sequence's prompt or the token sampled from its last logits, so sequences that are
+    // still reading their prompt and sequences that are already generating share the same forward
+    // pass.
+    bool beginSequence(BatchSequence &sequence, const std::string &prompt);
+    bool decodeBatch(const std::vector<BatchSequence*> &sequences);
+    virtual int32_t maxSequences() const { return 1; }
+    // Copies the KV cache of the first n_tokens of slot src to slot dst, so several sequences can
+    // continue one evaluated prompt. Models with a single slot have nothing to copy to.
+    virtual bool copySequence(int32_t src, int32_t dst, int32_t /*n_tokens*/) { return src == dst; }
+
+    // Named contexts are independent conversations on the same weights. Each one has a KV cache slot
+    // and an RNG of its own, so switching between them is O(1) and nothing is saved or restored.
+    // prompt(), the state functions and context shifts act on the current context; the caller keeps a
+    // PromptContext per context. The default context "" always exists and uses slot 0. The other
+    // contexts take the free slots of the maxSequences() a model has, so models with a single slot
+    // cannot create any, and their slots must not be given to decodeBatch() at the same time.
+    bool createContext(const std::string &name);
+    bool switchContext(const std::string &name);
+    bool destroyContext(const std::string &name); // switches to the default context if it is current
+    const std::string &currentContext() const { return m_context; }
+    int32_t contextSlot(const std::string &name) const; // -1 if there is no such context
+    // Writes the full state of a context that need not be the current one. Contexts share no KV cache
+    // rows, so this may run while another context evaluates, as long as no context is created,
+    // switched to or destroyed meanwhile.
+    bool writeContextState(const std::string &name, const StateWriter &write) const;
+
+    void setLoadOptions(const LoadOptions &options) { m_loadOptions = options; }
+    const LoadOptions &loadOptions() const { return m_loadOptions; }
+
+    // Speculative decoding: while generating, 'draft' proposes the next n_draft tokens which are then
+    // verified by evaluating them all at once with this model. Every token is still sampled from this
+    // model, so the output is the same as without a draft model, only faster if enough are accepted.
+    // The draft model must share the vocabulary of this one and is not owned. LLaMA models have to be
+    // given their draft model before they are loaded. Pass nullptr to stop using it.
+    void setDraftModel(LLModel *draft, int32_t n_draft = 4);
+    LLModel *draftModel() const { return m_draftModel; }
+    const SpeculativeStats &speculativeStats() const { return m_speculativeStats; }
+    void resetSpeculativeStats() { m_speculativeStats = SpeculativeStats(); }
+
+    // Models that do not count their evaluations report zeroes
+    virtual EvalStats evalStats() const { return EvalStats(); }
+    virtual void resetEvalStats() {}
+    // Bytes of the KV cache that hold evaluated tokens, 0 if the model does not know
+    virtual size_t kvCacheUsed() const { return 0; }
+
     virtual void setThreadCount(int32_t /*n_threads*/) {}
     virtual int32_t threadCount() const { return 1; }
 
@@ -105,19 +274,81 @@ protected:
     // These are pure virtual because subclasses need to implement as the default implementation of
     // 'prompt' above calls these functions
     virtual std::vector<Token> tokenize(PromptContext &, const std::string&) const = 0;
-    virtual std::string tokenToString(Token) const = 0;
+    // The piece of text of a token, which stays valid for as long as the model is loaded
+    virtual std::string_view tokenToString(Token) const = 0;
     virtual Token sampleToken(PromptContext &ctx) const = 0;
     virtual bool evalTokens(PromptContext &/*ctx*/, const std::vector<int32_t>& /*tokens*/) const = 0;
     virtual int32_t contextLength() const = 0;
     virtual const std::vector<Token>& endTokens() const = 0;
 
+    // One sequence of a batched evaluation: the n_tokens at 'tokens' are evaluated at position
+    // ctx->n_past of KV cache slot 'seq' and the logits of the last one are written to ctx->logits.
+    // The tokens belong to the caller, who keeps them where they are until evalBatch() returns.
+    struct BatchItem {
+        int32_t seq;
+        PromptContext *ctx;
+        const Token *tokens;
+        int32_t n_tokens;
+    };
+
+    // Models that reserve more than one KV cache slot override this to evaluate all items in one
+    // forward pass; the default can only handle the single slot every model has
+    virtual bool evalBatch(std::vector<BatchItem> &items);
+
+    // Models override this to drop n_discard tokens of the KV cache after the first n_keep and move
+    // the tokens up to n_past down in place. Returning false makes the caller recalculate the context.
+    virtual bool shiftContext(int32_t /*n_keep*/, int32_t /*n_discard*/, int32_t /*n_past*/) { return false; }
+
+    // The KV cache slot of the current context
+    int32_t currentSlot() const { return m_slot; }
+    // Called for the slot of a context that is created, models forget what it holds and reseed its RNG
+    virtual void resetSlot(int32_t /*slot*/) {}
+    // The state of the context in a slot, models with a single slot only have the current one
+    virtual bool writeSlotState(int32_t slot, const StateWriter &write) const
+    {
+        return slot == currentSlot() && writeState(write);
+    }
+
+    // The buffer API of models that implement writeState() and readState()
+    size_t streamedStateSize() const;
+    size_t saveStreamedState(uint8_t *dest) const;
+    size_t restoreStreamedState(const uint8_t *src);
+
     // This is a helper function called from the default implementation of 'prompt' but it can be
     // shared by all base classes so it isn't virtual
     void recalculateContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate);
 
+    // Frees up contextErase of the context window once it is full, and at least enough of it for the
+    // n_needed tokens about to be evaluated, see shiftContext(). Returns false if they cannot fit.
+    bool makeRoomInContext(PromptContext &promptCtx, int32_t n_needed, std::function<bool(bool)> recalculate);
+
+    // The generation loop of 'prompt' when there is a draft model. emitToken is called for every
+    // token that is accepted and returns false once generation should stop.
+    void generateSpeculative(PromptContext &promptCtx, std::function<bool(Token)> emitToken,
+                             std::function<bool(bool)> recalculate);
+
     const Implementation *m_implementation = nullptr;
+    LoadOptions m_loadOptions;
+
+    StopMatcher m_stopMatcher;          // of prompt(), kept to build it again only if the stops change
+
+    // Reused by every evaluation of prompt() and decodeBatch(), so that they stop allocating once
+    // they have seen the largest batch
+    std::vector<Token> m_evalTokens;
+    std::vector<BatchItem> m_batchItems;
+    std::vector<BatchSequence*> m_batchOwners;
+    std::vector<Token> m_batchSampled;  // the token each sequence of a decode step evaluates
+
+    LLModel *m_draftModel = nullptr;
+    int32_t m_draftTokens = 4;
+    PromptContext m_draftCtx;
+    SpeculativeStats m_speculativeStats;
 
 private:
+    std::map<std::string, int32_t> m_contexts = { { "", 0 } }; // name -> KV cache slot
+    std::string m_context;
+    int32_t m_slot = 0;
+
     friend class LLMImplementation;
 };
 
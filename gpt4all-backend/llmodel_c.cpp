@@ -1,14 +1,46 @@
 #include "llmodel_c.h"
 #include "llmodel.h"
+#include "cpu_scheduler.h"
 
+#include <algorithm>
 #include <cstring>
 #include <cerrno>
+#include <map>
 #include <utility>
 
+struct LLModelBatchEntry {
+    LLModel::PromptContext promptContext;
+    LLModel::BatchSequence sequence;
+};
+
 struct LLModelWrapper {
     LLModel *llModel = nullptr;
-    LLModel::PromptContext promptContext;
+    std::map<std::string, LLModel::PromptContext> promptContexts; // one per named context
+    std::map<int32_t, LLModelBatchEntry> batch;
+    int32_t n_threads = 0;  // as set by llmodel_setThreadCount, 0 for as many as there are cores
+    std::string response;   // NUL terminated copy of the piece handed to a response callback, kept to
+                            // reuse its buffer
+    std::vector<std::string> stop = LLModel::PromptContext().stop; // as set by llmodel_set_stop_sequences
     ~LLModelWrapper() { delete llModel; }
+    LLModel::PromptContext &promptContext() { return promptContexts[llModel->currentContext()]; }
+};
+
+// The cores of the calling thread while it evaluates the model, which is given as many threads as the
+// lease has cores. Sharing them with the other models of the process keeps the total number of
+// compute threads at the number of cores.
+class ModelCpuLease {
+public:
+    explicit ModelCpuLease(LLModelWrapper *wrapper)
+        : m_wrapper(wrapper), m_lease(wrapper->n_threads) { apply(); }
+
+    // called between tokens to follow the leases other models take and return
+    void refresh() { if (m_lease.refresh()) apply(); }
+
+private:
+    void apply() { m_wrapper->llModel->setThreadCount(m_lease.threadCount()); }
+
+    LLModelWrapper *m_wrapper;
+    CpuScheduler::Lease m_lease;
 };
 
 
@@ -95,14 +127,27 @@ uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src)
     return wrapper->llModel->restoreState(src);
 }
 
+bool llmodel_save_state_to_fd(llmodel_model model, int fd, int32_t since)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->saveStateToFile(fd, since);
+}
+
+bool llmodel_restore_state_from_fd(llmodel_model model, int fd)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->restoreStateFromFile(fd);
+}
+
 // Wrapper functions for the C callbacks
 bool prompt_wrapper(int32_t token_id, void *user_data) {
     llmodel_prompt_callback callback = reinterpret_cast<llmodel_prompt_callback>(user_data);
     return callback(token_id);
 }
 
-bool response_wrapper(int32_t token_id, const std::string &response, void *user_data) {
+bool response_wrapper(int32_t token_id, std::string_view piece, std::string &response, void *user_data) {
     llmodel_response_callback callback = reinterpret_cast<llmodel_response_callback>(user_data);
+    response.assign(piece);
     return callback(token_id, response.c_str());
 }
 
@@ -119,50 +164,233 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
 {
     LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
 
+    ModelCpuLease lease(wrapper);
+
     // Create std::function wrappers that call the C function pointers
-    std::function<bool(int32_t)> prompt_func =
-        std::bind(&prompt_wrapper, std::placeholders::_1, reinterpret_cast<void*>(prompt_callback));
-    std::function<bool(int32_t, const std::string&)> response_func =
-        std::bind(&response_wrapper, std::placeholders::_1, std::placeholders::_2, reinterpret_cast<void*>(response_callback));
+    std::function<bool(int32_t)> prompt_func = [&](int32_t token_id) {
+        lease.refresh();
+        return prompt_wrapper(token_id, reinterpret_cast<void*>(prompt_callback));
+    };
+    std::function<bool(int32_t, std::string_view)> response_func = [&](int32_t token_id, std::string_view piece) {
+        lease.refresh();
+        return response_wrapper(token_id, piece, wrapper->response, reinterpret_cast<void*>(response_callback));
+    };
     std::function<bool(bool)> recalc_func =
         std::bind(&recalculate_wrapper, std::placeholders::_1, reinterpret_cast<void*>(recalculate_callback));
 
-    if (size_t(ctx->n_past) < wrapper->promptContext.tokens.size())
-        wrapper->promptContext.tokens.resize(ctx->n_past);
-
+    // Tokens past n_past are kept: prompt() reuses the ones the new prompt starts with
     // Copy the C prompt context
-    wrapper->promptContext.n_past = ctx->n_past;
-    wrapper->promptContext.n_ctx = ctx->n_ctx;
-    wrapper->promptContext.n_predict = ctx->n_predict;
-    wrapper->promptContext.top_k = ctx->top_k;
-    wrapper->promptContext.top_p = ctx->top_p;
-    wrapper->promptContext.temp = ctx->temp;
-    wrapper->promptContext.n_batch = ctx->n_batch;
-    wrapper->promptContext.repeat_penalty = ctx->repeat_penalty;
-    wrapper->promptContext.repeat_last_n = ctx->repeat_last_n;
-    wrapper->promptContext.contextErase = ctx->context_erase;
+    wrapper->promptContext().n_past = ctx->n_past;
+    wrapper->promptContext().n_ctx = ctx->n_ctx;
+    wrapper->promptContext().n_predict = ctx->n_predict;
+    wrapper->promptContext().top_k = ctx->top_k;
+    wrapper->promptContext().top_p = ctx->top_p;
+    wrapper->promptContext().temp = ctx->temp;
+    wrapper->promptContext().n_batch = ctx->n_batch;
+    wrapper->promptContext().repeat_penalty = ctx->repeat_penalty;
+    wrapper->promptContext().repeat_last_n = ctx->repeat_last_n;
+    wrapper->promptContext().contextErase = ctx->context_erase;
+    wrapper->promptContext().stop = wrapper->stop;
 
     // Call the C++ prompt method
-    wrapper->llModel->prompt(prompt, prompt_func, response_func, recalc_func, wrapper->promptContext);
+    wrapper->llModel->prompt(prompt, prompt_func, response_func, recalc_func, wrapper->promptContext());
 
     // Update the C context by giving access to the wrappers raw pointers to std::vector data
     // which involves no copies
-    ctx->logits = wrapper->promptContext.logits.data();
-    ctx->logits_size = wrapper->promptContext.logits.size();
-    ctx->tokens = wrapper->promptContext.tokens.data();
-    ctx->tokens_size = wrapper->promptContext.tokens.size();
+    ctx->logits = wrapper->promptContext().logits.data();
+    ctx->logits_size = wrapper->promptContext().logits.size();
+    ctx->tokens = wrapper->promptContext().tokens.data();
+    ctx->tokens_size = wrapper->promptContext().tokens.size();
 
     // Update the rest of the C prompt context
-    ctx->n_past = wrapper->promptContext.n_past;
-    ctx->n_ctx = wrapper->promptContext.n_ctx;
-    ctx->n_predict = wrapper->promptContext.n_predict;
-    ctx->top_k = wrapper->promptContext.top_k;
-    ctx->top_p = wrapper->promptContext.top_p;
-    ctx->temp = wrapper->promptContext.temp;
-    ctx->n_batch = wrapper->promptContext.n_batch;
-    ctx->repeat_penalty = wrapper->promptContext.repeat_penalty;
-    ctx->repeat_last_n = wrapper->promptContext.repeat_last_n;
-    ctx->context_erase = wrapper->promptContext.contextErase;
+    ctx->n_past = wrapper->promptContext().n_past;
+    ctx->n_ctx = wrapper->promptContext().n_ctx;
+    ctx->n_predict = wrapper->promptContext().n_predict;
+    ctx->top_k = wrapper->promptContext().top_k;
+    ctx->top_p = wrapper->promptContext().top_p;
+    ctx->temp = wrapper->promptContext().temp;
+    ctx->n_batch = wrapper->promptContext().n_batch;
+    ctx->repeat_penalty = wrapper->promptContext().repeat_penalty;
+    ctx->repeat_last_n = wrapper->promptContext().repeat_last_n;
+    ctx->context_erase = wrapper->promptContext().contextErase;
+}
+
+void llmodel_set_max_sequences(llmodel_model model, int32_t n_seq)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModel::LoadOptions options = wrapper->llModel->loadOptions();
+    options.n_seq = n_seq;
+    wrapper->llModel->setLoadOptions(options);
+}
+
+int32_t llmodel_max_sequences(llmodel_model model)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->maxSequences();
+}
+
+bool llmodel_create_context(llmodel_model model, const char *name)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    if (!wrapper->llModel->createContext(name))
+        return false;
+    wrapper->promptContexts[name] = LLModel::PromptContext();
+    return true;
+}
+
+bool llmodel_switch_context(llmodel_model model, const char *name)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    return wrapper->llModel->switchContext(name);
+}
+
+bool llmodel_destroy_context(llmodel_model model, const char *name)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    if (!wrapper->llModel->destroyContext(name))
+        return false;
+    wrapper->promptContexts.erase(name);
+    return true;
+}
+
+void llmodel_set_mmap(llmodel_model model, bool use_mmap, bool prefault)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModel::LoadOptions options = wrapper->llModel->loadOptions();
+    options.use_mmap = use_mmap;
+    options.prefault = prefault;
+    wrapper->llModel->setLoadOptions(options);
+}
+
+void llmodel_set_logits_all(llmodel_model model, bool logits_all)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModel::LoadOptions options = wrapper->llModel->loadOptions();
+    options.logits_all = logits_all;
+    wrapper->llModel->setLoadOptions(options);
+}
+
+void llmodel_set_stop_sequences(llmodel_model model, const char **sequences, int32_t n_sequences)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    if (!sequences) {
+        wrapper->stop = LLModel::PromptContext().stop;
+        return;
+    }
+    wrapper->stop.clear();
+    for (int32_t i = 0; i < n_sequences; ++i) {
+        if (sequences[i])
+            wrapper->stop.emplace_back(sequences[i]);
+    }
+}
+
+bool llmodel_set_kv_cache_type(llmodel_model model, const char *type)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModel::LoadOptions options = wrapper->llModel->loadOptions();
+    const std::string_view name(type ? type : "");
+    if (name == "f16")
+        options.kv_type = LLModel::KVCacheType::F16;
+    else if (name == "q8_0")
+        options.kv_type = LLModel::KVCacheType::Q8_0;
+    else if (name == "q4_0")
+        options.kv_type = LLModel::KVCacheType::Q4_0;
+    else
+        return false;
+    wrapper->llModel->setLoadOptions(options);
+    return true;
+}
+
+bool batch_response_wrapper(int32_t token_id, std::string_view piece, int32_t seq, std::string *response,
+                            void *user_data) {
+    llmodel_batch_response_callback callback = reinterpret_cast<llmodel_batch_response_callback>(user_data);
+    response->assign(piece);
+    return callback(seq, token_id, response->c_str());
+}
+
+bool llmodel_batch_add(llmodel_model model, int32_t seq, const char *prompt,
+                       llmodel_batch_response_callback response_callback,
+                       const llmodel_prompt_context *ctx)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    if (wrapper->batch.count(seq))
+        return false;
+
+    LLModelBatchEntry &entry = wrapper->batch[seq];
+    entry.promptContext.n_predict = ctx->n_predict;
+    entry.promptContext.top_k = ctx->top_k;
+    entry.promptContext.top_p = ctx->top_p;
+    entry.promptContext.temp = ctx->temp;
+    entry.promptContext.n_batch = ctx->n_batch;
+    entry.promptContext.repeat_penalty = ctx->repeat_penalty;
+    entry.promptContext.repeat_last_n = ctx->repeat_last_n;
+    entry.promptContext.contextErase = ctx->context_erase;
+    entry.promptContext.stop = wrapper->stop;
+
+    entry.sequence.seq = seq;
+    entry.sequence.ctx = &entry.promptContext;
+    entry.sequence.responseCallback = std::bind(&batch_response_wrapper, std::placeholders::_1,
+        std::placeholders::_2, seq, &wrapper->response, reinterpret_cast<void*>(response_callback));
+
+    if (!wrapper->llModel->beginSequence(entry.sequence, prompt)) {
+        wrapper->batch.erase(seq);
+        return false;
+    }
+    return true;
+}
+
+void llmodel_batch_remove(llmodel_model model, int32_t seq)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    wrapper->batch.erase(seq);
+}
+
+int32_t llmodel_batch_step(llmodel_model model)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+
+    std::vector<LLModel::BatchSequence*> sequences;
+    sequences.reserve(wrapper->batch.size());
+    for (auto &[seq, entry] : wrapper->batch)
+        sequences.push_back(&entry.sequence);
+
+    ModelCpuLease lease(wrapper);
+    if (!wrapper->llModel->decodeBatch(sequences))
+        return -1;
+
+    std::erase_if(wrapper->batch, [](const auto &item) { return item.second.sequence.finished; });
+    return wrapper->batch.size();
+}
+
+void llmodel_set_draft_model(llmodel_model model, llmodel_model draft, int32_t n_draft)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    LLModelWrapper *draftWrapper = reinterpret_cast<LLModelWrapper*>(draft);
+    wrapper->llModel->setDraftModel(draftWrapper ? draftWrapper->llModel : nullptr, n_draft);
+}
+
+float llmodel_speculative_stats(llmodel_model model, uint64_t *drafted, uint64_t *accepted)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    const LLModel::SpeculativeStats &stats = wrapper->llModel->speculativeStats();
+    if (drafted) *drafted = stats.drafted;
+    if (accepted) *accepted = stats.accepted;
+    return stats.acceptRate();
+}
+
+float llmodel_eval_stats(llmodel_model model, uint64_t *tokens, uint64_t *allocations)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    const LLModel::EvalStats stats = wrapper->llModel->evalStats();
+    if (tokens) *tokens = stats.tokens;
+    if (allocations) *allocations = stats.allocations;
+    return stats.allocationsPerToken();
+}
+
+void llmodel_reset_eval_stats(llmodel_model model)
+{
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    wrapper->llModel->resetEvalStats();
 }
 
 float *llmodel_embedding(llmodel_model model, const char *text, size_t *embedding_size)
@@ -172,7 +400,11 @@ float *llmodel_embedding(llmodel_model model, const char *text, size_t *embeddin
         return nullptr;
     }
     LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
-    std::vector<float> embeddingVector = wrapper->llModel->embedding(text);
+    std::vector<float> embeddingVector;
+    {
+        ModelCpuLease lease(wrapper);
+        embeddingVector = wrapper->llModel->embedding(text);
+    }
     float *embedding = (float *)malloc(embeddingVector.size() * sizeof(float));
     if (embedding == nullptr) {
         *embedding_size = 0;
@@ -188,16 +420,50 @@ void llmodel_free_embedding(float *ptr)
     free(ptr);
 }
 
+float *llmodel_score(llmodel_model model, const char *prefix, const char *text, int32_t n_batch, size_t *n_tokens)
+{
+    *n_tokens = 0;
+    if (model == nullptr || text == nullptr || !strlen(text))
+        return nullptr;
+    LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
+    const bool hasPrefix = prefix != nullptr && strlen(prefix);
+    const auto prefixTokens = hasPrefix ? wrapper->llModel->tokenizeText(prefix, true) : std::vector<LLModel::Token>();
+    const auto tokens = wrapper->llModel->tokenizeText(text, !hasPrefix);
+
+    // the tokens of the prompt context describe the KV cache, so the prefix is shared with the last
+    // call to llmodel_score or llmodel_prompt
+    LLModel::PromptContext &promptContext = wrapper->promptContext();
+    promptContext.n_batch = n_batch;
+    std::vector<float> logprobs;
+    {
+        ModelCpuLease lease(wrapper);
+        if (!wrapper->llModel->score(prefixTokens, tokens, logprobs, promptContext) || logprobs.empty())
+            return nullptr;
+    }
+    float *result = (float *)malloc(logprobs.size() * sizeof(float));
+    if (result == nullptr)
+        return nullptr;
+    std::copy(logprobs.begin(), logprobs.end(), result);
+    *n_tokens = logprobs.size();
+    return result;
+}
+
+void llmodel_free_logprobs(float *ptr)
+{
+    free(ptr);
+}
+
 void llmodel_setThreadCount(llmodel_model model, int32_t n_threads)
 {
     LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
-    wrapper->llModel->setThreadCount(n_threads);
+    wrapper->n_threads = std::max(n_threads, 0);
+    wrapper->llModel->setThreadCount(n_threads > 0 ? n_threads : CpuScheduler::globalInstance().coreCount());
 }
 
 int32_t llmodel_threadCount(llmodel_model model)
 {
     LLModelWrapper *wrapper = reinterpret_cast<LLModelWrapper*>(model);
-    return wrapper->llModel->threadCount();
+    return wrapper->n_threads > 0 ? wrapper->n_threads : CpuScheduler::globalInstance().coreCount();
 }
 
 void llmodel_set_implementation_search_path(const char *path)
@@ -78,9 +78,10 @@ typedef struct llmodel_gpu_device llmodel_gpu_device;
 typedef bool (*llmodel_prompt_callback)(int32_t token_id);
 
 /**
- * Callback type for response.
+ * Callback type for response. It is called once for every token generated into the context.
  * @param token_id The token id of the response.
- * @param response The response string. NOTE: a token_id of -1 indicates the string is an error string.
+ * @param response The response string, empty while the text may be the start of a stop sequence.
+ * NOTE: a token_id of -1 indicates the string is an error string.
  * @return a bool indicating whether the model should keep generating.
  */
 typedef bool (*llmodel_response_callback)(int32_t token_id, const char *response);
@@ -92,6 +93,15 @@ typedef bool (*llmodel_response_callback)(int32_t token_id, const char *response
  */
 typedef bool (*llmodel_recalculate_callback)(bool is_recalculating);
 
+/**
+ * Callback type for batched generation.
+ * @param seq The sequence slot the token was generated for.
+ * @param token_id The token id of the response.
+ * @param response The response string.
+ * @return a bool indicating whether this sequence should keep generating.
+ */
+typedef bool (*llmodel_batch_response_callback)(int32_t seq, int32_t token_id, const char *response);
+
 /**
  * Create a llmodel instance.
  * Recognises correct model type from file at model_path
@@ -166,8 +176,32 @@ uint64_t llmodel_save_state_data(llmodel_model model, uint8_t *dest);
  */
 uint64_t llmodel_restore_state_data(llmodel_model model, const uint8_t *src);
 
+/**
+ * Streams the internal state of the model to a file descriptor without holding all of it in memory.
+ * Only the cached tokens are written. With since > 0 only the tokens from that position on are
+ * written, as a delta to append after an earlier save of the same conversation.
+ * NOTE: This state data is specific to the type of model you have created.
+ * @param model A pointer to the llmodel_model instance.
+ * @param fd A file descriptor open for writing.
+ * @param since The first cached token to write, 0 for the whole state.
+ * @return true if the state was written, false otherwise.
+ */
+bool llmodel_save_state_to_fd(llmodel_model model, int fd, int32_t since);
+
+/**
+ * Restores the internal state of the model from a file descriptor, applying every record up to the
+ * end of the file, so a full save followed by its deltas restores the latest state.
+ * NOTE: This state data is specific to the type of model you have created.
+ * @param model A pointer to the llmodel_model instance.
+ * @param fd A file descriptor open for reading.
+ * @return true if the state was restored, false otherwise.
+ */
+bool llmodel_restore_state_from_fd(llmodel_model model, int fd);
+
 /**
  * Generate a response using the model.
+ * NOTE: Setting ctx->n_past below the number of tokens in the context rewinds it. The tokens the new
+ * prompt has in common with the ones that were rewound are not evaluated again.
  * @param model A pointer to the llmodel_model instance.
  * @param prompt A string representing the input prompt.
  * @param prompt_callback A callback function for handling the processing of prompt.
@@ -181,6 +215,158 @@ void llmodel_prompt(llmodel_model model, const char *prompt,
                     llmodel_recalculate_callback recalculate_callback,
                     llmodel_prompt_context *ctx);
 
+/**
+ * Set the number of sequences that can be decoded together in one batch.
+ * NOTE: This must be called before the model is loaded. Models that do not support batched decoding
+ * ignore it and report a single sequence slot.
+ * @param model A pointer to the llmodel_model instance.
+ * @param n_seq The number of KV cache slots to reserve.
+ */
+void llmodel_set_max_sequences(llmodel_model model, int32_t n_seq);
+
+/**
+ * Get the number of sequences that can be decoded together in one batch.
+ * @param model A pointer to the llmodel_model instance.
+ * @return The number of KV cache slots of the loaded model.
+ */
+int32_t llmodel_max_sequences(llmodel_model model);
+
+/**
+ * Create a named context: an independent conversation on the weights of the loaded model, with a KV
+ * cache slot, an RNG and prompt context of its own. The default context "" always exists.
+ * NOTE: Contexts take the KV cache slots reserved with llmodel_set_max_sequences(), which must not be
+ * used by a batch at the same time. Models with a single slot cannot create any.
+ * @param model A pointer to the llmodel_model instance.
+ * @param name The name of the new context.
+ * @return true if the context was created, false if the name is taken or no slot is free.
+ */
+bool llmodel_create_context(llmodel_model model, const char *name);
+
+/**
+ * Make a context the current one. llmodel_prompt() and the state functions act on the current
+ * context, so switching between conversations does not save or restore anything.
+ * @param model A pointer to the llmodel_model instance.
+ * @param name The name of the context, "" for the default one.
+ * @return true if the context exists, false otherwise.
+ */
+bool llmodel_switch_context(llmodel_model model, const char *name);
+
+/**
+ * Destroy a named context and free its slot. The default context becomes current if it was.
+ * @param model A pointer to the llmodel_model instance.
+ * @param name The name of the context.
+ * @return true if the context existed, false otherwise or for the default context.
+ */
+bool llmodel_destroy_context(llmodel_model model, const char *name);
+
+/**
+ * Choose whether the weights are mapped from the model file or read into memory. Mapped weights are
+ * paged in as they are used and shared by every process that maps the same file.
+ * NOTE: This must be called before the model is loaded. Mapping is on by default.
+ * @param model A pointer to the llmodel_model instance.
+ * @param use_mmap Whether to map the weights.
+ * @param prefault Whether to read the whole mapped file in with several threads while loading.
+ */
+void llmodel_set_mmap(llmodel_model model, bool use_mmap, bool prefault);
+
+/**
+ * Keep the logits of every evaluated token, which llmodel_score needs for LLaMA models. Other models
+ * compute the logits they are asked for and do not need it.
+ * NOTE: This must be called before the model is loaded.
+ * @param model A pointer to the llmodel_model instance.
+ * @param logits_all Whether to keep the logits of every token.
+ */
+void llmodel_set_logits_all(llmodel_model model, bool logits_all);
+
+/**
+ * Set the stop sequences of the following calls to llmodel_prompt() and llmodel_batch_add().
+ * Generation ends before the first of them that appears in the response, and the text that could be
+ * the start of one is only passed to the response callback once it is known not to be. The default
+ * stops at "### Instruction", "### Prompt", "### Response", "### Human", "### Assistant" and
+ * "### Context".
+ * @param model A pointer to the llmodel_model instance.
+ * @param sequences An array of n_sequences strings, or NULL to go back to the default.
+ * @param n_sequences The number of stop sequences, 0 for none.
+ */
+void llmodel_set_stop_sequences(llmodel_model model, const char **sequences, int32_t n_sequences);
+
+/**
+ * Set the element type of the keys in the KV cache, the values keep their float type. Quantized keys
+ * let more sequences fit in memory and make attention read less per token, at some cost in accuracy.
+ * Models that cannot quantize their cache keep their own type.
+ * NOTE: This must be called before the model is loaded, and before llmodel_required_mem() to account for it.
+ * @param model A pointer to the llmodel_model instance.
+ * @param type "f16" (the default), "q8_0" or "q4_0".
+ * @return true if the type is known.
+ */
+bool llmodel_set_kv_cache_type(llmodel_model model, const char *type);
+
+/**
+ * Add a sequence to the batch of the model. It starts reading its prompt on the next call to
+ * llmodel_batch_step(), alongside the sequences that are already generating.
+ * @param model A pointer to the llmodel_model instance.
+ * @param seq The sequence slot to use, 0 <= seq < llmodel_max_sequences(). Must not be in use.
+ * @param prompt A string representing the input prompt.
+ * @param response_callback A callback function for handling the generated response.
+ * @param ctx A pointer to the llmodel_prompt_context structure holding the sampling parameters.
+ * @return true if the sequence was added, false if the slot is invalid or in use or the prompt does
+ * not fit the context window.
+ */
+bool llmodel_batch_add(llmodel_model model, int32_t seq, const char *prompt,
+                       llmodel_batch_response_callback response_callback,
+                       const llmodel_prompt_context *ctx);
+
+/**
+ * Remove a sequence from the batch of the model before it has finished.
+ * @param model A pointer to the llmodel_model instance.
+ * @param seq The sequence slot to release.
+ */
+void llmodel_batch_remove(llmodel_model model, int32_t seq);
+
+/**
+ * Advance every sequence in the batch of the model by one step. Sequences that finish are removed
+ * from the batch and their slot can be reused.
+ * @param model A pointer to the llmodel_model instance.
+ * @return The number of sequences still in the batch; -1 on error.
+ */
+int32_t llmodel_batch_step(llmodel_model model);
+
+/**
+ * Speed up generation with a small draft model that proposes the next tokens, which the model then
+ * verifies all at once. The output is the same as without the draft model.
+ * NOTE: LLaMA models have to be given their draft model before they are loaded.
+ * @param model A pointer to the llmodel_model instance.
+ * @param draft A pointer to the llmodel_model instance of a model with the same vocabulary, or NULL
+ * to stop using one. It is not owned by the model and has to outlive its use.
+ * @param n_draft The number of tokens the draft model proposes at a time.
+ */
+void llmodel_set_draft_model(llmodel_model model, llmodel_model draft, int32_t n_draft);
+
+/**
+ * Get how many of the tokens proposed by the draft model were accepted so far.
+ * @param model A pointer to the llmodel_model instance.
+ * @param drafted A pointer to a uint64_t that is set to the number of proposed tokens.
+ * @param accepted A pointer to a uint64_t that is set to the number of accepted tokens.
+ * @return The accept rate, between 0 and 1.
+ */
+float llmodel_speculative_stats(llmodel_model model, uint64_t *drafted, uint64_t *accepted);
+
+/**
+ * Get how many tokens the model evaluated and how many heap allocations that took. Decoding should
+ * stop allocating once it reaches a steady state. Models that do not count this report zeroes.
+ * @param model A pointer to the llmodel_model instance.
+ * @param tokens A pointer to a uint64_t that is set to the number of evaluated tokens.
+ * @param allocations A pointer to a uint64_t that is set to the number of allocations.
+ * @return The number of allocations per evaluated token.
+ */
+float llmodel_eval_stats(llmodel_model model, uint64_t *tokens, uint64_t *allocations);
+
+/**
+ * Reset the counters of llmodel_eval_stats, e.g. after a warmup.
+ * @param model A pointer to the llmodel_model instance.
+ */
+void llmodel_reset_eval_stats(llmodel_model model);
+
 /**
  * Generate an embedding using the model.
  * NOTE: If given NULL pointers for the model or text, or an empty text, a NULL pointer will be
@@ -200,10 +386,36 @@ float *llmodel_embedding(llmodel_model model, const char *text, size_t *embeddin
  */
 void llmodel_free_embedding(float *ptr);
 
+/**
+ * Computes the log-probability of every token of text following prefix, for ranking candidate
+ * completions or computing perplexity. The prefix starts the context and is only evaluated again where
+ * it differs from the tokens the current context already holds, so candidates scored one after the
+ * other after the same prefix share its KV cache.
+ * NOTE: LLaMA models have to be loaded after llmodel_set_logits_all.
+ * If given NULL pointers for the model or text, an empty text or a text that cannot be scored, a NULL
+ * pointer will be returned.
+ * @param model A pointer to the llmodel_model instance.
+ * @param prefix The text the scored tokens follow, NULL or empty for none.
+ * @param text The text to score.
+ * @param n_batch The number of tokens to evaluate at once.
+ * @param n_tokens A pointer to a size_t that will be set to the number of tokens of text.
+ * @return The log-probability of every token of text, which the caller frees with
+ * llmodel_free_logprobs. Without a prefix the first token is not predicted and its entry is 0.
+ */
+float *llmodel_score(llmodel_model model, const char *prefix, const char *text, int32_t n_batch, size_t *n_tokens);
+
+/**
+ * Frees the memory allocated by the llmodel_score function.
+ * @param ptr A pointer to the log-probabilities as returned from llmodel_score.
+ */
+void llmodel_free_logprobs(float *ptr);
+
 /**
  * Set the number of threads to be used by the model.
+ * NOTE: The cores are shared with the other models of the process while they evaluate, so the model
+ * may run fewer threads than this. By default it uses as many threads as there are physical cores.
  * @param model A pointer to the llmodel_model instance.
- * @param n_threads The number of threads to be used.
+ * @param n_threads The number of threads to be used, or 0 for as many as there are physical cores.
  */
 void llmodel_setThreadCount(llmodel_model model, int32_t n_threads);
 
@@ -1,15 +1,28 @@
 #include "llmodel.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <iostream>
-#include <unordered_set>
+
+#ifdef _WIN32
+#include <io.h>
+#define LLM_FD_READ _read
+#define LLM_FD_WRITE _write
+#else
+#include <unistd.h>
+#define LLM_FD_READ ::read
+#define LLM_FD_WRITE ::write
+#endif
 
 void LLModel::recalculateContext(PromptContext &promptCtx, std::function<bool(bool)> recalculate) {
     size_t i = 0;
     promptCtx.n_past = 0;
     while (i < promptCtx.tokens.size()) {
         size_t batch_end = std::min(i + promptCtx.n_batch, promptCtx.tokens.size());
-        std::vector<int32_t> batch(promptCtx.tokens.begin() + i, promptCtx.tokens.begin() + batch_end);
+        std::vector<Token> &batch = m_evalTokens;
+        batch.assign(promptCtx.tokens.begin() + i, promptCtx.tokens.begin() + batch_end);
         assert(promptCtx.n_past + int32_t(batch.size()) <= promptCtx.n_ctx);
         if (!evalTokens(promptCtx, batch)) {
             std::cerr << "LLModel ERROR: Failed to process prompt\n";
@@ -26,9 +39,137 @@ stop_generating:
     recalculate(false);
 }
 
+bool LLModel::makeRoomInContext(PromptContext &promptCtx, int32_t n_needed, std::function<bool(bool)> recalculate)
+{
+    if (n_needed > promptCtx.n_ctx) {
+        std::cerr << implementation().modelType() << " ERROR: " << n_needed
+            << " tokens do not fit the context window of " << promptCtx.n_ctx << "\n";
+        return false;
+    }
+
+    // Pinned tokens that would leave no room for the new ones are not kept, and at least as many
+    // tokens as those that do not fit are dropped
+    const int32_t n_keep = std::clamp(promptCtx.n_keep, 0,
+        std::max(0, std::min(promptCtx.n_past - 1, promptCtx.n_ctx - n_needed)));
+    const int32_t n_discard = std::min(promptCtx.n_past - n_keep,
+        std::max({ 1, int32_t((promptCtx.n_past - n_keep) * promptCtx.contextErase),
+                   promptCtx.n_past + n_needed - promptCtx.n_ctx }));
+
+    // tokens cached past n_past for a later prompt of the turn do not survive the shift
+    if (size_t(promptCtx.n_past) < promptCtx.tokens.size())
+        promptCtx.tokens.resize(promptCtx.n_past);
+
+    // The KV cache can only be shifted if the tokens tell us what is in it
+    if (size_t(promptCtx.n_past) == promptCtx.tokens.size()
+        && shiftContext(n_keep, n_discard, promptCtx.n_past)) {
+        promptCtx.tokens.erase(promptCtx.tokens.begin() + n_keep, promptCtx.tokens.begin() + n_keep + n_discard);
+        promptCtx.n_past -= n_discard;
+        return true;
+    }
+
+    // Erase the first percentage of context after the pinned tokens...
+    std::cerr << implementation().modelType() << ": reached the end of the context window so resizing\n";
+    const size_t n_kept = std::min(size_t(n_keep), promptCtx.tokens.size());
+    const size_t n_erase = std::min(size_t(n_discard), promptCtx.tokens.size() - n_kept);
+    promptCtx.tokens.erase(promptCtx.tokens.begin() + n_kept, promptCtx.tokens.begin() + n_kept + n_erase);
+    promptCtx.n_past = promptCtx.tokens.size();
+    recalculateContext(promptCtx, recalculate);
+    return true;
+}
+
+void LLModel::StopMatcher::reset(const std::vector<std::string> &sequences)
+{
+    m_state = 0;
+    m_text.clear();
+    m_shown = 0;
+    if (sequences == m_sequences)
+        return;
+
+    m_sequences = sequences;
+    m_next.clear();
+    m_depth.clear();
+    m_match.clear();
+    if (std::all_of(sequences.begin(), sequences.end(), [](const std::string &s) { return s.empty(); }))
+        return;
+
+    // the trie of the sequences, its edges are the only transitions set so far
+    m_next.assign(256, 0);
+    m_depth.assign(1, 0);
+    m_match.assign(1, 0);
+    for (const std::string &s : sequences) {
+        int32_t state = 0;
+        for (const char c : s) {
+            int32_t &next = m_next[state * 256 + (unsigned char) c];
+            if (!next) {
+                next = int32_t(m_depth.size());
+                m_next.resize(m_next.size() + 256, 0);
+                m_depth.push_back(m_depth[state] + 1);
+                m_match.push_back(0);
+            }
+            state = m_next[state * 256 + (unsigned char) c];
+        }
+        if (state)
+            m_match[state] = m_depth[state];
+    }
+
+    // Breadth first, each state falls back to the longest proper suffix of it that is in the trie and
+    // takes the transitions it lacks from there
+    std::vector<int32_t> fail(m_depth.size(), 0);
+    std::vector<int32_t> queue;
+    queue.reserve(m_depth.size());
+    queue.push_back(0);
+    for (size_t i = 0; i < queue.size(); ++i) {
+        const int32_t state = queue[i];
+        for (int c = 0; c < 256; ++c) {
+            int32_t &next = m_next[state * 256 + c];
+            const int32_t fallback = state ? m_next[fail[state] * 256 + c] : 0;
+            if (!next) {
+                next = fallback;
+                continue;
+            }
+            fail[next] = fallback;
+            if (!m_match[next])
+                m_match[next] = m_match[fallback];
+            queue.push_back(next);
+        }
+    }
+}
+
+std::string_view LLModel::StopMatcher::feed(std::string_view piece, bool &stopped, bool last)
+{
+    stopped = false;
+    if (m_next.empty())
+        return piece;
+
+    m_text.erase(0, m_shown);
+    const size_t start = m_text.size();
+    m_text.append(piece);
+    for (size_t i = start; i < m_text.size(); ++i) {
+        m_state = m_next[m_state * 256 + (unsigned char) m_text[i]];
+        if (const int32_t match = m_match[m_state]) {
+            stopped = true;
+            m_state = 0;
+            m_shown = m_text.size();
+            return std::string_view(m_text.data(), i + 1 - match);
+        }
+    }
+    m_shown = m_text.size() - (last ? 0 : m_depth[m_state]);
+    if (last)
+        m_state = 0;
+    return std::string_view(m_text.data(), m_shown);
+}
+
+std::string_view LLModel::StopMatcher::flush()
+{
+    m_text.erase(0, m_shown);
+    m_shown = m_text.size();
+    m_state = 0;
+    return m_text;
+}
+
 void LLModel::prompt(const std::string &prompt,
                      std::function<bool(int32_t)> promptCallback,
-                     std::function<bool(int32_t, const std::string&)> responseCallback,
+                     std::function<bool(int32_t, std::string_view)> responseCallback,
                      std::function<bool(bool)> recalculateCallback,
                      PromptContext &promptCtx)
 {
@@ -61,33 +202,58 @@ void LLModel::prompt(const std::string &prompt,
     promptCtx.n_past = std::min(promptCtx.n_past, promptCtx.n_ctx);
     promptCtx.n_batch = std::min(promptCtx.n_batch, LLMODEL_MAX_PROMPT_BATCH);
 
+    // The tokens past n_past are still in the KV cache if the caller rewound the context, so keep
+    // the ones the new prompt starts with and only evaluate the rest. The last prompt token is
+    // always evaluated as we need its logits. The cached tokens are only dropped from where the
+    // prompt differs, so a turn made of several prompts can reuse them in each of its prompts.
+    if (!embd_inp.empty() && size_t(promptCtx.n_past) < promptCtx.tokens.size()) {
+        auto cached = promptCtx.tokens.begin() + promptCtx.n_past;
+        const size_t n_cmp = std::min(size_t(promptCtx.tokens.end() - cached), embd_inp.size() - 1);
+        const size_t n_reuse = std::mismatch(cached, cached + n_cmp, embd_inp.begin()).first - cached;
+
+        promptCtx.n_past += n_reuse;
+        for (size_t t = 0; t < n_reuse; ++t) {
+            if (!promptCallback(embd_inp[t]))
+                return;
+        }
+        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_reuse);
+    }
+
     // process the prompt in batches
     size_t i = 0;
     while (i < embd_inp.size()) {
         size_t batch_end = std::min(i + promptCtx.n_batch, embd_inp.size());
-        std::vector<Token> batch(embd_inp.begin() + i, embd_inp.begin() + batch_end);
 
         // Check if the context has run out...
-        if (promptCtx.n_past + int32_t(batch.size()) > promptCtx.n_ctx) {
-            const int32_t erasePoint = promptCtx.n_ctx * promptCtx.contextErase;
-            // Erase the first percentage of context from the tokens...
-            std::cerr << implementation().modelType() << ": reached the end of the context window so resizing\n";
-            promptCtx.tokens.erase(promptCtx.tokens.begin(), promptCtx.tokens.begin() + erasePoint);
-            promptCtx.n_past = promptCtx.tokens.size();
-            recalculateContext(promptCtx, recalculateCallback);
-            assert(promptCtx.n_past + int32_t(batch.size()) <= promptCtx.n_ctx);
+        if (promptCtx.n_past + int32_t(batch_end - i) > promptCtx.n_ctx) {
+            if (!makeRoomInContext(promptCtx, batch_end - i, recalculateCallback))
+                return;
+            assert(promptCtx.n_past + int32_t(batch_end - i) <= promptCtx.n_ctx);
         }
 
+        // filled in after the context shift, which may evaluate with it as well
+        std::vector<Token> &batch = m_evalTokens;
+        batch.assign(embd_inp.begin() + i, embd_inp.begin() + batch_end);
         if (!evalTokens(promptCtx, batch)) {
             std::cerr << implementation().modelType() << " ERROR: Failed to process prompt\n";
             return;
         }
 
+        // Evaluating the cached token at its own position leaves the cache as it was, anything
+        // else overwrites it and the cached tokens after it
         size_t tokens = batch_end - i;
+        if (size_t(promptCtx.n_past) < promptCtx.tokens.size()) {
+            auto cached = promptCtx.tokens.begin() + promptCtx.n_past;
+            const size_t n_cmp = std::min(size_t(promptCtx.tokens.end() - cached), tokens);
+            const size_t n_kept = std::mismatch(cached, cached + n_cmp, batch.begin()).first - cached;
+            if (n_kept < tokens) {
+                promptCtx.tokens.resize(promptCtx.n_past + n_kept);
+                promptCtx.tokens.insert(promptCtx.tokens.end(), batch.begin() + n_kept, batch.begin() + tokens);
+            }
+        } else {
+            promptCtx.tokens.insert(promptCtx.tokens.end(), batch.begin(), batch.begin() + tokens);
+        }
         for (size_t t = 0; t < tokens; ++t) {
-            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
-                promptCtx.tokens.erase(promptCtx.tokens.begin());
-            promptCtx.tokens.push_back(batch.at(t));
             if (!promptCallback(batch.at(t)))
                 return;
         }
@@ -95,10 +261,33 @@ void LLModel::prompt(const std::string &prompt,
         i = batch_end;
     }
 
-    std::string cachedResponse;
-    std::vector<Token> cachedTokens;
-    std::unordered_set<std::string> reversePrompts
-        = { "### Instruction", "### Prompt", "### Response", "### Human", "### Assistant", "### Context" };
+    // the response overwrites whatever is cached after the prompt, and the sampler penalizes the
+    // last tokens it sees
+    if (promptCtx.n_predict > 0 && size_t(promptCtx.n_past) < promptCtx.tokens.size())
+        promptCtx.tokens.resize(promptCtx.n_past);
+
+    m_stopMatcher.reset(promptCtx.stop);
+    int32_t n_emitted = 0;
+    bool stopped = false;   // by a stop sequence or the caller, nothing held back is shown then
+
+    // Hands the text of a generated token to the caller, except for what may be the start of a stop
+    // sequence, returns false once generation has to stop. Every token the context grows by gets
+    // its own call, so callers can count them; the text held back is released with the last one.
+    auto emitToken = [&](Token id) -> bool {
+        const auto &eos = endTokens();
+        const bool isEnd = std::find(eos.begin(), eos.end(), id) != eos.end();
+        const bool last = ++n_emitted >= promptCtx.n_predict;
+        const std::string_view text = isEnd ? m_stopMatcher.flush()
+                                            : m_stopMatcher.feed(tokenToString(id), stopped, last);
+        if (!responseCallback(id, text))
+            stopped = true;
+        return !stopped && !isEnd;
+    };
+
+    if (m_draftModel && m_draftModel->isModelLoaded()) {
+        generateSpeculative(promptCtx, emitToken, recalculateCallback);
+        return;
+    }
 
     // predict next tokens
     for (int i = 0; i < promptCtx.n_predict; i++) {
@@ -108,62 +297,282 @@ void LLModel::prompt(const std::string &prompt,
 
         // Check if the context has run out...
         if (promptCtx.n_past + 1 > promptCtx.n_ctx) {
-            const int32_t erasePoint = promptCtx.n_ctx * promptCtx.contextErase;
-            // Erase the first percentage of context from the tokens...
-            std::cerr << implementation().modelType() << ": reached the end of the context window so resizing\n";
-            promptCtx.tokens.erase(promptCtx.tokens.begin(), promptCtx.tokens.begin() + erasePoint);
-            promptCtx.n_past = promptCtx.tokens.size();
-            recalculateContext(promptCtx, recalculateCallback);
+            if (!makeRoomInContext(promptCtx, 1, recalculateCallback))
+                break;
             assert(promptCtx.n_past + 1 <= promptCtx.n_ctx);
         }
 
-        if (!evalTokens(promptCtx, { id })) {
+        m_evalTokens.assign(1, id);
+        if (!evalTokens(promptCtx, m_evalTokens)) {
             std::cerr << implementation().modelType() << " ERROR: Failed to predict next token\n";
             return;
         }
 
+        // the tokens mirror the KV cache, even the ones held back or not shown below. As the context
+        // is shifted before it overflows they never outgrow the context window.
         promptCtx.n_past += 1;
+        promptCtx.tokens.push_back(id);
+
+        if (!emitToken(id))
+            break;
+    }
+}
+
+void LLModel::setDraftModel(LLModel *draft, int32_t n_draft)
+{
+    if (draft == this)
+        draft = nullptr;
+    m_draftModel = draft;
+    m_draftTokens = std::clamp(n_draft, 1, LLMODEL_MAX_PROMPT_BATCH - 1);
+    m_draftCtx = PromptContext();
+    m_loadOptions.logits_all = draft != nullptr;
+}
+
+void LLModel::generateSpeculative(PromptContext &promptCtx, std::function<bool(Token)> emitToken,
+                                  std::function<bool(bool)> recalculate)
+{
+    LLModel &draft = *m_draftModel;
+    PromptContext &draftCtx = m_draftCtx;
+
+    // The draft model proposes its most likely tokens, they are the ones most likely to be sampled
+    draftCtx.n_ctx = draft.contextLength();
+    draftCtx.n_batch = promptCtx.n_batch;
+    draftCtx.n_keep = promptCtx.n_keep;
+    draftCtx.top_k = 1;
+    draftCtx.repeat_penalty = promptCtx.repeat_penalty;
+    draftCtx.repeat_last_n = promptCtx.repeat_last_n;
+    draftCtx.contextErase = promptCtx.contextErase;
+
+    const auto &eos = endTokens();
+    const auto isEndToken = [&eos](Token id) { return std::find(eos.begin(), eos.end(), id) != eos.end(); };
+
+    // the logits of a single token, every row of a verification has this size
+    const size_t n_vocab = promptCtx.logits.size();
+    std::vector<Token> batch;
+    std::vector<Token> pending;
+    std::vector<float> rows;
+
+    Token id = sampleToken(promptCtx);
+    for (int n_generated = 0; n_generated < promptCtx.n_predict;) {
+        const int32_t n_draft = std::min(m_draftTokens, promptCtx.n_predict - n_generated - 1);
+
+        // Check if the context has run out...
+        if (promptCtx.n_past + 1 + n_draft > promptCtx.n_ctx) {
+            if (!makeRoomInContext(promptCtx, 1 + n_draft, recalculate))
+                return;
+            assert(promptCtx.n_past + 1 + n_draft <= promptCtx.n_ctx);
+        }
+
+        // Bring the draft model up to the tokens of this one followed by 'id'. Usually it only lacks
+        // 'id' and the drafts that were accepted, after a context shift it catches up from where
+        // its tokens start to differ. A draft model with a smaller context window than this one sits
+        // out once the tokens no longer fit it.
+        auto [draftEnd, targetEnd] = std::mismatch(draftCtx.tokens.begin(), draftCtx.tokens.end(),
+            promptCtx.tokens.begin(), promptCtx.tokens.end());
+        pending.assign(targetEnd, promptCtx.tokens.end());
+        pending.push_back(id);
+        draftCtx.tokens.erase(draftEnd, draftCtx.tokens.end());
+        draftCtx.n_past = draftCtx.tokens.size();
 
-        // display text
-        for (const auto token : endTokens()) {
-            if (id == token) return;
+        bool drafting = draftCtx.n_past + int32_t(pending.size()) + n_draft <= draftCtx.n_ctx;
+        for (size_t i = 0; drafting && i < pending.size(); i += draftCtx.n_batch) {
+            std::vector<Token> &chunk = m_evalTokens;
+            chunk.assign(pending.begin() + i,
+                pending.begin() + std::min(pending.size(), i + size_t(draftCtx.n_batch)));
+            drafting = draft.evalTokens(draftCtx, chunk);
+            draftCtx.n_past += chunk.size();
+            draftCtx.tokens.insert(draftCtx.tokens.end(), chunk.begin(), chunk.end());
+        }
+        if (!drafting) {
+            // the draft model is out of sync, start over with it next time
+            draftCtx.tokens.clear();
+            draftCtx.n_past = 0;
         }
 
-        const std::string str = tokenToString(id);
+        batch.assign(1, id);
+        for (int32_t j = 0; drafting && j < n_draft && !isEndToken(batch.back()); ++j) {
+            const Token d = draft.sampleToken(draftCtx);
+            batch.push_back(d);
+            if (j + 1 == n_draft || isEndToken(d))
+                break;
+            m_evalTokens.assign(1, d);
+            if (!draft.evalTokens(draftCtx, m_evalTokens))
+                break;
+            draftCtx.n_past += 1;
+            draftCtx.tokens.push_back(d);
+        }
+        m_speculativeStats.drafted += batch.size() - 1;
 
-        // Check if the provided str is part of our reverse prompts
-        bool foundPartialReversePrompt = false;
-        const std::string completed = cachedResponse + std::string(str);
-        if (reversePrompts.find(completed) != reversePrompts.end())
+        // Evaluate 'id' and the drafts at once, the logits of each token tell which token follows it
+        promptCtx.logits_all = true;
+        const bool ok = evalTokens(promptCtx, batch);
+        promptCtx.logits_all = false;
+        if (!ok || promptCtx.logits.size() != n_vocab * batch.size()) {
+            std::cerr << implementation().modelType() << " ERROR: Failed to verify draft tokens\n";
             return;
+        }
+        rows.swap(promptCtx.logits);
+
+        // Accept tokens for as long as the draft agrees with what this model samples. The KV cache
+        // past the first rejected draft is left behind and overwritten by the next evaluation.
+        for (size_t j = 0;; ++j) {
+            promptCtx.n_past += 1;
+            promptCtx.tokens.push_back(batch[j]);
+            promptCtx.logits.assign(rows.begin() + j * n_vocab, rows.begin() + (j + 1) * n_vocab);
+            ++n_generated;
 
-        // Check if it partially matches our reverse prompts and if so, cache
-        for (const auto& s : reversePrompts) {
-            if (s.compare(0, completed.size(), completed) == 0) {
-                foundPartialReversePrompt = true;
-                cachedResponse = completed;
+            if (!emitToken(batch[j]) || n_generated >= promptCtx.n_predict)
+                return;
+
+            id = sampleToken(promptCtx);
+            if (j + 1 == batch.size() || batch[j + 1] != id)
                 break;
-            }
+            ++m_speculativeStats.accepted;
         }
+    }
+}
 
-        // Regardless the token gets added to our cache
-        cachedTokens.push_back(id);
+bool LLModel::evalBatch(std::vector<BatchItem> &items)
+{
+    for (BatchItem &item : items) {
+        assert(item.seq == 0 && items.size() == 1);
+        m_evalTokens.assign(item.tokens, item.tokens + item.n_tokens);
+        if (!evalTokens(*item.ctx, m_evalTokens))
+            return false;
+    }
+    return true;
+}
+
+bool LLModel::beginSequence(BatchSequence &sequence, const std::string &prompt)
+{
+    if (!isModelLoaded() || !supportsCompletion())
+        return false;
 
-        // Continue if we have found a partial match
-        if (foundPartialReversePrompt)
+    if (sequence.seq < 0 || sequence.seq >= maxSequences()) {
+        std::cerr << implementation().modelType() << " ERROR: sequence slot " << sequence.seq
+            << " is out of range\n";
+        return false;
+    }
+
+    PromptContext &promptCtx = *sequence.ctx;
+    promptCtx.n_ctx = contextLength();
+    promptCtx.n_batch = std::min(promptCtx.n_batch, LLMODEL_MAX_PROMPT_BATCH);
+
+    sequence.pending = tokenizeText(prompt, true);
+    sequence.stop.reset(promptCtx.stop);
+    sequence.n_generated = 0;
+    sequence.finished = false;
+
+    if (sequence.pending.empty() || (int) sequence.pending.size() > promptCtx.n_ctx - 4) {
+        std::cerr << implementation().modelType() << " ERROR: The prompt is " << sequence.pending.size() <<
+            " tokens and the context window is " << promptCtx.n_ctx << "!\n";
+        promptCtx.n_past = 0;
+        promptCtx.tokens.clear();
+        sequence.finished = true;
+        return false;
+    }
+    promptCtx.n_predict = std::min(promptCtx.n_predict, promptCtx.n_ctx - (int) sequence.pending.size());
+
+    // The tokens are those the slot holds from the sequence it had before, if the caller kept them.
+    // The ones the new prompt starts with are not evaluated again, except for its last token as we
+    // need its logits.
+    const size_t n_cmp = std::min(promptCtx.tokens.size(), sequence.pending.size() - 1);
+    const size_t n_reuse = std::mismatch(promptCtx.tokens.begin(), promptCtx.tokens.begin() + n_cmp,
+                                         sequence.pending.begin()).first - promptCtx.tokens.begin();
+    promptCtx.tokens.resize(n_reuse);
+    promptCtx.n_past = n_reuse;
+    sequence.pending.erase(sequence.pending.begin(), sequence.pending.begin() + n_reuse);
+    return true;
+}
+
+// Ends a sequence that stops without a stop sequence, handing over the text it held back
+static void finishSequence(LLModel::BatchSequence &sequence)
+{
+    sequence.finished = true;
+    const std::string_view text = sequence.stop.flush();
+    if (!text.empty() && sequence.responseCallback) {
+        const auto &tokens = sequence.ctx->tokens;
+        sequence.responseCallback(tokens.empty() ? -1 : tokens.back(), text);
+    }
+}
+
+bool LLModel::decodeBatch(const std::vector<BatchSequence*> &sequences)
+{
+    // Prompt tokens of all sequences share this budget so that a long prompt joining the batch is
+    // read in chunks and does not stall the sequences that are already generating
+    int32_t promptBudget = LLMODEL_MAX_PROMPT_BATCH;
+
+    std::vector<BatchItem> &items = m_batchItems;
+    std::vector<BatchSequence*> &owners = m_batchOwners;
+    items.clear();
+    owners.clear();
+    m_batchSampled.resize(sequences.size());
+
+    for (size_t s = 0; s < sequences.size(); ++s) {
+        BatchSequence *sequence = sequences[s];
+        if (sequence->finished)
             continue;
 
-        // Empty the cache
-        for (auto t : cachedTokens) {
-            if (int32_t(promptCtx.tokens.size()) == promptCtx.n_ctx)
-                promptCtx.tokens.erase(promptCtx.tokens.begin());
-            promptCtx.tokens.push_back(t);
-            //TODO: Conversion to std::string can be avoided here...
-            if (!responseCallback(t, std::string(tokenToString(t))))
-                return;
+        PromptContext &promptCtx = *sequence->ctx;
+        if (!sequence->pending.empty()) {
+            const int32_t n = std::min({ int32_t(sequence->pending.size()), promptCtx.n_batch, promptBudget });
+            if (n <= 0)
+                continue;
+            promptBudget -= n;
+            items.push_back({ sequence->seq, &promptCtx, sequence->pending.data(), n });
+            owners.push_back(sequence);
+            continue;
         }
-        cachedTokens.clear();
+
+        if (sequence->n_generated >= promptCtx.n_predict || promptCtx.n_past + 1 > promptCtx.n_ctx) {
+            finishSequence(*sequence);
+            continue;
+        }
+
+        const Token id = sampleToken(promptCtx);
+        const auto &eos = endTokens();
+        if (std::find(eos.begin(), eos.end(), id) != eos.end()) {
+            finishSequence(*sequence);
+            continue;
+        }
+
+        m_batchSampled[s] = id;
+        items.push_back({ sequence->seq, &promptCtx, &m_batchSampled[s], 1 });
+        owners.push_back(sequence);
+    }
+
+    if (items.empty())
+        return true;
+
+    if (!evalBatch(items)) {
+        std::cerr << implementation().modelType() << " ERROR: Failed to evaluate batch\n";
+        return false;
+    }
+
+    for (size_t i = 0; i < items.size(); ++i) {
+        BatchSequence *sequence = owners[i];
+        PromptContext &promptCtx = *items[i].ctx;
+        const Token *tokens = items[i].tokens;
+        const int32_t n_tokens = items[i].n_tokens;
+
+        promptCtx.n_past += n_tokens;
+        promptCtx.tokens.insert(promptCtx.tokens.end(), tokens, tokens + n_tokens);
+
+        if (!sequence->pending.empty()) {
+            sequence->pending.erase(sequence->pending.begin(), sequence->pending.begin() + n_tokens);
+            continue;
+        }
+
+        ++sequence->n_generated;
+        bool stopped = false;
+        const std::string_view text = sequence->stop.feed(tokenToString(tokens[0]), stopped);
+        if (!text.empty() && sequence->responseCallback && !sequence->responseCallback(tokens[0], text))
+            stopped = true;
+        if (stopped)
+            sequence->finished = true;
     }
+
+    return true;
 }
 
 std::vector<float> LLModel::embedding(const std::string &/*text*/)
@@ -174,3 +583,290 @@ std::vector<float> LLModel::embedding(const std::string &/*text*/)
     }
     return std::vector<float>();
 }
+
+std::vector<LLModel::Token> LLModel::tokenizeText(const std::string &text, bool atStart) const
+{
+    // tokenize() adds the BOS token when nothing has been evaluated yet
+    PromptContext ctx;
+    ctx.n_past = atStart ? 0 : 1;
+    return tokenize(ctx, text);
+}
+
+// log(softmax(logits)[token]), taken relative to the largest logit so no exp() can overflow and the
+// sum is at least 1
+static float logSoftmax(const float *logits, size_t n_vocab, LLModel::Token token)
+{
+    if (token < 0 || size_t(token) >= n_vocab)
+        return -INFINITY;
+    const float max = *std::max_element(logits, logits + n_vocab);
+    double sum = 0.0;
+    for (size_t i = 0; i < n_vocab; ++i)
+        sum += std::exp(double(logits[i] - max));
+    return float(double(logits[token] - max) - std::log(sum));
+}
+
+bool LLModel::score(const std::vector<Token> &prefix, const std::vector<Token> &tokens, std::vector<float> &logprobs,
+                    PromptContext &promptCtx)
+{
+    logprobs.clear();
+    if (!isModelLoaded() || !supportsCompletion()) {
+        std::cerr << implementation().modelType() << " ERROR: this model cannot score text\n";
+        return false;
+    }
+
+    std::vector<Token> all;
+    all.reserve(prefix.size() + tokens.size());
+    all.insert(all.end(), prefix.begin(), prefix.end());
+    all.insert(all.end(), tokens.begin(), tokens.end());
+
+    promptCtx.n_ctx = contextLength();
+    if (int32_t(all.size()) > promptCtx.n_ctx) {
+        std::cerr << implementation().modelType() << " ERROR: " << all.size()
+                  << " tokens to score do not fit the context window of " << promptCtx.n_ctx << "\n";
+        return false;
+    }
+    if (tokens.empty())
+        return true;
+
+    // The logits of position j predict the token at j + 1, so scoring starts with the logits of the
+    // last prefix token. The cached tokens before it that match are kept, it is always evaluated.
+    const size_t n_prefix = prefix.size();
+    const size_t first = std::max<size_t>(n_prefix, 1) - 1;
+    const size_t n_cmp = std::min(promptCtx.tokens.size(), first);
+    const size_t n_reuse = std::mismatch(all.begin(), all.begin() + n_cmp, promptCtx.tokens.begin()).first - all.begin();
+    promptCtx.tokens.resize(n_reuse);
+    promptCtx.n_past = n_reuse;
+
+    logprobs.assign(tokens.size(), 0.0f);
+    const size_t n_batch = std::clamp(promptCtx.n_batch, 1, LLMODEL_MAX_PROMPT_BATCH);
+    bool ok = true;
+    for (size_t i = n_reuse; i < all.size(); i += n_batch) {
+        const size_t end = std::min(i + n_batch, all.size());
+        const std::vector<Token> batch(all.begin() + i, all.begin() + end);
+
+        // the rows of the batch that predict a scored token, the last token predicts nothing
+        promptCtx.logits_rows.clear();
+        for (size_t j = std::max(i, first); j < end && j + 1 < all.size(); ++j)
+            promptCtx.logits_rows.push_back(j - i);
+        const size_t n_rows = promptCtx.logits_rows.size();
+
+        if (!evalTokens(promptCtx, batch)) {
+            std::cerr << implementation().modelType() << " ERROR: Failed to evaluate the tokens to score\n";
+            ok = false;
+            break;
+        }
+        promptCtx.tokens.insert(promptCtx.tokens.end(), batch.begin(), batch.end());
+        promptCtx.n_past += batch.size();
+        if (!n_rows)
+            continue;
+
+        const size_t n_vocab = promptCtx.logits.size() / n_rows;
+        if (!n_vocab || promptCtx.logits.size() != n_rows * n_vocab) {
+            std::cerr << implementation().modelType() << " ERROR: the model did not return the logits to score with\n";
+            ok = false;
+            break;
+        }
+        for (size_t r = 0; r < n_rows; ++r) {
+            const size_t j = i + promptCtx.logits_rows[r];
+            logprobs[j + 1 - n_prefix] = logSoftmax(promptCtx.logits.data() + r * n_vocab, n_vocab, all[j + 1]);
+        }
+    }
+    promptCtx.logits_rows.clear();
+    if (!ok)
+        logprobs.clear();
+    return ok;
+}
+
+bool LLModel::writeState(const StateWriter &write, int32_t /*since*/) const
+{
+    // one piece with its size in front, so readState() knows how much to read
+    std::vector<uint8_t> state(stateSize());
+    const uint64_t size = saveState(state.data());
+    return write(&size, sizeof(size)) && write(state.data(), size);
+}
+
+bool LLModel::readState(const StateReader &read)
+{
+    // a state of another model, or one written before the size was put in front, is refused
+    // before restoreState() reads past its end
+    uint64_t size;
+    if (!read(&size, sizeof(size)) || size != stateSize())
+        return false;
+    std::vector<uint8_t> state(size);
+    return read(state.data(), size) && restoreState(state.data()) == size;
+}
+
+size_t LLModel::streamedStateSize() const
+{
+    size_t size = 0;
+    writeState([&size](const void *, size_t n) { size += n; return true; });
+    return size;
+}
+
+size_t LLModel::saveStreamedState(uint8_t *dest) const
+{
+    uint8_t *out = dest;
+    writeState([&out](const void *data, size_t n) { memcpy(out, data, n); out += n; return true; });
+    return out - dest;
+}
+
+size_t LLModel::restoreStreamedState(const uint8_t *src)
+{
+    const uint8_t *in = src;
+    const bool ok = readState([&in](void *data, size_t n) { memcpy(data, in, n); in += n; return true; });
+    return ok ? in - src : 0;
+}
+
+namespace {
+
+// The state is written in many small pieces, like a row of V per embedding dimension, so they are
+// collected before they go to the file
+class FdWriter {
+public:
+    explicit FdWriter(int fd) : m_fd(fd) { m_buf.reserve(s_capacity); }
+
+    bool write(const void *data, size_t size)
+    {
+        if (m_buf.size() + size > s_capacity && !flush())
+            return false;
+        if (size >= s_capacity)
+            return writeAll(static_cast<const uint8_t *>(data), size);
+        m_buf.insert(m_buf.end(), static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+        return true;
+    }
+
+    bool flush()
+    {
+        const bool ok = writeAll(m_buf.data(), m_buf.size());
+        m_buf.clear();
+        return ok;
+    }
+
+private:
+    bool writeAll(const uint8_t *data, size_t size)
+    {
+        while (size > 0) {
+            const auto n = LLM_FD_WRITE(m_fd, data, unsigned(std::min(size, s_capacity)));
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static constexpr size_t s_capacity = 1 << 20;
+    int m_fd;
+    std::vector<uint8_t> m_buf;
+};
+
+class FdReader {
+public:
+    explicit FdReader(int fd) : m_fd(fd) { m_buf.resize(s_capacity); }
+
+    bool read(void *data, size_t size)
+    {
+        uint8_t *out = static_cast<uint8_t *>(data);
+        while (size > 0) {
+            if (m_pos == m_end && !fill())
+                return false;
+            const size_t n = std::min(size, m_end - m_pos);
+            memcpy(out, m_buf.data() + m_pos, n);
+            m_pos += n;
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool atEnd() { return m_pos == m_end && !fill(); }
+
+private:
+    bool fill()
+    {
+        const auto n = LLM_FD_READ(m_fd, m_buf.data(), unsigned(s_capacity));
+        m_pos = 0;
+        m_end = n > 0 ? size_t(n) : 0;
+        return m_end > 0;
+    }
+
+    static constexpr size_t s_capacity = 1 << 20;
+    int m_fd;
+    std::vector<uint8_t> m_buf;
+    size_t m_pos = 0;
+    size_t m_end = 0;
+};
+
+} // namespace
+
+bool LLModel::saveStateToFile(int fd, int32_t since) const
+{
+    FdWriter writer(fd);
+    return writeState([&writer](const void *data, size_t size) { return writer.write(data, size); }, since)
+        && writer.flush();
+}
+
+bool LLModel::restoreStateFromFile(int fd)
+{
+    FdReader reader(fd);
+    bool restored = false;
+    while (!reader.atEnd()) {
+        if (!readState([&reader](void *data, size_t size) { return reader.read(data, size); }))
+            return false;
+        restored = true;
+    }
+    return restored;
+}
+
+bool LLModel::createContext(const std::string &name)
+{
+    if (!isModelLoaded() || m_contexts.count(name))
+        return false;
+
+    // the lowest slot no other context has
+    std::vector<bool> used(maxSequences());
+    for (const auto &context : m_contexts)
+        used[context.second] = true;
+    const auto free = std::find(used.begin(), used.end(), false);
+    if (free == used.end()) {
+        std::cerr << implementation().modelType() << " ERROR: no KV cache slot is free for context "
+            << name << "\n";
+        return false;
+    }
+
+    const int32_t slot = int32_t(free - used.begin());
+    m_contexts.emplace(name, slot);
+    resetSlot(slot);
+    return true;
+}
+
+bool LLModel::switchContext(const std::string &name)
+{
+    const auto it = m_contexts.find(name);
+    if (it == m_contexts.end())
+        return false;
+    m_context = it->first;
+    m_slot = it->second;
+    return true;
+}
+
+bool LLModel::destroyContext(const std::string &name)
+{
+    if (name.empty() || !m_contexts.erase(name))
+        return false;
+    if (m_context == name)
+        switchContext(std::string());
+    return true;
+}
+
+int32_t LLModel::contextSlot(const std::string &name) const
+{
+    const auto it = m_contexts.find(name);
+    return it == m_contexts.end() ? -1 : it->second;
+}
+
+bool LLModel::writeContextState(const std::string &name, const StateWriter &write) const
+{
+    const int32_t slot = contextSlot(name);
+    return slot >= 0 && writeSlotState(slot, write);
+}
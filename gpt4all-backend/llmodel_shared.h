@@ -1,9 +1,17 @@
 #pragma once
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
 #include <vector>
 #include <ggml.h>
 
+#include "llmodel.h"
+
 #if defined(GGML_USE_KOMPUTE)
 #include "ggml-vulkan.h"
 struct llm_buffer {
@@ -64,14 +72,20 @@ struct llm_buffer {
 #endif
 
 struct llm_kv_cache {
-    struct ggml_tensor * k;
-    struct ggml_tensor * v;
+    struct ggml_tensor * k = NULL;
+    struct ggml_tensor * v = NULL;
+
+    LLModel::KVCacheType kv_type = LLModel::KVCacheType::F16; // requested before the cache is created,
+        // see llm_kv_cache_type()
 
     struct ggml_context * ctx = NULL;
 
     llm_buffer buf;
 
-    int n; // number of tokens currently in the cache
+    std::vector<int> n = { 0 }; // number of tokens currently in the cache of every slot
+    std::vector<int> n_set = { 0 }; // positions of every slot written since the cache was created, rows
+        // past it are uninitialized memory while the ones below hold finite values, maybe of dropped tokens
+    int n_seq = 1; // number of independent sequence slots, each n_ctx tokens long
 
     ~llm_kv_cache() {
         if (ctx) {
@@ -80,11 +94,345 @@ struct llm_kv_cache {
     }
 };
 
+// Size in bytes of a row of n elements of the given type
+inline size_t llm_row_size(ggml_type type, int64_t n) {
+    return ggml_type_size(type)*n/ggml_blck_size(type);
+}
+
+// The K cache element type for the kv_type load option; V always has the unquantized type, def for
+// models whose graph needs another one than F16. Quantization blocks must not straddle two heads, so
+// when head_dim is not a multiple of the block size K stays unquantized too.
+inline ggml_type llm_kv_cache_type(LLModel::KVCacheType type, int head_dim, ggml_type def = GGML_TYPE_F16) {
+    ggml_type t = def;
+    switch (type) {
+    case LLModel::KVCacheType::F16:  t = def;             break;
+    case LLModel::KVCacheType::Q8_0: t = GGML_TYPE_Q8_0;  break;
+    case LLModel::KVCacheType::Q4_0: t = GGML_TYPE_Q4_0;  break;
+    }
+    return head_dim % ggml_blck_size(t) == 0 ? t : def;
+}
+
+// The positions 0..n-1, to pick the rows of a quantized cache with ggml_get_rows. It is filled in
+// right away, so it has to be created before any scratch buffer is set.
+inline struct ggml_tensor * llm_kv_cache_positions(struct ggml_context * ctx, int n) {
+    struct ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n);
+    for (int i = 0; i < n; ++i)
+        ((int32_t *) pos->data)[i] = i;
+    return pos;
+}
+
+// The rows of the hidden state of an evaluation of n tokens that get logits: every row with logits_all,
+// else the positions in rows, else the last one. Sets n_out to their number and returns the positions
+// to ggml_get_rows the hidden state with before the final norm, so the LM head only runs for them, or
+// nullptr when that is every row. It is filled in right away, so it has to be created before any
+// scratch buffer is set.
+inline struct ggml_tensor * llm_logits_rows(struct ggml_context * ctx, int n, bool logits_all,
+                                             const std::vector<int32_t> & rows, int & n_out) {
+    n_out = logits_all ? n : rows.empty() ? 1 : int(rows.size());
+    if (logits_all || (n == 1 && n_out == 1))
+        return nullptr;
+    struct ggml_tensor * out_rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_out);
+    for (int i = 0; i < n_out; ++i)
+        ((int32_t *) out_rows->data)[i] = rows.empty() ? n - 1 : std::clamp(rows[i], 0, n - 1);
+    return out_rows;
+}
+
+// Dequantizes n rows of n_embd elements of the quantized cache tensor t, starting at byte offset offs,
+// into an F32 tensor [n_embd, n] for the ops that only work on floats. pos is from
+// llm_kv_cache_positions() and holds at least n positions.
+inline struct ggml_tensor * llm_kv_cache_dequantize(struct ggml_context * ctx, struct ggml_tensor * t, int n_embd,
+                                                    int n, size_t offs, struct ggml_tensor * pos) {
+    struct ggml_tensor * rows = ggml_view_2d(ctx, t, n_embd, n, llm_row_size(t->type, n_embd), offs);
+    return ggml_get_rows(ctx, rows, ggml_view_1d(ctx, pos, n, 0));
+}
+
+// Drops the KV rows of positions [n_keep, n_keep + n_discard) of KV slot seq and moves the rows up
+// to n_past down to take their place. n_embd is the width of a K/V row and v_trans is set for caches
+// that store V transposed, with one row of n_ctx positions per embedding dimension.
+inline void llm_kv_cache_shift(llm_kv_cache & cache, int n_layer, int n_ctx, int n_embd, int seq,
+                               int n_keep, int n_discard, int n_past, bool v_trans) {
+    const int    n_move  = n_past - n_keep - n_discard;
+    const size_t k_row   = llm_row_size(cache.k->type, n_embd);
+    const size_t v_row   = llm_row_size(cache.v->type, n_embd);
+    const size_t v_esz   = ggml_element_size(cache.v);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const int64_t row = (int64_t(seq)*n_layer + il)*n_ctx;
+
+        uint8_t * k = (uint8_t *) cache.k->data + row*k_row;
+        memmove(k + n_keep*k_row, k + (n_keep + n_discard)*k_row, n_move*k_row);
+
+        if (v_trans) {
+            uint8_t * v = (uint8_t *) cache.v->data + row*n_embd*v_esz;
+            for (int i = 0; i < n_embd; ++i) {
+                uint8_t * vi = v + int64_t(i)*n_ctx*v_esz;
+                memmove(vi + n_keep*v_esz, vi + (n_keep + n_discard)*v_esz, n_move*v_esz);
+            }
+        } else {
+            uint8_t * v = (uint8_t *) cache.v->data + row*v_row;
+            memmove(v + n_keep*v_row, v + (n_keep + n_discard)*v_row, n_move*v_row);
+        }
+    }
+
+    cache.n[seq] = n_past - n_discard;
+}
+
+// Bytes of the KV cache that hold evaluated tokens, over all slots
+inline size_t llm_kv_cache_used(const llm_kv_cache & cache, int n_layer, int n_embd) {
+    if (!cache.k || !cache.v)
+        return 0;
+    size_t n_tokens = 0;
+    for (int n : cache.n)
+        n_tokens += n;
+    return n_tokens*n_layer*(llm_row_size(cache.k->type, n_embd) + llm_row_size(cache.v->type, n_embd));
+}
+
+// Copies the KV rows of positions [0, n) of slot src to slot dst, so a sequence in dst continues from
+// the same tokens without evaluating them again. The arguments are the same as for llm_kv_cache_shift().
+inline void llm_kv_cache_copy(llm_kv_cache & cache, int n_layer, int n_ctx, int n_embd, int src, int dst, int n,
+                              bool v_trans) {
+    const size_t k_row = llm_row_size(cache.k->type, n_embd);
+    const size_t v_row = llm_row_size(cache.v->type, n_embd);
+    const size_t v_esz = ggml_element_size(cache.v);
+    uint8_t * k = (uint8_t *) cache.k->data;
+    uint8_t * v = (uint8_t *) cache.v->data;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const int64_t from = (int64_t(src)*n_layer + il)*n_ctx;
+        const int64_t to   = (int64_t(dst)*n_layer + il)*n_ctx;
+
+        memcpy(k + to*k_row, k + from*k_row, n*k_row);
+
+        if (v_trans) {
+            for (int i = 0; i < n_embd; ++i) {
+                const int64_t offs = int64_t(i)*n_ctx;
+                memcpy(v + (to*n_embd + offs)*v_esz, v + (from*n_embd + offs)*v_esz, n*v_esz);
+            }
+        } else {
+            memcpy(v + to*v_row, v + from*v_row, n*v_row);
+        }
+    }
+
+    cache.n[dst] = n;
+    cache.n_set[dst] = std::max(cache.n_set[dst], n);
+}
+
+// Rotates the RoPE encoded keys of positions [first, first + n) of KV slot seq by delta positions, so
+// keys that were moved by llm_kv_cache_shift() look as if they had been evaluated at their new
+// position. neox selects the rotation of dimension pairs (i, i + n_rot/2) instead of (2i, 2i + 1).
+// Quantized keys are dequantized a head at a time and quantized again after the rotation.
+inline bool llm_kv_cache_rope_shift(llm_kv_cache & cache, int n_layer, int n_ctx, int n_head, int head_dim,
+                                    int n_rot, int seq, int first, int n, int delta, bool neox,
+                                    float freq_base = 10000.0f) {
+    const ggml_type type = cache.k->type;
+    const ggml_type_traits_t traits = ggml_internal_get_type_traits(type);
+    if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && !(traits.to_float && traits.from_float))
+        return false;
+
+    const int n_embd = n_head*head_dim;
+    const size_t k_row = llm_row_size(type, n_embd);
+    const size_t h_row = llm_row_size(type, head_dim);
+
+    // the rotation of a pair only depends on its index, compute them once
+    std::vector<float> cos_t(n_rot/2), sin_t(n_rot/2);
+    for (int i = 0; i < n_rot/2; ++i) {
+        const float theta = delta*powf(freq_base, -2.0f*i/n_rot);
+        cos_t[i] = cosf(theta);
+        sin_t[i] = sinf(theta);
+    }
+
+    std::vector<float> buf(head_dim);
+    for (int il = 0; il < n_layer; ++il) {
+        const int64_t row = (int64_t(seq)*n_layer + il)*n_ctx;
+        for (int p = first; p < first + n; ++p) {
+            for (int h = 0; h < n_head; ++h) {
+                uint8_t * x = (uint8_t *) cache.k->data + (row + p)*k_row + h*h_row;
+                if (type == GGML_TYPE_F16)
+                    ggml_fp16_to_fp32_row((const ggml_fp16_t *) x, buf.data(), head_dim);
+                else if (type == GGML_TYPE_F32)
+                    memcpy(buf.data(), x, head_dim*sizeof(float));
+                else
+                    traits.to_float(x, buf.data(), head_dim);
+
+                for (int i = 0; i < n_rot/2; ++i) {
+                    const int i0 = neox ? i : 2*i;
+                    const int i1 = neox ? i + n_rot/2 : 2*i + 1;
+                    const float x0 = buf[i0];
+                    const float x1 = buf[i1];
+                    buf[i0] = x0*cos_t[i] - x1*sin_t[i];
+                    buf[i1] = x0*sin_t[i] + x1*cos_t[i];
+                }
+
+                if (type == GGML_TYPE_F16)
+                    ggml_fp32_to_fp16_row(buf.data(), (ggml_fp16_t *) x, head_dim);
+                else if (type == GGML_TYPE_F32)
+                    memcpy(x, buf.data(), head_dim*sizeof(float));
+                else
+                    traits.from_float(buf.data(), x, head_dim);
+            }
+        }
+    }
+    return true;
+}
+
+#define LLM_STATE_MAGIC   0x5453544cu // "LTST"
+#define LLM_STATE_VERSION 1
+#define LLM_STATE_RNG_WORDS (std::mt19937::state_size + 1)
+
+// A record of the state of a model with an llm_kv_cache: this header, n_rng words of RNG state, then
+// the rows of positions [first, n) of a KV slot, K of every layer followed by V of every layer. A
+// full state has first = 0, a delta starts where the state it applies to left off. The slot is not
+// recorded, a state can be read into any slot of the same model.
+struct llm_state_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t  kv_type;   // ggml_type of the K cache
+    int32_t  n_layer;
+    int32_t  n_ctx;
+    int32_t  n_embd;    // width of a K/V row
+    int32_t  v_trans;
+    int32_t  first;
+    int32_t  n;
+    uint32_t n_rng;
+};
+
+// Writes a state record of the tokens in KV slot seq, only those from 'since' on, through write
+inline bool llm_state_write(const llm_kv_cache & cache, int n_layer, int n_ctx, int n_embd, bool v_trans, int seq,
+                            const std::mt19937 & rng, int since, const LLModel::StateWriter & write) {
+    // the engine only has a text form, which is its state words followed by its position
+    std::vector<uint32_t> rng_words;
+    {
+        std::stringstream rng_ss;
+        rng_ss << rng;
+        uint32_t w;
+        while (rng_ss >> w)
+            rng_words.push_back(w);
+    }
+    if (rng_words.size() != LLM_STATE_RNG_WORDS)
+        return false;
+
+    const int n = cache.n[seq];
+    llm_state_header header = {
+        LLM_STATE_MAGIC, LLM_STATE_VERSION, int32_t(cache.k->type), n_layer, n_ctx, n_embd, v_trans,
+        std::clamp(since, 0, n), n, uint32_t(rng_words.size()),
+    };
+    if (!write(&header, sizeof(header)) || !write(rng_words.data(), rng_words.size()*sizeof(uint32_t)))
+        return false;
+
+    const int    first = header.first;
+    const size_t k_row = llm_row_size(cache.k->type, n_embd);
+    const size_t v_row = llm_row_size(cache.v->type, n_embd);
+    const size_t v_esz = ggml_element_size(cache.v);
+    for (int il = 0; il < n_layer; ++il) {
+        const uint8_t * k = (const uint8_t *) cache.k->data + ((int64_t(seq)*n_layer + il)*n_ctx + first)*k_row;
+        if (!write(k, (n - first)*k_row))
+            return false;
+    }
+    for (int il = 0; il < n_layer; ++il) {
+        if (!v_trans) {
+            const uint8_t * v = (const uint8_t *) cache.v->data + ((int64_t(seq)*n_layer + il)*n_ctx + first)*v_row;
+            if (!write(v, (n - first)*v_row))
+                return false;
+            continue;
+        }
+        for (int i = 0; i < n_embd; ++i) {
+            const uint8_t * v = (const uint8_t *) cache.v->data + (((int64_t(seq)*n_layer + il)*n_embd + i)*n_ctx + first)*v_esz;
+            if (!write(v, (n - first)*v_esz))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Reads a state record written by llm_state_write() for a model of the same shape. A delta has to
+// start at or before the tokens the cache holds.
+inline bool llm_state_read(llm_kv_cache & cache, int n_layer, int n_ctx, int n_embd, bool v_trans, int seq,
+                           std::mt19937 & rng, const LLModel::StateReader & read) {
+    llm_state_header header;
+    if (!read(&header, sizeof(header)))
+        return false;
+    if (header.magic != LLM_STATE_MAGIC || header.version != LLM_STATE_VERSION
+            || header.kv_type != int32_t(cache.k->type) || header.n_layer != n_layer || header.n_ctx != n_ctx
+            || header.n_embd != n_embd || header.v_trans != int32_t(v_trans)
+            || header.first < 0 || header.first > header.n || header.n > n_ctx
+            || (header.first > 0 && header.first > cache.n[seq]) || header.n_rng != LLM_STATE_RNG_WORDS) {
+        fprintf(stderr, "%s: the state does not belong to this model\n", __func__);
+        return false;
+    }
+
+    std::vector<uint32_t> rng_words(header.n_rng);
+    if (!read(rng_words.data(), rng_words.size()*sizeof(uint32_t)))
+        return false;
+    if (rng_words.back() > std::mt19937::state_size) {
+        fprintf(stderr, "%s: the state holds no valid RNG state\n", __func__);
+        return false;
+    }
+    {
+        // the engine is left as it was if the words are not a state of it
+        std::stringstream rng_ss;
+        for (uint32_t w : rng_words)
+            rng_ss << w << ' ';
+        std::mt19937 restored;
+        rng_ss >> restored;
+        if (rng_ss.fail()) {
+            fprintf(stderr, "%s: the state holds no valid RNG state\n", __func__);
+            return false;
+        }
+        rng = restored;
+    }
+
+    const int    first = header.first;
+    const int    n     = header.n;
+    const size_t k_row = llm_row_size(cache.k->type, n_embd);
+    const size_t v_row = llm_row_size(cache.v->type, n_embd);
+    const size_t v_esz = ggml_element_size(cache.v);
+    for (int il = 0; il < n_layer; ++il) {
+        uint8_t * k = (uint8_t *) cache.k->data + ((int64_t(seq)*n_layer + il)*n_ctx + first)*k_row;
+        if (!read(k, (n - first)*k_row))
+            return false;
+    }
+    for (int il = 0; il < n_layer; ++il) {
+        if (!v_trans) {
+            uint8_t * v = (uint8_t *) cache.v->data + ((int64_t(seq)*n_layer + il)*n_ctx + first)*v_row;
+            if (!read(v, (n - first)*v_row))
+                return false;
+            continue;
+        }
+        for (int i = 0; i < n_embd; ++i) {
+            uint8_t * v = (uint8_t *) cache.v->data + (((int64_t(seq)*n_layer + il)*n_embd + i)*n_ctx + first)*v_esz;
+            if (!read(v, (n - first)*v_esz))
+                return false;
+        }
+    }
+
+    cache.n[seq] = n;
+    cache.n_set[seq] = std::max(cache.n_set[seq], n);
+    return true;
+}
+
+// One sequence of a batched evaluation: n_tokens tokens evaluated at position n_past of KV slot seq
+struct llm_batch_seq {
+    int seq;
+    int n_past;
+    const int32_t * tokens;
+    int n_tokens;
+};
+
+// Grows buf to at least size bytes and keeps it when it is already big enough, so a buffer used by
+// every evaluation stops allocating once it has grown. Returns whether it had to allocate.
+inline bool llm_buffer_reserve(llm_buffer & buf, size_t size) {
+    if (buf.addr && buf.size >= size)
+        return false;
+    buf.resize(size);
+    return true;
+}
+
 #if LLAMA_DATE >= 230519
-inline void ggml_graph_compute_g4a(llm_buffer& buf, ggml_cgraph * graph, int n_threads) {
+inline void ggml_graph_compute_g4a(llm_buffer& buf, ggml_cgraph * graph, int n_threads, uint64_t * n_allocs = nullptr) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
     if (plan.work_size > 0) {
-        buf.resize(plan.work_size);
+        if (llm_buffer_reserve(buf, plan.work_size) && n_allocs)
+            ++*n_allocs;
         plan.work_data = buf.addr;
     }
     ggml_graph_compute(graph, &plan);
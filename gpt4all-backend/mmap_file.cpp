@@ -0,0 +1,130 @@
+#include "mmap_file.h"
+
+#include <algorithm>
+#include <new>
+#include <thread>
+
+#include <ggml.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// mapped tensor data has to be at least as aligned as ggml aligns the tensors it allocates
+static constexpr size_t LLM_MMAP_ALIGN = 32;
+
+void llm_mmap::copy_deleter::operator()(uint8_t * p) const {
+    ::operator delete(p, std::align_val_t{LLM_MMAP_ALIGN});
+}
+
+llm_mmap::~llm_mmap() {
+    if (!addr)
+        return;
+#if defined(_WIN32)
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+}
+
+bool llm_mmap::open(const std::string & fname) {
+    if (!enabled || addr)
+        return addr != nullptr;
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER file_size;
+    HANDLE mapping = nullptr;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+
+    // the view keeps the mapping alive
+    void * view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+        return false;
+
+    addr = static_cast<uint8_t *>(view);
+    size = size_t(file_size.QuadPart);
+#else
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    void * view = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (view == MAP_FAILED)
+        return false;
+
+    addr = static_cast<uint8_t *>(view);
+    size = size_t(st.st_size);
+
+    // start reading the file in the background, all of it is needed before the first token
+    madvise(addr, size, MADV_WILLNEED);
+#endif
+
+    if (prefault)
+        prefault_pages();
+    return true;
+}
+
+void llm_mmap::prefault_pages() const {
+    // A single thread faulting the pages in one at a time cannot keep a fast disk busy, several
+    // threads each reading a contiguous part of the file can.
+    const size_t page     = 4096;
+    const int  n_threads  = std::clamp(int(std::thread::hardware_concurrency()), 1, 8);
+    const size_t chunk    = (size/n_threads + page - 1)/page*page;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+        const size_t first = t*chunk;
+        const size_t last  = std::min(size, first + chunk);
+        threads.emplace_back([this, first, last, page] {
+            uint8_t sum = 0;
+            for (size_t i = first; i < last; i += page)
+                sum += addr[i];
+            volatile uint8_t sink = sum; // keeps the reads from being optimized out
+            (void) sink;
+        });
+    }
+    for (auto & thread : threads)
+        thread.join();
+}
+
+bool llm_mmap::load_tensor(struct ggml_tensor * tensor, std::istream & fin) {
+    const size_t offset = size_t(fin.tellg());
+    const size_t nbytes = ggml_nbytes(tensor);
+
+    if (addr && offset % LLM_MMAP_ALIGN == 0 && offset + nbytes <= size) {
+        tensor->data = addr + offset;
+        fin.seekg(nbytes, std::ios::cur);
+        return bool(fin);
+    }
+
+    if (!tensor->data) {
+        // as aligned as a mapped tensor would be, the SIMD kernels of ggml rely on it
+        m_copies.emplace_back(static_cast<uint8_t *>(::operator new(nbytes, std::align_val_t{LLM_MMAP_ALIGN})));
+        tensor->data = m_copies.back().get();
+    }
+    fin.read(reinterpret_cast<char *>(tensor->data), nbytes);
+    return bool(fin);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ggml_tensor;
+
+// The weights of a model, mapped read-only from its file where the layout allows it so they are paged
+// in from the page cache instead of copied, and processes using the same file share one copy of them.
+// Tensors whose data is not aligned in the file, or all of them when mapping is disabled or fails, are
+// read into memory of their own instead.
+struct llm_mmap {
+    bool enabled  = true;   // set before open()
+    bool prefault = false;  // read the whole file in with several threads when it is opened
+
+    uint8_t * addr = nullptr;
+    size_t    size = 0;
+
+    llm_mmap() = default;
+    ~llm_mmap();
+
+    llm_mmap(const llm_mmap &) = delete;
+    llm_mmap & operator=(const llm_mmap &) = delete;
+
+    // Maps fname. Returns false, and tensors are read instead, if it is not enabled or mapping failed.
+    bool open(const std::string & fname);
+
+    bool mapped() const { return addr != nullptr; }
+
+    // Points the tensor at its data, which starts at the current position of fin, and moves fin past
+    // it. The data is read from fin into the tensor's own memory, allocating it if the tensor has none,
+    // when it cannot be mapped.
+    bool load_tensor(struct ggml_tensor * tensor, std::istream & fin);
+
+private:
+    void prefault_pages() const;
+
+    // frees the memory of a copy with the alignment it was allocated with
+    struct copy_deleter {
+        void operator()(uint8_t * p) const;
+    };
+
+    std::vector<std::unique_ptr<uint8_t, copy_deleter>> m_copies;  // the tensors that could not be mapped
+};
@@ -2,7 +2,10 @@
 #include "mpt_impl.h"
 
 #include "utils.h"
+#include "sampler.h"
 #include "llmodel_shared.h"
+#include "mmap_file.h"
+#include "sysinfo.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -79,12 +82,15 @@ struct mpt_model {
     struct llm_kv_cache kv_self;
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+    llm_mmap mapping; // the weights, unless they had to be copied
 
 
     llm_buffer eval_buf;
     llm_buffer scr0_buf;
     llm_buffer scr1_buf;
 
+    LLModel::EvalStats stats;
+
     ~mpt_model() {
         if (ctx) {
             ggml_free(ctx);
@@ -95,7 +101,8 @@ struct mpt_model {
 static bool kv_cache_init(
         const struct mpt_hparams & hparams,
              struct llm_kv_cache & cache,
-                         ggml_type   wtype,
+                         ggml_type   ktype,
+                         ggml_type   vtype,
                                int   n_ctx) {
     const int n_embd  = hparams.n_embd;
     const int n_layer = hparams.n_layer;
@@ -103,7 +110,7 @@ static bool kv_cache_init(
     const int64_t n_mem      = (int64_t)n_layer*n_ctx;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+    cache.buf.resize(llm_row_size(ktype, n_elements) + llm_row_size(vtype, n_elements) + 2_MiB);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -117,8 +124,8 @@ static bool kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, ktype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, vtype, n_elements);
 
     return true;
 }
@@ -185,12 +192,10 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 special = true;
             }
 
-            if (len > 0) {
-                word.resize(len);
+            word.resize(len);
+            if (len > 0)
                 fin.read((char *) word.data(), len);
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
-            }
+            vocab.add_token(word);
 
             if(special) {
                 vocab.add_special_token(word);
@@ -258,17 +263,20 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
 
         const int64_t n_mem      = (int64_t)n_layer*model.hparams.n_ctx;
         const int64_t n_elements = n_embd*n_mem;
+        const ggml_type k_type   = llm_kv_cache_type(model.kv_self.kv_type, n_embd/model.hparams.n_head);
 
-        *mem_req += (2u*n_elements*ggml_type_size(wtype) + 2_MiB);
+        *mem_req += (llm_row_size(k_type, n_elements) + llm_row_size(GGML_TYPE_F16, n_elements) + 2_MiB);
         return false;
     }
 
-    // create the ggml context
+    // create the ggml context, which only holds the tensor headers when the weights are mapped
     {
+        const bool mapped = model.mapping.open(fname);
+        const size_t n_objs = size_t(5 + 10*model.hparams.n_layer);
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
+            .mem_size   = mapped ? n_objs*ggml_tensor_overhead() : ctx_size,
             .mem_buffer = NULL,
-            .no_alloc   = false,
+            .no_alloc   = mapped,
         };
 
         model.ctx = ggml_init(params);
@@ -321,14 +329,15 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
     // key + value memory
     {
         const auto & hparams = model.hparams;
-        if (!kv_cache_init(hparams, model.kv_self, GGML_TYPE_F16, model.hparams.n_ctx)) {
+        const ggml_type k_type = llm_kv_cache_type(model.kv_self.kv_type, hparams.n_embd/hparams.n_head);
+        if (!kv_cache_init(hparams, model.kv_self, k_type, GGML_TYPE_F16, model.hparams.n_ctx)) {
             fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
             ggml_free(ctx);
             return false;
         }
 
         const size_t memory_size = ggml_nbytes(model.kv_self.k) + ggml_nbytes(model.kv_self.v);
-        printf("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+        printf("%s: kv self size  = %7.2f MB (K %s)\n", __func__, memory_size / 1024.0 / 1024.0, ggml_type_name(k_type));
     }
 
     // load weights
@@ -391,7 +400,10 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (!model.mapping.load_tensor(tensor, fin)) {
+                fprintf(stderr, "%s: failed to read tensor '%s' from the model file\n", __func__, name.data());
+                return false;
+            }
 
             //printf("%42s - [%5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ttype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -404,6 +416,14 @@ bool mpt_model_load(const std::string &fname, std::istream &fin, mpt_model & mod
         printf(" done\n");
 
         printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size/1024.0/1024.0, n_tensors);
+
+        // with mapped weights a tensor the file does not have would have no data at all
+        for (const auto & [name, tensor] : model.tensors) {
+            if (!tensor->data) {
+                fprintf(stderr, "%s: tensor '%s' is missing from the model file\n", __func__, name.c_str());
+                return false;
+            }
+        }
     }
 
     model.scr0_buf.resize(256u * 1024 * 1024);
@@ -432,7 +452,9 @@ bool mpt_eval(
         const int n_past,
         const std::vector<int>           & embd_inp,
               std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+              size_t                     & mem_per_token,
+              bool                         logits_all = false,
+        const std::vector<int32_t>       & logits_rows = {}) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
@@ -444,8 +466,7 @@ bool mpt_eval(
     const int n_vocab = hparams.n_vocab;
 
     const size_t init_buf_size = 1024_MiB;
-    if (!model.eval_buf.addr || model.eval_buf.size < init_buf_size)
-        model.eval_buf.resize(init_buf_size);
+    model.stats.allocations += llm_buffer_reserve(model.eval_buf, init_buf_size);
 
     if (mem_per_token > 0 && mem_per_token*N > model.eval_buf.size) {
         const size_t buf_size_new = 1.1*(mem_per_token*N); // add 10% to account for ggml object overhead
@@ -453,6 +474,7 @@ bool mpt_eval(
 
         // reallocate
         model.eval_buf.resize(buf_size_new);
+        model.stats.allocations++;
         if (model.eval_buf.addr == nullptr) {
             fprintf(stderr, "%s: failed to allocate %zu bytes\n", __func__, model.eval_buf.size);
             return false;
@@ -472,6 +494,11 @@ bool mpt_eval(
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     memcpy(embd->data, embd_inp.data(), N*ggml_element_size(embd));
 
+    int n_out;
+    struct ggml_tensor * out_rows = llm_logits_rows(ctx0, N, logits_all, logits_rows, n_out);
+
+    const size_t k_row = llm_row_size(model.kv_self.k->type, n_embd);
+
     // wte
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte, embd);
 
@@ -502,7 +529,7 @@ bool mpt_eval(
             {
                 Vcur = ggml_transpose(ctx0, Vcur);
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, (ggml_element_size(model.kv_self.k)*n_embd)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, model.kv_self.k, N*n_embd, k_row*(il*n_ctx + n_past));
                 struct ggml_tensor * v = ggml_view_2d(ctx0, model.kv_self.v, N, n_embd,
                                         (   n_ctx)*ggml_element_size(model.kv_self.v),
                                         (il*n_ctx)*ggml_element_size(model.kv_self.v)*n_embd + n_past*ggml_element_size(model.kv_self.v));
@@ -519,7 +546,7 @@ bool mpt_eval(
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*ggml_element_size(model.kv_self.k)*n_embd),
+                            ggml_view_1d(ctx0, model.kv_self.k, (n_past + N)*n_embd, il*n_ctx*k_row),
                             n_embd/n_head, n_head, n_past + N),
                         0, 2, 1, 3);
 
@@ -596,7 +623,10 @@ bool mpt_eval(
     ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
 
     struct ggml_tensor * out = inpL;
-    // -> logits
+    // -> logits, only for the rows that are returned
+    if (out_rows) {
+        out = ggml_get_rows(ctx0, out, out_rows);
+    }
     {
         out = ggml_norm(ctx0, out);
         out = ggml_mul(ctx0,
@@ -612,9 +642,11 @@ bool mpt_eval(
     ggml_graph_compute       (ctx0, &gf);
 
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(out) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    if (embd_w.capacity() < size_t(n_vocab)*n_out) {
+        model.stats.allocations++;
+    }
+    embd_w.resize(n_vocab*n_out);
+    memcpy(embd_w.data(), (float *) ggml_get_data(out), sizeof(float)*n_vocab*n_out);
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
@@ -623,117 +655,29 @@ bool mpt_eval(
 
     ggml_free(ctx0);
 
+    model.kv_self.n[0] = n_past + N;
+    model.stats.evals++;
+    model.stats.tokens += N;
     return true;
 }
 
 
-#define MPT_MAX_RNG_STATE 64*1024
-
-size_t mpt_get_state_size(const mpt_model &model)
+// the state is a record of the KV rows that are in use, see llm_state_write()
+static bool mpt_write_state(const mpt_model &model, const std::mt19937 &rng, int since,
+                              const LLModel::StateWriter &write)
 {
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = MPT_MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    fflush(stdout);
-    return s_total;
-}
-
-size_t mpt_copy_state_data(const mpt_model &model, const std::mt19937 &rng, uint8_t *dest)
-{
-    uint8_t * out = dest;
-    fflush(stdout);
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
-
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[MPT_MAX_RNG_STATE];
-
-        memset(&rng_buf[0], 0, MPT_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
-
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], MPT_MAX_RNG_STATE); out += MPT_MAX_RNG_STATE;
-    }
-
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
-        }
-    }
-
-    const size_t written  = out - dest;
-    assert(written == mpt_get_state_size(model));
-    fflush(stdout);
-    return written;
+    const auto & hparams = model.hparams;
+    return llm_state_write(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+        true, 0, rng, since, write);
 }
 
-size_t mpt_set_state_data(mpt_model *model, std::mt19937 *rng, const uint8_t *src)
+static bool mpt_read_state(mpt_model &model, std::mt19937 &rng, const LLModel::StateReader &read)
 {
-    const uint8_t * in = src;
-
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[MPT_MAX_RNG_STATE];
-
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, MPT_MAX_RNG_STATE); in += MPT_MAX_RNG_STATE;
-
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
-
-        assert(rng_ss.fail() == false);
-    }
-
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
-
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
-
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
-
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
-
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
-
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
-
-        }
-
-        model->kv_self.n = kv_ntok;
-    }
-
-    const size_t nread    = in - src;
-    assert(nread == mpt_get_state_size(*model));
-    fflush(stdout);
-    return nread;
+    const auto & hparams = model.hparams;
+    if (!llm_state_read(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+            true, 0, rng, read))
+        return false;
+    return true;
 }
 
 struct MPTPrivate {
@@ -744,6 +688,7 @@ struct MPTPrivate {
     int64_t n_threads = 0;
     size_t mem_per_token = 0;
     std::mt19937 rng;
+    llm_sampler sampler;
     bool has_im_end = false;
 };
 
@@ -758,6 +703,7 @@ size_t MPT::requiredMem(const std::string &modelPath) {
     mpt_model dummy_model;
     gpt_vocab dummy_vocab;
     size_t mem_req;
+    dummy_model.kv_self.kv_type = m_loadOptions.kv_type;
     auto fin = std::ifstream(modelPath, std::ios::binary);
     mpt_model_load(modelPath, fin, dummy_model, dummy_vocab, &mem_req);
     return mem_req;
@@ -767,6 +713,9 @@ bool MPT::loadModel(const std::string &modelPath) {
     std::mt19937 rng(time(NULL));
     d_ptr->rng = rng;
 
+    d_ptr->model->kv_self.kv_type = m_loadOptions.kv_type;
+    d_ptr->model->mapping.enabled = m_loadOptions.use_mmap;
+    d_ptr->model->mapping.prefault = m_loadOptions.prefault;
     auto fin = std::ifstream(modelPath, std::ios::binary);
 
     // load the model
@@ -775,9 +724,9 @@ bool MPT::loadModel(const std::string &modelPath) {
         return false;
     }
 
-    d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads = getPhysicalCoreCount();
     d_ptr->modelLoaded = true;
-    d_ptr->has_im_end = d_ptr->vocab.token_to_id.find("<|im_end|>") != d_ptr->vocab.token_to_id.end();
+    d_ptr->has_im_end = d_ptr->vocab.find("<|im_end|>") >= 0;
     fflush(stdout);
     return true;
 }
@@ -803,17 +752,27 @@ bool MPT::isModelLoaded() const
 
 size_t MPT::stateSize() const
 {
-    return mpt_get_state_size(*d_ptr->model);
+    return streamedStateSize();
 }
 
 size_t MPT::saveState(uint8_t *dest) const
 {
-    return mpt_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
+    return saveStreamedState(dest);
 }
 
 size_t MPT::restoreState(const uint8_t *src)
 {
-    return mpt_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return restoreStreamedState(src);
+}
+
+bool MPT::writeState(const StateWriter &write, int32_t since) const
+{
+    return mpt_write_state(*d_ptr->model, d_ptr->rng, since, write);
+}
+
+bool MPT::readState(const StateReader &read)
+{
+    return mpt_read_state(*d_ptr->model, d_ptr->rng, read);
 }
 
 std::vector<LLModel::Token> MPT::tokenize(PromptContext &, const std::string &str) const
@@ -821,21 +780,14 @@ std::vector<LLModel::Token> MPT::tokenize(PromptContext &, const std::string &st
     return ::gpt_tokenize(d_ptr->vocab, str);
 }
 
-std::string MPT::tokenToString(Token id) const
+std::string_view MPT::tokenToString(Token id) const
 {
-    return d_ptr->vocab.id_to_token[id];
+    return d_ptr->vocab.piece(id);
 }
 
 LLModel::Token MPT::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks,
-        promptCtx.logits,
-        promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty,
-        d_ptr->rng);
+    return d_ptr->sampler.sample(promptCtx, promptCtx.logits.data(), d_ptr->model->hparams.n_vocab, d_ptr->rng);
 }
 
 bool MPT::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
@@ -848,7 +800,33 @@ bool MPT::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) con
         initialized = true;
     }
 
-    return mpt_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+    return mpt_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token,
+        ctx.logits_all, ctx.logits_rows);
+}
+
+LLModel::EvalStats MPT::evalStats() const
+{
+    return d_ptr->model->stats;
+}
+
+size_t MPT::kvCacheUsed() const
+{
+    const auto & hparams = d_ptr->model->hparams;
+    return llm_kv_cache_used(d_ptr->model->kv_self, hparams.n_layer, hparams.n_embd);
+}
+
+void MPT::resetEvalStats()
+{
+    d_ptr->model->stats = EvalStats();
+}
+
+bool MPT::shiftContext(int32_t n_keep, int32_t n_discard, int32_t n_past)
+{
+    // ALiBi only depends on the distance between positions so the rows can simply be moved
+    const auto & hparams = d_ptr->model->hparams;
+    llm_kv_cache_shift(d_ptr->model->kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd, 0,
+        n_keep, n_discard, n_past, true);
+    return true;
 }
 
 int32_t MPT::contextLength() const
@@ -858,7 +836,7 @@ int32_t MPT::contextLength() const
 
 const std::vector<LLModel::Token> &MPT::endTokens() const
 {
-    static const std::vector<LLModel::Token> fres = {0, d_ptr->vocab.token_to_id["<|im_end|>"]};
+    static const std::vector<LLModel::Token> fres = {0, std::max(0, d_ptr->vocab.find("<|im_end|>"))};
     return fres;
 }
 
@@ -2,8 +2,13 @@
 #include "replit_impl.h"
 
 #include "utils.h"
+#include "sampler.h"
 #include "llmodel_shared.h"
+#include "mmap_file.h"
+#include "sysinfo.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
@@ -13,6 +18,7 @@
 #include <sstream>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <stdint.h>
 #include <string>
@@ -43,67 +49,147 @@ IMPORTANT: This model backend and convert script were developed for the original
 Replit model (hugginface commit hash: 9eceafb041eb8abd565dabfbfadd328869140011)
 */
 
-using piece_t = std::pair<std::size_t, float>;
-using piece_map_t = std::unordered_map<std::string, piece_t>;
-
 namespace {
 const char *modelType_ = "Replit";
 
 const std::string ws_symbol = "\342\226\201";
 }
 
+std::string replace_all(const std::string & str,    // where to work
+                        const std::string & find,   // substitute 'find'
+                        const std::string & replace //      by 'replace'
+) {
+    std::string result;
+    size_t find_len = find.size();
+    size_t pos, from = 0;
+    while (std::string::npos != (pos = str.find(find, from))) {
+        result.append(str, from, pos - from);
+        result.append(replace);
+        from = pos + find_len;
+    }
+    result.append(str, from, std::string::npos);
+    return result;
+}
+
+// The pieces of the vocabulary as a byte trie. The edges of a node are contiguous in 'edges' and
+// sorted by byte, except for the root which has a table for every byte.
+struct replit_piece_trie {
+    struct node {
+        LLModel::Token id = -1;         // the piece ending here, -1 if none
+        float cost = 0.0f;              // negated score of that piece
+        uint32_t first_edge = 0;
+        uint32_t n_edges = 0;
+    };
+    struct edge {
+        unsigned char byte;
+        int32_t child;
+    };
+
+    std::vector<node> nodes;
+    std::vector<edge> edges;
+    std::array<int32_t, 256> root{};
+
+    int32_t child(int32_t n, unsigned char byte) const {
+        if (n == 0) return root[byte];
+        const edge *e = edges.data() + nodes[n].first_edge;
+        const edge *end = e + nodes[n].n_edges;
+        for (; e != end && e->byte <= byte; ++e) {
+            if (e->byte == byte) return e->child;
+        }
+        return 0;
+    }
+
+    void build(const std::vector<std::string> & pieces, const std::vector<float> & scores);
+};
+
+void replit_piece_trie::build(const std::vector<std::string> & pieces, const std::vector<float> & scores) {
+    // children as lists while building, flattened into 'edges' at the end
+    std::vector<std::vector<edge>> children(1);
+    nodes.assign(1, node());
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        const std::string & piece = pieces[i];
+        if (piece.empty()) continue;
+        int32_t n = 0;
+        for (const char c : piece) {
+            auto & out = children[n];
+            auto it = std::find_if(out.begin(), out.end(), [&](const edge & e) { return e.byte == (unsigned char) c; });
+            if (it != out.end()) {
+                n = it->child;
+                continue;
+            }
+            const int32_t next = int32_t(nodes.size());
+            out.push_back({ (unsigned char) c, next });
+            nodes.emplace_back();
+            children.emplace_back();
+            n = next;
+        }
+        nodes[n].id = LLModel::Token(i);
+        nodes[n].cost = -scores[i];
+    }
+
+    edges.clear();
+    root.fill(0);
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        auto & out = children[n];
+        std::sort(out.begin(), out.end(), [](const edge & a, const edge & b) { return a.byte < b.byte; });
+        nodes[n].first_edge = uint32_t(edges.size());
+        nodes[n].n_edges = uint32_t(out.size());
+        edges.insert(edges.end(), out.begin(), out.end());
+    }
+    for (const edge & e : children[0])
+        root[e.byte] = e.child;
+}
+
 struct replit_tokenizer {
     gpt_vocab raw_vocab;
-    piece_map_t piece_map;
-    std::vector<std::string> vocab;
+    replit_piece_trie trie;
+    std::vector<std::string> vocab; // by id, with the whitespace symbol already turned back into spaces
 };
 
-std::pair<std::vector<LLModel::Token>, float> encode_word(const std::string & word, const piece_map_t & model) {
-    std::vector<int> best_segmentations_starts(word.length() + 1, -1);
-    best_segmentations_starts[0] = 0;
-
-    std::vector<float> best_segmentations_scores(word.length() + 1, -std::numeric_limits<float>::infinity());
-    best_segmentations_scores[0] = 1.0;
-
-    for (size_t start_idx = 0; start_idx < word.length(); ++start_idx) {
-        float best_score_at_start = best_segmentations_scores[start_idx];
-        for (size_t end_idx = start_idx + 1; end_idx <= word.length(); ++end_idx) {
-            std::string token = word.substr(start_idx, end_idx - start_idx);
-            if (model.count(token) && best_score_at_start != -std::numeric_limits<float>::infinity()) {
-                float token_score = model.at(token).second;
-                float score = token_score + best_score_at_start;
-                if (best_segmentations_scores[end_idx] == -std::numeric_limits<float>::infinity() ||
-                    best_segmentations_scores[end_idx] > score) {
-                    best_segmentations_starts[end_idx] = start_idx;
-                    best_segmentations_scores[end_idx] = score;
-                }
+// Unigram segmentation of 'word' of the lowest total cost. Only the pieces that start at a position
+// are visited, by walking the trie from there, so this is linear in the length of the word.
+std::vector<LLModel::Token> encode_word(const std::string & word, const replit_piece_trie & trie) {
+    const size_t n = word.length();
+    const float inf = std::numeric_limits<float>::infinity();
+    std::vector<size_t> best_starts(n + 1, 0);
+    std::vector<LLModel::Token> best_ids(n + 1, 0);
+    std::vector<float> best_costs(n + 1, inf);
+    best_costs[0] = 1.0f;
+
+    for (size_t start = 0; start < n; ++start) {
+        const float cost_at_start = best_costs[start];
+        if (cost_at_start == inf) continue;
+        int32_t node = 0;
+        for (size_t end = start + 1; end <= n; ++end) {
+            node = trie.child(node, word[end - 1]);
+            if (!node) break;
+            const auto & piece = trie.nodes[node];
+            if (piece.id < 0) continue;
+            const float cost = piece.cost + cost_at_start;
+            if (best_costs[end] == inf || best_costs[end] > cost) {
+                best_starts[end] = start;
+                best_ids[end] = piece.id;
+                best_costs[end] = cost;
             }
         }
     }
 
-    if (best_segmentations_scores.back() == -std::numeric_limits<float>::infinity()) {
-        return std::make_pair(std::vector<LLModel::Token>{0}, 0.0f);
+    if (best_costs.back() == inf) {
+        return {0};
     }
 
-    float score = best_segmentations_scores.back();
-    int start = best_segmentations_starts.back();
-    int end = word.length();
     std::vector<LLModel::Token> tokens;
-    while (start != 0) {
-        const auto token_id = model.at(word.substr(start, end - start)).first;
-        tokens.insert(tokens.begin(), token_id);
-        int next_start = best_segmentations_starts[start];
-        end = start;
-        start = next_start;
-    }
-    const auto token_id = model.at(word.substr(start, end - start)).first;
-    tokens.insert(tokens.begin(), token_id);
-    return std::make_pair(tokens, score);
+    for (size_t end = n; end > 0; end = best_starts[end])
+        tokens.push_back(best_ids[end]);
+    std::reverse(tokens.begin(), tokens.end());
+    return tokens;
 }
 
 bool replit_tokenizer_load(replit_tokenizer & tokenizer, std::istream & fin, int max_vocab_size) {
     std::string word;
     std::vector<char> buf(128);
+    std::vector<std::string> pieces(max_vocab_size);
+    std::vector<float> scores(max_vocab_size);
 
     for (LLModel::Token i = 0; i < max_vocab_size; i++) {
         uint32_t len;
@@ -116,44 +202,27 @@ bool replit_tokenizer_load(replit_tokenizer & tokenizer, std::istream & fin, int
         float score;
         fin.read((char *)&score, sizeof(score));
 
-        tokenizer.piece_map[word] = std::make_pair(i, -score);
-        tokenizer.raw_vocab.id_to_token[i] = word;
-        tokenizer.raw_vocab.token_to_id[word] = i;
+        pieces[i] = word;
+        scores[i] = score;
+        tokenizer.raw_vocab.add_token(word);
     }
 
+    tokenizer.trie.build(pieces, scores);
+    tokenizer.vocab.resize(max_vocab_size);
+    for (int i = 0; i < max_vocab_size; i++)
+        tokenizer.vocab[i] = replace_all(pieces[i], ws_symbol, " ");
     return true;
 }
 
-std::string replace_all(const std::string & str,    // where to work
-                        const std::string & find,   // substitute 'find'
-                        const std::string & replace //      by 'replace'
-) {
-    std::string result;
-    size_t find_len = find.size();
-    size_t pos, from = 0;
-    while (std::string::npos != (pos = str.find(find, from))) {
-        result.append(str, from, pos - from);
-        result.append(replace);
-        from = pos + find_len;
-    }
-    result.append(str, from, std::string::npos);
-    return result;
-}
-
 std::vector<LLModel::Token> replit_tokenizer_tokenize(replit_tokenizer & tokenizer, const std::string & text) {
-    std::vector<LLModel::Token> tokens;
     auto normalized_text = replace_all(text, " ", ws_symbol);
-    auto tokenized = encode_word(normalized_text, tokenizer.piece_map);
-
-    return tokenized.first;
+    return encode_word(normalized_text, tokenizer.trie);
 }
 
-std::string replit_tokenizer_detokenize(replit_tokenizer & tokenizer, const std::vector<LLModel::Token> & tokens) {
-    std::string text;
-    for (auto token : tokens) {
-        text += tokenizer.raw_vocab.id_to_token[token];
-    }
-    return replace_all(text, ws_symbol, " ");
+std::string_view replit_tokenizer_detokenize(const replit_tokenizer & tokenizer, LLModel::Token token) {
+    if (token < 0 || size_t(token) >= tokenizer.vocab.size())
+        return std::string_view();
+    return tokenizer.vocab[token];
 }
 
 // no defaults for now
@@ -199,10 +268,13 @@ struct replit_model {
     llm_buffer work_buf;
     llm_buffer scr0_buf;
     llm_buffer scr1_buf;
+
+    LLModel::EvalStats stats;
     #ifdef GGML_USE_METAL
     struct ggml_metal_context * ctx_metal;
     #endif
     std::map<std::string, struct ggml_tensor *> tensors;
+    llm_mmap mapping; // the weights, unless they had to be copied
 };
 
 static bool kv_cache_init(
@@ -333,12 +405,17 @@ bool replit_model_load(const std::string & fname, std::istream &fin, replit_mode
         return false;
     }
 
-    // create the ggml context
+    // create the ggml context, which only holds the tensor headers when the weights are mapped
     {
+#ifdef GGML_USE_METAL
+        model.mapping.enabled = false; // metal is handed the weights as the one buffer of the context
+#endif
+        const bool mapped = model.mapping.open(fname);
+        const size_t n_objs = size_t(2 + 6*model.hparams.n_layer);
         struct ggml_init_params params = {
-            .mem_size = ctx_size,
+            .mem_size = mapped ? n_objs*ggml_tensor_overhead() : ctx_size,
             .mem_buffer = NULL,
-            .no_alloc = false,
+            .no_alloc = mapped,
         };
 
         model.ctx = ggml_init(params);
@@ -472,7 +549,10 @@ bool replit_model_load(const std::string & fname, std::istream &fin, replit_mode
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (!model.mapping.load_tensor(tensor, fin)) {
+                fprintf(stderr, "%s: failed to read tensor '%s' from the model file\n", __func__, name.data());
+                return false;
+            }
 
             total_size += ggml_nbytes(tensor);
             if (++n_tensors % 8 == 0) {
@@ -484,6 +564,14 @@ bool replit_model_load(const std::string & fname, std::istream &fin, replit_mode
         printf(" done\n");
 
         printf("%s: model size = %8.2f MB / num tensors = %d\n", __func__, total_size / 1024.0 / 1024.0, n_tensors);
+
+        // with mapped weights a tensor the file does not have would have no data at all
+        for (const auto & [name, tensor] : model.tensors) {
+            if (!tensor->data) {
+                fprintf(stderr, "%s: tensor '%s' is missing from the model file\n", __func__, name.c_str());
+                return false;
+            }
+        }
     }
 
    model.eval_buf.resize(512u * 1024 * 1024);
@@ -534,9 +622,12 @@ bool replit_model_load(const std::string & fname, replit_model & model, replit_t
 //   - n_past:    the context size so far
 //   - embd_inp:  the embeddings of the tokens in the context
 //   - embd_w:    the predicted logits for the next token
+//   - logits_all: return the logits of every input token instead of only the last one
+//   - logits_rows: otherwise, when not empty, the positions among the input tokens to return the logits of
 //
 bool replit_eval(replit_model & model, const int n_threads, const int n_past,
-                 const std::vector<gpt_vocab::id> & embd_inp, std::vector<float> & embd_w, size_t & mem_per_token) {
+                 const std::vector<gpt_vocab::id> & embd_inp, std::vector<float> & embd_w, size_t & mem_per_token,
+                 bool logits_all = false, const std::vector<int32_t> & logits_rows = {}) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
@@ -558,6 +649,9 @@ bool replit_eval(replit_model & model, const int n_threads, const int n_past,
     struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     memcpy(embd->data, embd_inp.data(), N * ggml_element_size(embd));
 
+    int n_out;
+    struct ggml_tensor * out_rows = llm_logits_rows(ctx0, N, logits_all, logits_rows, n_out);
+
     struct ggml_tensor * inpL = ggml_get_rows(ctx0, model.wte_weight, embd);
 
     for (int il = 0; il < n_layer; ++il) {
@@ -680,6 +774,10 @@ bool replit_eval(replit_model & model, const int n_threads, const int n_past,
         inpL = ggml_add(ctx0, inpL, cur);
     }
     ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
+    // the norm and the output embedding only for the rows that are returned
+    if (out_rows) {
+        inpL = ggml_get_rows(ctx0, inpL, out_rows);
+    }
     // norm
     {
         inpL = ggml_norm(ctx0, inpL);
@@ -707,10 +805,10 @@ bool replit_eval(replit_model & model, const int n_threads, const int n_past,
         ggml_metal_get_tensor(model.ctx_metal, model.kv_self.k);
         ggml_metal_get_tensor(model.ctx_metal, model.kv_self.v);
 
-        ggml_graph_compute_g4a(model.work_buf, &gf, n_threads);
+        ggml_graph_compute_g4a(model.work_buf, &gf, n_threads, &model.stats.allocations);
     }
 #else
-    ggml_graph_compute_g4a(model.work_buf, &gf, n_threads);
+    ggml_graph_compute_g4a(model.work_buf, &gf, n_threads, &model.stats.allocations);
 #endif
 
     // std::cout << "Qcur" << std::endl;
@@ -721,9 +819,11 @@ bool replit_eval(replit_model & model, const int n_threads, const int n_past,
     // ggml_graph_dump_dot(&gf, NULL, "replit-model.dot");
     // }
 
-    // return result for just the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *)ggml_get_data(inpL) + (n_vocab * (N - 1)), sizeof(float) * n_vocab);
+    if (embd_w.capacity() < size_t(n_vocab)*n_out) {
+        model.stats.allocations++;
+    }
+    embd_w.resize(n_vocab * n_out);
+    memcpy(embd_w.data(), (float *)ggml_get_data(inpL), sizeof(float) * n_vocab * n_out);
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0) / N;
@@ -732,119 +832,29 @@ bool replit_eval(replit_model & model, const int n_threads, const int n_past,
 
     ggml_free(ctx0);
 
+    model.kv_self.n[0] = n_past + N;
+    model.stats.evals++;
+    model.stats.tokens += N;
     return true;
 }
 
 
-#define REPLIT_MAX_RNG_STATE 64*1024
-
-size_t replit_get_state_size(const replit_model &model)
-{
-    // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
-    // for reference, std::mt19937(1337) serializes to 6701 bytes.
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = REPLIT_MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    fflush(stdout);
-    return s_total;
-}
-
-size_t replit_copy_state_data(const replit_model &model, const std::mt19937 &rng, uint8_t *dest)
+// the state is a record of the KV rows that are in use, see llm_state_write()
+static bool replit_write_state(const replit_model &model, const std::mt19937 &rng, int since,
+                              const LLModel::StateWriter &write)
 {
-    uint8_t * out = dest;
-    fflush(stdout);
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
-
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[REPLIT_MAX_RNG_STATE];
-
-        memset(&rng_buf[0], 0, REPLIT_MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
-
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], REPLIT_MAX_RNG_STATE); out += REPLIT_MAX_RNG_STATE;
-    }
-
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
-        }
-    }
-
-    const size_t written  = out - dest;
-    const size_t expected [[maybe_unused]] = replit_get_state_size(model);
-    assert(written == expected);
-    fflush(stdout);
-    return written;
+    const auto & hparams = model.hparams;
+    return llm_state_write(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+        false, 0, rng, since, write);
 }
 
-size_t replit_set_state_data(replit_model *model, std::mt19937 *rng, const uint8_t *src)
+static bool replit_read_state(replit_model &model, std::mt19937 &rng, const LLModel::StateReader &read)
 {
-    const uint8_t * in = src;
-
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[REPLIT_MAX_RNG_STATE];
-
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, REPLIT_MAX_RNG_STATE); in += REPLIT_MAX_RNG_STATE;
-
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
-
-        assert(rng_ss.fail() == false);
-    }
-
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
-
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
-
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
-
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
-
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
-
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
-
-        }
-
-        model->kv_self.n = kv_ntok;
-    }
-
-    const size_t nread    = in - src;
-    const size_t expected [[maybe_unused]] = replit_get_state_size(*model);
-    assert(nread == expected);
-    fflush(stdout);
-    return nread;
+    const auto & hparams = model.hparams;
+    if (!llm_state_read(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+            false, 0, rng, read))
+        return false;
+    return true;
 }
 
 struct ReplitPrivate {
@@ -855,6 +865,7 @@ struct ReplitPrivate {
     int64_t n_threads = 0;
     size_t mem_per_token = 0;
     std::mt19937 rng;
+    llm_sampler sampler;
     bool has_end_of_text = false;
 };
 
@@ -879,6 +890,8 @@ bool Replit::loadModel(const std::string &modelPath) {
     std::mt19937 rng(time(NULL));
     d_ptr->rng = rng;
 
+    d_ptr->model->mapping.enabled = m_loadOptions.use_mmap;
+    d_ptr->model->mapping.prefault = m_loadOptions.prefault;
     auto fin = std::ifstream(modelPath, std::ios::binary);
 
     // load the model
@@ -887,9 +900,9 @@ bool Replit::loadModel(const std::string &modelPath) {
         return false;
     }
 
-    d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads = getPhysicalCoreCount();
     d_ptr->modelLoaded = true;
-    d_ptr->has_end_of_text = d_ptr->vocab.raw_vocab.token_to_id.find("<|endoftext|>") != d_ptr->vocab.raw_vocab.token_to_id.end();
+    d_ptr->has_end_of_text = d_ptr->vocab.raw_vocab.find("<|endoftext|>") >= 0;
     fflush(stdout);
     return true;
 }
@@ -924,17 +937,27 @@ bool Replit::isModelLoaded() const
 
 size_t Replit::stateSize() const
 {
-    return replit_get_state_size(*d_ptr->model);
+    return streamedStateSize();
 }
 
 size_t Replit::saveState(uint8_t *dest) const
 {
-    return replit_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
+    return saveStreamedState(dest);
 }
 
 size_t Replit::restoreState(const uint8_t *src)
 {
-    return replit_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return restoreStreamedState(src);
+}
+
+bool Replit::writeState(const StateWriter &write, int32_t since) const
+{
+    return replit_write_state(*d_ptr->model, d_ptr->rng, since, write);
+}
+
+bool Replit::readState(const StateReader &read)
+{
+    return replit_read_state(*d_ptr->model, d_ptr->rng, read);
 }
 
 std::vector<LLModel::Token> Replit::tokenize(PromptContext &, const std::string &str) const
@@ -942,26 +965,45 @@ std::vector<LLModel::Token> Replit::tokenize(PromptContext &, const std::string
     return replit_tokenizer_tokenize(d_ptr->vocab, str);
 }
 
-std::string Replit::tokenToString(LLModel::Token id) const
+std::string_view Replit::tokenToString(LLModel::Token id) const
 {
-    return replit_tokenizer_detokenize(d_ptr->vocab, {id});
+    return replit_tokenizer_detokenize(d_ptr->vocab, id);
 }
 
 LLModel::Token Replit::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks,
-        promptCtx.logits,
-        promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty,
-        d_ptr->rng);
+    return d_ptr->sampler.sample(promptCtx, promptCtx.logits.data(), d_ptr->model->hparams.n_vocab, d_ptr->rng);
 }
 
 bool Replit::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
 {
-    return replit_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+    return replit_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token,
+        ctx.logits_all, ctx.logits_rows);
+}
+
+LLModel::EvalStats Replit::evalStats() const
+{
+    return d_ptr->model->stats;
+}
+
+size_t Replit::kvCacheUsed() const
+{
+    const auto & hparams = d_ptr->model->hparams;
+    return llm_kv_cache_used(d_ptr->model->kv_self, hparams.n_layer, hparams.n_embd);
+}
+
+void Replit::resetEvalStats()
+{
+    d_ptr->model->stats = EvalStats();
+}
+
+bool Replit::shiftContext(int32_t n_keep, int32_t n_discard, int32_t n_past)
+{
+    // ALiBi only depends on the distance between positions so the rows can simply be moved
+    const auto & hparams = d_ptr->model->hparams;
+    llm_kv_cache_shift(d_ptr->model->kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd, 0,
+        n_keep, n_discard, n_past, false);
+    return true;
 }
 
 int32_t Replit::contextLength() const
@@ -971,7 +1013,7 @@ int32_t Replit::contextLength() const
 
 const std::vector<LLModel::Token> &Replit::endTokens() const
 {
-    static const std::vector<LLModel::Token> fres = {0, d_ptr->vocab.raw_vocab.token_to_id["<|endoftext|>"]};
+    static const std::vector<LLModel::Token> fres = {0, std::max(0, d_ptr->vocab.raw_vocab.find("<|endoftext|>"))};
     return fres;
 }
 
@@ -0,0 +1,218 @@
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LLM_SAMPLER_AVX_DISPATCH
+#endif
+
+using candidate = llm_sampler::candidate;
+
+namespace {
+
+bool by_logit(const candidate & a, const candidate & b) {
+    return a.logit > b.logit;
+}
+
+// Collects the tokens whose logit is above a threshold into a buffer. Whenever the buffer is full only
+// its k best are kept and the threshold is raised to the worst of them, so after a few thousand
+// tokens almost all of the vocabulary is rejected by a single comparison.
+struct top_k_collector {
+    std::vector<candidate> & cand;
+    const uint64_t * skip;      // tokens that were added up front with their penalized logit
+    size_t k;
+    size_t cap;
+    float threshold = -std::numeric_limits<float>::infinity();
+
+    void shrink() {
+        std::nth_element(cand.begin(), cand.begin() + (k - 1), cand.end(), by_logit);
+        cand.resize(k);
+        threshold = cand[k - 1].logit;
+    }
+
+    void push(const float * logits, size_t i) {
+        if (logits[i] <= threshold || (skip && (skip[i/64] >> (i%64) & 1)))
+            return;
+        cand.push_back({ logits[i], int32_t(i) });
+        if (cand.size() >= cap)
+            shrink();
+    }
+
+    void scan(const float * logits, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+            push(logits, i);
+    }
+
+#ifdef LLM_SAMPLER_AVX_DISPATCH
+    // compares eight logits at a time against the threshold, only the few that pass are looked at
+    __attribute__((target("avx")))
+    size_t scan_avx(const float * logits, size_t n) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const __m256 v = _mm256_loadu_ps(logits + i);
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(threshold), _CMP_GT_OQ));
+            while (mask) {
+                push(logits, i + __builtin_ctz(mask));
+                mask &= mask - 1;
+            }
+        }
+        return i;
+    }
+#endif
+};
+
+#ifdef LLM_SAMPLER_AVX_DISPATCH
+const bool has_avx = __builtin_cpu_supports("avx");
+#endif
+
+} // namespace
+
+llm_sampler_params llm_sampler::params_from(const LLModel::PromptContext & ctx) {
+    llm_sampler_params params;
+    params.top_k          = ctx.top_k;
+    params.top_p          = ctx.top_p;
+    params.min_p          = ctx.min_p;
+    params.typical_p      = ctx.typical_p;
+    params.temp           = ctx.temp;
+    params.repeat_penalty = ctx.repeat_penalty;
+    return params;
+}
+
+int32_t llm_sampler::sample(const LLModel::PromptContext & ctx, const float * logits, size_t n_vocab, std::mt19937 & rng) {
+    const size_t n_last = std::min(size_t(std::max(ctx.repeat_last_n, 0)), ctx.tokens.size());
+    return sample(logits, n_vocab, ctx.tokens.data() + ctx.tokens.size() - n_last, n_last, params_from(ctx), rng);
+}
+
+void llm_sampler::select_top_k(const float * logits, size_t n_vocab, const int32_t * last_n_tokens, size_t n_last,
+                               float repeat_penalty, size_t k) {
+    m_candidates.clear();
+    top_k_collector collector { m_candidates, nullptr, k, std::max<size_t>(4*k, 512) };
+    m_candidates.reserve(collector.cap + n_last);
+
+    // The penalized tokens go in first with their penalized logit and are skipped by the scan. This
+    // handles any penalty, even one that makes them more likely, at the cost of one bit per token.
+    if (repeat_penalty != 1.0f && n_last > 0) {
+        m_penalized.resize((n_vocab + 63)/64);
+        for (size_t i = 0; i < n_last; ++i) {
+            const int32_t id = last_n_tokens[i];
+            if (id < 0 || size_t(id) >= n_vocab || (m_penalized[id/64] >> (id%64) & 1))
+                continue;
+            m_penalized[id/64] |= uint64_t(1) << (id%64);
+            const float l = logits[id];
+            m_candidates.push_back({ l < 0.0f ? l*repeat_penalty : l/repeat_penalty, id });
+        }
+        collector.skip = m_penalized.data();
+        if (m_candidates.size() >= collector.cap)
+            collector.shrink();
+    }
+
+    size_t i = 0;
+#ifdef LLM_SAMPLER_AVX_DISPATCH
+    if (has_avx)
+        i = collector.scan_avx(logits, n_vocab);
+#endif
+    collector.scan(logits, i, n_vocab);
+
+    // clear only the bits we set so the bitset never has to be cleared as a whole
+    if (collector.skip) {
+        for (size_t j = 0; j < n_last; ++j) {
+            const int32_t id = last_n_tokens[j];
+            if (id >= 0 && size_t(id) < n_vocab)
+                m_penalized[id/64] &= ~(uint64_t(1) << (id%64));
+        }
+    }
+
+    if (m_candidates.size() > k)
+        collector.shrink();
+    std::sort(m_candidates.begin(), m_candidates.end(), by_logit);
+}
+
+int32_t llm_sampler::sample(const float * logits, size_t n_vocab, const int32_t * last_n_tokens, size_t n_last,
+                            const llm_sampler_params & params, std::mt19937 & rng) {
+    if (n_vocab == 0)
+        return 0;
+
+    const bool greedy = params.temp <= 0.0f;
+    const size_t k = greedy ? 1 : params.top_k <= 0 ? n_vocab : std::min(size_t(params.top_k), n_vocab);
+    select_top_k(logits, n_vocab, last_n_tokens, n_last, params.repeat_penalty, k);
+    if (m_candidates.empty())
+        return 0;
+    if (greedy || m_candidates.size() == 1)
+        return m_candidates.front().id;
+
+    // compute probs for the top K tokens, they are sorted so the first one has the largest logit
+    const float scale = 1.0f/params.temp;
+    const float maxl = m_candidates.front().logit;
+    size_t n = m_candidates.size();
+    m_probs.resize(n);
+
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        m_probs[i] = std::exp((m_candidates[i].logit - maxl)*scale);
+        sum += m_probs[i];
+    }
+    for (size_t i = 0; i < n; ++i)
+        m_probs[i] /= sum;
+
+    if (params.top_p < 1.0f) {
+        float cumsum = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            cumsum += m_probs[i];
+            if (cumsum >= params.top_p) {
+                n = i + 1;
+                break;
+            }
+        }
+    }
+
+    if (params.min_p > 0.0f) {
+        const float min_prob = params.min_p*m_probs[0];
+        size_t i = 1;
+        while (i < n && m_probs[i] >= min_prob)
+            ++i;
+        n = i;
+    }
+
+    // the candidates to sample from, as indices into m_probs
+    m_order.resize(n);
+    for (size_t i = 0; i < n; ++i)
+        m_order[i] = int32_t(i);
+
+    if (params.typical_p < 1.0f && n > 1) {
+        // keep the tokens whose surprise is closest to the entropy of the distribution
+        float total = 0.0f;
+        for (size_t i = 0; i < n; ++i)
+            total += m_probs[i];
+        float entropy = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            const float p = m_probs[i]/total;
+            entropy -= p*std::log(p);
+        }
+        const auto distance = [&](int32_t i) { return std::abs(-std::log(m_probs[i]/total) - entropy); };
+        std::sort(m_order.begin(), m_order.end(), [&](int32_t a, int32_t b) { return distance(a) < distance(b); });
+
+        float cumsum = 0.0f;
+        for (size_t i = 0; i < n; ++i) {
+            cumsum += m_probs[m_order[i]]/total;
+            if (cumsum >= params.typical_p) {
+                m_order.resize(i + 1);
+                break;
+            }
+        }
+    }
+
+    float total = 0.0f;
+    for (int32_t i : m_order)
+        total += m_probs[i];
+
+    float r = std::uniform_real_distribution<float>(0.0f, total)(rng);
+    for (int32_t i : m_order) {
+        r -= m_probs[i];
+        if (r < 0.0f)
+            return m_candidates[i].id;
+    }
+    return m_candidates[m_order.back()].id;
+}
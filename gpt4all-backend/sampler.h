@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "llmodel.h"
+
+struct llm_sampler_params {
+    int32_t top_k          = 40;
+    float   top_p          = 0.9f;
+    float   min_p          = 0.0f;      // drop tokens less than min_p times as likely as the most likely one
+    float   typical_p      = 1.0f;      // locally typical sampling, 1 disables it
+    float   temp           = 0.9f;      // <= 0 picks the most likely token
+    float   repeat_penalty = 1.10f;
+};
+
+// Samples the next token from the logits of the last one. Shared by every model implementation so they
+// all sample the same way; the buffers are kept between calls and sampling stops allocating once they
+// have grown to fit the vocabulary.
+//
+//   - the last n tokens are penalized (ctrl paper, https://arxiv.org/abs/1909.05858)
+//   - consider only the top K tokens
+//   - from them, consider only the top tokens with cumulative probability > P, those at least min_p
+//     times as likely as the most likely one and the locally typical ones
+//
+class llm_sampler {
+public:
+    static llm_sampler_params params_from(const LLModel::PromptContext & ctx);
+
+    // samples from the first n_vocab logits using the parameters and the last tokens of ctx
+    int32_t sample(const LLModel::PromptContext & ctx, const float * logits, size_t n_vocab, std::mt19937 & rng);
+
+    int32_t sample(const float * logits, size_t n_vocab, const int32_t * last_n_tokens, size_t n_last,
+                   const llm_sampler_params & params, std::mt19937 & rng);
+
+    struct candidate {
+        float   logit;
+        int32_t id;
+    };
+
+private:
+    void select_top_k(const float * logits, size_t n_vocab, const int32_t * last_n_tokens, size_t n_last,
+                      float repeat_penalty, size_t k);
+
+    std::vector<uint64_t>  m_penalized;     // bitset of the tokens in last_n_tokens
+    std::vector<candidate> m_candidates;
+    std::vector<float>     m_probs;
+    std::vector<int32_t>   m_order;
+};
@@ -3,7 +3,10 @@
 #include "llama.h"
 #include "llama-util.h"
 #include "utils.h"
+#include "sampler.h"
 #include "llmodel_shared.h"
+#include "mmap_file.h"
+#include "sysinfo.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -69,11 +72,14 @@ struct starcoder_model {
     //
     struct ggml_context * ctx;
     std::map<std::string, struct ggml_tensor *> tensors;
+    llm_mmap mapping; // the weights, unless they had to be copied
 
     llm_buffer eval_buf;
     llm_buffer scr0_buf;
     llm_buffer scr1_buf;
     llm_buffer work_buf;
+
+    LLModel::EvalStats stats;
 };
 
 static bool kv_cache_init(
@@ -176,8 +182,7 @@ bool starcoder_model_load(const std::string & fname, starcoder_model & model, gp
             fin.read((char *) buf.data(), len);
             word.assign(buf.data(), len);
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+            vocab.add_token(word);
 
             // if (i < 10) fprintf(stderr, "%.s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
         }
@@ -254,12 +259,14 @@ bool starcoder_model_load(const std::string & fname, starcoder_model & model, gp
         return false;
     }
 
-    // create the ggml context
+    // create the ggml context, which only holds the tensor headers when the weights are mapped
     {
+        const bool mapped = model.mapping.open(fname);
+        const size_t n_objs = size_t(5 + 12*model.hparams.n_layer);
         struct ggml_init_params params = {
-            .mem_size   = ctx_size,
+            .mem_size   = mapped ? n_objs*ggml_tensor_overhead() : ctx_size,
             .mem_buffer = NULL,
-            .no_alloc   = false,
+            .no_alloc   = mapped,
         };
 
         model.ctx = ggml_init(params);
@@ -418,11 +425,23 @@ bool starcoder_model_load(const std::string & fname, starcoder_model & model, gp
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            // the head shares the data of wte until the file turns out to have one of its own
+            if (name == "model/lm_head" && model.lm_head->data == model.wte->data) {
+                model.lm_head->data = nullptr;
+            }
+
+            if (!model.mapping.load_tensor(tensor, fin)) {
+                fprintf(stderr, "%s: failed to read tensor '%s' from the model file\n", __func__, name.data());
+                return false;
+            }
 
             // GPT-2 models share the WTE tensor as the LM head
             if (name == "model/wte" && has_lm_head == false) {
-                memcpy(model.lm_head->data, tensor->data, ggml_nbytes(tensor));
+                if (model.lm_head->data) {
+                    memcpy(model.lm_head->data, tensor->data, ggml_nbytes(tensor));
+                } else {
+                    model.lm_head->data = tensor->data;
+                }
             }
 
             if (name == "model/lm_head") {
@@ -433,6 +452,14 @@ bool starcoder_model_load(const std::string & fname, starcoder_model & model, gp
         }
 
         printf("%s: model size  = %8.2f MB\n", __func__, total_size/1024.0/1024.0);
+
+        // with mapped weights a tensor the file does not have would have no data at all
+        for (const auto & [name, tensor] : model.tensors) {
+            if (!tensor->data) {
+                fprintf(stderr, "%s: tensor '%s' is missing from the model file\n", __func__, name.c_str());
+                return false;
+            }
+        }
     }
 
     fin.close();
@@ -451,6 +478,8 @@ bool starcoder_model_load(const std::string & fname, starcoder_model & model, gp
 //   - n_past:    the context size so far
 //   - embd_inp:  the embeddings of the tokens in the context
 //   - embd_w:    the predicted logits for the next token
+//   - logits_all: return the logits of every input token instead of only the last one
+//   - logits_rows: otherwise, when not empty, the positions among the input tokens to return the logits of
 //
 bool starcoder_eval(
         starcoder_model & model,
@@ -458,7 +487,9 @@ bool starcoder_eval(
         const int n_past,
         const std::vector<gpt_vocab::id> & embd_inp,
               std::vector<float>         & embd_w,
-              size_t                     & mem_per_token) {
+              size_t                     & mem_per_token,
+              bool                         logits_all = false,
+        const std::vector<int32_t>       & logits_rows = {}) {
     const int N = embd_inp.size();
 
     const auto & hparams = model.hparams;
@@ -487,6 +518,9 @@ bool starcoder_eval(
         ((int32_t *) position->data)[i] = n_past + i;
     }
 
+    int n_out;
+    struct ggml_tensor * out_rows = llm_logits_rows(ctx0, N, logits_all, logits_rows, n_out);
+
     // wte + wpe
     struct ggml_tensor * inpL =
         ggml_add(ctx0,
@@ -704,13 +738,19 @@ bool starcoder_eval(
 
     ggml_set_scratch(ctx0, {0, model.scr0_buf.size, model.scr0_buf.addr, });
 
+    // the norm and the lm_head only for the rows that are returned
+    // [ 768, n_out]
+    if (out_rows) {
+        inpL = ggml_get_rows(ctx0, inpL, out_rows);
+    }
+
     // norm
     {
-        // [ 768, N]
+        // [ 768, n_out]
         inpL = ggml_norm(ctx0, inpL);
 
         // inpL = ln_f_g*inpL + ln_f_b
-        // [ 768, N]
+        // [ 768, n_out]
         inpL = ggml_add(ctx0,
                 ggml_mul(ctx0,
                     ggml_repeat(ctx0, model.ln_f_g, inpL),
@@ -722,7 +762,7 @@ bool starcoder_eval(
 
     // inpL = WTE * inpL
     // [ 768, 50257] - model.lm_head
-    // [ 768, N]     - inpL
+    // [ 768, n_out] - inpL
     inpL = ggml_mul_mat(ctx0, model.lm_head, inpL);
 
     // logits -> probs
@@ -730,19 +770,18 @@ bool starcoder_eval(
 
     // run the computation
     ggml_build_forward_expand(&gf, inpL);
-    ggml_graph_compute_g4a(model.work_buf, &gf, n_threads);
+    ggml_graph_compute_g4a(model.work_buf, &gf, n_threads, &model.stats.allocations);
 
     //if (n_past%100 == 0) {
     //    ggml_graph_print   (&gf);
     //    ggml_graph_dump_dot(&gf, NULL, "gpt-2.dot");
     //}
 
-    //embd_w.resize(n_vocab*N);
-    //memcpy(embd_w.data(), ggml_get_data(inpL), sizeof(float)*n_vocab*N);
-
-    // return result just for the last token
-    embd_w.resize(n_vocab);
-    memcpy(embd_w.data(), (float *) ggml_get_data(inpL) + (n_vocab*(N-1)), sizeof(float)*n_vocab);
+    if (embd_w.capacity() < size_t(n_vocab)*n_out) {
+        model.stats.allocations++;
+    }
+    embd_w.resize(n_vocab*n_out);
+    memcpy(embd_w.data(), (float *) ggml_get_data(inpL), sizeof(float)*n_vocab*n_out);
 
     if (mem_per_token == 0) {
         mem_per_token = ggml_used_mem(ctx0)/N;
@@ -751,110 +790,28 @@ bool starcoder_eval(
 
     ggml_free(ctx0);
 
+    model.kv_self.n[0] = n_past + N;
+    model.stats.evals++;
+    model.stats.tokens += N;
     return true;
 }
 
-#define MAX_RNG_STATE 64*1024
-size_t starcoder_get_state_size(const starcoder_model &model) {
-    const size_t s_rng_size        = sizeof(size_t);
-    const size_t s_rng             = MAX_RNG_STATE;
-    const size_t s_kv_size         = sizeof(size_t);
-    const size_t s_kv_ntok         = sizeof(int);
-    const size_t s_kv              = model.kv_self.buf.size;
-    const size_t s_total = (
-        + s_rng_size
-        + s_rng
-        + s_kv_size
-        + s_kv_ntok
-        + s_kv
-    );
-    return s_total;
-}
-
-size_t starcoder_copy_state_data(const starcoder_model &model, const std::mt19937 &rng, uint8_t *dest)
+// the state is a record of the KV rows that are in use, see llm_state_write()
+static bool starcoder_write_state(const starcoder_model &model, const std::mt19937 &rng, int since,
+                              const LLModel::StateWriter &write)
 {
-    uint8_t * out = dest;
-    // copy rng
-    {
-        std::stringstream rng_ss;
-        rng_ss << rng;
-
-        const size_t rng_size = rng_ss.str().size();
-        char rng_buf[MAX_RNG_STATE];
-
-        memset(&rng_buf[0], 0, MAX_RNG_STATE);
-        memcpy(&rng_buf[0], rng_ss.str().data(), rng_ss.str().size());
-
-        memcpy(out, &rng_size,   sizeof(rng_size));   out += sizeof(rng_size);
-        memcpy(out, &rng_buf[0], MAX_RNG_STATE); out += MAX_RNG_STATE;
-    }
-
-    // copy kv cache
-    {
-        const size_t kv_size = model.kv_self.buf.size;
-        const int    kv_ntok = model.kv_self.n;
-
-        memcpy(out, &kv_size, sizeof(kv_size)); out += sizeof(kv_size);
-        memcpy(out, &kv_ntok, sizeof(kv_ntok)); out += sizeof(kv_ntok);
-
-        if (kv_size) {
-            memcpy(out, model.kv_self.buf.addr, kv_size); out += kv_size;
-        }
-    }
-
-    const size_t written  = out - dest;
-    assert(written == starcoder_get_state_size(model));
-    fflush(stdout);
-    return written;
+    const auto & hparams = model.hparams;
+    return llm_state_write(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+        false, 0, rng, since, write);
 }
 
-size_t starcoder_set_state_data(starcoder_model *model, std::mt19937 *rng, const uint8_t *src)
+static bool starcoder_read_state(starcoder_model &model, std::mt19937 &rng, const LLModel::StateReader &read)
 {
-    const uint8_t * in = src;
-
-    // set rng
-    {
-        size_t rng_size;
-        char   rng_buf[MAX_RNG_STATE];
-
-        memcpy(&rng_size,   in, sizeof(rng_size));    in += sizeof(rng_size);
-        memcpy(&rng_buf[0], in, MAX_RNG_STATE); in += MAX_RNG_STATE;
-
-        std::stringstream rng_ss;
-        rng_ss.str(std::string(&rng_buf[0], rng_size));
-        rng_ss >> *rng;
-
-        assert(rng_ss.fail() == false);
-    }
-
-    // set kv cache
-    {
-        size_t kv_size;
-        int kv_ntok;
-
-        memcpy(&kv_size, in, sizeof(kv_size)); in += sizeof(kv_size);
-        memcpy(&kv_ntok, in, sizeof(kv_ntok)); in += sizeof(kv_ntok);
-
-        if (kv_size) {
-            assert(model->kv_self.buf.size == kv_size);
-
-            void * k_data = model->kv_self.k->data; // remember data pointers
-            void * v_data = model->kv_self.v->data; // because their value is stored in buf and overwritten by memcpy
-
-            memcpy(model->kv_self.buf.addr, in, kv_size); in += kv_size;
-
-            model->kv_self.k->data = k_data; // restore correct data pointers
-            model->kv_self.v->data = v_data;
-
-        }
-
-        model->kv_self.n = kv_ntok;
-    }
-
-    const size_t nread    = in - src;
-    assert(nread == starcoder_get_state_size(*model));
-    fflush(stdout);
-    return nread;
+    const auto & hparams = model.hparams;
+    if (!llm_state_read(model.kv_self, hparams.n_layer, hparams.n_ctx, hparams.n_embd,
+            false, 0, rng, read))
+        return false;
+    return true;
 }
 
 struct StarcoderPrivate {
@@ -865,6 +822,7 @@ struct StarcoderPrivate {
     int64_t n_threads = 0;
     size_t mem_per_token = 0;
     std::mt19937 rng;
+    llm_sampler sampler;
 };
 
 Starcoder::Starcoder() : d_ptr(new StarcoderPrivate) {
@@ -886,13 +844,16 @@ bool Starcoder::loadModel(const std::string &modelPath)
     std::mt19937 rng(time(NULL));
     d_ptr->rng = rng;
 
+    d_ptr->model->mapping.enabled = m_loadOptions.use_mmap;
+    d_ptr->model->mapping.prefault = m_loadOptions.prefault;
+
     // load the model
     if (!starcoder_model_load(modelPath, *d_ptr->model, d_ptr->vocab, nullptr)) {
         std::cerr << "STARCODER ERROR: failed to load model from " <<  modelPath;
         return false;
     }
 
-    d_ptr->n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
+    d_ptr->n_threads = getPhysicalCoreCount();
     d_ptr->modelLoaded = true;
     fflush(stdout);
     return true;
@@ -915,17 +876,27 @@ size_t Starcoder::requiredMem(const std::string &modelPath)
 
 size_t Starcoder::stateSize() const
 {
-    return starcoder_get_state_size(*d_ptr->model);
+    return streamedStateSize();
 }
 
 size_t Starcoder::saveState(uint8_t *dest) const
 {
-    return starcoder_copy_state_data(*d_ptr->model, d_ptr->rng, dest);
+    return saveStreamedState(dest);
 }
 
 size_t Starcoder::restoreState(const uint8_t *src)
 {
-    return starcoder_set_state_data(d_ptr->model, &d_ptr->rng, src);
+    return restoreStreamedState(src);
+}
+
+bool Starcoder::writeState(const StateWriter &write, int32_t since) const
+{
+    return starcoder_write_state(*d_ptr->model, d_ptr->rng, since, write);
+}
+
+bool Starcoder::readState(const StateReader &read)
+{
+    return starcoder_read_state(*d_ptr->model, d_ptr->rng, read);
 }
 
 void Starcoder::setThreadCount(int32_t n_threads)
@@ -945,19 +916,12 @@ std::vector<LLModel::Token> Starcoder::tokenize(PromptContext &, const std::stri
 
 LLModel::Token Starcoder::sampleToken(PromptContext &promptCtx) const
 {
-    const size_t n_prev_toks = std::min((size_t) promptCtx.repeat_last_n, promptCtx.tokens.size());
-    return gpt_sample_top_k_top_p(d_ptr->model->hparams.n_vocab,
-        promptCtx.tokens.data() + promptCtx.tokens.size() - n_prev_toks,
-        n_prev_toks,
-        promptCtx.logits,
-        promptCtx.top_k, promptCtx.top_p, promptCtx.temp,
-        promptCtx.repeat_penalty,
-        d_ptr->rng);
+    return d_ptr->sampler.sample(promptCtx, promptCtx.logits.data(), d_ptr->model->hparams.n_vocab, d_ptr->rng);
 }
 
-std::string Starcoder::tokenToString(Token id) const
+std::string_view Starcoder::tokenToString(Token id) const
 {
-    return d_ptr->vocab.id_to_token[id];
+    return d_ptr->vocab.piece(id);
 }
 
 bool Starcoder::evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const
@@ -970,7 +934,24 @@ bool Starcoder::evalTokens(PromptContext &ctx, const std::vector<int32_t> &token
         initialized = true;
     }
 
-    return starcoder_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token);
+    return starcoder_eval(*d_ptr->model, d_ptr->n_threads, ctx.n_past, tokens, ctx.logits, d_ptr->mem_per_token,
+        ctx.logits_all, ctx.logits_rows);
+}
+
+LLModel::EvalStats Starcoder::evalStats() const
+{
+    return d_ptr->model->stats;
+}
+
+size_t Starcoder::kvCacheUsed() const
+{
+    const auto & hparams = d_ptr->model->hparams;
+    return llm_kv_cache_used(d_ptr->model->kv_self, hparams.n_layer, hparams.n_embd);
+}
+
+void Starcoder::resetEvalStats()
+{
+    d_ptr->model->stats = EvalStats();
 }
 
 int32_t Starcoder::contextLength() const
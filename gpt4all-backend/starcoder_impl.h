@@ -24,8 +24,13 @@ public:
     size_t stateSize() const override;
     size_t saveState(uint8_t *dest) const override;
     size_t restoreState(const uint8_t *src) override;
+    bool writeState(const StateWriter &write, int32_t since = 0) const override;
+    bool readState(const StateReader &read) override;
     void setThreadCount(int32_t n_threads) override;
     int32_t threadCount() const override;
+    EvalStats evalStats() const override;
+    size_t kvCacheUsed() const override;
+    void resetEvalStats() override;
 
 private:
     std::unique_ptr<StarcoderPrivate> d_ptr;
@@ -33,7 +38,7 @@ private:
 protected:
     std::vector<Token> tokenize(PromptContext &, const std::string&) const override;
     Token sampleToken(PromptContext &ctx) const override;
-    std::string tokenToString(Token) const override;
+    std::string_view tokenToString(Token) const override;
     bool evalTokens(PromptContext &ctx, const std::vector<int32_t> &tokens) const override;
     int32_t contextLength() const override;
     const std::vector<Token>& endTokens() const override;
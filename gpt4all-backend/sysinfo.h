@@ -1,18 +1,28 @@
 #ifndef SYSINFO_H
 #define SYSINFO_H
 
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <iomanip>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 #if defined(__linux__)
+#include <sched.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #elif defined(__APPLE__)
+#include <mach/mach.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/sysctl.h>
 #elif defined(_WIN32)
 #include <windows.h>
+#include <psapi.h>
 #endif
 
 static long long getSystemTotalRAMInBytes()
@@ -58,4 +68,188 @@ static std::string getSystemTotalRAMInGBString()
     return ss.str();
 }
 
+// Memory of this process that is in RAM, 0 if it can't be found out
+static long long getProcessResidentMemoryInBytes()
+{
+    long long rss = 0;
+
+#if defined(__linux__)
+    std::ifstream file("/proc/self/statm");
+    long long size = 0, resident = 0;
+    if (file >> size >> resident)
+        rss = resident * sysconf(_SC_PAGESIZE);
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) == KERN_SUCCESS)
+        rss = info.resident_size;
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        rss = counters.WorkingSetSize;
+#endif
+
+    return rss;
+}
+
+// The most memory this process has had in RAM so far, 0 if it can't be found out
+static long long getProcessPeakResidentMemoryInBytes()
+{
+    long long peak = 0;
+
+#if defined(__linux__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+        peak = usage.ru_maxrss; // bytes
+#else
+        peak = usage.ru_maxrss * 1024LL; // kilobytes
+#endif
+    }
+#elif defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        peak = counters.PeakWorkingSetSize;
+#endif
+
+    return peak;
+}
+
+struct CpuCore {
+    int cpu = 0;        // the first logical cpu of the core
+    int node = 0;       // NUMA node
+    int package = 0;
+    int core = 0;
+};
+
+#if defined(__linux__)
+// Parses a list of cpus like "0-3,8-11" as found in sysfs
+static std::vector<int> parseCpuList(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first = 0, last = 0;
+        const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            last = first;
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static int readSysfsInt(const std::string &path, int fallback)
+{
+    std::ifstream file(path);
+    int value;
+    return file >> value ? value : fallback;
+}
+#endif
+
+// The physical cores this thread may run on, ordered so that the cores of a NUMA node and of a package
+// are next to each other. Hyper-threads are left out: compute threads share the units of their core
+// and gain nothing from running on both siblings. Only Linux tells us the affinity and the NUMA nodes,
+// elsewhere these are all the cores of the machine, or its performance cores on Apple silicon.
+static std::vector<CpuCore> getPhysicalCpuCores()
+{
+    std::vector<CpuCore> cores;
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        CPU_ZERO(&allowed);
+
+    std::vector<int> nodeOf(CPU_SETSIZE, 0);
+    for (int node = 0; node < 64; ++node) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list))
+            continue;
+        for (int cpu : parseCpuList(list)) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+                nodeOf[cpu] = node;
+        }
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        const std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        CpuCore c;
+        c.cpu = cpu;
+        c.node = nodeOf[cpu];
+        c.package = readSysfsInt(topology + "physical_package_id", 0);
+        c.core = readSysfsInt(topology + "core_id", cpu);
+        const bool sibling = std::any_of(cores.begin(), cores.end(), [&](const CpuCore &o) {
+            return o.package == c.package && o.core == c.core;
+        });
+        if (!sibling)
+            cores.push_back(c);
+    }
+
+    std::sort(cores.begin(), cores.end(), [](const CpuCore &a, const CpuCore &b) {
+        return std::tie(a.node, a.package, a.core, a.cpu) < std::tie(b.node, b.package, b.core, b.cpu);
+    });
+#elif defined(__APPLE__)
+    // Apple silicon lists its performance cores as perflevel0, the efficiency cores would only hold the
+    // compute threads back; Intel Macs do not have perflevels
+    int n = 0;
+    size_t size = sizeof(n);
+    if (sysctlbyname("hw.perflevel0.physicalcpu", &n, &size, NULL, 0) != 0 || n <= 0) {
+        size = sizeof(n);
+        if (sysctlbyname("hw.physicalcpu", &n, &size, NULL, 0) != 0)
+            n = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+        CpuCore c;
+        c.cpu = i;
+        c.core = i;
+        cores.push_back(c);
+    }
+#elif defined(_WIN32)
+    // one record per core, with the logical processors of the core in its group's mask
+    DWORD size = 0;
+    GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &size);
+    std::vector<char> buffer(size);
+    auto *info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *>(buffer.data());
+    if (size && GetLogicalProcessorInformationEx(RelationProcessorCore, info, &size)) {
+        for (DWORD offset = 0; offset < size;) {
+            const auto *record = reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *>(buffer.data() + offset);
+            offset += record->Size;
+            if (record->Relationship != RelationProcessorCore || !record->Processor.GroupCount)
+                continue;
+            const GROUP_AFFINITY &group = record->Processor.GroupMask[0];
+            int first = 0;
+            while (first < 64 && !(group.Mask >> first & 1))
+                ++first;
+            CpuCore c;
+            c.cpu = int(group.Group)*64 + first;
+            c.core = int(cores.size());
+            cores.push_back(c);
+        }
+    }
+#endif
+
+    if (cores.empty()) {
+        const int n = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < n; ++i) {
+            CpuCore c;
+            c.cpu = i;
+            c.core = i;
+            cores.push_back(c);
+        }
+    }
+    return cores;
+}
+
+static int getPhysicalCoreCount()
+{
+    return int(getPhysicalCpuCores().size());
+}
+
 #endif // SYSINFO_H
@@ -1,7 +1,7 @@
 #include "utils.h"
 
 #include <fstream>
-#include <regex>
+#include <queue>
 
 void replace(std::string & str, const std::string & needle, const std::string & replacement) {
     size_t pos = 0;
@@ -102,227 +102,267 @@ std::map<std::string, int32_t> json_parse(const std::string & fname) {
     return result;
 }
 
-std::vector<gpt_vocab::id> gpt_tokenize_inner(const gpt_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
-
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
-
-        std::regex re(pat);
-        std::smatch m;
-
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+gpt_vocab::id gpt_vocab::add_token(std::string_view piece) {
+    const id i = id(size());
+    pieces.append(piece);
+    pieces.push_back('\0');
+    offsets.push_back(uint32_t(pieces.size()));
+    if (piece.empty())
+        return i;
+
+    // keep the table at most half full
+    if (2 * (size() + 1) > index.size()) {
+        index.assign(std::max(size_t(1024), index.size() * 2), -1);
+        for (id j = 0; j <= i; ++j) {
+            if (offsets[j + 1] - offsets[j] > 1)
+                insert_index(j);
         }
+    } else {
+        insert_index(i);
     }
+    return i;
+}
 
-    // find the longest tokens that form the words:
-    std::vector<gpt_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.size() == 0) continue;
-
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            while (j > i) {
-                auto it = vocab.token_to_id.find(word.substr(i, j-i));
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    break;
-                }
-                --j;
-            }
-            if (i == n) {
-                break;
-            }
-            if (j == i) {
-                auto sub = word.substr(i, 1);
-                if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-                    tokens.push_back(vocab.token_to_id.at(sub));
-                } else {
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
-                }
-                ++i;
-            }
+void gpt_vocab::insert_index(id i) {
+    const std::string_view p = piece(i);
+    const size_t mask = index.size() - 1;
+    for (size_t slot = std::hash<std::string_view>()(p) & mask;; slot = (slot + 1) & mask) {
+        if (index[slot] < 0 || piece(index[slot]) == p) {
+            index[slot] = i;
+            return;
         }
     }
-
-    return tokens;
-}
-
-std::string regex_escape(const std::string &s) {
-  static const std::regex metacharacters(R"([\.\^\$\-\+\(\)\[\]\{\}\|\?\*])");
-  return std::regex_replace(s, metacharacters, "\\$&");
 }
 
-std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
-    // Generate the subpattern from the special_tokens vector if it's not empty
-    if (!vocab.special_tokens.empty()) {
-        std::vector<gpt_vocab::id> out;
-        std::vector<std::string> chunks;
-        std::string str = text;
-        std::string special_tokens_subpattern;
-        for (const auto &token : vocab.special_tokens) {
-            if (!special_tokens_subpattern.empty()) {
-                special_tokens_subpattern += "|";
-            }
-            special_tokens_subpattern += regex_escape(token);
-        }
-        std::regex re(special_tokens_subpattern);
-        std::smatch m;
-        while (std::regex_search(str, m, re)) {
-            auto tok = vocab.token_to_id.find(m.str());
-            if (tok != vocab.token_to_id.end()) {
-                auto tokid = tok->second;
-                auto pfxtoks = gpt_tokenize_inner(vocab, m.prefix());
-                out.insert(out.end(), pfxtoks.begin(), pfxtoks.end());
-                out.push_back(tokid);
-                str = m.suffix();
-            }
-        }
-        if (!str.empty()) {
-            auto tokrest = gpt_tokenize_inner(vocab, str);
-            out.insert(out.end(), tokrest.begin(), tokrest.end());
-        }
-        return out;
-    } else {
-        return gpt_tokenize_inner(vocab, text);
+gpt_vocab::id gpt_vocab::find(std::string_view p) const {
+    if (index.empty())
+        return -1;
+    const size_t mask = index.size() - 1;
+    for (size_t slot = std::hash<std::string_view>()(p) & mask;; slot = (slot + 1) & mask) {
+        const id i = index[slot];
+        if (i < 0 || piece(i) == p)
+            return i;
     }
 }
 
+namespace {
 
-bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
-    printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
+enum class gpt_char_class { space, letter, digit, other };
 
-    vocab.token_to_id = ::json_parse(fname);
+bool gpt_is_letter(uint32_t cp) {
+    if (cp < 0xc0) return cp == 0xaa || cp == 0xb5 || cp == 0xba;
+    if (cp == 0xd7 || cp == 0xf7) return false;
+    if (cp >= 0x300 && cp < 0x370) return false;        // combining marks
+    if (cp >= 0x2000 && cp < 0x2c00) return false;      // punctuation, symbols, arrows, math, shapes
+    if (cp >= 0x3000 && cp < 0x3040) return false;      // CJK punctuation
+    if (cp >= 0xfe30 && cp < 0xfe70) return false;      // CJK compatibility forms
+    if (cp >= 0xff00 && cp < 0xff21) return false;      // fullwidth punctuation and digits
+    if (cp >= 0x1f000 && cp < 0x1fb00) return false;    // emoji
+    return true;
+}
 
-    for (const auto & kv : vocab.token_to_id) {
-        vocab.id_to_token[kv.second] = kv.first;
+// Classifies the character at 'pos' and sets 'len' to its length in bytes; invalid UTF-8 counts as
+// single bytes of punctuation
+gpt_char_class gpt_classify(std::string_view text, size_t pos, size_t &len) {
+    const unsigned char c = text[pos];
+    len = 1;
+    if (c < 0x80) {
+        if (c == ' ' || (c >= '\t' && c <= '\r')) return gpt_char_class::space;
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return gpt_char_class::letter;
+        if (c >= '0' && c <= '9') return gpt_char_class::digit;
+        return gpt_char_class::other;
     }
 
-    printf("%s: vocab size = %d\n", __func__, (int) vocab.token_to_id.size());
-
-    // print the vocabulary
-    //for (auto kv : vocab.token_to_id) {
-    //    printf("'%s' -> %d\n", kv.first.data(), kv.second);
-    //}
-
-    return true;
+    const size_t n = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+    if (n == 1 || pos + n > text.size()) return gpt_char_class::other;
+    uint32_t cp = c & (0x7f >> n);
+    for (size_t i = 1; i < n; ++i) {
+        const unsigned char cc = text[pos + i];
+        if ((cc & 0xc0) != 0x80) return gpt_char_class::other;
+        cp = (cp << 6) | (cc & 0x3f);
+    }
+    len = n;
+    if (cp == 0xa0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200a) || cp == 0x2028 || cp == 0x2029
+        || cp == 0x202f || cp == 0x205f || cp == 0x3000)
+        return gpt_char_class::space;
+    return gpt_is_letter(cp) ? gpt_char_class::letter : gpt_char_class::other;
 }
 
-gpt_vocab::id gpt_sample_top_k_top_p(
-        const size_t actualVocabSize,
-        const int32_t * last_n_tokens_data,
-        int   last_n_tokens_size,
-        const std::vector<float> logits,
-        int    top_k,
-        double top_p,
-        double temp,
-        float repeat_penalty,
-        std::mt19937 & rng) {
-    int n_logits = actualVocabSize;
-
-    const auto last_n_tokens = std::vector<int32_t>(last_n_tokens_data, last_n_tokens_data + last_n_tokens_size);
-    const auto * plogits = logits.data();
-
-    if (temp <= 0) {
-        // select the token with the highest logit directly
-        float max_logit = plogits[0];
-        gpt_vocab::id max_id = 0;
-
-        for (int i = 1; i < n_logits; ++i) {
-            if (plogits[i] > max_logit) {
-                max_logit = plogits[i];
-                max_id = i;
+// The GPT-2 pre-tokenizer, see gpt_tokenize() in utils.h
+void gpt_split_words(std::string_view text, std::vector<std::string_view> & words) {
+    const size_t n = text.size();
+    size_t i = 0;
+    while (i < n) {
+        // contractions
+        if (text[i] == '\'' && i + 1 < n) {
+            const char c = text[i + 1];
+            if (c == 's' || c == 't' || c == 'm' || c == 'd') {
+                words.push_back(text.substr(i, 2));
+                i += 2;
+                continue;
+            }
+            const std::string_view two = text.substr(i + 1, 2);
+            if (two == "re" || two == "ve" || two == "ll") {
+                words.push_back(text.substr(i, 3));
+                i += 3;
+                continue;
             }
         }
-        return max_id;
-    }
-    std::vector<std::pair<double, gpt_vocab::id>> logits_id;
-    logits_id.reserve(n_logits);
 
-    {
-        const float scale = 1.0f/temp;
-        for (int i = 0; i < n_logits; ++i) {
-            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
-            // credit https://github.com/facebookresearch/llama/compare/main...shawwn:llama:main
-            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
-                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
-                if (plogits[i] < 0.0f) {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
-                } else {
-                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
+        size_t len;
+        gpt_char_class cls = gpt_classify(text, i, len);
+        size_t end = i;
+        if (cls == gpt_char_class::space) {
+            size_t next_len = 0;
+            const gpt_char_class next = text[i] == ' ' && i + 1 < n ? gpt_classify(text, i + 1, next_len)
+                                                                     : gpt_char_class::space;
+            if (next == gpt_char_class::space) {
+                // a run of whitespace, without its last character if a word follows
+                size_t last = i;
+                end = i + len;
+                while (end < n && gpt_classify(text, end, len) == gpt_char_class::space) {
+                    last = end;
+                    end += len;
                 }
-            } else {
-                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
+                if (end < n && last > i)
+                    end = last;
+                words.push_back(text.substr(i, end - i));
+                i = end;
+                continue;
             }
+            // a single space goes with the word after it
+            cls = next;
+            len = next_len;
+            end = i + 1;
         }
-    }
-
-    // find the top K tokens
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + top_k, logits_id.end(),
-            [](const std::pair<double, gpt_vocab::id> & a, const std::pair<double, gpt_vocab::id> & b) {
-        return a.first > b.first;
-    });
 
-    logits_id.resize(top_k);
-
-    double maxl = -INFINITY;
-    for (const auto & kv : logits_id) {
-        maxl = std::max(maxl, kv.first);
+        end += len;
+        while (end < n && gpt_classify(text, end, len) == cls)
+            end += len;
+        words.push_back(text.substr(i, end - i));
+        i = end;
     }
+}
 
-    // compute probs for the top K tokens
-    std::vector<double> probs;
-    probs.reserve(logits_id.size());
+// Encodes a word with byte pair merges, starting from its bytes and always applying the merge of
+// lowest rank next
+void gpt_encode_word(const gpt_vocab & vocab, std::string_view word, std::vector<gpt_vocab::id> & tokens) {
+    const gpt_vocab::id whole = vocab.find(word);
+    if (whole >= 0) {
+        tokens.push_back(whole);
+        return;
+    }
 
-    double sum = 0.0;
-    for (const auto & kv : logits_id) {
-        double p = exp(kv.first - maxl);
-        probs.push_back(p);
-        sum += p;
+    struct symbol {
+        size_t start;
+        size_t len;     // 0 once merged into the symbol before it
+        int prev;
+        int next;
+    };
+    std::vector<symbol> symbols(word.size());
+    for (size_t i = 0; i < word.size(); ++i)
+        symbols[i] = { i, 1, int(i) - 1, i + 1 < word.size() ? int(i + 1) : -1 };
+
+    struct merge {
+        gpt_vocab::id rank;
+        int left;
+        size_t len;     // of the merged symbol, which tells whether the pair is still there
+    };
+    const auto later = [](const merge & a, const merge & b) {
+        return a.rank > b.rank || (a.rank == b.rank && a.left > b.left);
+    };
+    std::priority_queue<merge, std::vector<merge>, decltype(later)> queue(later);
+
+    const auto add_pair = [&](int left) {
+        if (left < 0 || symbols[left].next < 0)
+            return;
+        const symbol & l = symbols[left];
+        const size_t len = l.len + symbols[l.next].len;
+        const gpt_vocab::id merged = vocab.find(word.substr(l.start, len));
+        if (merged >= 0)
+            queue.push({ merged, left, len });
+    };
+    for (int i = 0; i + 1 < int(symbols.size()); ++i)
+        add_pair(i);
+
+    while (!queue.empty()) {
+        const merge m = queue.top();
+        queue.pop();
+        symbol & l = symbols[m.left];
+        if (l.len == 0 || l.next < 0 || l.len + symbols[l.next].len != m.len)
+            continue;
+        symbol & r = symbols[l.next];
+        l.len = m.len;
+        l.next = r.next;
+        r.len = 0;
+        if (l.next >= 0)
+            symbols[l.next].prev = m.left;
+        add_pair(l.prev);
+        add_pair(m.left);
     }
 
-    // normalize the probs
-    for (auto & p : probs) {
-        p /= sum;
+    for (int i = symbols.empty() ? -1 : 0; i >= 0; i = symbols[i].next) {
+        const std::string_view piece = word.substr(symbols[i].start, symbols[i].len);
+        const gpt_vocab::id id = vocab.find(piece);
+        if (id >= 0) {
+            tokens.push_back(id);
+        } else {
+            fprintf(stderr, "%s: unknown token '%.*s'\n", __func__, int(piece.size()), piece.data());
+        }
     }
+}
+
+void gpt_tokenize_inner(const gpt_vocab & vocab, std::string_view text, std::vector<gpt_vocab::id> & tokens) {
+    std::vector<std::string_view> words;
+    gpt_split_words(text, words);
+    for (const auto & word : words)
+        gpt_encode_word(vocab, word, tokens);
+}
+
+} // namespace
 
-    if (top_p < 1.0f) {
-        double cumsum = 0.0f;
-        for (int i = 0; i < top_k; i++) {
-            cumsum += probs[i];
-            if (cumsum >= top_p) {
-                top_k = i + 1;
-                probs.resize(top_k);
-                logits_id.resize(top_k);
+std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text) {
+    std::vector<gpt_vocab::id> out;
+    const std::string_view str = text;
+    size_t begin = 0;
+    if (!vocab.special_tokens.empty()) {
+        for (size_t i = 0; i < str.size(); ++i) {
+            if (!vocab.special_token_starts[(unsigned char) str[i]])
+                continue;
+            for (const auto & special : vocab.special_tokens) {
+                if (str.compare(i, special.size(), special) != 0)
+                    continue;
+                const gpt_vocab::id tok = vocab.find(special);
+                if (tok < 0)
+                    continue;
+                gpt_tokenize_inner(vocab, str.substr(begin, i - begin), out);
+                out.push_back(tok);
+                begin = i + special.size();
+                i = begin - 1;
                 break;
             }
         }
-
-        cumsum = 1.0/cumsum;
-        for (int i = 0; i < (int) probs.size(); i++) {
-            probs[i] *= cumsum;
-        }
     }
+    gpt_tokenize_inner(vocab, str.substr(begin), out);
+    return out;
+}
 
-    //printf("\n");
-    //for (int i = 0; i < (int) probs.size(); i++) {
-    //    printf("%d: '%s' %f\n", i, vocab.id_to_token.at(logits_id[i].second).c_str(), probs[i]);
-    //}
-    //exit(0);
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-    int idx = dist(rng);
+bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab) {
+    printf("%s: loading vocab from '%s'\n", __func__, fname.c_str());
+
+    std::map<gpt_vocab::id, std::string> id_to_token;
+    for (const auto & kv : ::json_parse(fname)) {
+        id_to_token[kv.second] = kv.first;
+    }
+    for (const auto & kv : id_to_token) {
+        if (kv.first < 0) continue;
+        while (vocab.size() < size_t(kv.first))
+            vocab.add_token(std::string_view());
+        vocab.add_token(kv.second);
+    }
 
-    return logits_id[idx].second;
-}
\ No newline at end of file
+    printf("%s: vocab size = %d\n", __func__, (int) vocab.size());
+
+    return true;
+}
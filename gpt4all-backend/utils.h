@@ -2,7 +2,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
 #include <random>
@@ -45,17 +48,44 @@ std::string gpt_random_prompt(std::mt19937 & rng);
 // Vocab utils
 //
 
+// The vocabulary of the GGML model families. The pieces of the tokens are stored one after the other
+// in a single buffer, each followed by a NUL, and found by id through their offsets or by piece
+// through an open addressing table of ids, so neither direction allocates or copies.
 struct gpt_vocab {
     using id    = int32_t;
     using token = std::string;
 
-    std::map<token, id> token_to_id;
-    std::map<id, token> id_to_token;
-    std::vector<std::string> special_tokens;
+    std::vector<std::string> special_tokens; // longest first, so the longest one that matches wins
+    std::array<bool, 256> special_token_starts{}; // first bytes of the special tokens
+
+    // Appends the token with the next id; the pieces have to be added in the order of their ids. An
+    // empty piece keeps the id taken without making it findable, and of pieces that are the same the
+    // last one is found.
+    id add_token(std::string_view piece);
+
+    size_t size() const { return offsets.size() - 1; }
+    std::string_view piece(id i) const {
+        if (i < 0 || size_t(i) >= size()) return std::string_view();
+        return std::string_view(pieces.data() + offsets[i], offsets[i + 1] - offsets[i] - 1);
+    }
+    // -1 if there is no such token
+    id find(std::string_view piece) const;
 
     void add_special_token(const std::string &token) {
-        special_tokens.push_back(token);
+        if (token.empty() || std::find(special_tokens.begin(), special_tokens.end(), token) != special_tokens.end())
+            return;
+        auto pos = std::find_if(special_tokens.begin(), special_tokens.end(),
+            [&](const std::string &s) { return s.size() < token.size(); });
+        special_tokens.insert(pos, token);
+        special_token_starts[(unsigned char) token[0]] = true;
     }
+
+private:
+    void insert_index(id i);
+
+    std::string pieces;
+    std::vector<uint32_t> offsets = { 0 };  // of every piece, plus the end of the last one
+    std::vector<id> index;                  // ids by hash of their piece, -1 if empty, a power of two long
 };
 
 void replace(std::string & str, const std::string & needle, const std::string & replacement);
@@ -65,33 +95,20 @@ std::map<std::string, int32_t> json_parse(const std::string & fname);
 
 // split text into tokens
 //
+// The text is split into words like the GPT-2 pre-tokenizer does, then each word is encoded with byte
+// pair merges. Special tokens are matched first and never merged with their neighbours.
+//
 // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
 //
 // Regex (Python):
 // r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
 //
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+// The split is hand-written and treats most characters outside of ASCII as letters, leaving out the
+// common punctuation, symbol and emoji blocks, which is close to \p{L} without the Unicode tables.
+// The model files carry no merge list, so a merge ranks by the id of the token it produces: BPE
+// vocabularies number their tokens in the order the merges were learned.
 //
 std::vector<gpt_vocab::id> gpt_tokenize(const gpt_vocab & vocab, const std::string & text);
 
 // load the tokens from encoder.json
 bool gpt_vocab_init(const std::string & fname, gpt_vocab & vocab);
-
-// sample next token given probabilities for each embedding
-//
-//   - consider only the top K tokens
-//   - from them, consider only the top tokens with cumulative probability > P
-//
-// TODO: not sure if this implementation is correct
-//
-gpt_vocab::id gpt_sample_top_k_top_p(
-        const size_t actualVocabSize,
-        const int32_t * last_n_tokens_data,
-        int   last_n_tokens_size,
-        const std::vector<float> logits,
-        int    top_k,
-        double top_p,
-        double temp,
-        float repeat_penalty,
-        std::mt19937 & rng);
@@ -78,7 +78,7 @@ size_t ChatAPI::restoreState(const uint8_t *src)
 void ChatAPI::prompt(const std::string &prompt,
                      const std::string &promptTemplate,
                      std::function<bool(int32_t)> promptCallback,
-                     std::function<bool(int32_t, const std::string&)> responseCallback,
+                     std::function<bool(int32_t, std::string_view)> responseCallback,
                      std::function<bool(bool)> recalculateCallback,
                      PromptContext &promptCtx,
                      bool special,
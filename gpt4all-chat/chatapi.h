@@ -62,7 +62,7 @@ public:
     void prompt(const std::string &prompt,
                 const std::string &promptTemplate,
                 std::function<bool(int32_t)> promptCallback,
-                std::function<bool(int32_t, const std::string&)> responseCallback,
+                std::function<bool(int32_t, std::string_view)> responseCallback,
                 std::function<bool(bool)> recalculateCallback,
                 PromptContext &ctx,
                 bool special,
@@ -98,7 +98,7 @@ protected:
         throw std::logic_error("not implemented");
     }
 
-    std::string tokenToString(Token id) const override {
+    std::string_view tokenToString(Token id) const override {
         (void)id;
         throw std::logic_error("not implemented");
     }
@@ -127,7 +127,7 @@ protected:
     }
 
 private:
-    std::function<bool(int32_t, const std::string&)> m_responseCallback;
+    std::function<bool(int32_t, std::string_view)> m_responseCallback;
     QString m_modelName;
     QString m_apiKey;
     QString m_requestURL;
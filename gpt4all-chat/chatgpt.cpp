@@ -72,7 +72,7 @@ size_t ChatGPT::restoreState(const uint8_t *src)
 
 void ChatGPT::prompt(const std::string &prompt,
         std::function<bool(int32_t)> promptCallback,
-        std::function<bool(int32_t, const std::string&)> responseCallback,
+        std::function<bool(int32_t, std::string_view)> responseCallback,
         std::function<bool(bool)> recalculateCallback,
         PromptContext &promptCtx) {
 
@@ -56,7 +56,7 @@ public:
     size_t restoreState(const uint8_t *src) override;
     void prompt(const std::string &prompt,
         std::function<bool(int32_t)> promptCallback,
-        std::function<bool(int32_t, const std::string&)> responseCallback,
+        std::function<bool(int32_t, std::string_view)> responseCallback,
         std::function<bool(bool)> recalculateCallback,
         PromptContext &ctx) override;
 
@@ -81,14 +81,14 @@ protected:
     // them as they are only called from the default implementation of 'prompt' which we override and
     // completely replace
     std::vector<Token> tokenize(PromptContext &, const std::string&) const override { return std::vector<Token>(); }
-    std::string tokenToString(Token) const override { return std::string(); }
+    std::string_view tokenToString(Token) const override { return std::string_view(); }
     Token sampleToken(PromptContext &ctx) const override { return -1; }
     bool evalTokens(PromptContext &/*ctx*/, const std::vector<int32_t>& /*tokens*/) const override { return false; }
     int32_t contextLength() const override { return -1; }
     const std::vector<Token>& endTokens() const override { static const std::vector<Token> fres; return fres; }
 
 private:
-    std::function<bool(int32_t, const std::string&)> m_responseCallback;
+    std::function<bool(int32_t, std::string_view)> m_responseCallback;
     QString m_modelName;
     QString m_apiKey;
     QList<QString> m_context;
@@ -1,37 +1,153 @@
 #include "chatllm.h"
 #include "chat.h"
 #include "chatgpt.h"
+#include "metrics.h"
 #include "modellist.h"
 #include "network.h"
 #include "mysettings.h"
 #include "../gpt4all-backend/llmodel.h"
 
+#include <optional>
+
 //#define DEBUG
 //#define DEBUG_MODEL_LOADING
 
-#define MPT_INTERNAL_STATE_VERSION 0
-#define GPTJ_INTERNAL_STATE_VERSION 0
-#define REPLIT_INTERNAL_STATE_VERSION 0
-#define LLAMA_INTERNAL_STATE_VERSION 0
-#define FALCON_INTERNAL_STATE_VERSION 0
-#define BERT_INTERNAL_STATE_VERSION 0
-#define STARCODER_INTERNAL_STATE_VERSION 0
+// Version 1 is the streamed state of LLModel::writeState(): LLaMA writes its state with the size in
+// front, the other models a header and the rows of the cached tokens. Older states are dropped.
+#define MPT_INTERNAL_STATE_VERSION 1
+#define GPTJ_INTERNAL_STATE_VERSION 1
+#define REPLIT_INTERNAL_STATE_VERSION 1
+#define LLAMA_INTERNAL_STATE_VERSION 1
+#define FALCON_INTERNAL_STATE_VERSION 1
+#define BERT_INTERNAL_STATE_VERSION 1
+#define STARCODER_INTERNAL_STATE_VERSION 1
+
+static void deleteModel(LLModelInfo &info)
+{
+    delete std::exchange(info.model, nullptr);
+    delete std::exchange(info.draftModel, nullptr);
+}
+
+// The type of a model a backend has loaded, nothing if it is not one we know
+static std::optional<LLModelType> modelType(LLModel *model)
+{
+    switch (model->implementation().modelType()[0]) {
+    case 'L': return LLModelType::LLAMA_;
+    case 'G': return LLModelType::GPTJ_;
+    case 'M': return LLModelType::MPT_;
+    case 'R': return LLModelType::REPLIT_;
+    case 'F': return LLModelType::FALCON_;
+    case 'B': return LLModelType::BERT_;
+    case 'S': return LLModelType::STARCODER_;
+    default:  return std::nullopt;
+    }
+}
+
+static QString buildVariant(bool forceMetal)
+{
+#if defined(Q_OS_MAC) && defined(__arm__)
+    return forceMetal ? "metal" : "auto";
+#else
+    Q_UNUSED(forceMetal);
+    return "auto";
+#endif
+}
+
+// What loading the model with n_seq KV cache slots takes, as the backend estimates it. This only reads
+// the header of the file.
+static size_t requiredModelMem(const QString &filePath, const QString &variant, bool isChatGPT,
+                               const LLModel::LoadOptions &options)
+{
+    if (isChatGPT || !QFileInfo::exists(filePath))
+        return 0;
+    std::unique_ptr<LLModel> model(LLModel::Implementation::construct(filePath.toStdString(), variant.toStdString()));
+    if (!model)
+        return 0;
+    model->setLoadOptions(options);
+    return model->requiredMem(filePath.toStdString());
+}
+
+// Whether a loaded model has the KV cache the options ask for. A model with more slots than asked for
+// holds memory the caller never uses, one with fewer cannot batch as much; a model whose implementation
+// gave it fewer slots than it was loaded with has all it can have for any larger n_seq too. A model
+// that is to get a draft model must keep the logits of every token, LLaMA only can if loaded that way.
+static bool hasLoadOptions(const LLModel *model, const LLModel::LoadOptions &options)
+{
+    const LLModel::LoadOptions &loaded = model->loadOptions();
+    const int32_t slots = model->maxSequences();
+    return loaded.kv_type == options.kv_type
+        && (slots == options.n_seq || (slots < loaded.n_seq && slots < options.n_seq))
+        && (loaded.logits_all || !options.logits_all);
+}
+
+// Whether the model is set up to be sped up by a smaller model, see ChatLLM::loadDraftModel()
+static bool hasDraftModel(const ModelInfo &modelInfo)
+{
+    const QString draftFile = modelInfo.draftModel();
+    return !draftFile.isEmpty() && draftFile != modelInfo.filename();
+}
 
+// Keeps the models that were released loaded, so that switching back to one of them does not load it
+// from disk again. The models are keyed by file and build variant, an idle model is only handed out if
+// it was loaded with the KV cache the caller asks for, and together they must fit in the memory
+// budget of the settings; the idle model that was used least recently is unloaded first. With a budget
+// of 0 only the model that was released last stays loaded, like when the store held a single model.
 class LLModelStore {
 public:
     static LLModelStore *globalInstance();
 
-    LLModelInfo acquireModel(); // will block until llmodel is ready
+    // Returns the idle model loaded from the file with the build variant and the load options, or an
+    // empty LLModelInfo with requiredMem reserved for loading it. Chats block while the models other
+    // chats use take up the budget, the server does not; a model that does not fit in the budget on
+    // its own is still loaded.
+    LLModelInfo acquireModel(const QFileInfo &fileInfo, const QString &variant, const LLModel::LoadOptions &options,
+                             size_t requiredMem, bool isServer);
     void releaseModel(const LLModelInfo &info); // must be called when you are done
 
+    // Loads the model in the background if it fits in the budget without unloading anything
+    void preloadModel(const QFileInfo &fileInfo, const QString &variant, const LLModel::LoadOptions &options);
+
+    // Chats that take turns with a model with several KV cache slots leave their conversation in a
+    // named context of it, see LLModel::createContext(). claimContext() makes the context of the
+    // chat the current one and returns true if it still holds the conversation. Otherwise it creates
+    // the context, giving it the slot of the chat that used the model least recently if none is free,
+    // and sets state to the saved state of the conversation, if there is one. The states of contexts
+    // that lose their slot, or whose model is unloaded or taken by the server, are saved first.
+    bool claimContext(LLModel *model, const QString &name, QByteArray &state);
+    // The state of a context that was left in a model, for chats that save themselves unloaded
+    bool contextState(const QString &name, QByteArray &state);
+    void forgetContext(const QString &name);
+    void forgetModel(LLModel *model); // for a model that is deleted without the store
+
 private:
-    LLModelStore()
+    LLModelStore() {}
+    ~LLModelStore() {}
+
+    static QString key(const QFileInfo &fileInfo, const QString &variant)
     {
-        // seed with empty model
-        m_availableModels.append(LLModelInfo());
+        return fileInfo.absoluteFilePath() + '|' + variant;
     }
-    ~LLModelStore() {}
-    QVector<LLModelInfo> m_availableModels;
+    static size_t budget()
+    {
+        return size_t(MySettings::globalInstance()->modelPoolMemory()) * 1024 * 1024;
+    }
+    // unloads idle models, least recently used first, until 'needed' more bytes fit in the budget
+    void evict(size_t needed, int keep = 0);
+    // saves the state of a context for its chat and frees its slot
+    void parkContext(const QString &name);
+    void parkContexts(LLModel *model);
+    void updateMetrics() const
+    {
+        Metrics::globalInstance()->setLoadedModels(m_idleModels.size() + m_inUse.size(), m_usedMem);
+    }
+
+    QList<LLModelInfo> m_idleModels; // least recently used first
+    QStringList m_inUse; // keys of the models that are acquired
+    int m_chatsInUse = 0; // how many of them chats have acquired
+    size_t m_usedMem = 0; // by the loaded and the reserved models
+    QHash<QString, LLModel*> m_contexts; // the model each chat left its context in
+    QHash<QString, QByteArray> m_contextStates; // of the contexts that lost their slot
+    QStringList m_contextOrder; // least recently claimed first
     QMutex m_mutex;
     QWaitCondition m_condition;
     friend class MyLLModelStore;
@@ -44,22 +160,195 @@ LLModelStore *LLModelStore::globalInstance()
     return storeInstance();
 }
 
-LLModelInfo LLModelStore::acquireModel()
+LLModelInfo LLModelStore::acquireModel(const QFileInfo &fileInfo, const QString &variant,
+                                       const LLModel::LoadOptions &options, size_t requiredMem, bool isServer)
 {
     QMutexLocker locker(&m_mutex);
-    while (m_availableModels.isEmpty())
+    const QString k = key(fileInfo, variant);
+    LLModelInfo info;
+    for (;;) {
+        const auto it = std::find_if(m_idleModels.begin(), m_idleModels.end(), [&](const LLModelInfo &idle) {
+            return key(idle.fileInfo, idle.buildVariant) == k && hasLoadOptions(idle.model, options);
+        });
+        if (it != m_idleModels.end()) {
+            info = *it;
+            m_idleModels.erase(it);
+            if (isServer)
+                parkContexts(info.model); // the server batches over all of the slots
+            break;
+        }
+        evict(requiredMem);
+        if (isServer || !m_chatsInUse || m_usedMem + requiredMem <= budget()) {
+            m_usedMem += requiredMem;
+            info.fileInfo = fileInfo;
+            info.buildVariant = variant;
+            info.requiredMem = requiredMem;
+            break;
+        }
         m_condition.wait(locker.mutex());
-    return m_availableModels.takeFirst();
+    }
+
+    info.isServer = isServer;
+    m_inUse.append(k);
+    if (!isServer)
+        ++m_chatsInUse;
+    updateMetrics();
+    return info;
 }
 
 void LLModelStore::releaseModel(const LLModelInfo &info)
 {
     QMutexLocker locker(&m_mutex);
-    m_availableModels.append(info);
-    Q_ASSERT(m_availableModels.count() < 2);
+    m_inUse.removeOne(key(info.fileInfo, info.buildVariant));
+    if (!info.isServer)
+        --m_chatsInUse;
+    if (info.model)
+        m_idleModels.append(info);
+    else
+        m_usedMem -= std::min(m_usedMem, info.requiredMem);
+    evict(0, 1 /*keep the model just released*/);
+    updateMetrics();
     m_condition.wakeAll();
 }
 
+void LLModelStore::evict(size_t needed, int keep)
+{
+    while (m_idleModels.size() > keep && m_usedMem + needed > budget()) {
+        LLModelInfo info = m_idleModels.takeFirst();
+#if defined(DEBUG_MODEL_LOADING)
+        qDebug() << "evicting model" << info.fileInfo.fileName() << info.model;
+#endif
+        m_usedMem -= std::min(m_usedMem, info.requiredMem);
+        parkContexts(info.model);
+        deleteModel(info);
+    }
+}
+
+bool LLModelStore::claimContext(LLModel *model, const QString &name, QByteArray &state)
+{
+    QMutexLocker locker(&m_mutex);
+    const std::string context = name.toStdString();
+    m_contextOrder.removeOne(name);
+    m_contextOrder.append(name);
+    if (m_contexts.value(name) == model && model->switchContext(context))
+        return true;
+
+    // the conversation is in another model, for one with another build variant say
+    if (m_contexts.contains(name))
+        parkContext(name);
+    state = m_contextStates.take(name);
+    if (model->maxSequences() < 2) {
+        m_contextOrder.removeOne(name);
+        return false;
+    }
+
+    // the default context keeps slot 0 for the chats that cannot have a context of their own
+    if (std::count(m_contexts.cbegin(), m_contexts.cend(), model) >= model->maxSequences() - 1) {
+        const auto victim = std::find_if(m_contextOrder.cbegin(), m_contextOrder.cend(), [&](const QString &other) {
+            return m_contexts.value(other) == model;
+        });
+        if (victim != m_contextOrder.cend())
+            parkContext(*victim);
+    }
+    if (!model->createContext(context)) {
+        model->switchContext(std::string());
+        m_contextOrder.removeOne(name);
+        return false;
+    }
+    model->switchContext(context);
+    m_contexts.insert(name, model);
+    return false;
+}
+
+bool LLModelStore::contextState(const QString &name, QByteArray &state)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_contextStates.contains(name)) {
+        state = m_contextStates.value(name);
+        return true;
+    }
+    LLModel *model = m_contexts.value(name);
+    state.clear();
+    return model && model->writeContextState(name.toStdString(), [&state](const void *data, size_t size) {
+        state.append(static_cast<const char*>(data), qsizetype(size));
+        return true;
+    });
+}
+
+void LLModelStore::forgetContext(const QString &name)
+{
+    QMutexLocker locker(&m_mutex);
+    if (LLModel *model = m_contexts.take(name))
+        model->destroyContext(name.toStdString());
+    m_contextStates.remove(name);
+    m_contextOrder.removeOne(name);
+}
+
+void LLModelStore::forgetModel(LLModel *model)
+{
+    QMutexLocker locker(&m_mutex);
+    parkContexts(model);
+}
+
+void LLModelStore::parkContext(const QString &name)
+{
+    LLModel *model = m_contexts.take(name);
+    const std::string context = name.toStdString();
+    QByteArray state;
+    if (model->writeContextState(context, [&state](const void *data, size_t size) {
+            state.append(static_cast<const char*>(data), qsizetype(size));
+            return true;
+        })) {
+        m_contextStates.insert(name, state);
+    }
+    model->destroyContext(context);
+}
+
+void LLModelStore::parkContexts(LLModel *model)
+{
+    for (const QString &name : m_contexts.keys(model))
+        parkContext(name);
+}
+
+void LLModelStore::preloadModel(const QFileInfo &fileInfo, const QString &variant, const LLModel::LoadOptions &options)
+{
+    QThread *thread = QThread::create([this, fileInfo, variant, options] {
+        const QString filePath = fileInfo.absoluteFilePath();
+        const size_t requiredMem = requiredModelMem(filePath, variant, false, options);
+        {
+            QMutexLocker locker(&m_mutex);
+            const QString k = key(fileInfo, variant);
+            const bool loaded = m_inUse.contains(k) || std::any_of(m_idleModels.cbegin(), m_idleModels.cend(),
+                [&](const LLModelInfo &info) {
+                    return key(info.fileInfo, info.buildVariant) == k && hasLoadOptions(info.model, options);
+                });
+            if (loaded || !requiredMem || m_usedMem + requiredMem > budget())
+                return;
+            m_inUse.append(k);
+            m_usedMem += requiredMem;
+            updateMetrics();
+        }
+
+        LLModelInfo info;
+        info.fileInfo = fileInfo;
+        info.buildVariant = variant;
+        info.requiredMem = requiredMem;
+        info.isServer = true; // chats do not wait for it either
+        info.model = LLModel::Implementation::construct(filePath.toStdString(), variant.toStdString());
+        if (info.model) {
+            info.model->setLoadOptions(options);
+            if (!info.model->loadModel(filePath.toStdString()))
+                deleteModel(info);
+        }
+#if defined(DEBUG_MODEL_LOADING)
+        qDebug() << "preloaded model" << fileInfo.fileName() << info.model;
+#endif
+        releaseModel(info);
+    });
+    QObject::connect(thread, &QThread::finished, thread, &QObject::deleteLater);
+    thread->start();
+}
+
 ChatLLM::ChatLLM(Chat *parent, bool isServer)
     : QObject{nullptr}
     , m_promptResponseTokens(0)
@@ -68,6 +357,7 @@ ChatLLM::ChatLLM(Chat *parent, bool isServer)
     , m_shouldBeLoaded(true)
     , m_stopGenerating(false)
     , m_timer(nullptr)
+    , m_firstTokenTime(-1)
     , m_isServer(isServer)
     , m_forceMetal(MySettings::globalInstance()->forceMetal())
     , m_reloadingToChangeVariant(false)
@@ -86,6 +376,9 @@ ChatLLM::ChatLLM(Chat *parent, bool isServer)
     connect(this, &ChatLLM::requestRetrieveFromDB, LocalDocs::globalInstance()->database(), &Database::retrieveFromDB,
         Qt::BlockingQueuedConnection);
 
+    static std::atomic<int> nextContext = 0;
+    m_contextName = QString("chat-%1").arg(nextContext++);
+
     m_llmThread.setObjectName(parent->id());
     m_llmThread.start();
 }
@@ -99,9 +392,11 @@ ChatLLM::~ChatLLM()
     // The only time we should have a model loaded here is on shutdown
     // as we explicitly unload the model in all other circumstances
     if (isModelLoaded()) {
-        delete m_llModelInfo.model;
-        m_llModelInfo.model = nullptr;
+        LLModelStore::globalInstance()->forgetModel(m_llModelInfo.model);
+        deleteModel(m_llModelInfo);
     }
+    LLModelStore::globalInstance()->forgetContext(m_contextName);
+    Metrics::globalInstance()->setKvCacheUsed(this, 0);
 }
 
 void ChatLLM::handleThreadStarted()
@@ -152,59 +447,63 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
     QString filePath = modelInfo.dirpath + modelInfo.filename();
     QFileInfo fileInfo(filePath);
 
-    // We have a live model, but it isn't the one we want
-    bool alreadyAcquired = isModelLoaded();
-    if (alreadyAcquired) {
+    // We have a live model, but it isn't the one we want. It goes back to the store, which keeps it
+    // loaded if it fits in the budget along with the one we want.
+    if (isModelLoaded()) {
         resetContext();
+        LLModelStore::globalInstance()->forgetContext(m_contextName);
+        m_contextParked = false;
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "already acquired model deleted" << m_llmThread.objectName() << m_llModelInfo.model;
+        qDebug() << "already acquired model released" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-        delete m_llModelInfo.model;
-        m_llModelInfo.model = nullptr;
+        LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
+        m_llModelInfo = LLModelInfo();
+        reportKvCacheUsed();
         emit isModelLoadedChanged(false);
-    } else if (!m_isServer) {
-        // This is a blocking call that tries to retrieve the model we need from the model store.
-        // If it succeeds, then we just have to restore state. If the store has never had a model
-        // returned to it, then the modelInfo.model pointer should be null which will happen on startup
-        m_llModelInfo = LLModelStore::globalInstance()->acquireModel();
+    }
+
+    // This is a blocking call that tries to retrieve the model we need from the model store. If it
+    // succeeds, then we just have to restore state. Otherwise it has made room for the model, unloading
+    // the idle models that were used least recently. The server does not wait for the chats to release
+    // their models.
+    const QString variant = buildVariant(m_forceMetal);
+    const LLModel::LoadOptions options = loadOptions(modelInfo);
+    m_llModelInfo = LLModelStore::globalInstance()->acquireModel(fileInfo, variant, options,
+        requiredModelMem(filePath, variant, isChatGPT, options), m_isServer);
 #if defined(DEBUG_MODEL_LOADING)
-        qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model;
+    qDebug() << "acquired model from store" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-        // At this point it is possible that while we were blocked waiting to acquire the model from the
-        // store, that our state was changed to not be loaded. If this is the case, release the model
-        // back into the store and quit loading
-        if (!m_shouldBeLoaded) {
+    // At this point it is possible that while we were blocked waiting to acquire the model from the
+    // store, that our state was changed to not be loaded. If this is the case, release the model
+    // back into the store and quit loading
+    if (!m_shouldBeLoaded) {
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "no longer need model" << m_llmThread.objectName() << m_llModelInfo.model;
+        qDebug() << "no longer need model" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-            LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
-            m_llModelInfo = LLModelInfo();
-            emit isModelLoadedChanged(false);
-            return false;
-        }
+        LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
+        m_llModelInfo = LLModelInfo();
+        emit isModelLoadedChanged(false);
+        return false;
+    }
 
-        // Check if the store just gave us exactly the model we were looking for
-        if (m_llModelInfo.model && m_llModelInfo.fileInfo == fileInfo && !m_reloadingToChangeVariant) {
-#if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "store had our model" << m_llmThread.objectName() << m_llModelInfo.model;
-#endif
-            restoreState();
-            emit isModelLoadedChanged(true);
-            setModelInfo(modelInfo);
-            Q_ASSERT(!m_modelInfo.filename().isEmpty());
-            if (m_modelInfo.filename().isEmpty())
-                emit modelLoadingError(QString("Modelinfo is left null for %1").arg(modelInfo.filename()));
-            else
-                processSystemPrompt();
-            return true;
-        } else {
-            // Release the memory since we have to switch to a different model.
+    // Check if the store just gave us exactly the model we were looking for
+    if (m_llModelInfo.model) {
 #if defined(DEBUG_MODEL_LOADING)
-            qDebug() << "deleting model" << m_llmThread.objectName() << m_llModelInfo.model;
+        qDebug() << "store had our model" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
-            delete m_llModelInfo.model;
-            m_llModelInfo.model = nullptr;
-        }
+        // it may have been loaded by another chat or preloaded
+        m_llModelType = isChatGPT ? LLModelType::CHATGPT_ : *modelType(m_llModelInfo.model);
+        if (!isChatGPT && !m_llModelInfo.draftModel)
+            loadDraftModel(modelInfo); // a preloaded model, or one released before the draft was set
+        restoreState();
+        emit isModelLoadedChanged(true);
+        setModelInfo(modelInfo);
+        Q_ASSERT(!m_modelInfo.filename().isEmpty());
+        if (m_modelInfo.filename().isEmpty())
+            emit modelLoadingError(QString("Modelinfo is left null for %1").arg(modelInfo.filename()));
+        else
+            processSystemPrompt();
+        return true;
     }
 
     // Guarantee we've released the previous models memory
@@ -216,9 +515,6 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
     // Check if we've previously tried to load this file and failed/crashed
     if (MySettings::globalInstance()->attemptModelLoad() == filePath) {
         MySettings::globalInstance()->setAttemptModelLoad(QString()); // clear the flag
-        if (!m_isServer)
-            LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
-        m_llModelInfo = LLModelInfo();
         emit modelLoadingError(QString("Previous attempt to load model resulted in crash for `%1` most likely due to out of memory. You should either remove this model or decrease your system RAM by closing other applications.").arg(modelInfo.filename()));
     }
 
@@ -237,50 +533,39 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
             ChatGPT *model = new ChatGPT();
             model->setModelName(chatGPTModel);
             model->setAPIKey(apiKey);
+            model->setLoadOptions(options);
             m_llModelInfo.model = model;
         } else {
 
-#if defined(Q_OS_MAC) && defined(__arm__)
-            if (m_forceMetal)
-                m_llModelInfo.model = LLMImplementation::construct(filePath.toStdString(), "metal");
-            else
-                m_llModelInfo.model = LLMImplementation::construct(filePath.toStdString(), "auto");
-#else
-            m_llModelInfo.model = LLModel::Implementation::construct(filePath.toStdString(), "auto");
-#endif
+            m_llModelInfo.model = LLModel::Implementation::construct(filePath.toStdString(), variant.toStdString());
 
             if (m_llModelInfo.model) {
+                m_llModelInfo.model->setLoadOptions(options);
+                loadDraftModel(modelInfo); // before loadModel as llama.cpp has to know about it up front
                 MySettings::globalInstance()->setAttemptModelLoad(filePath);
+                QElapsedTimer loadTimer;
+                loadTimer.start();
                 bool success = m_llModelInfo.model->loadModel(filePath.toStdString());
                 MySettings::globalInstance()->setAttemptModelLoad(QString());
+                if (success)
+                    Metrics::globalInstance()->observe(Metrics::ModelLoad, loadTimer.elapsed() / 1000.0);
                 if (!success) {
-                    delete std::exchange(m_llModelInfo.model, nullptr);
-                    if (!m_isServer)
-                        LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
+                    deleteModel(m_llModelInfo);
+                    LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
                     m_llModelInfo = LLModelInfo();
                     emit modelLoadingError(QString("Could not load model due to invalid model file for %1").arg(modelInfo.filename()));
                 } else {
-                    switch (m_llModelInfo.model->implementation().modelType()[0]) {
-                    case 'L': m_llModelType = LLModelType::LLAMA_; break;
-                    case 'G': m_llModelType = LLModelType::GPTJ_; break;
-                    case 'M': m_llModelType = LLModelType::MPT_; break;
-                    case 'R': m_llModelType = LLModelType::REPLIT_; break;
-                    case 'F': m_llModelType = LLModelType::FALCON_; break;
-                    case 'B': m_llModelType = LLModelType::BERT_; break;
-                    case 'S': m_llModelType = LLModelType::STARCODER_; break;
-                    default:
-                        {
-                            delete std::exchange(m_llModelInfo.model, nullptr);
-                            if (!m_isServer)
-                                LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
-                            m_llModelInfo = LLModelInfo();
-                            emit modelLoadingError(QString("Could not determine model type for %1").arg(modelInfo.filename()));
-                        }
+                    if (const auto type = modelType(m_llModelInfo.model)) {
+                        m_llModelType = *type;
+                    } else {
+                        deleteModel(m_llModelInfo);
+                        LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
+                        m_llModelInfo = LLModelInfo();
+                        emit modelLoadingError(QString("Could not determine model type for %1").arg(modelInfo.filename()));
                     }
                 }
             } else {
-                if (!m_isServer)
-                    LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
+                LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
                 m_llModelInfo = LLModelInfo();
                 emit modelLoadingError(QString("Could not load model due to invalid format for %1").arg(modelInfo.filename()));
             }
@@ -302,8 +587,7 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
         } else
             emit sendModelLoaded();
     } else {
-        if (!m_isServer)
-            LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
+        LLModelStore::globalInstance()->releaseModel(m_llModelInfo); // release back into the store
         m_llModelInfo = LLModelInfo();
         emit modelLoadingError(QString("Could not find file for model %1").arg(modelInfo.filename()));
     }
@@ -315,6 +599,22 @@ bool ChatLLM::loadModel(const ModelInfo &modelInfo)
     return m_llModelInfo.model;
 }
 
+void ChatLLM::preloadModel(const ModelInfo &modelInfo)
+{
+    if (modelInfo.isChatGPT || modelInfo.filename().isEmpty())
+        return;
+    const QFileInfo fileInfo(modelInfo.dirpath + modelInfo.filename());
+    LLModelStore::globalInstance()->preloadModel(fileInfo, buildVariant(m_forceMetal), loadOptions(modelInfo));
+}
+
+LLModel::LoadOptions ChatLLM::loadOptions(const ModelInfo &modelInfo) const
+{
+    LLModel::LoadOptions options;
+    options.n_seq = contextPoolSize();
+    options.logits_all = !modelInfo.isChatGPT && hasDraftModel(modelInfo); // see LLModel::setDraftModel()
+    return options;
+}
+
 bool ChatLLM::isModelLoaded() const
 {
     return m_llModelInfo.model && m_llModelInfo.model->isModelLoaded();
@@ -351,6 +651,26 @@ void ChatLLM::resetContext()
     m_ctx = LLModel::PromptContext();
 }
 
+void ChatLLM::forgetContext()
+{
+    // the KV cache does not hold what the context says, so nothing of it can be reused
+    m_processedSystemPrompt = false;
+    m_ctx.n_past = 0;
+    m_ctx.n_keep = 0;
+    m_ctx.tokens.clear();
+    m_ctx.logits.clear();
+}
+
+void ChatLLM::rewindContext()
+{
+    // Forget the conversation but keep its tokens, the next prompt reuses the part of the KV cache
+    // that it has in common with them
+    resetResponse();
+    m_processedSystemPrompt = false;
+    m_ctx.n_past = 0;
+    m_ctx.n_keep = 0;
+}
+
 std::string remove_leading_whitespace(const std::string& input) {
     auto first_non_whitespace = std::find_if(input.begin(), input.end(), [](unsigned char c) {
         return !std::isspace(c);
@@ -402,13 +722,14 @@ bool ChatLLM::handlePrompt(int32_t token)
     ++m_promptTokens;
     ++m_promptResponseTokens;
     m_timer->start();
+    refreshCpuLease();
     return !m_stopGenerating;
 }
 
-bool ChatLLM::handleResponse(int32_t token, const std::string &response)
+bool ChatLLM::handleResponse(int32_t token, std::string_view response)
 {
 #if defined(DEBUG)
-    printf("%s", response.c_str());
+    printf("%.*s", int(response.size()), response.data());
     fflush(stdout);
 #endif
 
@@ -422,10 +743,15 @@ bool ChatLLM::handleResponse(int32_t token, const std::string &response)
     // m_promptResponseTokens is related to last prompt/response not
     // the entire context window which we can reset on regenerate prompt
     ++m_promptResponseTokens;
+    if (m_firstTokenTime < 0)
+        m_firstTokenTime = m_promptTimer.nsecsElapsed();
     m_timer->inc();
-    Q_ASSERT(!response.empty());
-    m_response.append(response);
-    emit responseChanged(QString::fromStdString(m_response));
+    // the text of a token may be held back, it comes with a later one
+    if (!response.empty()) {
+        m_response.append(response);
+        emit responseChanged(QString::fromStdString(m_response));
+    }
+    refreshCpuLease();
     return !m_stopGenerating;
 }
 
@@ -436,6 +762,10 @@ bool ChatLLM::handleRecalculate(bool isRecalc)
 #endif
     if (m_isRecalc != isRecalc) {
         m_isRecalc = isRecalc;
+        if (isRecalc)
+            m_recalcTimer.start();
+        else
+            Metrics::globalInstance()->observe(Metrics::ContextRecalculation, m_recalcTimer.elapsed() / 1000.0);
         emit recalcChanged();
     }
     return !m_stopGenerating;
@@ -452,6 +782,7 @@ bool ChatLLM::prompt(const QList<QString> &collectionList, const QString &prompt
     const int32_t n_batch = MySettings::globalInstance()->modelPromptBatchSize(m_modelInfo);
     const float repeat_penalty = MySettings::globalInstance()->modelRepeatPenalty(m_modelInfo);
     const int32_t repeat_penalty_tokens = MySettings::globalInstance()->modelRepeatPenaltyTokens(m_modelInfo);
+    m_ctx.min_p = MySettings::globalInstance()->modelMinP(m_modelInfo);
     return promptInternal(collectionList, prompt, promptTemplate, n_predict, top_k, top_p, temp, n_batch,
         repeat_penalty, repeat_penalty_tokens);
 }
@@ -464,20 +795,9 @@ bool ChatLLM::promptInternal(const QList<QString> &collectionList, const QString
         return false;
 
     QList<ResultInfo> databaseResults;
-    const int retrievalSize = MySettings::globalInstance()->localDocsRetrievalSize();
-    emit requestRetrieveFromDB(collectionList, prompt, retrievalSize, &databaseResults); // blocks
+    QString instructPrompt = applyPromptTemplate(collectionList, prompt, promptTemplate, databaseResults);
     emit databaseResultsChanged(databaseResults);
 
-    // Augment the prompt template with the results if any
-    QList<QString> augmentedTemplate;
-    if (!databaseResults.isEmpty())
-        augmentedTemplate.append("### Context:");
-    for (const ResultInfo &info : databaseResults)
-        augmentedTemplate.append(info.text);
-    augmentedTemplate.append(promptTemplate);
-
-    QString instructPrompt = augmentedTemplate.join("\n").arg(prompt);
-
     int n_threads = MySettings::globalInstance()->threadCount();
 
     m_stopGenerating = false;
@@ -494,18 +814,36 @@ bool ChatLLM::promptInternal(const QList<QString> &collectionList, const QString
     m_ctx.n_batch = n_batch;
     m_ctx.repeat_penalty = repeat_penalty;
     m_ctx.repeat_last_n = repeat_penalty_tokens;
-    m_llModelInfo.model->setThreadCount(n_threads);
+    acquireCpuLease(n_threads);
 #if defined(DEBUG)
     printf("%s", qPrintable(instructPrompt));
     fflush(stdout);
 #endif
     m_timer->start();
+    const quint32 promptTokensBefore = m_promptTokens;
+    const quint32 promptResponseTokensBefore = m_promptResponseTokens;
+    m_firstTokenTime = -1;
+    m_promptTimer.start();
     m_llModelInfo.model->prompt(instructPrompt.toStdString(), promptFunc, responseFunc, recalcFunc, m_ctx);
 #if defined(DEBUG)
     printf("\n");
     fflush(stdout);
 #endif
     m_timer->stop();
+    releaseCpuLease();
+    if (m_llModelType != LLModelType::CHATGPT_ && m_firstTokenTime > 0) {
+        const qint64 promptTokens = m_promptTokens - promptTokensBefore;
+        const qint64 responseTokens = m_promptResponseTokens - promptResponseTokensBefore - promptTokens;
+        reportTimings(m_firstTokenTime / 1e9, promptTokens, (m_promptTimer.nsecsElapsed() - m_firstTokenTime) / 1e9,
+            responseTokens);
+    }
+    reportKvCacheUsed();
+#if defined(DEBUG)
+    if (m_llModelInfo.draftModel) {
+        printf("draft accept rate: %.2f\n", m_llModelInfo.model->speculativeStats().acceptRate());
+        fflush(stdout);
+    }
+#endif
     std::string trimmed = trim_whitespace(m_response);
     if (trimmed != m_response) {
         m_response = trimmed;
@@ -515,6 +853,96 @@ bool ChatLLM::promptInternal(const QList<QString> &collectionList, const QString
     return true;
 }
 
+QString ChatLLM::applyPromptTemplate(const QList<QString> &collectionList, const QString &prompt,
+    const QString &promptTemplate, QList<ResultInfo> &databaseResults)
+{
+    const int retrievalSize = MySettings::globalInstance()->localDocsRetrievalSize();
+    if (!collectionList.isEmpty()) {
+        QElapsedTimer retrievalTimer;
+        retrievalTimer.start();
+        emit requestRetrieveFromDB(collectionList, prompt, retrievalSize, &databaseResults); // blocks
+        Metrics::globalInstance()->observe(Metrics::LocalDocsRetrieval, retrievalTimer.nsecsElapsed() / 1e9);
+    }
+
+    // Augment the prompt template with the results if any
+    QList<QString> augmentedTemplate;
+    if (!databaseResults.isEmpty())
+        augmentedTemplate.append("### Context:");
+    for (const ResultInfo &info : databaseResults)
+        augmentedTemplate.append(info.text);
+    augmentedTemplate.append(promptTemplate);
+
+    return augmentedTemplate.join("\n").arg(prompt);
+}
+
+// The latencies of a prompt for the metrics the server exports: the time to the first token, in which
+// the prompt tokens were evaluated, and the time the other generated tokens took
+void ChatLLM::reportTimings(double timeToFirstToken, qint64 promptTokens, double decodeTime, qint64 decodedTokens)
+{
+    Metrics *metrics = Metrics::globalInstance();
+    metrics->observe(Metrics::TimeToFirstToken, timeToFirstToken);
+    if (promptTokens > 0 && timeToFirstToken > 0)
+        metrics->observe(Metrics::PromptTokensPerSecond, promptTokens / timeToFirstToken);
+    if (decodedTokens > 1 && decodeTime > 0)
+        metrics->observe(Metrics::DecodeTokensPerSecond, (decodedTokens - 1) / decodeTime);
+}
+
+void ChatLLM::reportKvCacheUsed()
+{
+    Metrics::globalInstance()->setKvCacheUsed(this, isModelLoaded() ? m_llModelInfo.model->kvCacheUsed() : 0);
+}
+
+// Shares the cores with the other chats and the embedding worker while the model evaluates, the model
+// runs as many threads as the lease has cores. Remote models do not compute here and take no cores.
+void ChatLLM::acquireCpuLease(int32_t n_threads)
+{
+    if (m_llModelType == LLModelType::CHATGPT_) {
+        m_llModelInfo.model->setThreadCount(n_threads);
+        return;
+    }
+    m_cpuLease = std::make_unique<CpuScheduler::Lease>(n_threads);
+    setThreadCount(m_cpuLease->threadCount());
+}
+
+// Called between tokens so a long response follows the chats that start and stop meanwhile
+void ChatLLM::refreshCpuLease()
+{
+    if (m_cpuLease && m_cpuLease->refresh())
+        setThreadCount(m_cpuLease->threadCount());
+}
+
+void ChatLLM::releaseCpuLease()
+{
+    m_cpuLease.reset();
+}
+
+// The draft model takes turns with the model it proposes tokens for, so it runs on the same cores
+void ChatLLM::setThreadCount(int32_t n_threads)
+{
+    m_llModelInfo.model->setThreadCount(n_threads);
+    if (m_llModelInfo.draftModel)
+        m_llModelInfo.draftModel->setThreadCount(n_threads);
+}
+
+void ChatLLM::loadDraftModel(const ModelInfo &modelInfo)
+{
+    if (!hasDraftModel(modelInfo))
+        return;
+
+    const QString draftPath = modelInfo.dirpath + modelInfo.draftModel();
+    LLModel *draft = nullptr;
+    if (QFileInfo::exists(draftPath))
+        draft = LLModel::Implementation::construct(draftPath.toStdString(), "auto");
+    if (!draft || !draft->loadModel(draftPath.toStdString())) {
+        qWarning() << "WARNING: could not load draft model" << draftPath;
+        delete draft;
+        return;
+    }
+
+    m_llModelInfo.draftModel = draft;
+    m_llModelInfo.model->setDraftModel(draft, modelInfo.draftTokens());
+}
+
 void ChatLLM::setShouldBeLoaded(bool b)
 {
 #if defined(DEBUG_MODEL_LOADING)
@@ -543,12 +971,16 @@ void ChatLLM::unloadModel()
     if (!isModelLoaded() || m_isServer)
         return;
 
-    saveState();
+    // the conversation stays in the slot of our context for when we take the model again
+    m_contextParked = ownsContext();
+    if (!m_contextParked)
+        saveState();
 #if defined(DEBUG_MODEL_LOADING)
     qDebug() << "unloadModel" << m_llmThread.objectName() << m_llModelInfo.model;
 #endif
     LLModelStore::globalInstance()->releaseModel(m_llModelInfo);
     m_llModelInfo = LLModelInfo();
+    reportKvCacheUsed();
     emit isModelLoadedChanged(false);
 }
 
@@ -581,6 +1013,7 @@ void ChatLLM::generateName()
         std::placeholders::_2);
     auto recalcFunc = std::bind(&ChatLLM::handleNameRecalculate, this, std::placeholders::_1);
     LLModel::PromptContext ctx = m_ctx;
+    acquireCpuLease(MySettings::globalInstance()->threadCount());
 #if defined(DEBUG)
     printf("%s", qPrintable(instructPrompt));
     fflush(stdout);
@@ -590,6 +1023,7 @@ void ChatLLM::generateName()
     printf("\n");
     fflush(stdout);
 #endif
+    releaseCpuLease();
     std::string trimmed = trim_whitespace(m_nameResponse);
     if (trimmed != m_nameResponse) {
         m_nameResponse = trimmed;
@@ -612,10 +1046,10 @@ bool ChatLLM::handleNamePrompt(int32_t token)
     return !m_stopGenerating;
 }
 
-bool ChatLLM::handleNameResponse(int32_t token, const std::string &response)
+bool ChatLLM::handleNameResponse(int32_t token, std::string_view response)
 {
 #if defined(DEBUG)
-    qDebug() << "name response" << m_llmThread.objectName() << token << response;
+    qDebug() << "name response" << m_llmThread.objectName() << token << QByteArrayView(response.data(), response.size());
 #endif
     Q_UNUSED(token);
 
@@ -645,10 +1079,11 @@ bool ChatLLM::handleSystemPrompt(int32_t token)
     return !m_stopGenerating;
 }
 
-bool ChatLLM::handleSystemResponse(int32_t token, const std::string &response)
+bool ChatLLM::handleSystemResponse(int32_t token, std::string_view response)
 {
 #if defined(DEBUG)
-    qDebug() << "system response" << m_llmThread.objectName() << token << response << m_stopGenerating;
+    qDebug() << "system response" << m_llmThread.objectName() << token << QByteArrayView(response.data(), response.size())
+             << m_stopGenerating;
 #endif
     Q_UNUSED(token);
     Q_UNUSED(response);
@@ -664,20 +1099,29 @@ bool ChatLLM::handleSystemRecalculate(bool isRecalc)
     return false;
 }
 
+// The version of the state the backend of a model type saves, -1 for types without one
+static int internalStateVersion(LLModelType type)
+{
+    switch (type) {
+    case REPLIT_: return REPLIT_INTERNAL_STATE_VERSION;
+    case MPT_: return MPT_INTERNAL_STATE_VERSION;
+    case GPTJ_: return GPTJ_INTERNAL_STATE_VERSION;
+    case LLAMA_: return LLAMA_INTERNAL_STATE_VERSION;
+    case FALCON_: return FALCON_INTERNAL_STATE_VERSION;
+    case BERT_: return BERT_INTERNAL_STATE_VERSION;
+    case STARCODER_: return STARCODER_INTERNAL_STATE_VERSION;
+    default: return -1;
+    }
+}
+
 bool ChatLLM::serialize(QDataStream &stream, int version)
 {
     if (version > 1) {
         stream << m_llModelType;
-        switch (m_llModelType) {
-        case REPLIT_: stream << REPLIT_INTERNAL_STATE_VERSION; break;
-        case MPT_: stream << MPT_INTERNAL_STATE_VERSION; break;
-        case GPTJ_: stream << GPTJ_INTERNAL_STATE_VERSION; break;
-        case LLAMA_: stream << LLAMA_INTERNAL_STATE_VERSION; break;
-        case FALCON_: stream << FALCON_INTERNAL_STATE_VERSION; break;
-        case BERT_: stream << BERT_INTERNAL_STATE_VERSION; break;
-        case STARCODER_: stream << STARCODER_INTERNAL_STATE_VERSION; break;
-        default: Q_UNREACHABLE();
-        }
+        const int stateVersion = internalStateVersion(m_llModelType);
+        if (stateVersion < 0)
+            Q_UNREACHABLE();
+        stream << stateVersion;
     }
     stream << response();
     stream << generatedName();
@@ -691,8 +1135,11 @@ bool ChatLLM::serialize(QDataStream &stream, int version)
     stream.writeRawData(reinterpret_cast<const char*>(m_ctx.logits.data()), m_ctx.logits.size() * sizeof(float));
     stream << quint64(m_ctx.tokens.size());
     stream.writeRawData(reinterpret_cast<const char*>(m_ctx.tokens.data()), m_ctx.tokens.size() * sizeof(int));
+    if (!isModelLoaded() && m_contextParked && !LLModelStore::globalInstance()->contextState(m_contextName, m_state))
+        m_state.clear();
     saveState();
-    QByteArray compressed = qCompress(m_state);
+    // the state only holds the cached tokens and barely compresses, so favor speed
+    QByteArray compressed = qCompress(m_state, 1);
     stream << compressed;
 #if defined(DEBUG)
     qDebug() << "serialize" << m_llmThread.objectName() << m_state.size();
@@ -702,10 +1149,10 @@ bool ChatLLM::serialize(QDataStream &stream, int version)
 
 bool ChatLLM::deserialize(QDataStream &stream, int version)
 {
+    int stateVersion = -1;
     if (version > 1) {
-        int internalStateVersion;
         stream >> m_llModelType;
-        stream >> internalStateVersion; // for future use
+        stream >> stateVersion;
     }
     QString response;
     stream >> response;
@@ -734,6 +1181,11 @@ bool ChatLLM::deserialize(QDataStream &stream, int version)
     } else {
         stream >> m_state;
     }
+    // the backend cannot read a state in an older format, the chat starts over from an empty context
+    if (m_llModelType != LLModelType::CHATGPT_ && stateVersion != internalStateVersion(m_llModelType)) {
+        m_state.clear();
+        forgetContext();
+    }
 #if defined(DEBUG)
     qDebug() << "deserialize" << m_llmThread.objectName();
 #endif
@@ -754,17 +1206,50 @@ void ChatLLM::saveState()
         return;
     }
 
-    const size_t stateSize = m_llModelInfo.model->stateSize();
-    m_state.resize(stateSize);
+    m_state.clear();
+    m_llModelInfo.model->writeState([this](const void *data, size_t size) {
+        m_state.append(static_cast<const char*>(data), qsizetype(size));
+        return true;
+    });
 #if defined(DEBUG)
     qDebug() << "saveState" << m_llmThread.objectName() << "size:" << m_state.size();
 #endif
-    m_llModelInfo.model->saveState(static_cast<uint8_t*>(reinterpret_cast<void*>(m_state.data())));
+}
+
+bool ChatLLM::ownsContext() const
+{
+    return isModelLoaded() && m_llModelType != LLModelType::CHATGPT_
+        && m_llModelInfo.model->currentContext() == m_contextName.toStdString();
+}
+
+int32_t ChatLLM::contextPoolSize() const
+{
+    // slot 0 is for the default context, of the chats that find no slot for their own
+    const int chats = MySettings::globalInstance()->chatContexts();
+    return chats > 0 ? chats + 1 : 1;
 }
 
 void ChatLLM::restoreState()
 {
-    if (!isModelLoaded() || m_state.isEmpty())
+    if (!isModelLoaded())
+        return;
+
+    if (!m_isServer && m_llModelType != LLModelType::CHATGPT_) {
+        const bool parked = std::exchange(m_contextParked, false);
+        QByteArray state;
+        if (LLModelStore::globalInstance()->claimContext(m_llModelInfo.model, m_contextName, state)) {
+            m_state.clear();
+            return;
+        }
+        if (parked) {
+            m_state = state;
+            // the context lost its slot without its state being saved
+            if (m_state.isEmpty())
+                forgetContext();
+        }
+    }
+
+    if (m_state.isEmpty())
         return;
 
     if (m_llModelType == LLModelType::CHATGPT_) {
@@ -783,7 +1268,18 @@ void ChatLLM::restoreState()
     qDebug() << "restoreState" << m_llmThread.objectName() << "size:" << m_state.size();
 #endif
     m_processedSystemPrompt = true;
-    m_llModelInfo.model->restoreState(static_cast<const uint8_t*>(reinterpret_cast<void*>(m_state.data())));
+    qsizetype offset = 0;
+    const bool restored = m_llModelInfo.model->readState([this, &offset](void *data, size_t size) {
+        if (qsizetype(size) > m_state.size() - offset)
+            return false;
+        memcpy(data, m_state.constData() + offset, size);
+        offset += qsizetype(size);
+        return true;
+    });
+    if (!restored) {
+        qWarning() << "ERROR: Could not restore the state of" << m_llmThread.objectName();
+        forgetContext();
+    }
     m_state.clear();
     m_state.resize(0);
 }
@@ -817,11 +1313,12 @@ void ChatLLM::processSystemPrompt()
     m_ctx.n_predict = n_predict;
     m_ctx.top_k = top_k;
     m_ctx.top_p = top_p;
+    m_ctx.min_p = MySettings::globalInstance()->modelMinP(m_modelInfo);
     m_ctx.temp = temp;
     m_ctx.n_batch = n_batch;
     m_ctx.repeat_penalty = repeat_penalty;
     m_ctx.repeat_last_n = repeat_penalty_tokens;
-    m_llModelInfo.model->setThreadCount(n_threads);
+    acquireCpuLease(n_threads);
 #if defined(DEBUG)
     printf("%s", qPrintable(QString::fromStdString(systemPrompt)));
     fflush(stdout);
@@ -831,5 +1328,8 @@ void ChatLLM::processSystemPrompt()
     printf("\n");
     fflush(stdout);
 #endif
+    releaseCpuLease();
+    // Keep the system prompt in the context window when it fills up
+    m_ctx.n_keep = m_ctx.n_past;
     m_processedSystemPrompt = true;
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "localdocs.h"
 #include "modellist.h"
 #include "../gpt4all-backend/llmodel.h"
+#include "../gpt4all-backend/cpu_scheduler.h"
 
 enum LLModelType {
     MPT_,
@@ -22,7 +23,11 @@ enum LLModelType {
 
 struct LLModelInfo {
     LLModel *model = nullptr;
+    LLModel *draftModel = nullptr; // proposes tokens for speculative decoding, deleted along with model
     QFileInfo fileInfo;
+    QString buildVariant; // the model store pools models by file and build variant
+    size_t requiredMem = 0; // what the model store accounts for the model
+    bool isServer = false; // chats do not wait for the server to release its model
     // NOTE: This does not store the model type or name on purpose as this is left for ChatLLM which
     // must be able to serialize the information even if it is in the unloaded state
 };
@@ -80,6 +85,7 @@ public:
     void regenerateResponse();
     void resetResponse();
     void resetContext();
+    void rewindContext();
 
     void stopGenerating() { m_stopGenerating = true; }
 
@@ -102,6 +108,7 @@ public Q_SLOTS:
     bool prompt(const QList<QString> &collectionList, const QString &prompt);
     bool loadDefaultModel();
     bool loadModel(const ModelInfo &modelInfo);
+    void preloadModel(const ModelInfo &modelInfo);
     void modelChangeRequested(const ModelInfo &modelInfo);
     void forceUnloadModel();
     void unloadModel();
@@ -136,16 +143,34 @@ protected:
         int32_t n_predict, int32_t top_k, float top_p, float temp, int32_t n_batch, float repeat_penalty,
         int32_t repeat_penalty_tokens);
     bool handlePrompt(int32_t token);
-    bool handleResponse(int32_t token, const std::string &response);
+    virtual bool handleResponse(int32_t token, std::string_view response);
     bool handleRecalculate(bool isRecalc);
     bool handleNamePrompt(int32_t token);
-    bool handleNameResponse(int32_t token, const std::string &response);
+    bool handleNameResponse(int32_t token, std::string_view response);
     bool handleNameRecalculate(bool isRecalc);
     bool handleSystemPrompt(int32_t token);
-    bool handleSystemResponse(int32_t token, const std::string &response);
+    bool handleSystemResponse(int32_t token, std::string_view response);
     bool handleSystemRecalculate(bool isRecalc);
+    // Fills in the prompt template, preceded by the LocalDocs excerpts retrieved for the prompt
+    QString applyPromptTemplate(const QList<QString> &collectionList, const QString &prompt,
+        const QString &promptTemplate, QList<ResultInfo> &databaseResults);
+    // KV cache slots a model is loaded with, for sequences that are evaluated together or for the
+    // contexts of the chats that take turns with it
+    virtual int32_t contextPoolSize() const;
+    // what the model is loaded with, and what a model the store hands out must have been loaded with
+    LLModel::LoadOptions loadOptions(const ModelInfo &modelInfo) const;
+    LLModel *llModel() const { return m_llModelInfo.model; }
     void saveState();
     void restoreState();
+    void forgetContext();
+    bool ownsContext() const; // whether the model runs the named context of this chat
+    void loadDraftModel(const ModelInfo &modelInfo);
+    void reportTimings(double timeToFirstToken, qint64 promptTokens, double decodeTime, qint64 decodedTokens);
+    void reportKvCacheUsed();
+    void acquireCpuLease(int32_t n_threads);
+    void refreshCpuLease();
+    void releaseCpuLease();
+    void setThreadCount(int32_t n_threads);
 
 protected:
     LLModel::PromptContext m_ctx;
@@ -159,8 +184,14 @@ private:
     LLModelType m_llModelType;
     ModelInfo m_modelInfo;
     TokenTimer *m_timer;
+    QElapsedTimer m_promptTimer;
+    qint64 m_firstTokenTime;    // nanoseconds after m_promptTimer started, -1 before the first token
+    QElapsedTimer m_recalcTimer;
     QByteArray m_state;
+    QString m_contextName; // of this chat in the models it uses, see LLModelStore::claimContext()
+    bool m_contextParked = false; // the conversation was left in a model instead of m_state
     QThread m_llmThread;
+    std::unique_ptr<CpuScheduler::Lease> m_cpuLease;
     std::atomic<bool> m_stopGenerating;
     std::atomic<bool> m_shouldBeLoaded;
     std::atomic<bool> m_isRecalc;
@@ -1,5 +1,10 @@
 #include "embllm.h"
 #include "modellist.h"
+#include "../gpt4all-backend/cpu_scheduler.h"
+
+#include <QTimer>
+
+#include <utility>
 
 EmbeddingLLMWorker::EmbeddingLLMWorker()
     : QObject(nullptr)
@@ -97,6 +102,9 @@ std::vector<float> EmbeddingLLMWorker::generateSyncEmbedding(const QString &text
 
     std::vector<float> embedding(m_model->embeddingSize());
     try {
+        // share the cores with the chats, see CpuScheduler
+        CpuScheduler::Lease cpuLease(0);
+        m_model->setThreadCount(cpuLease.threadCount());
         m_model->embed({text.toStdString()}, embedding.data(), true);
     } catch (const std::exception &e) {
         qWarning() << "WARNING: LLModel::embed failed: " << e.what();
@@ -151,20 +159,22 @@ void EmbeddingLLMWorker::requestAsyncEmbedding(const QVector<EmbeddingChunk> &ch
     }
 
     if (m_nomicAPIKey.isEmpty()) {
+        std::vector<std::string> texts;
+        texts.reserve(chunks.size());
+        for (const auto &c : chunks)
+            texts.push_back(c.chunk.toStdString());
+        const size_t n_embd = m_model->embeddingSize();
+        std::vector<float> embeddings(texts.size() * n_embd);
+        if (!embedBatched(texts, embeddings.data(), false))
+            return;
+
         QVector<EmbeddingResult> results;
         results.reserve(chunks.size());
-        for (auto c : chunks) {
+        for (int i = 0; i < chunks.size(); ++i) {
             EmbeddingResult result;
-            result.folder_id = c.folder_id;
-            result.chunk_id = c.chunk_id;
-            // TODO(cebtenzzre): take advantage of batched embeddings
-            result.embedding.resize(m_model->embeddingSize());
-            try {
-                m_model->embed({c.chunk.toStdString()}, result.embedding.data(), false);
-            } catch (const std::exception &e) {
-                qWarning() << "WARNING: LLModel::embed failed:" << e.what();
-                return;
-            }
+            result.folder_id = chunks[i].folder_id;
+            result.chunk_id = chunks[i].chunk_id;
+            result.embedding.assign(embeddings.begin() + i * n_embd, embeddings.begin() + (i + 1) * n_embd);
             results << result;
         }
         emit embeddingsGenerated(results);
@@ -177,6 +187,84 @@ void EmbeddingLLMWorker::requestAsyncEmbedding(const QVector<EmbeddingChunk> &ch
     sendAtlasRequest(texts, "search_document", QVariant::fromValue(chunks));
 }
 
+static int estimateTokens(const std::string &text)
+{
+    return int(text.size() / 4) + 1;
+}
+
+// Embeds the texts in as few calls to the model as fit in EMBEDDING_BATCH_TOKENS, so the model packs
+// them into batched forward passes instead of evaluating one text at a time
+bool EmbeddingLLMWorker::embedBatched(const std::vector<std::string> &texts, float *embeddings, bool isRetrieval)
+{
+    const size_t n_embd = m_model->embeddingSize();
+    // share the cores with the chats, see CpuScheduler
+    CpuScheduler::Lease cpuLease(0);
+    m_model->setThreadCount(cpuLease.threadCount());
+    for (size_t begin = 0; begin < texts.size();) {
+        size_t end = begin;
+        int tokens = 0;
+        while (end < texts.size() && (end == begin || tokens + estimateTokens(texts[end]) <= EMBEDDING_BATCH_TOKENS))
+            tokens += estimateTokens(texts[end++]);
+
+        if (cpuLease.refresh())
+            m_model->setThreadCount(cpuLease.threadCount());
+        try {
+            m_model->embed(std::vector<std::string>(texts.begin() + begin, texts.begin() + end),
+                embeddings + begin * n_embd, isRetrieval);
+        } catch (const std::exception &e) {
+            qWarning() << "WARNING: LLModel::embed failed:" << e.what();
+            return false;
+        }
+        begin = end;
+    }
+    return true;
+}
+
+// The requests of the server are collected until the worker gets to them, so the texts of requests
+// that arrive together are embedded together
+void EmbeddingLLMWorker::requestServerEmbeddings(quint64 requestId, const QStringList &texts)
+{
+    m_serverRequests.append({ requestId, texts });
+    if (m_serverRequests.size() == 1)
+        QTimer::singleShot(0, this, &EmbeddingLLMWorker::processServerEmbeddings);
+}
+
+void EmbeddingLLMWorker::processServerEmbeddings()
+{
+    const QList<ServerEmbeddingRequest> requests = std::exchange(m_serverRequests, {});
+
+    QString error;
+    if (!hasModel() && !loadModel())
+        error = "no embedding model is installed";
+    else if (isNomic())
+        error = "the server only generates embeddings with a local model";
+
+    std::vector<std::string> texts;
+    for (const auto &request : requests)
+        for (const QString &text : request.texts)
+            texts.push_back(text.toStdString());
+
+    const size_t n_embd = error.isEmpty() ? m_model->embeddingSize() : 0;
+    std::vector<float> embeddings(texts.size() * n_embd);
+    if (error.isEmpty() && !embedBatched(texts, embeddings.data(), false))
+        error = "the embedding model failed";
+
+    size_t first = 0;
+    for (const auto &request : requests) {
+        QVector<std::vector<float>> results;
+        int tokens = 0;
+        if (error.isEmpty()) {
+            for (qsizetype i = 0; i < request.texts.size(); ++i) {
+                const auto begin = embeddings.begin() + (first + i) * n_embd;
+                results.append(std::vector<float>(begin, begin + n_embd));
+                tokens += estimateTokens(texts[first + i]);
+            }
+        }
+        first += request.texts.size();
+        emit serverEmbeddingsGenerated(request.id, results, tokens, error);
+    }
+}
+
 std::vector<float> jsonArrayToVector(const QJsonArray &jsonArray) {
     std::vector<float> result;
 
@@ -284,6 +372,10 @@ EmbeddingLLM::EmbeddingLLM()
         &EmbeddingLLM::embeddingsGenerated, Qt::QueuedConnection);
     connect(m_embeddingWorker, &EmbeddingLLMWorker::errorGenerated, this,
         &EmbeddingLLM::errorGenerated, Qt::QueuedConnection);
+    connect(this, &EmbeddingLLM::requestServerEmbeddings, m_embeddingWorker,
+        &EmbeddingLLMWorker::requestServerEmbeddings, Qt::QueuedConnection);
+    connect(m_embeddingWorker, &EmbeddingLLMWorker::serverEmbeddingsGenerated, this,
+        &EmbeddingLLM::serverEmbeddingsGenerated, Qt::QueuedConnection);
 }
 
 EmbeddingLLM::~EmbeddingLLM()
@@ -310,3 +402,8 @@ void EmbeddingLLM::generateAsyncEmbeddings(const QVector<EmbeddingChunk> &chunks
 {
     emit requestAsyncEmbedding(chunks);
 }
+
+void EmbeddingLLM::generateServerEmbeddings(quint64 requestId, const QStringList &texts)
+{
+    emit requestServerEmbeddings(requestId, texts);
+}
@@ -9,6 +9,9 @@
 
 #include "../gpt4all-backend/llmodel.h"
 
+// Texts are embedded together in calls of up to this many tokens, estimated from their length
+#define EMBEDDING_BATCH_TOKENS 8192
+
 struct EmbeddingChunk {
     int folder_id;
     int chunk_id;
@@ -42,18 +45,29 @@ public:
 public Q_SLOTS:
     void requestSyncEmbedding(const QString &text);
     void requestAsyncEmbedding(const QVector<EmbeddingChunk> &chunks);
+    void requestServerEmbeddings(quint64 requestId, const QStringList &texts);
 
 Q_SIGNALS:
     void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
     void errorGenerated(int folder_id, const QString &error);
+    void serverEmbeddingsGenerated(quint64 requestId, const QVector<std::vector<float>> &embeddings,
+        int tokens, const QString &error);
     void finished();
 
 private Q_SLOTS:
     void handleFinished();
+    void processServerEmbeddings();
 
 private:
     void sendAtlasRequest(const QStringList &texts, const QString &taskType, QVariant userData = {});
+    bool embedBatched(const std::vector<std::string> &texts, float *embeddings, bool isRetrieval);
+
+    struct ServerEmbeddingRequest {
+        quint64 id;
+        QStringList texts;
+    };
 
+    QList<ServerEmbeddingRequest> m_serverRequests; // that arrived since the last batch
     QString m_nomicAPIKey;
     QNetworkAccessManager *m_networkManager;
     std::vector<float> m_lastResponse;
@@ -74,12 +88,17 @@ public:
 public Q_SLOTS:
     std::vector<float> generateEmbeddings(const QString &text); // synchronous
     void generateAsyncEmbeddings(const QVector<EmbeddingChunk> &chunks);
+    // answered by serverEmbeddingsGenerated with the same requestId
+    void generateServerEmbeddings(quint64 requestId, const QStringList &texts);
 
 Q_SIGNALS:
     void requestSyncEmbedding(const QString &text);
     void requestAsyncEmbedding(const QVector<EmbeddingChunk> &chunks);
+    void requestServerEmbeddings(quint64 requestId, const QStringList &texts);
     void embeddingsGenerated(const QVector<EmbeddingResult> &embeddings);
     void errorGenerated(int folder_id, const QString &error);
+    void serverEmbeddingsGenerated(quint64 requestId, const QVector<std::vector<float>> &embeddings,
+        int tokens, const QString &error);
 
 private:
     EmbeddingLLMWorker *m_embeddingWorker;
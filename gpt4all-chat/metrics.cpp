@@ -0,0 +1,117 @@
+#include "metrics.h"
+#include "../gpt4all-backend/sysinfo.h"
+
+#include <QMutexLocker>
+#include <QTextStream>
+
+#include <algorithm>
+
+struct HistogramInfo {
+    const char *name;
+    const char *help;
+    std::vector<double> bounds;
+};
+
+static const HistogramInfo &histogramInfo(Metrics::Histogram histogram)
+{
+    static const std::vector<double> latency = { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+    static const std::vector<double> rate = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000 };
+    static const std::vector<double> slow = { 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300 };
+    static const std::vector<double> fast = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5 };
+    static const HistogramInfo infos[Metrics::HistogramCount] = {
+        { "gpt4all_time_to_first_token_seconds", "Time from a prompt to its first generated token.", latency },
+        { "gpt4all_prompt_tokens_per_second", "Prompt evaluation speed.", rate },
+        { "gpt4all_decode_tokens_per_second", "Generation speed after the first token.", rate },
+        { "gpt4all_queue_wait_seconds", "Time server requests waited for a KV cache slot.", latency },
+        { "gpt4all_model_load_seconds", "Time to load a model from disk.", slow },
+        { "gpt4all_localdocs_retrieval_seconds", "Time to retrieve the LocalDocs excerpts of a prompt.", fast },
+        { "gpt4all_context_recalculation_seconds", "Time spent recalculating a context that was full.", slow },
+    };
+    return infos[histogram];
+}
+
+class MyMetrics: public Metrics { };
+Q_GLOBAL_STATIC(MyMetrics, metricsInstance)
+Metrics *Metrics::globalInstance()
+{
+    return metricsInstance();
+}
+
+Metrics::Metrics()
+    : m_loadedModels(0)
+    , m_loadedModelBytes(0)
+{
+    for (int i = 0; i < HistogramCount; ++i) {
+        Buckets &buckets = m_histograms[i];
+        buckets.bounds = histogramInfo(Histogram(i)).bounds;
+        buckets.counts.assign(buckets.bounds.size() + 1, 0);
+    }
+}
+
+void Metrics::observe(Histogram histogram, double value)
+{
+    QMutexLocker locker(&m_mutex);
+    Buckets &buckets = m_histograms[histogram];
+    const auto bucket = std::lower_bound(buckets.bounds.begin(), buckets.bounds.end(), value);
+    ++buckets.counts[bucket - buckets.bounds.begin()];
+    buckets.sum += value;
+    ++buckets.count;
+}
+
+void Metrics::setLoadedModels(int count, quint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_loadedModels = count;
+    m_loadedModelBytes = bytes;
+}
+
+void Metrics::setKvCacheUsed(const void *owner, quint64 bytes)
+{
+    QMutexLocker locker(&m_mutex);
+    if (bytes)
+        m_kvCacheUsed.insert(owner, bytes);
+    else
+        m_kvCacheUsed.remove(owner);
+}
+
+QByteArray Metrics::exposition() const
+{
+    QByteArray out;
+    QTextStream stream(&out);
+
+    const auto gauge = [&](const char *name, const char *help, qint64 value) {
+        stream << "# HELP " << name << ' ' << help << '\n'
+               << "# TYPE " << name << " gauge\n"
+               << name << ' ' << value << '\n';
+    };
+
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < HistogramCount; ++i) {
+        const HistogramInfo &info = histogramInfo(Histogram(i));
+        const Buckets &buckets = m_histograms[i];
+        stream << "# HELP " << info.name << ' ' << info.help << '\n'
+               << "# TYPE " << info.name << " histogram\n";
+        quint64 cumulative = 0;
+        for (size_t b = 0; b < buckets.bounds.size(); ++b) {
+            cumulative += buckets.counts[b];
+            stream << info.name << "_bucket{le=\"" << buckets.bounds[b] << "\"} " << cumulative << '\n';
+        }
+        stream << info.name << "_bucket{le=\"+Inf\"} " << buckets.count << '\n'
+               << info.name << "_sum " << buckets.sum << '\n'
+               << info.name << "_count " << buckets.count << '\n';
+    }
+
+    quint64 kvCacheUsed = 0;
+    for (quint64 bytes : m_kvCacheUsed)
+        kvCacheUsed += bytes;
+
+    gauge("gpt4all_loaded_models", "Models that are loaded or being loaded.", m_loadedModels);
+    gauge("gpt4all_loaded_model_bytes", "Memory the loaded models need, as estimated before loading them.",
+        m_loadedModelBytes);
+    gauge("gpt4all_kv_cache_bytes", "Bytes of the KV caches that hold evaluated tokens.", kvCacheUsed);
+    locker.unlock();
+
+    gauge("process_resident_memory_bytes", "Resident memory size in bytes.", getProcessResidentMemoryInBytes());
+    stream.flush();
+    return out;
+}
@@ -0,0 +1,58 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+
+#include <array>
+#include <vector>
+
+// Performance measurements of the chats and the server, served by the server as Prometheus metrics
+// at /metrics. Observations come from the threads of the chats, the server and the model store, so
+// everything is behind one mutex; nothing here is on a path that runs more than once per token.
+class Metrics
+{
+public:
+    static Metrics *globalInstance();
+
+    enum Histogram {
+        TimeToFirstToken,       // seconds from the request or prompt to the first token
+        PromptTokensPerSecond,
+        DecodeTokensPerSecond,
+        QueueWait,              // seconds a server request waited for a KV cache slot
+        ModelLoad,              // seconds
+        LocalDocsRetrieval,     // seconds
+        ContextRecalculation,   // seconds
+        HistogramCount
+    };
+
+    void observe(Histogram histogram, double value);
+
+    void setLoadedModels(int count, quint64 bytes);
+    // KV cache in use by the model of a chat or the server, 0 once it has no model
+    void setKvCacheUsed(const void *owner, quint64 bytes);
+
+    // Everything in the Prometheus text exposition format
+    QByteArray exposition() const;
+
+protected:
+    Metrics();
+    ~Metrics() {}
+
+private:
+    struct Buckets {
+        std::vector<double> bounds;
+        std::vector<quint64> counts; // per bound, not cumulative, plus one for +Inf
+        double sum = 0.0;
+        quint64 count = 0;
+    };
+
+    mutable QMutex m_mutex;
+    std::array<Buckets, HistogramCount> m_histograms;
+    QHash<const void*, quint64> m_kvCacheUsed;
+    int m_loadedModels;
+    quint64 m_loadedModelBytes;
+};
+
+#endif // METRICS_H
@@ -139,6 +139,28 @@ void ModelInfo::setSystemPrompt(const QString &p)
     m_systemPrompt = p;
 }
 
+QString ModelInfo::draftModel() const
+{
+    return MySettings::globalInstance()->modelDraftModel(*this);
+}
+
+void ModelInfo::setDraftModel(const QString &f)
+{
+    if (isClone) MySettings::globalInstance()->setModelDraftModel(*this, f, isClone /*force*/);
+    m_draftModel = f;
+}
+
+int ModelInfo::draftTokens() const
+{
+    return MySettings::globalInstance()->modelDraftTokens(*this);
+}
+
+void ModelInfo::setDraftTokens(int t)
+{
+    if (isClone) MySettings::globalInstance()->setModelDraftTokens(*this, t, isClone /*force*/);
+    m_draftTokens = t;
+}
+
 InstalledModels::InstalledModels(QObject *parent)
     : QSortFilterProxyModel(parent)
 {
@@ -234,6 +256,8 @@ ModelList::ModelList()
     connect(MySettings::globalInstance(), &MySettings::repeatPenaltyTokensChanged, this, &ModelList::updateDataForSettings);;
     connect(MySettings::globalInstance(), &MySettings::promptTemplateChanged, this, &ModelList::updateDataForSettings);
     connect(MySettings::globalInstance(), &MySettings::systemPromptChanged, this, &ModelList::updateDataForSettings);
+    connect(MySettings::globalInstance(), &MySettings::draftModelChanged, this, &ModelList::updateDataForSettings);
+    connect(MySettings::globalInstance(), &MySettings::draftTokensChanged, this, &ModelList::updateDataForSettings);
     connect(&m_networkManager, &QNetworkAccessManager::sslErrors, this, &ModelList::handleSslErrors);
 
     updateModelsFromJson();
@@ -478,6 +502,10 @@ QVariant ModelList::dataInternal(const ModelInfo *info, int role) const
             return info->promptTemplate();
         case SystemPromptRole:
             return info->systemPrompt();
+        case DraftModelRole:
+            return info->draftModel();
+        case DraftTokensRole:
+            return info->draftTokens();
     }
 
     return QVariant();
@@ -603,6 +631,10 @@ void ModelList::updateData(const QString &id, int role, const QVariant &value)
             info->setPromptTemplate(value.toString()); break;
         case SystemPromptRole:
             info->setSystemPrompt(value.toString()); break;
+        case DraftModelRole:
+            info->setDraftModel(value.toString()); break;
+        case DraftTokensRole:
+            info->setDraftTokens(value.toInt()); break;
         }
 
         // Extra guarantee that these always remains in sync with filesystem
@@ -689,6 +721,8 @@ QString ModelList::clone(const ModelInfo &model)
     updateData(id, ModelList::RepeatPenaltyTokensRole, model.repeatPenaltyTokens());
     updateData(id, ModelList::PromptTemplateRole, model.promptTemplate());
     updateData(id, ModelList::SystemPromptRole, model.systemPrompt());
+    updateData(id, ModelList::DraftModelRole, model.draftModel());
+    updateData(id, ModelList::DraftTokensRole, model.draftTokens());
     return id;
 }
 
@@ -1057,6 +1091,10 @@ void ModelList::parseModelsJsonFile(const QByteArray &jsonData, bool save)
             updateData(id, ModelList::PromptTemplateRole, obj["promptTemplate"].toString());
         if (obj.contains("systemPrompt"))
             updateData(id, ModelList::SystemPromptRole, obj["systemPrompt"].toString());
+        if (obj.contains("draftModel"))
+            updateData(id, ModelList::DraftModelRole, obj["draftModel"].toString());
+        if (obj.contains("draftTokens"))
+            updateData(id, ModelList::DraftTokensRole, obj["draftTokens"].toInt());
     }
 
     const QString chatGPTDesc = tr("<ul><li>Requires personal OpenAI API key.</li><li>WARNING: Will send"
@@ -1149,6 +1187,9 @@ void ModelList::updateModelsFromSettings()
         const QString promptTemplate = settings.value(g + "/promptTemplate").toString();
         Q_ASSERT(settings.contains(g + "/systemPrompt"));
         const QString systemPrompt = settings.value(g + "/systemPrompt").toString();
+        // clones saved before speculative decoding do not have these
+        const QString draftModel = settings.value(g + "/draftModel").toString();
+        const int draftTokens = settings.value(g + "/draftTokens", 4).toInt();
 
         addModel(id);
         updateData(id, ModelList::IsCloneRole, true);
@@ -1163,5 +1204,7 @@ void ModelList::updateModelsFromSettings()
         updateData(id, ModelList::RepeatPenaltyTokensRole, repeatPenaltyTokens);
         updateData(id, ModelList::PromptTemplateRole, promptTemplate);
         updateData(id, ModelList::SystemPromptRole, systemPrompt);
+        updateData(id, ModelList::DraftModelRole, draftModel);
+        updateData(id, ModelList::DraftTokensRole, draftTokens);
     }
 }
@@ -50,6 +50,8 @@ struct ModelInfo {
     Q_PROPERTY(int repeatPenaltyTokens READ repeatPenaltyTokens WRITE setRepeatPenaltyTokens)
     Q_PROPERTY(QString promptTemplate READ promptTemplate WRITE setPromptTemplate)
     Q_PROPERTY(QString systemPrompt READ systemPrompt WRITE setSystemPrompt)
+    Q_PROPERTY(QString draftModel READ draftModel WRITE setDraftModel)
+    Q_PROPERTY(int draftTokens READ draftTokens WRITE setDraftTokens)
     Q_PROPERTY(int likes READ likes WRITE setLikes)
     Q_PROPERTY(int downloads READ downloads WRITE setDownloads)
     Q_PROPERTY(QDateTime recency READ recency WRITE setRecency)
@@ -149,6 +151,10 @@ public:
     void setPromptTemplate(const QString &t);
     QString systemPrompt() const;
     void setSystemPrompt(const QString &p);
+    QString draftModel() const;
+    void setDraftModel(const QString &f);
+    int draftTokens() const;
+    void setDraftTokens(int t);
 
     bool shouldSaveMetadata() const;
 
@@ -179,6 +185,8 @@ private:
     int     m_repeatPenaltyTokens  = 64;
     QString m_promptTemplate       = "### Human:\n%1\n\n### Assistant:\n";
     QString m_systemPrompt         = "### System:\nYou are an AI assistant who gives a quality response to whatever humans ask of you.\n\n";
+    QString m_draftModel;          // filename of a smaller model with the same vocabulary for speculative decoding
+    int     m_draftTokens          = 4;
     friend class MySettings;
 };
 Q_DECLARE_METATYPE(ModelInfo)
@@ -317,6 +325,8 @@ public:
         RepeatPenaltyTokensRole,
         PromptTemplateRole,
         SystemPromptRole,
+        DraftModelRole,
+        DraftTokensRole,
         MinPRole,
         LikesRole,
         DownloadsRole,
@@ -368,6 +378,8 @@ public:
         roles[RepeatPenaltyTokensRole] = "repeatPenaltyTokens";
         roles[PromptTemplateRole] = "promptTemplate";
         roles[SystemPromptRole] = "systemPrompt";
+        roles[DraftModelRole] = "draftModel";
+        roles[DraftTokensRole] = "draftTokens";
         roles[LikesRole] = "likes";
         roles[DownloadsRole] = "downloads";
         roles[RecencyRole] = "recency";
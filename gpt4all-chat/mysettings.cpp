@@ -1,6 +1,7 @@
 #include "mysettings.h"
 #include "modellist.h"
 #include "../gpt4all-backend/llmodel.h"
+#include "../gpt4all-backend/cpu_scheduler.h"
 
 #include <QDir>
 #include <QFile>
@@ -9,9 +10,11 @@
 #include <QStandardPaths>
 #include <QUrl>
 
-static int      default_threadCount         = std::min(4, (int32_t) std::thread::hardware_concurrency());
+static int      default_threadCount         = CpuScheduler::globalInstance().coreCount();
 static bool     default_saveChatsContext    = false;
 static bool     default_serverChat          = false;
+static int      default_modelPoolMemory     = 0;
+static int      default_chatContexts        = 2;
 static QString  default_userDefaultModel    = "Application default";
 static bool     default_forceMetal          = false;
 static QString  default_lastVersionStarted  = "";
@@ -98,6 +101,8 @@ void MySettings::restoreModelDefaults(const ModelInfo &model)
     setModelRepeatPenaltyTokens(model, model.m_repeatPenaltyTokens);
     setModelPromptTemplate(model, model.m_promptTemplate);
     setModelSystemPrompt(model, model.m_systemPrompt);
+    setModelDraftModel(model, model.m_draftModel);
+    setModelDraftTokens(model, model.m_draftTokens);
 }
 
 void MySettings::restoreApplicationDefaults()
@@ -108,6 +113,8 @@ void MySettings::restoreApplicationDefaults()
     setThreadCount(default_threadCount);
     setSaveChatsContext(default_saveChatsContext);
     setServerChat(default_serverChat);
+    setModelPoolMemory(default_modelPoolMemory);
+    setChatContexts(default_chatContexts);
     setNetworkPort(default_networkPort);
     setModelPath(defaultLocalModelsPath());
     setUserDefaultModel(default_userDefaultModel);
@@ -617,6 +624,50 @@ void MySettings::setModelSystemPrompt(const ModelInfo &m, const QString &p, bool
         emit systemPromptChanged(m);
 }
 
+QString MySettings::modelDraftModel(const ModelInfo &m) const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value(QString("model-%1").arg(m.id()) + "/draftModel", m.m_draftModel).toString();
+}
+
+void MySettings::setModelDraftModel(const ModelInfo &m, const QString &f, bool force)
+{
+    if (modelDraftModel(m) == f && !force)
+        return;
+
+    QSettings setting;
+    if (m.m_draftModel == f && !m.shouldSaveMetadata())
+        setting.remove(QString("model-%1").arg(m.id()) + "/draftModel");
+    else
+        setting.setValue(QString("model-%1").arg(m.id()) + "/draftModel", f);
+    setting.sync();
+    if (!force)
+        emit draftModelChanged(m);
+}
+
+int MySettings::modelDraftTokens(const ModelInfo &m) const
+{
+    QSettings setting;
+    setting.sync();
+    return setting.value(QString("model-%1").arg(m.id()) + "/draftTokens", m.m_draftTokens).toInt();
+}
+
+void MySettings::setModelDraftTokens(const ModelInfo &m, int t, bool force)
+{
+    if (modelDraftTokens(m) == t && !force)
+        return;
+
+    QSettings setting;
+    if (m.m_draftTokens == t && !m.shouldSaveMetadata())
+        setting.remove(QString("model-%1").arg(m.id()) + "/draftTokens");
+    else
+        setting.setValue(QString("model-%1").arg(m.id()) + "/draftTokens", t);
+    setting.sync();
+    if (!force)
+        emit draftTokensChanged(m);
+}
+
 int MySettings::threadCount() const
 {
     QSettings setting;
@@ -680,6 +731,44 @@ void MySettings::setServerChat(bool b)
     emit serverChatChanged();
 }
 
+int MySettings::modelPoolMemory() const
+{
+    QSettings setting;
+    setting.sync();
+    return std::max(setting.value("modelPoolMemory", default_modelPoolMemory).toInt(), 0);
+}
+
+void MySettings::setModelPoolMemory(int m)
+{
+    m = std::max(m, 0);
+    if (modelPoolMemory() == m)
+        return;
+
+    QSettings setting;
+    setting.setValue("modelPoolMemory", m);
+    setting.sync();
+    emit modelPoolMemoryChanged();
+}
+
+int MySettings::chatContexts() const
+{
+    QSettings setting;
+    setting.sync();
+    return std::max(setting.value("chatContexts", default_chatContexts).toInt(), 0);
+}
+
+void MySettings::setChatContexts(int c)
+{
+    c = std::max(c, 0);
+    if (chatContexts() == c)
+        return;
+
+    QSettings setting;
+    setting.setValue("chatContexts", c);
+    setting.sync();
+    emit chatContextsChanged();
+}
+
 int MySettings::networkPort() const
 {
     QSettings setting;
@@ -14,6 +14,8 @@ class MySettings : public QObject
     Q_PROPERTY(int threadCount READ threadCount WRITE setThreadCount NOTIFY threadCountChanged)
     Q_PROPERTY(bool saveChatsContext READ saveChatsContext WRITE setSaveChatsContext NOTIFY saveChatsContextChanged)
     Q_PROPERTY(bool serverChat READ serverChat WRITE setServerChat NOTIFY serverChatChanged)
+    Q_PROPERTY(int modelPoolMemory READ modelPoolMemory WRITE setModelPoolMemory NOTIFY modelPoolMemoryChanged)
+    Q_PROPERTY(int chatContexts READ chatContexts WRITE setChatContexts NOTIFY chatContextsChanged)
     Q_PROPERTY(QString modelPath READ modelPath WRITE setModelPath NOTIFY modelPathChanged)
     Q_PROPERTY(QString userDefaultModel READ userDefaultModel WRITE setUserDefaultModel NOTIFY userDefaultModelChanged)
     Q_PROPERTY(QString chatTheme READ chatTheme WRITE setChatTheme NOTIFY chatThemeChanged)
@@ -84,6 +86,10 @@ public:
     Q_INVOKABLE void setModelPromptTemplate(const ModelInfo &m, const QString &t, bool force = false);
     QString modelSystemPrompt(const ModelInfo &m) const;
     Q_INVOKABLE void setModelSystemPrompt(const ModelInfo &m, const QString &p, bool force = false);
+    QString modelDraftModel(const ModelInfo &m) const;
+    Q_INVOKABLE void setModelDraftModel(const ModelInfo &m, const QString &f, bool force = false);
+    int modelDraftTokens(const ModelInfo &m) const;
+    Q_INVOKABLE void setModelDraftTokens(const ModelInfo &m, int t, bool force = false);
     int modelContextLength(const ModelInfo &m) const;
     Q_INVOKABLE void setModelContextLength(const ModelInfo &m, int s, bool force = false);
     int modelGpuLayers(const ModelInfo &m) const;
@@ -96,6 +102,10 @@ public:
     void setSaveChatsContext(bool b);
     bool serverChat() const;
     void setServerChat(bool b);
+    int modelPoolMemory() const; // MiB the loaded models may take, 0 keeps only one loaded
+    void setModelPoolMemory(int m);
+    int chatContexts() const; // chats that keep their context in a loaded model, 0 saves it on every switch
+    void setChatContexts(int c);
     QString modelPath() const;
     void setModelPath(const QString &p);
     QString userDefaultModel() const;
@@ -153,9 +163,13 @@ Q_SIGNALS:
     void repeatPenaltyTokensChanged(const ModelInfo &model);
     void promptTemplateChanged(const ModelInfo &model);
     void systemPromptChanged(const ModelInfo &model);
+    void draftModelChanged(const ModelInfo &model);
+    void draftTokensChanged(const ModelInfo &model);
     void threadCountChanged();
     void saveChatsContextChanged();
     void serverChatChanged();
+    void modelPoolMemoryChanged();
+    void chatContextsChanged();
     void modelPathChanged();
     void userDefaultModelChanged();
     void chatThemeChanged();
@@ -286,9 +286,71 @@ MySettingsTab {
             Accessible.name: serverPortField.text
             Accessible.description: ToolTip.text
         }
-        Rectangle {
+        MySettingsLabel {
+            id: modelPoolMemoryLabel
+            text: qsTr("Memory for loaded models (MiB)")
             Layout.row: 10
             Layout.column: 0
+        }
+        MyTextField {
+            id: modelPoolMemoryField
+            text: MySettings.modelPoolMemory
+            color: theme.textColor
+            font.pixelSize: theme.fontSizeLarge
+            ToolTip.text: qsTr("Models stay loaded after a switch while they fit in this much memory, so switching back to them is instant. 0 keeps only one model loaded")
+            ToolTip.visible: hovered
+            Layout.row: 10
+            Layout.column: 1
+            validator: IntValidator {
+                bottom: 0
+            }
+            onEditingFinished: {
+                var val = parseInt(text)
+                if (!isNaN(val)) {
+                    MySettings.modelPoolMemory = val
+                    focus = false
+                } else {
+                    text = MySettings.modelPoolMemory
+                }
+            }
+            Accessible.role: Accessible.EditableText
+            Accessible.name: modelPoolMemoryLabel.text
+            Accessible.description: ToolTip.text
+        }
+        MySettingsLabel {
+            id: chatContextsLabel
+            text: qsTr("Chats kept in a loaded model")
+            Layout.row: 11
+            Layout.column: 0
+        }
+        MyTextField {
+            id: chatContextsField
+            text: MySettings.chatContexts
+            color: theme.textColor
+            font.pixelSize: theme.fontSizeLarge
+            ToolTip.text: qsTr("Chats that use the same model keep their conversation in it, so switching between them saves and restores nothing. Each one takes a KV cache of its own on models that support it. 0 saves the conversation on every switch")
+            ToolTip.visible: hovered
+            Layout.row: 11
+            Layout.column: 1
+            validator: IntValidator {
+                bottom: 0
+            }
+            onEditingFinished: {
+                var val = parseInt(text)
+                if (!isNaN(val)) {
+                    MySettings.chatContexts = val
+                    focus = false
+                } else {
+                    text = MySettings.chatContexts
+                }
+            }
+            Accessible.role: Accessible.EditableText
+            Accessible.name: chatContextsLabel.text
+            Accessible.description: ToolTip.text
+        }
+        Rectangle {
+            Layout.row: 12
+            Layout.column: 0
             Layout.columnSpan: 3
             Layout.fillWidth: true
             height: 3
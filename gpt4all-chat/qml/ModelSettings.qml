@@ -782,6 +782,88 @@ MySettingsTab {
                 Accessible.name: gpuLayersLabel.text
                 Accessible.description: ToolTip.text
             }
+            MySettingsLabel {
+                id: draftModelLabel
+                visible: !root.currentModelInfo.isOnline
+                text: qsTr("Draft Model")
+                Layout.row: 5
+                Layout.column: 0
+            }
+            MyTextField {
+                id: draftModelField
+                visible: !root.currentModelInfo.isOnline
+                text: root.currentModelInfo.draftModel
+                color: theme.textColor
+                font.pixelSize: theme.fontSizeLarge
+                ToolTip.text: qsTr("File name of a small model with the same vocabulary that proposes tokens for this one to verify. Leave empty to disable.\nNOTE: Does not take effect until you reload the model.")
+                ToolTip.visible: hovered
+                Layout.row: 5
+                Layout.column: 1
+                Connections {
+                    target: MySettings
+                    function onDraftModelChanged() {
+                        draftModelField.text = root.currentModelInfo.draftModel;
+                    }
+                }
+                Connections {
+                    target: root
+                    function onCurrentModelInfoChanged() {
+                        draftModelField.text = root.currentModelInfo.draftModel;
+                    }
+                }
+                onEditingFinished: {
+                    MySettings.setModelDraftModel(root.currentModelInfo, text.trim())
+                    focus = false
+                }
+                Accessible.role: Accessible.EditableText
+                Accessible.name: draftModelLabel.text
+                Accessible.description: ToolTip.text
+            }
+            MySettingsLabel {
+                id: draftTokensLabel
+                visible: !root.currentModelInfo.isOnline
+                text: qsTr("Draft Tokens")
+                Layout.row: 5
+                Layout.column: 2
+            }
+            MyTextField {
+                id: draftTokensField
+                visible: !root.currentModelInfo.isOnline
+                text: root.currentModelInfo.draftTokens
+                color: theme.textColor
+                font.pixelSize: theme.fontSizeLarge
+                ToolTip.text: qsTr("Amount of tokens the draft model proposes at a time.\nNOTE: Does not take effect until you reload the model.")
+                ToolTip.visible: hovered
+                Layout.row: 5
+                Layout.column: 3
+                validator: IntValidator {
+                    bottom: 1
+                }
+                Connections {
+                    target: MySettings
+                    function onDraftTokensChanged() {
+                        draftTokensField.text = root.currentModelInfo.draftTokens;
+                    }
+                }
+                Connections {
+                    target: root
+                    function onCurrentModelInfoChanged() {
+                        draftTokensField.text = root.currentModelInfo.draftTokens;
+                    }
+                }
+                onEditingFinished: {
+                    var val = parseInt(text)
+                    if (!isNaN(val)) {
+                        MySettings.setModelDraftTokens(root.currentModelInfo, val)
+                        focus = false
+                    } else {
+                        text = root.currentModelInfo.draftTokens
+                    }
+                }
+                Accessible.role: Accessible.EditableText
+                Accessible.name: draftTokensLabel.text
+                Accessible.description: ToolTip.text
+            }
         }
 
         Rectangle {
@@ -1,5 +1,6 @@
 #include "server.h"
 #include "chat.h"
+#include "metrics.h"
 #include "mysettings.h"
 #include "modellist.h"
 
@@ -7,7 +8,14 @@
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QJsonValue>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include <algorithm>
 #include <iostream>
+#include <optional>
 
 //#define DEBUG
 
@@ -54,10 +62,286 @@ static inline QJsonObject resultToJson(const ResultInfo &info)
     return result;
 }
 
+struct ServerChoice {
+    LLModel::PromptContext ctx;
+    LLModel::BatchSequence sequence;
+    std::string response;
+    int index = 0;
+    size_t streamed = 0;    // bytes of the response sent as events
+    int32_t slot = -1;      // the KV cache slot while generating
+    bool started = false;
+};
+
+// A completion request from the moment it is accepted until its response is written
+struct ServerRequest {
+    explicit ServerRequest(QHttpServerResponder &&responder) : responder(std::move(responder)) {}
+
+    bool done() const
+    {
+        for (const auto &choice : choices)
+            if (!choice->started || !choice->sequence.finished)
+                return false;
+        return true;
+    }
+
+    QHttpServerResponder responder;
+    QDeadlineTimer deadline;
+    QElapsedTimer age;                      // since it arrived
+    qint64 admittedAt = -1;                 // nanoseconds of age, for the metrics
+    qint64 promptDoneAt = -1;
+    bool isChat = false;
+    ModelInfo modelInfo;
+    QString prompt;                         // as it is shown in the chat
+    std::string instructPrompt;             // filled in when it is admitted
+    QList<ResultInfo> databaseResults;
+    int maxTokens = 16;
+    float temperature = 1.f;
+    float topP = 1.f;
+    bool echo = false;
+    bool stream = false;                    // answer with server-sent events as the tokens arrive
+    std::optional<std::vector<std::string>> stop; // the default stop sequences of the model if not given
+    bool streaming = false;                 // the headers of the event stream have been sent
+    int promptTokens = 0;
+    int promptTokensEvaluated = 0;          // the others were in the KV cache of the slot already
+    std::unique_ptr<LLModel::PromptContext> promptCtx;  // of the first choice once it evaluated the prompt
+    std::vector<std::unique_ptr<ServerChoice>> choices; // BatchSequence points at the PromptContext
+};
+
+static void writeStatus(QHttpServerResponder &responder, QHttpServerResponder::StatusCode status)
+{
+    responder.write({ { "Access-Control-Allow-Origin", "*" } }, status);
+}
+
+static void writeJson(QHttpServerResponder &responder, const QJsonObject &object)
+{
+    responder.write(QJsonDocument(object).toJson(QJsonDocument::Compact),
+        { { "Content-Type", "application/json" }, { "Access-Control-Allow-Origin", "*" } });
+}
+
+// Server-sent events go out as chunks of a chunked response, so the client gets each token when it is
+// generated instead of when the response is done
+static void writeChunk(QHttpServerResponder &responder, const QByteArray &data)
+{
+    responder.writeBody(QByteArray::number(data.size(), 16) + "\r\n" + data + "\r\n");
+}
+
+static void writeEvent(QHttpServerResponder &responder, const QJsonObject &object)
+{
+    writeChunk(responder, "data: " + QJsonDocument(object).toJson(QJsonDocument::Compact) + "\n\n");
+}
+
+static void beginStream(ServerRequest &request)
+{
+    request.responder.writeStatusLine(QHttpServerResponder::StatusCode::Ok);
+    request.responder.writeHeaders({
+        { "Content-Type", "text/event-stream" },
+        { "Cache-Control", "no-cache" },
+        { "Transfer-Encoding", "chunked" },
+        { "Access-Control-Allow-Origin", "*" },
+    });
+    request.streaming = true;
+}
+
+static void endStream(QHttpServerResponder &responder)
+{
+    writeChunk(responder, "data: [DONE]\n\n");
+    responder.writeBody(QByteArray("0\r\n\r\n"));
+}
+
+// Once the event stream has started the status can't change anymore, the error goes in an event
+static void failRequest(ServerRequest &request, QHttpServerResponder::StatusCode status)
+{
+    if (!request.streaming) {
+        writeStatus(request.responder, status);
+        return;
+    }
+    QJsonObject error;
+    error.insert("message", "the completion failed");
+    error.insert("code", int(status));
+    QJsonObject event;
+    event.insert("error", error);
+    writeEvent(request.responder, event);
+    endStream(request.responder);
+}
+
+// QHttpServer does not tell us when a client goes away, its socket does
+static bool clientDisconnected(const QHttpServerResponder &responder)
+{
+    const QTcpSocket *socket = responder.socket();
+    return !socket || socket->state() != QAbstractSocket::ConnectedState;
+}
+
+static QJsonObject chunkToJson(const ServerRequest &request, int index, const QString &text, bool first,
+    const QJsonValue &finishReason = QJsonValue::Null)
+{
+    QJsonObject chunk;
+    chunk.insert("id", "foobarbaz");
+    chunk.insert("object", request.isChat ? "chat.completion.chunk" : "text_completion");
+    chunk.insert("created", QDateTime::currentSecsSinceEpoch());
+    chunk.insert("model", request.modelInfo.name());
+
+    QJsonObject choice;
+    choice.insert("index", index);
+    if (request.isChat) {
+        QJsonObject delta;
+        if (first)
+            delta.insert("role", "assistant");
+        if (!text.isEmpty())
+            delta.insert("content", text);
+        choice.insert("delta", delta);
+    } else {
+        choice.insert("text", text);
+        choice.insert("logprobs", QJsonValue::Null); // We don't support
+    }
+    choice.insert("finish_reason", finishReason);
+
+    QJsonArray choices;
+    choices.append(choice);
+    chunk.insert("choices", choices);
+    return chunk;
+}
+
+// Sends what the choice generated since its last event. The whitespace the response starts with is
+// left out like it is from a whole response, and an incomplete UTF-8 character waits for the rest.
+static void streamChoice(ServerRequest &request, ServerChoice &choice, int index)
+{
+    const std::string &response = choice.response;
+    const size_t begin = choice.streamed ? choice.streamed : response.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+        return;
+
+    size_t end = response.size();
+    size_t continuation = 0;
+    while (end - continuation > begin && continuation < 3
+           && (uchar(response[end - continuation - 1]) & 0xC0) == 0x80)
+        ++continuation;
+    if (end - continuation > begin) {
+        const uchar lead = response[end - continuation - 1];
+        const size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+        if (length > continuation + 1)
+            end -= continuation + 1;
+    }
+    if (end <= begin)
+        return;
+
+    writeEvent(request.responder, chunkToJson(request, index,
+        QString::fromStdString(response.substr(begin, end - begin)), choice.streamed == 0));
+    choice.streamed = end;
+}
+
+static void prepareChoice(ServerRequest &request, ServerChoice &choice, int32_t slot)
+{
+    choice.slot = slot;
+    choice.started = true;
+
+    LLModel::BatchSequence &sequence = choice.sequence;
+    sequence.seq = slot;
+    sequence.ctx = &choice.ctx;
+    sequence.responseCallback = [&request, &choice](int32_t, std::string_view piece) {
+        if (request.promptDoneAt < 0) {
+            request.promptDoneAt = request.age.nsecsElapsed();
+            Metrics *metrics = Metrics::globalInstance();
+            metrics->observe(Metrics::TimeToFirstToken, request.promptDoneAt / 1e9);
+            const double promptTime = (request.promptDoneAt - request.admittedAt) / 1e9;
+            if (promptTime > 0)
+                metrics->observe(Metrics::PromptTokensPerSecond, request.promptTokensEvaluated / promptTime);
+        }
+        choice.response.append(piece);
+        if (request.streaming)
+            streamChoice(request, choice, choice.index);
+        return true;
+    };
+}
+
+// Starts the choice where the first choice was when it had evaluated the prompt. The KV cache of the
+// prompt is already in the slot, only the tokens after it are evaluated.
+static void continueFromPrompt(ServerRequest &request, ServerChoice &choice, int32_t slot)
+{
+    prepareChoice(request, choice, slot);
+    choice.ctx = *request.promptCtx;
+    LLModel::BatchSequence &sequence = choice.sequence;
+    sequence.stop.reset(choice.ctx.stop);
+    sequence.pending.clear();
+    sequence.n_generated = 0;
+    sequence.finished = false;
+}
+
+// The prompt stays in the slot of a finished choice, so a choice that is still waiting takes it over
+// without copying anything. This is how models with a single slot share the prompt between choices.
+static void handOverSlots(ServerRequest &request)
+{
+    if (!request.promptCtx)
+        return;
+    for (const auto &finished : request.choices) {
+        if (finished->slot < 0 || !finished->sequence.finished)
+            continue;
+        const auto waiting = std::find_if(request.choices.begin(), request.choices.end(),
+            [](const auto &c) { return !c->started; });
+        if (waiting == request.choices.end())
+            return;
+        const int32_t slot = finished->slot;
+        finished->slot = -1;
+        continueFromPrompt(request, **waiting, slot);
+    }
+}
+
+static QJsonObject completionToJson(const ServerRequest &request)
+{
+    QJsonObject responseObject;
+    responseObject.insert("id", "foobarbaz");
+    responseObject.insert("object", "text_completion");
+    responseObject.insert("created", QDateTime::currentSecsSinceEpoch());
+    responseObject.insert("model", request.modelInfo.name());
+
+    QJsonArray choices;
+    int index = 0;
+    int responseTokens = 0;
+    for (const auto &c : request.choices) {
+        const QString result = (request.echo ? QString("%1\n").arg(request.prompt) : QString())
+            + QString::fromStdString(c->response).trimmed();
+        QJsonObject choice;
+        if (request.isChat) {
+            choice.insert("index", index++);
+            choice.insert("finish_reason", c->sequence.n_generated >= request.maxTokens ? "length" : "stop");
+            QJsonObject message;
+            message.insert("role", "assistant");
+            message.insert("content", result);
+            choice.insert("message", message);
+        } else {
+            choice.insert("text", result);
+            choice.insert("index", index++);
+            choice.insert("logprobs", QJsonValue::Null); // We don't support
+            choice.insert("finish_reason", c->sequence.n_generated >= request.maxTokens ? "length" : "stop");
+        }
+        if (MySettings::globalInstance()->localDocsShowReferences()) {
+            QJsonArray references;
+            for (const auto &ref : request.databaseResults)
+                references.append(resultToJson(ref));
+            choice.insert("references", references);
+        }
+        choices.append(choice);
+        responseTokens += c->sequence.n_generated;
+    }
+
+    responseObject.insert("choices", choices);
+
+    QJsonObject usage;
+    usage.insert("prompt_tokens", request.promptTokens);
+    usage.insert("completion_tokens", responseTokens);
+    usage.insert("total_tokens", request.promptTokens + responseTokens);
+    responseObject.insert("usage", usage);
+    return responseObject;
+}
+
 Server::Server(Chat *chat)
     : ChatLLM(chat, true /*isServer*/)
     , m_chat(chat)
     , m_server(nullptr)
+    , m_remoteRequest(nullptr)
+    , m_remoteChoice(0)
+    , m_stepScheduled(false)
+    , m_embeddingLLM(nullptr)
+    , m_nextEmbeddingsRequest(0)
 {
     connect(this, &Server::threadStarted, this, &Server::start);
     connect(this, &Server::databaseResultsChanged, this, &Server::handleDatabaseResultsChanged);
@@ -66,6 +350,7 @@ Server::Server(Chat *chat)
 
 Server::~Server()
 {
+    delete m_embeddingLLM;
 }
 
 void Server::start()
@@ -76,6 +361,10 @@ void Server::start()
         return;
     }
 
+    // have the model the requests default to ready if the model memory budget allows it
+    if (MySettings::globalInstance()->serverChat())
+        preloadModel(ModelList::globalInstance()->defaultModelInfo());
+
     m_server->route("/v1/models", QHttpServerRequest::Method::Get,
         [](const QHttpServerRequest &request) {
             if (!MySettings::globalInstance()->serverChat())
@@ -115,19 +404,43 @@ void Server::start()
         }
     );
 
+    // The completions are answered when they are done, not when the handler returns, so the server
+    // keeps accepting requests while it generates
     m_server->route("/v1/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
-            if (!MySettings::globalInstance()->serverChat())
-                return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
-            return handleCompletionRequest(request, false);
+        [this](const QHttpServerRequest &request, QHttpServerResponder &&responder) {
+            if (!MySettings::globalInstance()->serverChat()) {
+                writeStatus(responder, QHttpServerResponder::StatusCode::Unauthorized);
+                return;
+            }
+            handleCompletionRequest(request, std::move(responder), false);
         }
     );
 
     m_server->route("/v1/chat/completions", QHttpServerRequest::Method::Post,
-        [this](const QHttpServerRequest &request) {
+        [this](const QHttpServerRequest &request, QHttpServerResponder &&responder) {
+            if (!MySettings::globalInstance()->serverChat()) {
+                writeStatus(responder, QHttpServerResponder::StatusCode::Unauthorized);
+                return;
+            }
+            handleCompletionRequest(request, std::move(responder), true);
+        }
+    );
+
+    m_server->route("/v1/embeddings", QHttpServerRequest::Method::Post,
+        [this](const QHttpServerRequest &request, QHttpServerResponder &&responder) {
+            if (!MySettings::globalInstance()->serverChat()) {
+                writeStatus(responder, QHttpServerResponder::StatusCode::Unauthorized);
+                return;
+            }
+            handleEmbeddingsRequest(request, std::move(responder));
+        }
+    );
+
+    m_server->route("/metrics", QHttpServerRequest::Method::Get,
+        [](const QHttpServerRequest &request) {
             if (!MySettings::globalInstance()->serverChat())
                 return QHttpServerResponse(QHttpServerResponder::StatusCode::Unauthorized);
-            return handleCompletionRequest(request, true);
+            return QHttpServerResponse("text/plain; version=0.0.4", Metrics::globalInstance()->exposition());
         }
     );
 
@@ -136,18 +449,20 @@ void Server::start()
         return std::move(resp);
     });
 
+    // the chat shows the requests as they finish, generation never waits for the GUI
     connect(this, &Server::requestServerNewPromptResponsePair, m_chat,
-        &Chat::serverNewPromptResponsePair, Qt::BlockingQueuedConnection);
+        &Chat::serverNewPromptResponsePair, Qt::QueuedConnection);
 }
 
-QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &request, bool isChat)
+void Server::handleCompletionRequest(const QHttpServerRequest &request, QHttpServerResponder &&responder, bool isChat)
 {
     // We've been asked to do a completion...
     QJsonParseError err;
     const QJsonDocument document = QJsonDocument::fromJson(request.body(), &err);
     if (err.error || !document.isObject()) {
         std::cerr << "ERROR: invalid json in completions body" << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::NoContent);
+        writeStatus(responder, QHttpServerResponder::StatusCode::NoContent);
+        return;
     }
 #if defined(DEBUG)
     printf("/v1/completions %s\n", qPrintable(document.toJson(QJsonDocument::Indented)));
@@ -156,13 +471,15 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     const QJsonObject body = document.object();
     if (!body.contains("model")) { // required
         std::cerr << "ERROR: completions contains no model" << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::NoContent);
+        writeStatus(responder, QHttpServerResponder::StatusCode::NoContent);
+        return;
     }
     QJsonArray messages;
     if (isChat) {
         if (!body.contains("messages")) {
             std::cerr << "ERROR: chat completions contains no messages" << std::endl;
-            return QHttpServerResponse(QHttpServerResponder::StatusCode::NoContent);
+            writeStatus(responder, QHttpServerResponder::StatusCode::NoContent);
+            return;
         }
         messages = body["messages"].toArray();
     }
@@ -207,7 +524,7 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
 
     int n = 1;
     if (body.contains("n"))
-        n = body["n"].toInt();
+        n = std::max(1, body["n"].toInt());
 
     int logprobs = -1; // supposed to be null by default??
     if (body.contains("logprobs"))
@@ -217,25 +534,30 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     if (body.contains("echo"))
         echo = body["echo"].toBool();
 
-    // We currently don't support any of the following...
-#if 0
-    // FIXME: Need configurable reverse prompts
-    QList<QString> stop;
-    if (body.contains("stop")) {
+    bool stream = false;
+    if (body.contains("stream"))
+        stream = body["stream"].toBool();
+
+    // not part of the OpenAI API: how many seconds the client is willing to wait for the response
+    qint64 timeout = SERVER_REQUEST_TIMEOUT_MS;
+    if (body.contains("timeout"))
+        timeout = qint64(body["timeout"].toDouble() * 1000);
+
+    std::optional<std::vector<std::string>> stop;
+    if (body.contains("stop") && !body["stop"].isNull()) {
+        stop.emplace();
         QJsonValue stopValue = body["stop"];
         if (stopValue.isString())
-            stop.append(stopValue.toString());
+            stop->push_back(stopValue.toString().toStdString());
         else {
             QJsonArray array = stopValue.toArray();
             for (QJsonValue v : array)
-                stop.append(v.toString());
+                stop->push_back(v.toString().toStdString());
         }
     }
 
-    // FIXME: QHttpServer doesn't support server-sent events
-    bool stream = false;
-    if (body.contains("stream"))
-        stream = body["stream"].toBool();
+    // We currently don't support any of the following...
+#if 0
 
     // FIXME: What does this do?
     QString suffix;
@@ -278,114 +600,426 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
         actualPrompt.prepend(chats.join("\n"));
     }
 
-    // adds prompt/response items to GUI
-    emit requestServerNewPromptResponsePair(actualPrompt); // blocks
-
-    // load the new model if necessary
-    setShouldBeLoaded(true);
-
     if (modelInfo.filename().isEmpty()) {
         std::cerr << "ERROR: couldn't load default model " << modelRequested.toStdString() << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::BadRequest);
-    } else if (!loadModel(modelInfo)) {
-        std::cerr << "ERROR: couldn't load model " << modelInfo.name().toStdString() << std::endl;
-        return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+        writeStatus(responder, QHttpServerResponder::StatusCode::BadRequest);
+        return;
     }
 
-    // don't remember any context
-    resetContext();
-
-    const QString promptTemplate    = modelInfo.promptTemplate();
-    const float top_k               = modelInfo.topK();
-    const int n_batch               = modelInfo.promptBatchSize();
-    const float repeat_penalty      = modelInfo.repeatPenalty();
-    const int repeat_last_n         = modelInfo.repeatPenaltyTokens();
+    if (m_queue.size() >= SERVER_MAX_QUEUED_REQUESTS) {
+        std::cerr << "ERROR: too many completion requests are waiting" << std::endl;
+        writeStatus(responder, QHttpServerResponder::StatusCode::ServiceUnavailable);
+        return;
+    }
 
-    int promptTokens = 0;
-    int responseTokens = 0;
-    QList<QPair<QString, QList<ResultInfo>>> responses;
+    auto pending = std::make_unique<ServerRequest>(std::move(responder));
+    pending->age.start();
+    pending->deadline = QDeadlineTimer(timeout);
+    pending->isChat = isChat;
+    pending->modelInfo = modelInfo;
+    pending->prompt = actualPrompt;
+    pending->maxTokens = max_tokens;
+    pending->temperature = temperature;
+    pending->topP = top_p;
+    pending->echo = echo;
+    pending->stream = stream;
+    pending->stop = std::move(stop);
     for (int i = 0; i < n; ++i) {
-        if (!promptInternal(
-            m_collections,
-            actualPrompt,
-            promptTemplate,
-            max_tokens /*n_predict*/,
-            top_k,
-            top_p,
-            temperature,
-            n_batch,
-            repeat_penalty,
-            repeat_last_n)) {
-
-            std::cerr << "ERROR: couldn't prompt model " << modelInfo.name().toStdString() << std::endl;
-            return QHttpServerResponse(QHttpServerResponder::StatusCode::InternalServerError);
+        pending->choices.push_back(std::make_unique<ServerChoice>());
+        pending->choices.back()->index = i;
+    }
+    m_queue.push_back(std::move(pending));
+    scheduleStep();
+}
+
+struct Server::EmbeddingsRequest {
+    explicit EmbeddingsRequest(QHttpServerResponder &&responder) : responder(std::move(responder)) {}
+
+    QHttpServerResponder responder;
+    QString model;
+};
+
+void Server::handleEmbeddingsRequest(const QHttpServerRequest &request, QHttpServerResponder &&responder)
+{
+    QJsonParseError err;
+    const QJsonDocument document = QJsonDocument::fromJson(request.body(), &err);
+    if (err.error || !document.isObject()) {
+        std::cerr << "ERROR: invalid json in embeddings body" << std::endl;
+        writeStatus(responder, QHttpServerResponder::StatusCode::BadRequest);
+        return;
+    }
+
+    const QJsonObject body = document.object();
+    const QJsonValue input = body["input"];
+    QStringList texts;
+    if (input.isString()) {
+        texts.append(input.toString());
+    } else {
+        for (const QJsonValue &v : input.toArray()) {
+            if (!v.isString()) { // we don't take tokens
+                texts.clear();
+                break;
+            }
+            texts.append(v.toString());
         }
-        QString echoedPrompt = actualPrompt;
-        if (!echoedPrompt.endsWith("\n"))
-            echoedPrompt += "\n";
-        responses.append(qMakePair((echo ? QString("%1\n").arg(actualPrompt) : QString()) + response(), m_databaseResults));
-        if (!promptTokens)
-            promptTokens += m_promptTokens;
-        responseTokens += m_promptResponseTokens - m_promptTokens;
-        if (i != n - 1)
-            resetResponse();
+    }
+    if (texts.isEmpty() || texts.size() > SERVER_MAX_EMBEDDING_INPUTS) {
+        std::cerr << "ERROR: embeddings need between 1 and " << SERVER_MAX_EMBEDDING_INPUTS << " strings" << std::endl;
+        writeStatus(responder, QHttpServerResponder::StatusCode::BadRequest);
+        return;
+    }
+
+    if (!m_embeddingLLM) {
+        m_embeddingLLM = new EmbeddingLLM;
+        connect(m_embeddingLLM, &EmbeddingLLM::serverEmbeddingsGenerated, this, &Server::handleEmbeddingsGenerated);
+    }
+
+    const quint64 id = m_nextEmbeddingsRequest++;
+    auto pending = std::make_unique<EmbeddingsRequest>(std::move(responder));
+    pending->model = body["model"].toString();
+    m_embeddingsRequests.emplace(id, std::move(pending));
+    m_embeddingLLM->generateServerEmbeddings(id, texts);
+}
+
+void Server::handleEmbeddingsGenerated(quint64 requestId, const QVector<std::vector<float>> &embeddings, int tokens,
+    const QString &error)
+{
+    const auto it = m_embeddingsRequests.find(requestId);
+    if (it == m_embeddingsRequests.end())
+        return;
+    std::unique_ptr<EmbeddingsRequest> request = std::move(it->second);
+    m_embeddingsRequests.erase(it);
+
+    if (!error.isEmpty()) {
+        std::cerr << "ERROR: couldn't generate embeddings: " << error.toStdString() << std::endl;
+        writeStatus(request->responder, QHttpServerResponder::StatusCode::InternalServerError);
+        return;
+    }
+
+    QJsonArray data;
+    for (qsizetype i = 0; i < embeddings.size(); ++i) {
+        QJsonArray values;
+        for (float v : embeddings[i])
+            values.append(v);
+        QJsonObject embedding;
+        embedding.insert("object", "embedding");
+        embedding.insert("index", int(i));
+        embedding.insert("embedding", values);
+        data.append(embedding);
     }
 
     QJsonObject responseObject;
-    responseObject.insert("id", "foobarbaz");
-    responseObject.insert("object", "text_completion");
-    responseObject.insert("created", QDateTime::currentSecsSinceEpoch());
-    responseObject.insert("model", modelInfo.name());
+    responseObject.insert("object", "list");
+    responseObject.insert("data", data);
+    responseObject.insert("model", request->model);
+    QJsonObject usage;
+    usage.insert("prompt_tokens", tokens); // estimated, the tokenizer of the model is not exposed
+    usage.insert("total_tokens", tokens);
+    responseObject.insert("usage", usage);
+    writeJson(request->responder, responseObject);
+}
 
-    QJsonArray choices;
+void Server::scheduleStep()
+{
+    if (m_stepScheduled)
+        return;
+    m_stepScheduled = true;
+    QTimer::singleShot(0, this, &Server::step);
+}
 
-    if (isChat) {
-        int index = 0;
-        for (const auto &r : responses) {
-            QString result = r.first;
-            QList<ResultInfo> infos = r.second;
-            QJsonObject choice;
-            choice.insert("index", index++);
-            choice.insert("finish_reason", responseTokens == max_tokens ? "length" : "stop");
-            QJsonObject message;
-            message.insert("role", "assistant");
-            message.insert("content", result);
-            choice.insert("message", message);
-            if (MySettings::globalInstance()->localDocsShowReferences()) {
-                QJsonArray references;
-                for (const auto &ref : infos)
-                    references.append(resultToJson(ref));
-                choice.insert("references", references);
+// Runs one decode of every sequence that has a slot. Returning to the event loop between steps lets
+// new requests join the batch, and deadlines and disconnected clients free their slots right away.
+void Server::step()
+{
+    m_stepScheduled = false;
+    dropAbandonedRequests();
+    admitRequests();
+
+    if (!m_running.empty()) {
+        refreshCpuLease();
+        std::vector<LLModel::BatchSequence*> sequences;
+        for (const auto &request : m_running)
+            for (const auto &choice : request->choices)
+                if (choice->started && !choice->sequence.finished)
+                    sequences.push_back(&choice->sequence);
+
+        const bool ok = llModel()->decodeBatch(sequences);
+        for (auto it = m_running.begin(); it != m_running.end();) {
+            ServerRequest &request = **it;
+            if (!ok) {
+                std::cerr << "ERROR: couldn't prompt model " << request.modelInfo.name().toStdString() << std::endl;
+                failRequest(request, QHttpServerResponder::StatusCode::InternalServerError);
+                for (const auto &choice : request.choices)
+                    choice->sequence.finished = true;
+            }
+            if (ok) {
+                const ServerChoice &first = *request.choices.front();
+                if (!request.promptCtx && request.choices.size() > 1 && first.sequence.pending.empty()
+                    && !first.sequence.n_generated && !first.sequence.finished)
+                    request.promptCtx = std::make_unique<LLModel::PromptContext>(first.ctx);
+                handOverSlots(request);
+            }
+            releaseSlots(request);
+            if (!ok || request.done()) {
+                if (ok)
+                    finishRequest(request);
+                it = m_running.erase(it);
+            } else {
+                ++it;
             }
-            choices.append(choice);
         }
-    } else {
-        int index = 0;
-        for (const auto &r : responses) {
-            QString result = r.first;
-            QList<ResultInfo> infos = r.second;
-            QJsonObject choice;
-            choice.insert("text", result);
-            choice.insert("index", index++);
-            choice.insert("logprobs", QJsonValue::Null); // We don't support
-            choice.insert("finish_reason", responseTokens == max_tokens ? "length" : "stop");
-            if (MySettings::globalInstance()->localDocsShowReferences()) {
-                QJsonArray references;
-                for (const auto &ref : infos)
-                    references.append(resultToJson(ref));
-                choice.insert("references", references);
+    }
+
+    reportKvCacheUsed();
+    if (m_running.empty())
+        releaseCpuLease();
+    if (!m_running.empty() || !m_queue.empty())
+        scheduleStep();
+}
+
+void Server::dropAbandonedRequests()
+{
+    const auto abandoned = [](ServerRequest &request) {
+        if (clientDisconnected(request.responder))
+            return true;
+        if (!request.deadline.hasExpired())
+            return false;
+        failRequest(request, QHttpServerResponder::StatusCode::GatewayTimeout);
+        return true;
+    };
+
+    for (auto it = m_queue.begin(); it != m_queue.end();)
+        it = abandoned(**it) ? m_queue.erase(it) : it + 1;
+
+    for (auto it = m_running.begin(); it != m_running.end();) {
+        if (!abandoned(**it)) {
+            ++it;
+            continue;
+        }
+        for (const auto &choice : (*it)->choices)
+            choice->sequence.finished = true;
+        releaseSlots(**it);
+        it = m_running.erase(it);
+    }
+}
+
+// The choices of the running requests get the free slots first, then the queued requests in the order
+// they arrived. The loaded model only changes once nothing is running on it.
+void Server::admitRequests()
+{
+    for (auto it = m_running.begin(); it != m_running.end();) {
+        if (startChoices(**it)) {
+            ++it;
+            continue;
+        }
+        failRequest(**it, QHttpServerResponder::StatusCode::BadRequest);
+        releaseSlots(**it);
+        it = m_running.erase(it);
+    }
+
+    while (!m_queue.empty()) {
+        ServerRequest &request = *m_queue.front();
+        if (!isModelLoaded() || !(modelInfo() == request.modelInfo)) {
+            if (!m_running.empty())
+                return;
+
+            // load the new model if necessary
+            setShouldBeLoaded(true);
+            if (!loadModel(request.modelInfo)) {
+                std::cerr << "ERROR: couldn't load model " << request.modelInfo.name().toStdString() << std::endl;
+                writeStatus(request.responder, QHttpServerResponder::StatusCode::InternalServerError);
+                m_queue.pop_front();
+                continue;
             }
-            choices.append(choice);
+            m_slotTokens.clear();
+        }
+        if (m_running.empty()) {
+            m_slotsInUse.assign(llModel()->maxSequences(), false);
+            m_slotTokens.resize(m_slotsInUse.size());
+        }
+
+        // remote models don't decode here, they answer one request per step
+        if (request.modelInfo.isChatGPT) {
+            Metrics::globalInstance()->observe(Metrics::QueueWait, request.age.elapsed() / 1000.0);
+            std::unique_ptr<ServerRequest> remote = std::move(m_queue.front());
+            m_queue.pop_front();
+            runRemoteRequest(*remote);
+            return;
+        }
+
+        if (std::find(m_slotsInUse.begin(), m_slotsInUse.end(), false) == m_slotsInUse.end())
+            return;
+
+        std::unique_ptr<ServerRequest> admitted = std::move(m_queue.front());
+        m_queue.pop_front();
+        admitted->admittedAt = admitted->age.nsecsElapsed();
+        Metrics::globalInstance()->observe(Metrics::QueueWait, admitted->admittedAt / 1e9);
+        admitted->instructPrompt = applyPromptTemplate(m_collections, admitted->prompt,
+            admitted->modelInfo.promptTemplate(), admitted->databaseResults).toStdString();
+        if (!startChoices(*admitted)) {
+            std::cerr << "ERROR: couldn't prompt model " << admitted->modelInfo.name().toStdString() << std::endl;
+            writeStatus(admitted->responder, QHttpServerResponder::StatusCode::BadRequest);
+            releaseSlots(*admitted);
+            continue;
         }
+        if (admitted->stream) {
+            beginStream(*admitted);
+            if (admitted->echo && !admitted->isChat)
+                for (int i = 0; i < int(admitted->choices.size()); ++i)
+                    writeEvent(admitted->responder, chunkToJson(*admitted, i, admitted->prompt + "\n", false));
+        }
+        if (m_running.empty())
+            acquireCpuLease(MySettings::globalInstance()->threadCount());
+        m_running.push_back(std::move(admitted));
     }
+}
 
-    responseObject.insert("choices", choices);
+// Gives the free slots to the choices of the request that have not started, false if the prompt
+// cannot be evaluated
+bool Server::startChoices(ServerRequest &request)
+{
+    for (size_t index = 0; index < request.choices.size(); ++index) {
+        ServerChoice &choice = *request.choices[index];
+        if (choice.started)
+            continue;
 
-    QJsonObject usage;
-    usage.insert("prompt_tokens", int(promptTokens));
-    usage.insert("completion_tokens", int(responseTokens));
-    usage.insert("total_tokens", int(promptTokens + responseTokens));
-    responseObject.insert("usage", usage);
+        // the other choices continue the prompt the first one evaluates
+        if (index > 0 && !request.promptCtx)
+            return true;
+
+        const auto freeSlot = std::find(m_slotsInUse.begin(), m_slotsInUse.end(), false);
+        if (freeSlot == m_slotsInUse.end())
+            return true;
+        const int32_t slot = int32_t(freeSlot - m_slotsInUse.begin());
+
+        if (index > 0) {
+            // copy the prompt from a slot of the request, the tokens generated after it don't matter
+            const auto source = std::find_if(request.choices.begin(), request.choices.end(),
+                [](const auto &c) { return c->slot >= 0; });
+            if (source == request.choices.end()
+                || !llModel()->copySequence((*source)->slot, slot, request.promptCtx->n_past))
+                return true; // wait for a slot of the request to be handed over
+            *freeSlot = true;
+            continueFromPrompt(request, choice, slot);
+            continue;
+        }
+
+        *freeSlot = true;
+        prepareChoice(request, choice, slot);
+        LLModel::PromptContext &ctx = choice.ctx;
+        ctx.n_predict = request.maxTokens;
+        ctx.top_k = request.modelInfo.topK();
+        ctx.top_p = request.topP;
+        ctx.temp = request.temperature;
+        ctx.n_batch = request.modelInfo.promptBatchSize();
+        ctx.repeat_penalty = request.modelInfo.repeatPenalty();
+        ctx.repeat_last_n = request.modelInfo.repeatPenaltyTokens();
+        if (request.stop)
+            ctx.stop = *request.stop;
+        // the prompts of most requests start with the same preamble, so the one the slot has is kept
+        ctx.tokens = m_slotTokens[slot];
+        if (!llModel()->beginSequence(choice.sequence, request.instructPrompt))
+            return false;
+        request.promptTokensEvaluated = int(choice.sequence.pending.size());
+        request.promptTokens = ctx.n_past + request.promptTokensEvaluated;
+    }
+    return true;
+}
+
+void Server::releaseSlots(ServerRequest &request)
+{
+    for (const auto &choice : request.choices) {
+        if (choice->slot < 0 || !choice->sequence.finished)
+            continue;
+        m_slotsInUse[choice->slot] = false;
+        m_slotTokens[choice->slot] = choice->ctx.tokens;
+        choice->slot = -1;
+    }
+}
+
+void Server::runRemoteRequest(ServerRequest &request)
+{
+    emit requestServerNewPromptResponsePair(request.prompt);
+
+    if (request.stream)
+        beginStream(request);
+
+    // don't remember any context
+    rewindContext();
+    for (size_t index = 0; index < request.choices.size(); ++index) {
+        const auto &choice = request.choices[index];
+        resetResponse();
+        m_remoteRequest = &request;
+        m_remoteChoice = int(index);
+        if (!promptInternal(
+            m_collections,
+            request.prompt,
+            request.modelInfo.promptTemplate(),
+            request.maxTokens /*n_predict*/,
+            request.modelInfo.topK(),
+            request.topP,
+            request.temperature,
+            request.modelInfo.promptBatchSize(),
+            request.modelInfo.repeatPenalty(),
+            request.modelInfo.repeatPenaltyTokens())) {
+
+            m_remoteRequest = nullptr;
+            std::cerr << "ERROR: couldn't prompt model " << request.modelInfo.name().toStdString() << std::endl;
+            failRequest(request, QHttpServerResponder::StatusCode::InternalServerError);
+            return;
+        }
+        m_remoteRequest = nullptr;
+        choice->response = response().toStdString();
+        choice->started = true;
+        choice->sequence.finished = true;
+        choice->sequence.n_generated = m_promptResponseTokens - m_promptTokens;
+        request.promptTokens = m_promptTokens;
+    }
+    request.databaseResults = m_databaseResults;
+    reply(request);
+}
+
+bool Server::handleResponse(int32_t token, std::string_view response)
+{
+    const bool keepGoing = ChatLLM::handleResponse(token, response);
+    if (m_remoteRequest && m_remoteRequest->streaming && !response.empty()) {
+        ServerChoice &choice = *m_remoteRequest->choices[m_remoteChoice];
+        choice.response.append(response);
+        streamChoice(*m_remoteRequest, choice, m_remoteChoice);
+    }
+    return keepGoing;
+}
+
+void Server::finishRequest(ServerRequest &request)
+{
+    int generated = 0;
+    for (const auto &choice : request.choices)
+        generated += choice->sequence.n_generated;
+    const double decodeTime = (request.age.nsecsElapsed() - request.promptDoneAt) / 1e9;
+    if (request.promptDoneAt >= 0 && generated > 1 && decodeTime > 0)
+        Metrics::globalInstance()->observe(Metrics::DecodeTokensPerSecond, (generated - 1) / decodeTime);
+
+    // adds prompt/response items to GUI
+    emit requestServerNewPromptResponsePair(request.prompt);
+    emit databaseResultsChanged(request.databaseResults);
+    emit responseChanged(QString::fromStdString(request.choices.front()->response).trimmed());
+    emit responseStopped();
+    reply(request);
+}
+
+void Server::reply(ServerRequest &request)
+{
+    if (request.streaming) {
+        for (int i = 0; i < int(request.choices.size()); ++i) {
+            const ServerChoice &choice = *request.choices[i];
+            writeEvent(request.responder, chunkToJson(request, i, QString(), choice.streamed == 0,
+                choice.sequence.n_generated >= request.maxTokens ? "length" : "stop"));
+        }
+        endStream(request.responder);
+        return;
+    }
+
+    const QJsonObject responseObject = completionToJson(request);
 
 #if defined(DEBUG)
     QJsonDocument newDoc(responseObject);
@@ -393,5 +1027,5 @@ QHttpServerResponse Server::handleCompletionRequest(const QHttpServerRequest &re
     fflush(stdout);
 #endif
 
-    return QHttpServerResponse(responseObject);
+    writeJson(request.responder, responseObject);
 }
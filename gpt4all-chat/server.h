@@ -2,10 +2,29 @@
 #define SERVER_H
 
 #include "chatllm.h"
+#include "embllm.h"
 
 #include <QObject>
 #include <QtHttpServer/QHttpServer>
 
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Requests waiting for a KV cache slot; more than this are refused with 503 so a burst of clients
+// cannot queue up work nobody will wait for
+#define SERVER_MAX_QUEUED_REQUESTS 32
+// KV cache slots the server loads models with. Models that evaluate several sequences at once
+// generate this many responses together, the others one at a time.
+#define SERVER_CONTEXT_POOL 4
+// Inputs a single /v1/embeddings request may have
+#define SERVER_MAX_EMBEDDING_INPUTS 2048
+// How long a request may wait and generate unless its body asks for a "timeout" in seconds
+#define SERVER_REQUEST_TIMEOUT_MS (10 * 60 * 1000)
+
+struct ServerRequest;
+
 class Server : public ChatLLM
 {
     Q_OBJECT
@@ -21,15 +40,44 @@ Q_SIGNALS:
     void requestServerNewPromptResponsePair(const QString &prompt);
 
 private Q_SLOTS:
-    QHttpServerResponse handleCompletionRequest(const QHttpServerRequest &request, bool isChat);
     void handleDatabaseResultsChanged(const QList<ResultInfo> &results) { m_databaseResults = results; }
     void handleCollectionListChanged(const QList<QString> &collectionList) { m_collections = collectionList; }
+    void step();
+    void handleEmbeddingsGenerated(quint64 requestId, const QVector<std::vector<float>> &embeddings, int tokens,
+        const QString &error);
+
+protected:
+    int32_t contextPoolSize() const override { return SERVER_CONTEXT_POOL; }
+    bool handleResponse(int32_t token, std::string_view response) override;
 
 private:
+    void handleCompletionRequest(const QHttpServerRequest &request, QHttpServerResponder &&responder, bool isChat);
+    void handleEmbeddingsRequest(const QHttpServerRequest &request, QHttpServerResponder &&responder);
+    void scheduleStep();
+    void dropAbandonedRequests();
+    void admitRequests();
+    bool startChoices(ServerRequest &request);
+    void runRemoteRequest(ServerRequest &request);
+    void finishRequest(ServerRequest &request);
+    void reply(ServerRequest &request);
+    void releaseSlots(ServerRequest &request);
+
     Chat *m_chat;
     QHttpServer *m_server;
     QList<ResultInfo> m_databaseResults;
     QList<QString> m_collections;
+    std::deque<std::unique_ptr<ServerRequest>> m_queue;     // accepted, in the order they arrived
+    std::vector<std::unique_ptr<ServerRequest>> m_running;  // holding at least one KV cache slot
+    std::vector<bool> m_slotsInUse;
+    std::vector<std::vector<LLModel::Token>> m_slotTokens; // in the KV cache of each slot of the loaded model
+    ServerRequest *m_remoteRequest;     // streamed from handleResponse() while a remote model answers it
+    int m_remoteChoice;
+    bool m_stepScheduled;
+    // embeddings are generated on a worker thread of their own, next to the completions
+    EmbeddingLLM *m_embeddingLLM;
+    struct EmbeddingsRequest;
+    std::map<quint64, std::unique_ptr<EmbeddingsRequest>> m_embeddingsRequests;
+    quint64 m_nextEmbeddingsRequest;
 };
 
 #endif // SERVER_H